@@ -0,0 +1,306 @@
+// nanoDB microbenchmarks and workload generator
+//
+// Builds the shell source into the same program (without its main) and
+// drives process_command exactly like the prompt does, so every timing
+// includes parsing, table lookup and storage.
+//
+//   nanobench [--rows 1000,100000,10000000] [--fields 4] [--cardinality 100]
+//             [--width 64] [--seed 1]
+//   nanobench --generate <rows> [--fields ...]   print an insert script
+//
+// Results are printed one JSON object per line:
+//   {"bench":"insert","rows":1000,"ops":1000,"ops_per_sec":...,"p50_us":...,"p99_us":...}
+
+#define NANODB_NO_MAIN
+#include "main.c"
+
+#ifdef _WIN32
+#define NULL_DEVICE "NUL"
+#else
+#define NULL_DEVICE "/dev/null"
+#endif
+
+#define BENCH_DB "nanobench"
+#define BENCH_MAX_WIDTH 200
+#define BENCH_MAX_ROW_COUNTS 8
+#define BENCH_TIME_BUDGET_NS 2000000000ull // per benchmark, after its first 3 ops
+#define BENCH_MIN_OPS 3
+
+typedef struct
+{
+    int fields;
+    int cardinality;
+    int width; // bytes of field values per record
+    unsigned long seed;
+} DataSpec;
+
+FILE *report;
+
+// Small deterministic generator so runs are comparable
+unsigned long bench_rand(unsigned long *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Field value number `value` as stored: "v<value>" padded to `per_field`
+// bytes with a per-value filler, so a query can name it exactly. Returns
+// the length written.
+size_t bench_format_value(char *out, size_t size, unsigned long value, int per_field)
+{
+    int n = snprintf(out, size, "v%lu", value);
+    if (n < 0 || size == 0)
+        return 0;
+    size_t used = (size_t)n < size ? (size_t)n : size - 1;
+
+    int digits = snprintf(NULL, 0, "%lu", value) + 1;
+    for (int p = digits; p < per_field && used + 1 < size; p++)
+        out[used++] = (char)('a' + (value + (unsigned long)p) % 26);
+    out[used] = '\0';
+    return used;
+}
+
+// Attributes of synthetic row `row`: f0..f<fields-1>, each drawing from
+// `cardinality` values and padded so the values add up to `width` bytes
+void bench_make_attributes(char *out, size_t size, unsigned long row, const DataSpec *spec)
+{
+    size_t used = 0;
+    int per_field = spec->width / spec->fields;
+
+    for (int f = 0; f < spec->fields && used < size; f++)
+    {
+        unsigned long state = spec->seed + row * 7919ul + (unsigned long)f * 104729ul + 1;
+        bench_rand(&state);
+        unsigned long value = bench_rand(&state) % (unsigned long)spec->cardinality;
+
+        int n = snprintf(out + used, size - used, "%sf%d:", f ? ", " : "", f);
+        if (n < 0 || (size_t)n >= size - used)
+            return;
+        used += (size_t)n;
+        used += bench_format_value(out + used, size - used, value, per_field);
+    }
+}
+
+int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Print one result line from per-operation latencies (sorted in place)
+void bench_report(const char *name, unsigned long rows, uint64_t *latencies, size_t ops, uint64_t total_ns)
+{
+    if (ops == 0)
+        return;
+
+    qsort(latencies, ops, sizeof(uint64_t), compare_u64);
+    double p50 = (double)latencies[(ops - 1) / 2] / 1000.0;
+    double p99 = (double)latencies[(size_t)((double)(ops - 1) * 0.99)] / 1000.0;
+    double per_sec = total_ns ? (double)ops * 1e9 / (double)total_ns : 0.0;
+
+    fprintf(report, "{\"bench\":\"%s\",\"rows\":%lu,\"ops\":%zu,\"ops_per_sec\":%.1f,\"p50_us\":%.2f,\"p99_us\":%.2f}\n",
+            name, rows, ops, per_sec, p50, p99);
+    fflush(report);
+}
+
+// Time up to `ops` commands produced by `make_command`. Reads and writes
+// stop early once they use up the time budget; inserts always run to `ops`
+// because they build the table.
+typedef void (*command_maker)(char *out, size_t size, size_t op, void *ctx);
+
+void bench_run(const char *name, unsigned long rows, size_t ops, bool budgeted, command_maker make_command, void *ctx)
+{
+    uint64_t *latencies = malloc((ops ? ops : 1) * sizeof(uint64_t));
+    if (!latencies)
+        return;
+
+    char command[MAX_INPUT_SIZE + 64];
+    uint64_t total = 0;
+    size_t done = 0;
+    while (done < ops && (!budgeted || done < BENCH_MIN_OPS || total < BENCH_TIME_BUDGET_NS))
+    {
+        make_command(command, sizeof(command), done, ctx);
+        uint64_t start = clock_ns();
+        process_command(command);
+        latencies[done] = clock_ns() - start;
+        total += latencies[done];
+        done++;
+    }
+
+    bench_report(name, rows, latencies, done, total);
+    free(latencies);
+}
+
+typedef struct
+{
+    const DataSpec *spec;
+    unsigned long rows;
+    unsigned long state;
+    unsigned long delete_stride;
+    char attributes[BENCH_MAX_WIDTH * 2];
+} BenchContext;
+
+void make_insert(char *out, size_t size, size_t op, void *arg)
+{
+    BenchContext *ctx = arg;
+    bench_make_attributes(ctx->attributes, sizeof(ctx->attributes), op, ctx->spec);
+    snprintf(out, size, "insert into t set %s", ctx->attributes);
+}
+
+void make_point_get(char *out, size_t size, size_t op, void *arg)
+{
+    (void)op;
+    BenchContext *ctx = arg;
+    snprintf(out, size, "get t id:%lu", bench_rand(&ctx->state) % ctx->rows + 1);
+}
+
+// Values are padded like the generator pads them, so the get matches the
+// rows holding that value
+void make_filtered_get(char *out, size_t size, size_t op, void *arg)
+{
+    (void)op;
+    BenchContext *ctx = arg;
+    char value[BENCH_MAX_WIDTH + 32];
+    unsigned long number = bench_rand(&ctx->state) % (unsigned long)ctx->spec->cardinality;
+    bench_format_value(value, sizeof(value), number, ctx->spec->width / ctx->spec->fields);
+    snprintf(out, size, "get t f0:%s", value);
+}
+
+void make_update(char *out, size_t size, size_t op, void *arg)
+{
+    BenchContext *ctx = arg;
+    snprintf(out, size, "update t id:%lu f1:u%zu", bench_rand(&ctx->state) % ctx->rows + 1, op);
+}
+
+// Deletes walk the ids with a stride so every op removes a live row
+void make_delete(char *out, size_t size, size_t op, void *arg)
+{
+    BenchContext *ctx = arg;
+    snprintf(out, size, "delete t id:%lu", (unsigned long)op * ctx->delete_stride + 1);
+}
+
+size_t clamp_ops(unsigned long want, size_t min, size_t max)
+{
+    if (want < min)
+        return min;
+    return want > max ? max : (size_t)want;
+}
+
+void bench_scale(unsigned long rows, const DataSpec *spec)
+{
+    BenchContext ctx = {spec, rows, spec->seed * 2654435761ul + rows, 1, {0}};
+    char command[64];
+
+    process_command("create db " BENCH_DB);
+    process_command("use " BENCH_DB);
+    process_command("create table t");
+
+    // Scans touch every row, so they are capped lower than point operations
+    size_t point_ops = clamp_ops(rows, 1, 10000);
+    size_t scan_ops = clamp_ops(2000000ul / rows, 3, 200);
+    size_t delete_ops = clamp_ops(rows / 2, 1, 1000);
+    ctx.delete_stride = rows / delete_ops;
+
+    bench_run("insert", rows, rows, false, make_insert, &ctx);
+    bench_run("point_get", rows, point_ops, true, make_point_get, &ctx);
+    bench_run("filtered_get", rows, scan_ops, true, make_filtered_get, &ctx);
+    bench_run("update", rows, point_ops, true, make_update, &ctx);
+    bench_run("delete", rows, delete_ops, true, make_delete, &ctx);
+
+    snprintf(command, sizeof(command), "use %s", DEFAULT_DB);
+    process_command(command);
+    process_command("delete db " BENCH_DB);
+}
+
+// --rows 1000,100000 -> counts
+int parse_row_counts(const char *list, unsigned long *counts)
+{
+    int n = 0;
+    const char *p = list;
+    while (*p && n < BENCH_MAX_ROW_COUNTS)
+    {
+        char *end;
+        unsigned long value = strtoul(p, &end, 10);
+        if (end == p || value == 0)
+            return -1;
+        counts[n++] = value;
+        p = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != '\0')
+            return -1;
+    }
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    DataSpec spec = {4, 100, 64, 1};
+    unsigned long counts[BENCH_MAX_ROW_COUNTS] = {1000, 100000, 10000000};
+    int count_n = 3;
+    unsigned long generate = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!value)
+        {
+            fprintf(stderr, "Missing value for %s\n", arg);
+            return 1;
+        }
+        i++;
+
+        if (strcmp(arg, "--rows") == 0)
+            count_n = parse_row_counts(value, counts);
+        else if (strcmp(arg, "--fields") == 0)
+            spec.fields = atoi(value);
+        else if (strcmp(arg, "--cardinality") == 0)
+            spec.cardinality = atoi(value);
+        else if (strcmp(arg, "--width") == 0)
+            spec.width = atoi(value);
+        else if (strcmp(arg, "--seed") == 0)
+            spec.seed = strtoul(value, NULL, 10);
+        else if (strcmp(arg, "--generate") == 0)
+            generate = strtoul(value, NULL, 10);
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", arg);
+            return 1;
+        }
+    }
+
+    if (count_n <= 0 || spec.fields <= 0 || spec.cardinality <= 0 || spec.width < spec.fields ||
+        spec.width > BENCH_MAX_WIDTH)
+    {
+        fprintf(stderr, "Invalid options (width must be between fields and %d).\n", BENCH_MAX_WIDTH);
+        return 1;
+    }
+
+    if (generate > 0)
+    {
+        char attributes[BENCH_MAX_WIDTH * 2];
+        for (unsigned long row = 0; row < generate; row++)
+        {
+            bench_make_attributes(attributes, sizeof(attributes), row, &spec);
+            printf("insert into t set %s\n", attributes);
+        }
+        return 0;
+    }
+
+    // Command output goes to the null device; results keep the real stdout
+    report = fdopen(dup(fileno(stdout)), "w");
+    if (!report || !freopen(NULL_DEVICE, "w", stdout))
+    {
+        fprintf(stderr, "Failed to redirect command output.\n");
+        return 1;
+    }
+
+    initialize();
+    for (int i = 0; i < count_n; i++)
+        bench_scale(counts[i], &spec);
+    storage_shutdown();
+
+    fclose(report);
+    return 0;
+}
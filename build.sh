@@ -22,7 +22,8 @@ pkill -f "./main" 2>/dev/null || true
 # Compile
 echo ""
 echo "Compiling..."
-gcc -Wall -Wextra -g main.c -o main
+# Parallel scans and read-ahead run on worker threads
+gcc -Wall -Wextra -g main.c -o main -lpthread
 
 # Check if compilation was successful
 if [ $? -eq 0 ]; then
@@ -5,6 +5,12 @@
 #include <stdbool.h> // boolean type
 #include <stdlib.h>  // standard library functions
 #include <unistd.h>  // access function of OS like _WIN32
+#include <stdint.h>  // fixed-width integers for the on-disk page format
+#include <time.h>    // clocks for command timing
+#include <stdarg.h>  // variadic plan output
+#include <assert.h>  // internal invariants
+
+#include "nanodb.h" // embedding API, implemented at the end of this file
 
 #ifdef _WIN32
 #include <direct.h> // for _mkdir on Windows
@@ -12,6 +18,7 @@
 #include <sys/stat.h>  // for mkdir on Unix/Linux
 #include <sys/types.h> // for mkdir on Unix/Linux
 #include <dirent.h>    // for directory operations on Unix/Linux
+#include <pthread.h>   // worker threads for parallel scans
 #endif
 
 #ifdef _WIN32
@@ -20,29 +27,106 @@
 #include <dirent.h> // for directory operations on Unix/Linux
 #endif
 
-#define MAX_INPUT_SIZE 256
+#define MAX_INPUT_SIZE 4096 // room for long "id in (...)" lists
 #define DB_DIR "db"
 #define VERSION "0.2.0"
-#define CMD_COUNT 21
+#define CMD_COUNT 60
 #define DEFAULT_DB "nano"
 
+#define PAGE_SIZE 4096
+#define DEFAULT_POOL_PAGES 256
+#define MIN_POOL_PAGES 8
+#define MAX_PAGED_FILES 128
+#define MAX_OPEN_TABLES 32
+#define TABLE_MAGIC "NANOTBL1"
+#define TABLE_EXT ".tbl"
+#define BLOCK_INDEX_EXT ".blk"
+#define DICT_EXT ".dict"
+#define SEGMENT_EXT ".seg"
+#define STATS_EXT ".stats"
+#define FEED_EXT ".feed"
+#define FEED_INDEX_EXT ".feedx"
+#define WAL_EXT ".wal"
+#define SHARD_EXT ".shard"
+#define MAX_SHARDS 16
+#define SEGMENT_MAGIC "NANOSEG1"
+#define WAL_MAGIC "NANOWAL1"
+#define DEFAULT_MEMTABLE_KB 1024
+#define SEGMENT_COMPACT_AT 4  // segment files that trigger folding them into the table file
+#define MEM_ENTRY_OVERHEAD 32 // bookkeeping bytes charged per memtable entry
+#define DEFAULT_WORK_MEMORY_KB (64 * 1024)
+#define SORT_MERGE_FANIN 64 // run files merged at once
+#define JOIN_PARTITIONS 16  // partition files per side when a join spills
+#define MAX_PARALLEL_WORKERS 16
+#define READAHEAD_FIRST 4  // pages of the first read-ahead read
+#define READAHEAD_PAGES 32 // most pages per read-ahead read
+#define READAHEAD_DEPTH 4  // read-ahead reads in flight
+#define TABLE_FLAG_COMPRESSED 1u
+#define TABLE_FLAG_TTL 2u // rows may carry an expiry time
+#define TABLE_FLAG_FEED 4u // writes are logged to the change feed
+#define LEGACY_TABLE_EXT ".txt"
+#define LEGACY_BACKUP_EXT ".txt.bak" // a legacy table once imported
+#define PAGE_HEADER_SIZE 4
+#define SLOT_SIZE 4
+#define MAX_RECORD_SIZE (PAGE_SIZE - PAGE_HEADER_SIZE - SLOT_SIZE)
+
 char DB[50] = DEFAULT_DB;
 
 char cmd_list[CMD_COUNT][50] = {
     "create db <name>",
-    "create table <name>",
+    "create table <name> [compression=on] [shards=N]",
+    "create table <name> ... [ttl=<seconds>]",
+    "compress table <name>",
+    "set ttl <table> <seconds>",
+    "expire <table>",
+    "analyze <table>",
+    "create fulltext index <table> <field>",
+    "drop fulltext index <table> <field>",
+    "create prefix index <table> <field>",
+    "drop prefix index <table> <field>",
     "list db",
     "list table",
     "use <name>",
-    "insert into <table> set ...",
+    "insert into <table> set ... [ttl <seconds>]",
     "get <table>",
     "get <table> <field:value>",
+    "get <table> <field> in (<value>, ...)",
+    "get <table> ... [order by <field> [desc]]",
+    "get <table> ... [limit <n>]",
+    "get <table> <field> contains \"<words>\"",
+    "get <table> <field> like \"<pattern>\"",
+    "get <table> <field> startswith \"<text>\"",
+    "get <a> join <b> on <a.f> = <b.f>",
+    "count <table> [by <field>]",
+    "watch <table> [from <seq>] [limit <n>]",
+    "unwatch <table>",
     "update <table> <where> <set>",
+    "update <table> <field> in (...) <set>",
+    "upsert <table> key:<field> set ...",
     "delete <table> <field:value>",
+    "delete <table> <field> in (<value>, ...)",
+    "prepare <name> as <command>",
+    "execute <name> [(<args>)]",
+    "deallocate <name>",
+    "set buffer_pool <pages>",
+    "set memtable <KB>",
+    "set work_memory <KB>",
+    "set parallel <workers>",
+    "set result_cache <KB>",
+    "set memory_limit <KB>",
+    "memory",
+    "flush",
+    "explain <command>",
+    "explain analyze <command>",
+    "stats [reset]",
+    "stats dump [<file>]",
+    "timing on|off",
     "delete table <name>",
     "delete db <name>",
     "drop table <name>",
     "drop db <name>",
+    "snapshot db <name> to <file>",
+    "restore db from <file> [as <name>]",
     "clear",
     "cls",
     "help",
@@ -51,17 +135,36 @@ char cmd_list[CMD_COUNT][50] = {
     "quit",
 };
 
-// take input
-void get_input(char *buffer, size_t size)
+// Whether the running command failed, and the last error message printed.
+// process_command clears them; nanodb_execute hands them to the caller.
+bool command_failed = false;
+char command_error[300] = "";
+
+// Print an error and mark the running command as failed
+void print_error(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vsnprintf(command_error, sizeof(command_error), format, args);
+    va_end(args);
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    command_failed = true;
+}
+
+// take input, false once stdin is closed
+bool get_input(char *buffer, size_t size)
 {
     if (fgets(buffer, size, stdin) == NULL)
     {
         buffer[0] = '\0';
-        return;
+        return false;
     }
     size_t len = strlen(buffer);
     if (len > 0 && buffer[len - 1] == '\n')
         buffer[len - 1] = '\0';
+    return true;
 }
 
 // Clear
@@ -100,928 +203,11344 @@ int remove_dir_wrapper(const char *path)
 #endif
 }
 
+// Defined with the catalog
+void catalog_load();
+
 // Initialize DB directory
 void initialize()
 {
     make_dir(DB_DIR);
+    catalog_load();
 }
 
-// Create DB folder
-void create_db(const char *name)
+// Check whether a file or folder exists
+bool file_exists(const char *path)
 {
-    if (name == NULL || strlen(name) == 0)
-    {
-        printf("Invalid database name.\n");
-        return;
-    }
-
-    char path[300] = {0};
 #ifdef _WIN32
-    snprintf(path, sizeof(path), "db\\%s", name);
+    return (_access(path, 0) == 0);
 #else
-    snprintf(path, sizeof(path), "db/%s", name);
+    return (access(path, F_OK) == 0);
 #endif
+}
 
-    int result = make_dir(path);
-
-    if (result == 0)
-    {
-        printf("Database '%s' created at %s\n", name, path);
-    }
-    else
-    {
-        printf("Failed to create database. It may already exist.\n");
-    }
+// Build the path of a file that belongs to a table (e.g. db/<db>/<table>.tbl)
+void build_table_path(char *out, size_t size, const char *db_name, const char *table_name, const char *ext)
+{
+#ifndef _WIN32
+    snprintf(out, size, "db/%s/%s%s", db_name, table_name, ext);
+#else
+    snprintf(out, size, "db\\%s\\%s%s", db_name, table_name, ext);
+#endif
 }
 
-// List DB folders
-void list_dbs()
+// Seek that works past 2GB on every platform
+int seek_file(FILE *fp, uint64_t offset)
 {
+#ifdef _WIN32
+    return _fseeki64(fp, (__int64)offset, SEEK_SET);
+#else
+    return fseeko(fp, (off_t)offset, SEEK_SET);
+#endif
+}
 
+// ---------------------------------------------------------------------------
+// Instrumentation
+// process_command times every command and files it under its command type
+// (the command word, plus the object for "create table", "insert into" and
+// the like). While a command runs, the storage code adds the bytes it reads
+// and writes, rows scanned, rows returned and syncs, and the time is split
+// into phases: lookup (finding and opening the table), scan (reading rows,
+// including the per-row work of the command), sort (ordering and merging
+// after the scan), join (partitioned join passes), write (memtable,
+// segments, compaction and flushes) and other (parsing, printing).
+// ---------------------------------------------------------------------------
+
+#define METRICS_MAX_TYPES 48
+#define METRICS_BUCKETS 24 // bucket b counts commands that took under 2^b microseconds
+#define METRICS_FILE "metrics.json"
+
+typedef enum
+{
+    PHASE_OTHER,
+    PHASE_LOOKUP,
+    PHASE_SCAN,
+    PHASE_SORT,
+    PHASE_JOIN,
+    PHASE_WRITE,
+    PHASE_COUNT
+} MetricsPhase;
+
+const char *phase_names[PHASE_COUNT] = {"other", "lookup", "scan", "sort", "join", "write"};
+
+typedef struct
+{
+    uint64_t phase_ns[PHASE_COUNT];
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t rows_scanned;
+    uint64_t rows_returned; // printed, or changed by insert, update and delete
+    uint64_t syncs;         // files flushed to the OS
+    uint64_t cache_hits;    // get results answered by the result cache
+    uint64_t cache_misses;
+} MetricsCounters;
+
+typedef struct
+{
+    char name[32];
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[METRICS_BUCKETS];
+    MetricsCounters totals;
+} CommandMetrics;
+
+CommandMetrics command_metrics[METRICS_MAX_TYPES];
+int command_metrics_count = 0;
+MetricsCounters metrics = {0}; // the command being run
+MetricsPhase metrics_phase = PHASE_OTHER;
+uint64_t metrics_phase_start = 0;
+bool timing_enabled = false;
+
+// Monotonic clock in nanoseconds
+uint64_t clock_ns()
+{
+    struct timespec ts;
 #ifdef _WIN32
-    struct _finddata_t data;
-    intptr_t handle;
+    timespec_get(&ts, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
 
-    handle = _findfirst("db\\*", &data);
-    if (handle == -1)
-    {
-        printf("No databases found.\n");
-        return;
-    }
+// Charge the time so far to the current phase and switch to `phase`.
+// Returns the phase to hand back to metrics_leave.
+MetricsPhase metrics_enter(MetricsPhase phase)
+{
+    uint64_t now = clock_ns();
+    metrics.phase_ns[metrics_phase] += now - metrics_phase_start;
+    metrics_phase_start = now;
 
-    bool found = false;
+    MetricsPhase previous = metrics_phase;
+    metrics_phase = phase;
+    return previous;
+}
 
-    do
-    {
-        if (data.attrib & _A_SUBDIR)
-        {
-            if (strcmp(data.name, ".") == 0 || strcmp(data.name, "..") == 0)
-                continue;
+void metrics_leave(MetricsPhase previous)
+{
+    metrics_enter(previous);
+}
 
-            if (!found)
-            {
-                printf("Databases:\n");
-                found = true;
-            }
+// Statistics group of a command, e.g. "insert into", "get join" or "update"
+void command_type_name(const char *command, char *out, size_t size)
+{
+    char first[32] = {0}, second[32] = {0}, third[32] = {0};
+    sscanf(command, "%31s %31s %31s", first, second, third);
 
-            printf(" - %s\n", data.name);
+    const char *objects[] = {"db", "table", "into", "buffer_pool", "memtable", "work_memory", "parallel", "result_cache", "memory_limit", "ttl"};
+    for (size_t i = 0; i < sizeof(objects) / sizeof(objects[0]); i++)
+    {
+        if (strcmp(second, objects[i]) == 0)
+        {
+            snprintf(out, size, "%s %s", first, second);
+            return;
         }
-    } while (_findnext(handle, &data) == 0);
-
-    _findclose(handle);
-
-    if (!found)
-        printf("No databases found.\n");
+    }
 
-#else
-    DIR *dir = opendir("db");
-    if (!dir)
+    if (strcmp(first, "get") == 0)
     {
-        printf("No databases found.\n");
+        if (strstr(command, " join "))
+            snprintf(out, size, "get join");
+        else if (strstr(command, " order by ") || strstr(command, " limit "))
+            snprintf(out, size, "get order by/limit");
+        else if (third[0])
+            snprintf(out, size, "get filtered");
+        else
+            snprintf(out, size, "get");
         return;
     }
+    snprintf(out, size, "%s", first[0] ? first : "(empty)");
+}
 
-    struct dirent *entry;
-    bool found = false;
-
-    while ((entry = readdir(dir)) != NULL)
+// Add the finished command's counters to its type
+void metrics_record(const char *type, uint64_t elapsed_ns)
+{
+    CommandMetrics *m = NULL;
+    for (int i = 0; i < command_metrics_count && !m; i++)
     {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue;
-
-        // Check if it's a directory using stat
-        char path[512];
-        snprintf(path, sizeof(path), "db/%s", entry->d_name);
-
-        struct stat statbuf;
-        if (stat(path, &statbuf) == 0 && S_ISDIR(statbuf.st_mode))
-        {
-            if (!found)
-            {
-                printf("Databases:\n");
-                found = true;
-            }
-
-            printf(" - %s\n", entry->d_name);
-        }
+        if (strcmp(command_metrics[i].name, type) == 0)
+            m = &command_metrics[i];
+    }
+    if (!m)
+    {
+        if (command_metrics_count == METRICS_MAX_TYPES)
+            return;
+        m = &command_metrics[command_metrics_count++];
+        memset(m, 0, sizeof(*m));
+        snprintf(m->name, sizeof(m->name), "%s", type);
     }
 
-    closedir(dir);
-
-    if (!found)
-        printf("No databases found.\n");
-#endif
+    int bucket = 0;
+    while (bucket < METRICS_BUCKETS - 1 && elapsed_ns / 1000 >= (1ull << bucket))
+        bucket++;
+
+    m->count++;
+    m->total_ns += elapsed_ns;
+    if (elapsed_ns > m->max_ns)
+        m->max_ns = elapsed_ns;
+    m->buckets[bucket]++;
+
+    for (int p = 0; p < PHASE_COUNT; p++)
+        m->totals.phase_ns[p] += metrics.phase_ns[p];
+    m->totals.bytes_read += metrics.bytes_read;
+    m->totals.bytes_written += metrics.bytes_written;
+    m->totals.rows_scanned += metrics.rows_scanned;
+    m->totals.rows_returned += metrics.rows_returned;
+    m->totals.syncs += metrics.syncs;
+    m->totals.cache_hits += metrics.cache_hits;
+    m->totals.cache_misses += metrics.cache_misses;
 }
 
-// void check DB exists -- to be implemented
-
-bool check_db_exists(const char *name)
+// Upper bound in microseconds of the bucket reaching `fraction` of the commands
+uint64_t metrics_percentile(const CommandMetrics *m, double fraction)
 {
-    if (name == NULL || name[0] == '\0')
+    double wanted = (double)m->count * fraction;
+    uint64_t target = (uint64_t)wanted;
+    if ((double)target < wanted)
+        target++;
+
+    uint64_t seen = 0;
+    for (int b = 0; b < METRICS_BUCKETS; b++)
     {
-        printf("Invalid database name.\n");
-        return false;
+        seen += m->buckets[b];
+        if (seen > 0 && seen >= target)
+            return 1ull << b;
     }
+    return 1ull << (METRICS_BUCKETS - 1);
+}
 
-    char path[300] = {0};
-
-#ifdef _WIN32
-    snprintf(path, sizeof(path), "db\\%s", name);
-    return (_access(path, 0) == 0);
+// timing on: one line after each command
+void print_command_timing(uint64_t elapsed_ns)
+{
+    printf("Time: %.3f ms (", (double)elapsed_ns / 1e6);
+    for (int p = PHASE_COUNT - 1; p >= 0; p--)
+        printf("%s %.3f%s", phase_names[p], (double)metrics.phase_ns[p] / 1e6, p ? ", " : "");
+    printf("), read %llu B, written %llu B, rows %llu scanned / %llu returned, syncs %llu\n",
+           (unsigned long long)metrics.bytes_read, (unsigned long long)metrics.bytes_written,
+           (unsigned long long)metrics.rows_scanned, (unsigned long long)metrics.rows_returned,
+           (unsigned long long)metrics.syncs);
+}
 
-#else
-    snprintf(path, sizeof(path), "db/%s", name);
-    return (access(path, F_OK) == 0);
+// Defined with the result cache
+void print_result_cache_summary();
 
-#endif
-}
+// Defined with statements
+void print_statement_cache_summary();
 
-// create Table (Text file) -- to be implemented
-void create_table(const char *name, const char *db_name)
+// stats: per command type latency, time split, I/O and rows
+void print_stats()
 {
-    // Check valid table name & db name
-    if (!name || name[0] == '\0' || !db_name || db_name[0] == '\0')
+    if (command_metrics_count == 0)
     {
-        printf("Invalid table or database name.\n");
+        printf("No commands recorded yet.\n");
         return;
     }
 
-    // Check if database folder exists
-    if (!check_db_exists(db_name))
+    printf("%-20s %8s %10s %10s %10s %10s  %-34s %10s %10s %10s %10s %7s %10s\n", "command", "count", "avg_us",
+           "p50_us", "p99_us", "max_us", "lookup/scan/sort/join/write/other%", "read_KB", "write_KB", "scanned",
+           "returned", "syncs", "cache_h/m");
+    for (int i = 0; i < command_metrics_count; i++)
     {
-        printf("Error: Database '%s' not found. Please create it first or use an existing database.\n", db_name);
-        return;
-    }
+        const CommandMetrics *m = &command_metrics[i];
+        const MetricsCounters *c = &m->totals;
+        char split[48] = "";
+        double total = m->total_ns ? (double)m->total_ns : 1.0;
+        for (int p = 1; p <= PHASE_COUNT; p++)
+        {
+            size_t used = strlen(split);
+            snprintf(split + used, sizeof(split) - used, "%s%.0f", p > 1 ? "/" : "",
+                     100.0 * (double)c->phase_ns[p % PHASE_COUNT] / total);
+        }
 
-    // Build full table file path
-    char table_path[300] = {0};
-    snprintf(table_path, sizeof(table_path), "db/%s/%s.txt", db_name, name);
+        char cache[32];
+        snprintf(cache, sizeof(cache), "%llu/%llu", (unsigned long long)c->cache_hits,
+                 (unsigned long long)c->cache_misses);
 
-#ifdef _WIN32
-    snprintf(table_path, sizeof(table_path), "db\\%s\\%s.txt", db_name, name);
-#endif
-    // Create the table file
-    FILE *file = fopen(table_path, "w");
-    if (!file)
-    {
-        printf("Failed to create table file.\n");
-        return;
+        printf("%-20s %8llu %10.1f %10llu %10llu %10.1f  %-34s %10.1f %10.1f %10llu %10llu %7llu %10s\n", m->name,
+               (unsigned long long)m->count, (double)m->total_ns / 1000.0 / (double)m->count,
+               (unsigned long long)metrics_percentile(m, 0.5), (unsigned long long)metrics_percentile(m, 0.99),
+               (double)m->max_ns / 1000.0, split, (double)c->bytes_read / 1024.0, (double)c->bytes_written / 1024.0,
+               (unsigned long long)c->rows_scanned, (unsigned long long)c->rows_returned,
+               (unsigned long long)c->syncs, cache);
     }
-
-    printf("Table '%s' created successfully inside database '%s'.\n",
-           name, db_name);
-
-    fclose(file);
+    printf("Percentiles are bucket upper bounds (powers of two).\n");
+    print_result_cache_summary();
+    print_statement_cache_summary();
 }
 
-// Get next auto-increment ID for a table
-int get_next_id(const char *db_name, const char *table)
+// stats dump [<file>]: one JSON object per command type, histogram included
+bool dump_stats(const char *path)
 {
-    char table_path[300] = {0};
-
-#ifndef _WIN32
-    snprintf(table_path, sizeof(table_path), "db/%s/%s.txt", db_name, table);
-#else
-    snprintf(table_path, sizeof(table_path), "db\\%s\\%s.txt", db_name, table);
-#endif
-
-    FILE *file = fopen(table_path, "r");
+    FILE *file = fopen(path, "w");
     if (!file)
-    {
-        // File doesn't exist yet, start with ID 1
-        return 1;
-    }
-
-    int last_id = 0;
-    char line[512];
+        return false;
 
-    // Read all lines to find the highest ID
-    while (fgets(line, sizeof(line), file))
+    for (int i = 0; i < command_metrics_count; i++)
     {
-        // Parse id: from the line
-        char *id_ptr = strstr(line, "id:");
-        if (id_ptr)
+        const CommandMetrics *m = &command_metrics[i];
+        const MetricsCounters *c = &m->totals;
+
+        fprintf(file, "{\"command\":\"%s\",\"count\":%llu,\"total_us\":%.1f,\"p50_us\":%llu,\"p99_us\":%llu,\"max_us\":%.1f",
+                m->name, (unsigned long long)m->count, (double)m->total_ns / 1000.0,
+                (unsigned long long)metrics_percentile(m, 0.5), (unsigned long long)metrics_percentile(m, 0.99),
+                (double)m->max_ns / 1000.0);
+        for (int p = 0; p < PHASE_COUNT; p++)
+            fprintf(file, ",\"%s_us\":%.1f", phase_names[p], (double)c->phase_ns[p] / 1000.0);
+        fprintf(file, ",\"bytes_read\":%llu,\"bytes_written\":%llu,\"rows_scanned\":%llu,\"rows_returned\":%llu,\"syncs\":%llu,\"cache_hits\":%llu,\"cache_misses\":%llu,\"histogram_us\":{",
+                (unsigned long long)c->bytes_read, (unsigned long long)c->bytes_written,
+                (unsigned long long)c->rows_scanned, (unsigned long long)c->rows_returned,
+                (unsigned long long)c->syncs, (unsigned long long)c->cache_hits,
+                (unsigned long long)c->cache_misses);
+
+        bool first = true;
+        for (int b = 0; b < METRICS_BUCKETS; b++)
         {
-            int current_id;
-            if (sscanf(id_ptr, "id:%d", &current_id) == 1)
-            {
-                if (current_id > last_id)
-                {
-                    last_id = current_id;
-                }
-            }
+            if (m->buckets[b] == 0)
+                continue;
+            fprintf(file, "%s\"%llu\":%llu", first ? "" : ",", 1ull << b, (unsigned long long)m->buckets[b]);
+            first = false;
         }
+        fprintf(file, "}}\n");
     }
+    return fclose(file) == 0;
+}
 
-    fclose(file);
-    return last_id + 1;
+// ---------------------------------------------------------------------------
+// Block codec
+//
+// A small LZ77 codec using the LZ4 block layout: each sequence is a token
+// (literal length in the high nibble, match length - 4 in the low nibble),
+// optional length extension bytes, the literals and a 2-byte match offset.
+// It trades ratio for speed, which is what page-at-a-time decompression needs.
+// ---------------------------------------------------------------------------
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_GUARD 12
+#define LZ_MAX_OFFSET 65535
+
+uint32_t lz_read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
 }
 
-// Check if table exists in a database
-bool check_table_exists(const char *db_name, const char *table_name)
+// Write a length nibble overflow as a run of 255s and a final byte
+bool lz_put_length(unsigned char *dst, size_t cap, size_t *op, size_t len)
 {
-    if (!db_name || db_name[0] == '\0' || !table_name || table_name[0] == '\0')
+    while (len >= 255)
+    {
+        if (*op >= cap)
+            return false;
+        dst[(*op)++] = 255;
+        len -= 255;
+    }
+    if (*op >= cap)
         return false;
+    dst[(*op)++] = (unsigned char)len;
+    return true;
+}
 
-    if (!check_db_exists(db_name))
-    {
-        printf("Database '%s' does not exist.\n", db_name);
+bool lz_put_sequence(unsigned char *dst, size_t cap, size_t *op, const unsigned char *literals,
+                     size_t literal_len, size_t offset, size_t match_len)
+{
+    if (*op >= cap)
         return false;
-    }
 
-    char table_path[300] = {0};
+    size_t token_pos = (*op)++;
+    unsigned char token = (unsigned char)((literal_len < 15 ? literal_len : 15) << 4);
 
-#ifndef _WIN32
-    snprintf(table_path, sizeof(table_path), "db/%s/%s.txt", db_name, table_name);
-#else
-    snprintf(table_path, sizeof(table_path), "db\\%s\\%s.txt", db_name, table_name);
-#endif
+    if (literal_len >= 15 && !lz_put_length(dst, cap, op, literal_len - 15))
+        return false;
 
-#ifdef _WIN32
-    return (_access(table_path, 0) == 0);
-#else
-    return (access(table_path, F_OK) == 0);
-#endif
-}
+    if (*op + literal_len > cap)
+        return false;
+    memcpy(dst + *op, literals, literal_len);
+    *op += literal_len;
 
-// Update specific records in a table based on where clause and set clause
-void update_record_in_table(const char *table_name, const char *db_name, const char *where_clause, const char *set_clause)
-{
-    if (!check_table_exists(db_name, table_name))
+    if (match_len > 0)
     {
-        printf("Error: Table '%s' does not exist in database '%s'.\n", table_name, db_name);
-        return;
-    }
-
-    char table_path[300] = {0};
-#ifndef _WIN32
-    snprintf(table_path, sizeof(table_path), "db/%s/%s.txt", db_name, table_name);
-#else
-    snprintf(table_path, sizeof(table_path), "db\\%s\\%s.txt", db_name, table_name);
-#endif
+        size_t m = match_len - LZ_MIN_MATCH;
+        token |= (unsigned char)(m < 15 ? m : 15);
 
-    // Parse the where clause to extract field and value
-    char where_field[100], where_value[200];
-    if (sscanf(where_clause, "%99[^:]:%199s", where_field, where_value) != 2)
-    {
-        printf("Error: Invalid where clause format. Use 'field:value' (e.g., id:1)\n");
-        return;
-    }
+        if (*op + 2 > cap)
+            return false;
+        dst[(*op)++] = (unsigned char)(offset & 0xFF);
+        dst[(*op)++] = (unsigned char)(offset >> 8);
 
-    // Parse the set clause to extract field and value
-    char set_field[100], set_value[200];
-    if (sscanf(set_clause, "%99[^:]:%199s", set_field, set_value) != 2)
-    {
-        printf("Error: Invalid set clause format. Use 'field:value' (e.g., name:NewName)\n");
-        return;
+        if (m >= 15 && !lz_put_length(dst, cap, op, m - 15))
+            return false;
     }
 
-    // Create temporary file
-    char temp_path[300];
-#ifndef _WIN32
-    snprintf(temp_path, sizeof(temp_path), "db/%s/%s_temp.txt", db_name, table_name);
-#else
-    snprintf(temp_path, sizeof(temp_path), "db\\%s\\%s_temp.txt", db_name, table_name);
-#endif
+    dst[token_pos] = token;
+    return true;
+}
 
-    FILE *file = fopen(table_path, "r");
-    FILE *temp_file = fopen(temp_path, "w");
+// Compress `len` bytes. Returns the compressed size, or 0 if it does not fit in `cap`.
+size_t lz_compress(const unsigned char *src, size_t len, unsigned char *dst, size_t cap)
+{
+    uint32_t table[1 << LZ_HASH_BITS] = {0}; // position + 1, 0 = empty
+    size_t ip = 0, anchor = 0, op = 0;
+    size_t match_limit = len > LZ_MATCH_GUARD ? len - LZ_MATCH_GUARD : 0;
 
-    if (!file || !temp_file)
+    while (ip < match_limit)
     {
-        printf("Error: Failed to open files for update.\n");
-        if (file)
-            fclose(file);
-        if (temp_file)
-            fclose(temp_file);
-        return;
-    }
+        uint32_t seq = lz_read32(src + ip);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t ref = table[h];
+        table[h] = (uint32_t)(ip + 1);
 
-    char line[512];
-    int updated_count = 0;
-
-    // Read each line and update if it matches the where clause
-    while (fgets(line, sizeof(line), file))
-    {
-        // Remove trailing newline for processing
-        size_t len = strlen(line);
-        bool had_newline = false;
-        if (len > 0 && line[len - 1] == '\n')
+        if (ref == 0 || ip - (ref - 1) > LZ_MAX_OFFSET || lz_read32(src + ref - 1) != seq)
         {
-            line[len - 1] = '\0';
-            had_newline = true;
+            ip++;
+            continue;
         }
+        ref--;
 
-        // Check if the line contains the where_field=where_value pattern (for id) or where_field:where_value (for other fields)
-        char search_pattern_equals[300];
-        snprintf(search_pattern_equals, sizeof(search_pattern_equals), "%s=%s", where_field, where_value);
+        size_t match_len = LZ_MIN_MATCH;
+        while (ip + match_len < len - LZ_LAST_LITERALS && src[ref + match_len] == src[ip + match_len])
+            match_len++;
 
-        char search_pattern_colon[300];
-        snprintf(search_pattern_colon, sizeof(search_pattern_colon), "%s:%s", where_field, where_value);
+        if (!lz_put_sequence(dst, cap, &op, src + anchor, ip - anchor, ip - ref, match_len))
+            return 0;
 
-        char search_pattern_quoted[300];
-        snprintf(search_pattern_quoted, sizeof(search_pattern_quoted), "%s:\"%s\"", where_field, where_value);
-
-        bool matches_where = (strstr(line, search_pattern_equals) != NULL ||
-                              strstr(line, search_pattern_colon) != NULL ||
-                              strstr(line, search_pattern_quoted) != NULL);
-
-        if (matches_where)
-        {
-            updated_count++;
+        ip += match_len;
+        anchor = ip;
+    }
 
-            // Find and replace the field value in the line
-            char updated_line[512] = {0};
-            char *field_pos = NULL;
+    if (!lz_put_sequence(dst, cap, &op, src + anchor, len - anchor, 0, 0))
+        return 0;
+    return op;
+}
 
-            // Try to find the field to update (look for both = and : separators)
-            char old_pattern_equals[300];
-            char old_pattern_colon[300];
-            snprintf(old_pattern_equals, sizeof(old_pattern_equals), "%s=", set_field);
-            snprintf(old_pattern_colon, sizeof(old_pattern_colon), "%s:", set_field);
+// Decompress into `dst`. Returns the decompressed size, or 0 on corrupt input.
+size_t lz_decompress(const unsigned char *src, size_t len, unsigned char *dst, size_t cap)
+{
+    size_t ip = 0, op = 0;
 
-            field_pos = strstr(line, old_pattern_equals);
-            char separator = '=';
+    while (ip < len)
+    {
+        unsigned char token = src[ip++];
 
-            if (!field_pos)
+        size_t literal_len = token >> 4;
+        if (literal_len == 15)
+        {
+            unsigned char b;
+            do
             {
-                field_pos = strstr(line, old_pattern_colon);
-                separator = ':';
-            }
+                if (ip >= len)
+                    return 0;
+                b = src[ip++];
+                literal_len += b;
+            } while (b == 255);
+        }
 
-            if (field_pos)
+        if (ip + literal_len > len || op + literal_len > cap)
+            return 0;
+        memcpy(dst + op, src + ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+
+        // The last sequence has literals only
+        if (ip >= len)
+            break;
+
+        if (ip + 2 > len)
+            return 0;
+        size_t offset = src[ip] | ((size_t)src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op)
+            return 0;
+
+        size_t match_len = (token & 0x0F);
+        if (match_len == 15)
+        {
+            unsigned char b;
+            do
             {
-                // Build the new line with updated value
-                size_t prefix_len = field_pos - line;
-                strncpy(updated_line, line, prefix_len);
-                updated_line[prefix_len] = '\0';
+                if (ip >= len)
+                    return 0;
+                b = src[ip++];
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += LZ_MIN_MATCH;
 
-                // Add field name and separator
-                snprintf(updated_line + strlen(updated_line), sizeof(updated_line) - strlen(updated_line),
-                         "%s%c", set_field, separator);
+        if (op + match_len > cap)
+            return 0;
 
-                // Find where the old value ends
-                char *value_start = field_pos + strlen(set_field) + 1; // +1 for separator
-                char *value_end = value_start;
+        // Byte by byte because the match may overlap the output
+        for (size_t i = 0; i < match_len; i++, op++)
+            dst[op] = dst[op - offset];
+    }
+    return op;
+}
 
-                // Skip leading space if present
-                if (*value_end == ' ')
-                    value_end++;
+// ---------------------------------------------------------------------------
+// Paged storage
+//
+// Every table is a file of PAGE_SIZE pages. Page 0 holds the table header and
+// all other pages use a slotted layout:
+//
+//   [slot_count:u16][free_end:u16][slot 0][slot 1]...  free  ...[records]
+//
+// A slot is {offset:u16, length:u16}. Records grow down from the end of the
+// page and a slot with offset 0 marks a deleted record. Pages are only ever
+// touched through the buffer pool below, which keeps hot pages in memory
+// across commands and writes dirty pages back when they are evicted or
+// flushed.
+//
+// Compressed tables keep page 0 raw at offset 0 and store every other page
+// as an independently compressed block. A block index in <table>.blk maps
+// page numbers to file offsets and records the id range of each block, so a
+// scan decompresses one block at a time and an id lookup only one block.
+// ---------------------------------------------------------------------------
+
+#define BLOCK_INDEX_MAGIC "NANOBLK1"
+#define BLOCK_STORED_RAW 1u
+
+typedef struct
+{
+    uint64_t offset;
+    uint32_t length; // bytes on disk, 0 if the block was never written
+    uint32_t capacity; // bytes reserved at offset, reused by smaller rewrites
+    uint32_t min_id;
+    uint32_t max_id;
+    uint32_t flags;
+} BlockEntry;
+
+typedef struct
+{
+    bool in_use;
+    char path[300];
+    FILE *fp;
+    uint32_t page_count;
 
-                // Find the end of the value (comma, space after unquoted, or end of string)
-                if (*value_end == '"')
-                {
-                    // Quoted value - find closing quote
-                    value_end++;
-                    while (*value_end && *value_end != '"')
-                        value_end++;
-                    if (*value_end == '"')
-                        value_end++;
-                }
-                else
-                {
-                    // Unquoted value - find comma or end of string
-                    while (*value_end && *value_end != ',' && *value_end != ' ')
-                        value_end++;
-                }
+    // Block compression (only for compressed tables)
+    bool compressed;
+    char index_path[300];
+    BlockEntry *blocks;
+    uint32_t block_capacity;
+    uint64_t data_end;
+    bool index_dirty;
+} PagedFile;
 
-                // Append the new value
-                snprintf(updated_line + strlen(updated_line), sizeof(updated_line) - strlen(updated_line),
-                         "%s%s", set_value, value_end);
+PagedFile paged_files[MAX_PAGED_FILES];
 
-                // Write updated line
-                fprintf(temp_file, "%s\n", updated_line);
-            }
-            else
-            {
-                // Field not found, write original line
-                fprintf(temp_file, "%s%s", line, had_newline ? "\n" : "");
-            }
-        }
-        else
+// Defined with the slotted page helpers; gives the id range stored in a page
+bool page_id_range(const unsigned char *page, uint32_t *min_id, uint32_t *max_id);
+
+// Open (or create) a paged file and return its id, -1 on failure
+int paged_open(const char *path, bool create)
+{
+    int file_id = -1;
+    for (int i = 0; i < MAX_PAGED_FILES; i++)
+    {
+        if (!paged_files[i].in_use)
         {
-            // No match, write original line
-            fprintf(temp_file, "%s%s", line, had_newline ? "\n" : "");
+            file_id = i;
+            break;
         }
     }
 
-    fclose(file);
-    fclose(temp_file);
-
-    // Replace original file with temp file
-    if (remove(table_path) != 0)
+    if (file_id < 0)
     {
-        printf("Error: Failed to remove original table file.\n");
-        remove(temp_path);
-        return;
+        print_error("Error: Too many open table files.\n");
+        return -1;
     }
 
-    if (rename(temp_path, table_path) != 0)
-    {
-        printf("Error: Failed to rename temporary file.\n");
-        return;
-    }
+    FILE *fp = fopen(path, create ? "w+b" : "r+b");
+    if (!fp)
+        return -1;
 
-    if (updated_count > 0)
-    {
-        printf("Updated %d record(s) in table '%s' where %s=%s, set %s=%s.\n",
-               updated_count, table_name, where_field, where_value, set_field, set_value);
-    }
-    else
-    {
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+
+    PagedFile *pf = &paged_files[file_id];
+    memset(pf, 0, sizeof(*pf));
+    pf->in_use = true;
+    strncpy(pf->path, path, sizeof(pf->path) - 1);
+    pf->fp = fp;
+    pf->page_count = size > 0 ? (uint32_t)((size + PAGE_SIZE - 1) / PAGE_SIZE) : 0;
+    return file_id;
+}
+
+bool paged_reserve_blocks(PagedFile *pf, uint32_t count)
+{
+    if (count <= pf->block_capacity)
+        return true;
+
+    uint32_t capacity = pf->block_capacity ? pf->block_capacity : 64;
+    while (capacity < count)
+        capacity *= 2;
+
+    BlockEntry *blocks = realloc(pf->blocks, capacity * sizeof(BlockEntry));
+    if (!blocks)
+        return false;
+
+    memset(blocks + pf->block_capacity, 0, (capacity - pf->block_capacity) * sizeof(BlockEntry));
+    pf->blocks = blocks;
+    pf->block_capacity = capacity;
+    return true;
+}
+
+// Switch a file to compressed blocks. An existing index is loaded from
+// `index_path`; a missing index means the table has no data pages yet.
+bool paged_enable_compression(int file_id, const char *index_path)
+{
+    PagedFile *pf = &paged_files[file_id];
+    pf->compressed = true;
+    strncpy(pf->index_path, index_path, sizeof(pf->index_path) - 1);
+    pf->page_count = 1;
+    pf->index_dirty = false;
+
+    fseek(pf->fp, 0, SEEK_END);
+    long size = ftell(pf->fp);
+    pf->data_end = size > PAGE_SIZE ? (uint64_t)size : PAGE_SIZE;
+
+    FILE *idx = fopen(index_path, "rb");
+    if (!idx)
+    {
+        pf->index_dirty = true;
+        return paged_reserve_blocks(pf, 1);
+    }
+
+    char magic[8];
+    uint32_t count = 0;
+    bool ok = fread(magic, 1, sizeof(magic), idx) == sizeof(magic) &&
+              memcmp(magic, BLOCK_INDEX_MAGIC, sizeof(magic)) == 0 &&
+              fread(&count, sizeof(count), 1, idx) == 1 &&
+              count >= 1 && paged_reserve_blocks(pf, count) &&
+              fread(pf->blocks, sizeof(BlockEntry), count, idx) == count;
+    fclose(idx);
+
+    if (!ok)
+    {
+        print_error("Error: Block index '%s' is corrupt.\n", index_path);
+        return false;
+    }
+
+    pf->page_count = count;
+    metrics.bytes_read += 12 + (uint64_t)count * sizeof(BlockEntry);
+    return true;
+}
+
+// Persist the block index of a compressed file
+bool paged_save_index(PagedFile *pf)
+{
+    if (!pf->compressed || !pf->index_dirty)
+        return true;
+
+    FILE *idx = fopen(pf->index_path, "wb");
+    if (!idx)
+        return false;
+
+    uint32_t count = pf->page_count;
+    bool ok = fwrite(BLOCK_INDEX_MAGIC, 1, 8, idx) == 8 &&
+              fwrite(&count, sizeof(count), 1, idx) == 1 &&
+              fwrite(pf->blocks, sizeof(BlockEntry), count, idx) == count;
+    ok = (fclose(idx) == 0) && ok;
+
+    if (ok)
+    {
+        pf->index_dirty = false;
+        metrics.bytes_written += 12 + (uint64_t)count * sizeof(BlockEntry);
+    }
+    return ok;
+}
+
+// Push buffered writes (and the block index) to the OS
+bool paged_sync(int file_id)
+{
+    PagedFile *pf = &paged_files[file_id];
+    bool ok = fflush(pf->fp) == 0;
+    metrics.syncs++;
+    return paged_save_index(pf) && ok;
+}
+
+// Read one page from disk; pages past the end of the file read as zeros
+bool paged_read_page(int file_id, uint32_t page_no, unsigned char *buffer)
+{
+    PagedFile *pf = &paged_files[file_id];
+    memset(buffer, 0, PAGE_SIZE);
+
+    if (page_no >= pf->page_count)
+        return true;
+
+    if (pf->compressed && page_no > 0)
+    {
+        BlockEntry *b = &pf->blocks[page_no];
+        if (b->length == 0)
+            return true;
+
+        unsigned char block[PAGE_SIZE];
+        if (b->length > PAGE_SIZE || seek_file(pf->fp, b->offset) != 0 ||
+            fread(block, 1, b->length, pf->fp) != b->length)
+            return false;
+        metrics.bytes_read += b->length;
+
+        if (b->flags & BLOCK_STORED_RAW)
+        {
+            memcpy(buffer, block, b->length);
+            return true;
+        }
+        return lz_decompress(block, b->length, buffer, PAGE_SIZE) == PAGE_SIZE;
+    }
+
+    if (seek_file(pf->fp, (uint64_t)page_no * PAGE_SIZE) != 0)
+        return false;
+
+    // A short read at the end of the file leaves the rest zero-filled
+    metrics.bytes_read += fread(buffer, 1, PAGE_SIZE, pf->fp);
+    return true;
+}
+
+#ifndef _WIN32
+// paged_read_page with positioned reads, for scan worker threads: it does
+// not move the shared file position, so several threads can read one file.
+// Buffered writes must be flushed first. Bytes read are added to `bytes`
+// instead of the (single-threaded) metrics.
+bool paged_pread_page(int file_id, uint32_t page_no, unsigned char *buffer, uint64_t *bytes)
+{
+    PagedFile *pf = &paged_files[file_id];
+    int fd = fileno(pf->fp);
+    memset(buffer, 0, PAGE_SIZE);
+
+    if (page_no >= pf->page_count)
+        return true;
+
+    if (pf->compressed && page_no > 0)
+    {
+        const BlockEntry *b = &pf->blocks[page_no];
+        if (b->length == 0)
+            return true;
+
+        unsigned char block[PAGE_SIZE];
+        if (b->length > PAGE_SIZE || pread(fd, block, b->length, (off_t)b->offset) != (ssize_t)b->length)
+            return false;
+        *bytes += b->length;
+
+        if (b->flags & BLOCK_STORED_RAW)
+        {
+            memcpy(buffer, block, b->length);
+            return true;
+        }
+        return lz_decompress(block, b->length, buffer, PAGE_SIZE) == PAGE_SIZE;
+    }
+
+    // A short read at the end of the file leaves the rest zero-filled
+    ssize_t n = pread(fd, buffer, PAGE_SIZE, (off_t)page_no * PAGE_SIZE);
+    if (n < 0)
+        return false;
+    *bytes += (uint64_t)n;
+    return true;
+}
+#endif
+
+// Compress a page and store it in its old slot if it still fits, or at the end of the file
+bool paged_write_block(PagedFile *pf, uint32_t page_no, const unsigned char *buffer)
+{
+    if (!paged_reserve_blocks(pf, page_no + 1))
+        return false;
+
+    unsigned char block[PAGE_SIZE];
+    uint32_t flags = 0;
+    size_t length = lz_compress(buffer, PAGE_SIZE, block, sizeof(block) - 1);
+    if (length == 0)
+    {
+        memcpy(block, buffer, PAGE_SIZE);
+        length = PAGE_SIZE;
+        flags = BLOCK_STORED_RAW;
+    }
+
+    BlockEntry *b = &pf->blocks[page_no];
+    uint64_t offset = b->offset;
+    uint32_t capacity = b->capacity;
+    if (capacity < length)
+    {
+        offset = pf->data_end;
+        capacity = (uint32_t)length;
+    }
+
+    if (seek_file(pf->fp, offset) != 0 || fwrite(block, 1, length, pf->fp) != length)
+        return false;
+    metrics.bytes_written += length;
+
+    if (offset == pf->data_end)
+        pf->data_end += length;
+
+    b->offset = offset;
+    b->length = (uint32_t)length;
+    b->capacity = capacity;
+    b->flags = flags;
+    if (!page_id_range(buffer, &b->min_id, &b->max_id))
+    {
+        b->min_id = 1;
+        b->max_id = 0; // empty block, never matches an id range
+    }
+
+    pf->index_dirty = true;
+    return true;
+}
+
+// Write one page to disk
+bool paged_write_page(int file_id, uint32_t page_no, const unsigned char *buffer)
+{
+    PagedFile *pf = &paged_files[file_id];
+
+    if (pf->compressed && page_no > 0)
+    {
+        if (!paged_write_block(pf, page_no, buffer))
+            return false;
+    }
+    else
+    {
+        if (seek_file(pf->fp, (uint64_t)page_no * PAGE_SIZE) != 0)
+            return false;
+
+        if (fwrite(buffer, 1, PAGE_SIZE, pf->fp) != PAGE_SIZE)
+            return false;
+        metrics.bytes_written += PAGE_SIZE;
+    }
+
+    if (page_no >= pf->page_count)
+        pf->page_count = page_no + 1;
+    return true;
+}
+
+// Reserve a new page number at the end of the file
+uint32_t paged_allocate(int file_id)
+{
+    PagedFile *pf = &paged_files[file_id];
+    if (pf->compressed && paged_reserve_blocks(pf, pf->page_count + 1))
+    {
+        memset(&pf->blocks[pf->page_count], 0, sizeof(BlockEntry));
+        pf->index_dirty = true;
+    }
+    return pf->page_count++;
+}
+
+// True if a compressed block is known to hold no id in [min_id, max_id]
+bool paged_block_excludes(int file_id, uint32_t page_no, uint32_t min_id, uint32_t max_id)
+{
+    PagedFile *pf = &paged_files[file_id];
+    if (!pf->compressed || page_no == 0 || page_no >= pf->page_count)
+        return false;
+
+    BlockEntry *b = &pf->blocks[page_no];
+    if (b->length == 0)
+        return false;
+    return b->max_id < min_id || b->min_id > max_id;
+}
+
+// Whether a sorted id list has an id in [min_id, max_id]
+bool ids_overlap(const uint32_t *ids, size_t count, uint32_t min_id, uint32_t max_id)
+{
+    size_t lo = 0, hi = count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ids[mid] < min_id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < count && ids[lo] <= max_id;
+}
+
+// True if a compressed block is known to hold none of the sorted `ids`
+bool paged_block_excludes_ids(int file_id, uint32_t page_no, const uint32_t *ids, size_t count)
+{
+    PagedFile *pf = &paged_files[file_id];
+    if (!pf->compressed || page_no == 0 || page_no >= pf->page_count)
+        return false;
+
+    BlockEntry *b = &pf->blocks[page_no];
+    if (b->length == 0)
+        return false;
+    return !ids_overlap(ids, count, b->min_id, b->max_id);
+}
+
+void paged_close(int file_id)
+{
+    PagedFile *pf = &paged_files[file_id];
+    if (!pf->in_use)
+        return;
+
+    fclose(pf->fp);
+    free(pf->blocks);
+    memset(pf, 0, sizeof(*pf));
+}
+
+// ---------------------------------------------------------------------------
+// Buffer pool
+// ---------------------------------------------------------------------------
+
+typedef struct
+{
+    int file_id; // -1 when the frame holds no page
+    uint32_t page_no;
+    int pin_count;
+    bool dirty;
+    int hash_next;
+    int lru_prev;
+    int lru_next;
+} BufferFrame;
+
+typedef struct
+{
+    int frame_count;
+    BufferFrame *frames;
+    unsigned char *memory;
+    int *buckets;
+    int bucket_count;
+    int lru_head; // least recently used unpinned frame
+    int lru_tail; // most recently used unpinned frame
+} BufferPool;
+
+BufferPool pool = {0};
+int pool_size_setting = DEFAULT_POOL_PAGES;
+
+// Remove a frame from the LRU list (frames are only listed while unpinned)
+void pool_lru_unlink(int i)
+{
+    BufferFrame *f = &pool.frames[i];
+
+    if (f->lru_prev >= 0)
+        pool.frames[f->lru_prev].lru_next = f->lru_next;
+    else
+        pool.lru_head = f->lru_next;
+
+    if (f->lru_next >= 0)
+        pool.frames[f->lru_next].lru_prev = f->lru_prev;
+    else
+        pool.lru_tail = f->lru_prev;
+
+    f->lru_prev = f->lru_next = -1;
+}
+
+// Append a frame as the most recently used one
+void pool_lru_push_back(int i)
+{
+    BufferFrame *f = &pool.frames[i];
+    f->lru_prev = pool.lru_tail;
+    f->lru_next = -1;
+
+    if (pool.lru_tail >= 0)
+        pool.frames[pool.lru_tail].lru_next = i;
+    else
+        pool.lru_head = i;
+    pool.lru_tail = i;
+}
+
+// Put an empty frame first in line for reuse
+void pool_lru_push_front(int i)
+{
+    BufferFrame *f = &pool.frames[i];
+    f->lru_prev = -1;
+    f->lru_next = pool.lru_head;
+
+    if (pool.lru_head >= 0)
+        pool.frames[pool.lru_head].lru_prev = i;
+    else
+        pool.lru_tail = i;
+    pool.lru_head = i;
+}
+
+int pool_bucket(int file_id, uint32_t page_no)
+{
+    uint32_t h = (uint32_t)file_id * 2654435761u ^ page_no * 40503u;
+    return (int)(h % (uint32_t)pool.bucket_count);
+}
+
+// Find the frame holding a page, -1 if it is not cached
+int pool_lookup(int file_id, uint32_t page_no)
+{
+    for (int i = pool.buckets[pool_bucket(file_id, page_no)]; i >= 0; i = pool.frames[i].hash_next)
+    {
+        if (pool.frames[i].file_id == file_id && pool.frames[i].page_no == page_no)
+            return i;
+    }
+    return -1;
+}
+
+void pool_hash_insert(int i)
+{
+    int b = pool_bucket(pool.frames[i].file_id, pool.frames[i].page_no);
+    pool.frames[i].hash_next = pool.buckets[b];
+    pool.buckets[b] = i;
+}
+
+void pool_hash_remove(int i)
+{
+    int *link = &pool.buckets[pool_bucket(pool.frames[i].file_id, pool.frames[i].page_no)];
+    while (*link >= 0)
+    {
+        if (*link == i)
+        {
+            *link = pool.frames[i].hash_next;
+            break;
+        }
+        link = &pool.frames[*link].hash_next;
+    }
+    pool.frames[i].hash_next = -1;
+}
+
+unsigned char *pool_frame_data(int i)
+{
+    return pool.memory + (size_t)i * PAGE_SIZE;
+}
+
+bool pool_init(int pages)
+{
+    pool.frames = calloc((size_t)pages, sizeof(BufferFrame));
+    pool.memory = malloc((size_t)pages * PAGE_SIZE);
+    pool.bucket_count = pages * 2;
+    pool.buckets = malloc((size_t)pool.bucket_count * sizeof(int));
+
+    if (!pool.frames || !pool.memory || !pool.buckets)
+    {
+        free(pool.frames);
+        free(pool.memory);
+        free(pool.buckets);
+        memset(&pool, 0, sizeof(pool));
+        print_error("Error: Failed to allocate buffer pool.\n");
+        return false;
+    }
+
+    pool.frame_count = pages;
+    pool.lru_head = pool.lru_tail = -1;
+    for (int b = 0; b < pool.bucket_count; b++)
+        pool.buckets[b] = -1;
+
+    for (int i = 0; i < pages; i++)
+    {
+        pool.frames[i].file_id = -1;
+        pool.frames[i].hash_next = -1;
+        pool_lru_push_back(i);
+    }
+    return true;
+}
+
+bool pool_write_frame(int i)
+{
+    BufferFrame *f = &pool.frames[i];
+    if (!paged_write_page(f->file_id, f->page_no, pool_frame_data(i)))
+    {
+        print_error("Error: Failed to write page %u of '%s'.\n", f->page_no, paged_files[f->file_id].path);
+        return false;
+    }
+    f->dirty = false;
+    return true;
+}
+
+// Pin a page in memory, reading it from disk on a miss. `fresh` pages are
+// newly allocated and start zero-filled instead of being read.
+unsigned char *pool_fetch_page(int file_id, uint32_t page_no, bool fresh)
+{
+    if (!pool.frames && !pool_init(pool_size_setting))
+        return NULL;
+
+    int i = pool_lookup(file_id, page_no);
+    if (i >= 0)
+    {
+        if (pool.frames[i].pin_count == 0)
+            pool_lru_unlink(i);
+        pool.frames[i].pin_count++;
+        return pool_frame_data(i);
+    }
+
+    // Miss: evict the least recently used unpinned frame
+    i = pool.lru_head;
+    if (i < 0)
+    {
+        print_error("Error: Buffer pool exhausted (all %d pages are pinned).\n", pool.frame_count);
+        return NULL;
+    }
+
+    BufferFrame *f = &pool.frames[i];
+    if (f->file_id >= 0)
+    {
+        if (f->dirty && !pool_write_frame(i))
+            return NULL;
+        pool_hash_remove(i);
+        f->file_id = -1;
+    }
+    pool_lru_unlink(i);
+
+    unsigned char *data = pool_frame_data(i);
+    if (fresh)
+    {
+        memset(data, 0, PAGE_SIZE);
+    }
+    else if (!paged_read_page(file_id, page_no, data))
+    {
+        print_error("Error: Failed to read page %u of '%s'.\n", page_no, paged_files[file_id].path);
+        pool_lru_push_front(i);
+        return NULL;
+    }
+
+    f->file_id = file_id;
+    f->page_no = page_no;
+    f->pin_count = 1;
+    f->dirty = fresh;
+    pool_hash_insert(i);
+    return data;
+}
+
+// Release a pinned page, marking it dirty if it was modified
+void pool_unpin(unsigned char *page, bool dirty)
+{
+    int i = (int)((page - pool.memory) / PAGE_SIZE);
+    BufferFrame *f = &pool.frames[i];
+
+    if (dirty)
+        f->dirty = true;
+
+    if (f->pin_count > 0 && --f->pin_count == 0)
+        pool_lru_push_back(i);
+}
+
+// Write back every dirty page of one file
+bool pool_flush_file(int file_id)
+{
+    bool ok = true;
+    for (int i = 0; i < pool.frame_count; i++)
+    {
+        if (pool.frames[i].file_id == file_id && pool.frames[i].dirty)
+            ok = pool_write_frame(i) && ok;
+    }
+    return paged_sync(file_id) && ok;
+}
+
+// Forget every cached page of a file without writing it back
+void pool_discard_file(int file_id)
+{
+    for (int i = 0; i < pool.frame_count; i++)
+    {
+        BufferFrame *f = &pool.frames[i];
+        if (f->file_id != file_id)
+            continue;
+
+        // Files are only closed when nothing reads them. A pinned frame is
+        // not in the LRU list, and its page is still in use: leave it be.
+        assert(f->pin_count == 0);
+        if (f->pin_count > 0)
+            continue;
+
+        pool_hash_remove(i);
+        f->file_id = -1;
+        f->dirty = false;
+        pool_lru_unlink(i);
+        pool_lru_push_front(i);
+    }
+}
+
+// Write back all dirty pages of all files
+bool pool_flush_all()
+{
+    bool ok = true;
+    for (int i = 0; i < pool.frame_count; i++)
+    {
+        if (pool.frames[i].file_id >= 0 && pool.frames[i].dirty)
+            ok = pool_write_frame(i) && ok;
+    }
+
+    for (int f = 0; f < MAX_PAGED_FILES; f++)
+    {
+        if (paged_files[f].in_use)
+            ok = paged_sync(f) && ok;
+    }
+    return ok;
+}
+
+// Change the number of frames. Dirty pages are written back first.
+bool pool_resize(int pages)
+{
+    if (pages < MIN_POOL_PAGES)
+        pages = MIN_POOL_PAGES;
+
+    if (pool.frames)
+    {
+        for (int i = 0; i < pool.frame_count; i++)
+        {
+            if (pool.frames[i].pin_count > 0)
+            {
+                print_error("Error: Cannot resize the buffer pool while pages are pinned.\n");
+                return false;
+            }
+        }
+
+        if (!pool_flush_all())
+            return false;
+
+        free(pool.frames);
+        free(pool.memory);
+        free(pool.buckets);
+        memset(&pool, 0, sizeof(pool));
+    }
+
+    pool_size_setting = pages;
+    return pool_init(pages);
+}
+
+// ---------------------------------------------------------------------------
+// Slotted pages
+// ---------------------------------------------------------------------------
+
+uint16_t page_get16(const unsigned char *page, size_t offset)
+{
+    uint16_t v;
+    memcpy(&v, page + offset, sizeof(v));
+    return v;
+}
+
+void page_put16(unsigned char *page, size_t offset, uint16_t v)
+{
+    memcpy(page + offset, &v, sizeof(v));
+}
+
+uint16_t page_slot_count(const unsigned char *page)
+{
+    return page_get16(page, 0);
+}
+
+uint16_t page_slot_offset(const unsigned char *page, uint16_t slot)
+{
+    return page_get16(page, PAGE_HEADER_SIZE + (size_t)slot * SLOT_SIZE);
+}
+
+uint16_t page_slot_length(const unsigned char *page, uint16_t slot)
+{
+    return page_get16(page, PAGE_HEADER_SIZE + (size_t)slot * SLOT_SIZE + 2);
+}
+
+void page_set_slot(unsigned char *page, uint16_t slot, uint16_t offset, uint16_t length)
+{
+    page_put16(page, PAGE_HEADER_SIZE + (size_t)slot * SLOT_SIZE, offset);
+    page_put16(page, PAGE_HEADER_SIZE + (size_t)slot * SLOT_SIZE + 2, length);
+}
+
+void page_init(unsigned char *page)
+{
+    memset(page, 0, PAGE_SIZE);
+    page_put16(page, 0, 0);
+    page_put16(page, 2, PAGE_SIZE);
+}
+
+// Contiguous free bytes between the slot array and the record area
+size_t page_contiguous_free(const unsigned char *page)
+{
+    size_t slots_end = PAGE_HEADER_SIZE + (size_t)page_slot_count(page) * SLOT_SIZE;
+    size_t free_end = page_get16(page, 2);
+    return free_end > slots_end ? free_end - slots_end : 0;
+}
+
+// Free bytes available after compaction, ignoring the record in `skip_slot`
+size_t page_total_free(const unsigned char *page, int skip_slot)
+{
+    uint16_t count = page_slot_count(page);
+    size_t used = PAGE_HEADER_SIZE + (size_t)count * SLOT_SIZE;
+
+    for (uint16_t s = 0; s < count; s++)
+    {
+        if ((int)s != skip_slot && page_slot_offset(page, s) != 0)
+            used += page_slot_length(page, s);
+    }
+    return PAGE_SIZE - used;
+}
+
+// Move all live records to the end of the page so free space is contiguous
+void page_compact(unsigned char *page)
+{
+    unsigned char copy[PAGE_SIZE];
+    memcpy(copy, page, PAGE_SIZE);
+
+    uint16_t count = page_slot_count(page);
+    size_t free_end = PAGE_SIZE;
+
+    for (uint16_t s = 0; s < count; s++)
+    {
+        uint16_t offset = page_slot_offset(copy, s);
+        uint16_t length = page_slot_length(copy, s);
+        if (offset == 0)
+            continue;
+
+        free_end -= length;
+        memcpy(page + free_end, copy + offset, length);
+        page_set_slot(page, s, (uint16_t)free_end, length);
+    }
+    page_put16(page, 2, (uint16_t)free_end);
+}
+
+// Insert a record into a page, returning its slot or -1 if it does not fit
+int page_insert(unsigned char *page, const char *record, size_t length)
+{
+    size_t needed = length + SLOT_SIZE;
+
+    if (page_contiguous_free(page) < needed)
+    {
+        if (page_total_free(page, -1) < needed)
+            return -1;
+        page_compact(page);
+    }
+
+    uint16_t slot = page_slot_count(page);
+    uint16_t free_end = (uint16_t)(page_get16(page, 2) - length);
+    memcpy(page + free_end, record, length);
+
+    page_put16(page, 0, (uint16_t)(slot + 1));
+    page_put16(page, 2, free_end);
+    page_set_slot(page, slot, free_end, (uint16_t)length);
+    return slot;
+}
+
+// Replace a record in place; false if the page has no room for it
+bool page_update(unsigned char *page, uint16_t slot, const char *record, size_t length)
+{
+    uint16_t offset = page_slot_offset(page, slot);
+    uint16_t old_length = page_slot_length(page, slot);
+
+    if (length <= old_length)
+    {
+        memcpy(page + offset, record, length);
+        page_set_slot(page, slot, offset, (uint16_t)length);
+        return true;
+    }
+
+    if (page_contiguous_free(page) < length)
+    {
+        if (page_total_free(page, slot) < length)
+            return false;
+        page_set_slot(page, slot, 0, 0);
+        page_compact(page);
+    }
+
+    uint16_t free_end = (uint16_t)(page_get16(page, 2) - length);
+    memcpy(page + free_end, record, length);
+    page_put16(page, 2, free_end);
+    page_set_slot(page, slot, free_end, (uint16_t)length);
+    return true;
+}
+
+void page_delete(unsigned char *page, uint16_t slot)
+{
+    page_set_slot(page, slot, 0, 0);
+}
+
+// ---------------------------------------------------------------------------
+// Records
+//
+// A record is a line like "id:1, name:John, age:30". Fields are separated by
+// commas, keys and values by ':' or '=', and values may be quoted.
+// ---------------------------------------------------------------------------
+
+typedef struct
+{
+    const char *key;
+    size_t key_len;
+    const char *value; // raw value, quotes included
+    size_t value_len;
+} RecordField;
+
+// Step to the next "key:value" field at *cursor; false at the end of the record
+bool record_next_field(const char **cursor, RecordField *field)
+{
+    const char *p = *cursor;
+
+    while (*p)
+    {
+        while (*p == ' ' || *p == ',')
+            p++;
+        if (*p == '\0')
+            break;
+
+        const char *key = p;
+        while (*p && *p != ':' && *p != '=' && *p != ',')
+            p++;
+
+        const char *key_end = p;
+        while (key_end > key && key_end[-1] == ' ')
+            key_end--;
+
+        // Piece without a separator, skip it
+        if (*p != ':' && *p != '=')
+            continue;
+        p++;
+
+        while (*p == ' ')
+            p++;
+
+        const char *val = p;
+        const char *val_end;
+        if (*p == '"')
+        {
+            p++;
+            while (*p && *p != '"')
+                p++;
+            if (*p == '"')
+                p++;
+            val_end = p;
+            while (*p && *p != ',')
+                p++;
+        }
+        else
+        {
+            while (*p && *p != ',')
+                p++;
+            val_end = p;
+            while (val_end > val && val_end[-1] == ' ')
+                val_end--;
+        }
+
+        field->key = key;
+        field->key_len = (size_t)(key_end - key);
+        field->value = val;
+        field->value_len = (size_t)(val_end - val);
+        *cursor = p;
+        return true;
+    }
+
+    *cursor = p;
+    return false;
+}
+
+bool field_key_is(const RecordField *field, const char *name)
+{
+    size_t len = strlen(name);
+    return field->key_len == len && strncmp(field->key, name, len) == 0;
+}
+
+// Locate a field. On success *value points at the raw value (quotes
+// included) and *value_len holds its length.
+bool record_find_field(const char *record, const char *field, const char **value, size_t *value_len)
+{
+    RecordField f;
+    const char *cursor = record;
+
+    while (record_next_field(&cursor, &f))
+    {
+        if (field_key_is(&f, field))
+        {
+            *value = f.value;
+            *value_len = f.value_len;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+// Strip surrounding quotes from a value
+void unquote_value(const char **value, size_t *len)
+{
+    if (*len >= 2 && (*value)[0] == '"' && (*value)[*len - 1] == '"')
+    {
+        (*value)++;
+        *len -= 2;
+    }
+}
+
+// Compare a stored value with a query value, ignoring quotes on either side
+bool record_value_equals(const char *value, size_t value_len, const char *expected)
+{
+    size_t expected_len = strlen(expected);
+    unquote_value(&value, &value_len);
+    unquote_value(&expected, &expected_len);
+    return value_len == expected_len && strncmp(value, expected, value_len) == 0;
+}
+
+// Check whether a record has field == value
+bool record_matches(const char *record, const char *field, const char *value)
+{
+    const char *found;
+    size_t found_len;
+    if (!record_find_field(record, field, &found, &found_len))
+        return false;
+    return record_value_equals(found, found_len, value);
+}
+
+// Get the numeric id of a record, 0 if it has none
+uint32_t record_id(const char *record)
+{
+    const char *value;
+    size_t len;
+    if (!record_find_field(record, "id", &value, &len))
+        return 0;
+    return (uint32_t)strtoul(value, NULL, 10);
+}
+
+// Copy `record` into `out` with the value of `field` replaced by `value`.
+// Returns false if the record has no such field or the result is too long.
+bool record_set_field(const char *record, const char *field, const char *value, char *out, size_t out_size)
+{
+    const char *old_value;
+    size_t old_len;
+    if (!record_find_field(record, field, &old_value, &old_len))
+        return false;
+
+    size_t prefix_len = (size_t)(old_value - record);
+    int written = snprintf(out, out_size, "%.*s%s%s", (int)prefix_len, record, value, old_value + old_len);
+    return written >= 0 && (size_t)written < out_size;
+}
+
+// Copy `record` into `out` with every field of `attributes` ("a:1, b:2")
+// set: replaced where the record has it, appended where it does not. The
+// id is left as it is. Returns false if the result is too long.
+bool record_merge_fields(const char *record, const char *attributes, char *out, size_t out_size)
+{
+    char merged[PAGE_SIZE];
+    int written = snprintf(out, out_size, "%s", record);
+    if (written < 0 || (size_t)written >= out_size)
+        return false;
+
+    RecordField f;
+    const char *cursor = attributes;
+    while (record_next_field(&cursor, &f))
+    {
+        char field[100], value[PAGE_SIZE];
+        if (field_key_is(&f, "id") || f.key_len == 0 || f.key_len >= sizeof(field) || f.value_len >= sizeof(value))
+            continue;
+        memcpy(field, f.key, f.key_len);
+        field[f.key_len] = '\0';
+        memcpy(value, f.value, f.value_len);
+        value[f.value_len] = '\0';
+
+        const char *old_value;
+        size_t old_len;
+        if (record_find_field(out, field, &old_value, &old_len))
+        {
+            if (!record_set_field(out, field, value, merged, sizeof(merged)))
+                return false;
+        }
+        else
+        {
+            written = snprintf(merged, sizeof(merged), "%s, %s:%s", out, field, value);
+            if (written < 0 || (size_t)written >= sizeof(merged))
+                return false;
+        }
+
+        written = snprintf(out, out_size, "%s", merged);
+        if (written < 0 || (size_t)written >= out_size)
+            return false;
+    }
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Dictionary encoding
+//
+// Low-cardinality string fields (department:Computer) are stored as a
+// DICT_MARKER byte followed by a one or two byte code into a per-field value
+// list kept in <table>.dict. Code bytes are >= 0x80 so they never look like a
+// field separator. Values past DICT_MAX_VALUES are simply stored as text, so
+// a record may mix encoded and plain fields.
+// ---------------------------------------------------------------------------
+
+#define DICT_MAGIC "NANODICT1"
+#define DICT_MARKER '\x01'
+#define DICT_MAX_FIELDS 16
+#define DICT_MAX_VALUES 255
+#define DICT_HASH_SLOTS 512
+#define DICT_MIN_ROWS 64
+#define DICT_MIN_REPEAT 4
+#define DICT_MIN_VALUE_LEN 3
+#define PROFILE_MAX_FIELDS 32
+
+// Small set of distinct values with hashed lookup
+typedef struct
+{
+    int count;
+    char *values[DICT_MAX_VALUES];
+    int16_t slots[DICT_HASH_SLOTS]; // value index + 1, 0 = empty
+} ValueSet;
+
+typedef struct
+{
+    char field[100];
+    ValueSet set;
+} DictField;
+
+typedef struct
+{
+    int field_count;
+    DictField fields[DICT_MAX_FIELDS];
+    bool dirty;
+} Dictionary;
+
+uint32_t hash_bytes(const char *data, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Index of a value in the set, -1 if missing
+int value_set_find(const ValueSet *set, const char *value, size_t len)
+{
+    uint32_t slot = hash_bytes(value, len) & (DICT_HASH_SLOTS - 1);
+    while (set->slots[slot] != 0)
+    {
+        const char *v = set->values[set->slots[slot] - 1];
+        if (strlen(v) == len && memcmp(v, value, len) == 0)
+            return set->slots[slot] - 1;
+        slot = (slot + 1) & (DICT_HASH_SLOTS - 1);
+    }
+    return -1;
+}
+
+// Add a value, returning its index or -1 when the set is full
+int value_set_add(ValueSet *set, const char *value, size_t len)
+{
+    int index = value_set_find(set, value, len);
+    if (index >= 0 || set->count == DICT_MAX_VALUES)
+        return index;
+
+    char *copy = malloc(len + 1);
+    if (!copy)
+        return -1;
+    memcpy(copy, value, len);
+    copy[len] = '\0';
+
+    uint32_t slot = hash_bytes(value, len) & (DICT_HASH_SLOTS - 1);
+    while (set->slots[slot] != 0)
+        slot = (slot + 1) & (DICT_HASH_SLOTS - 1);
+
+    set->values[set->count] = copy;
+    set->slots[slot] = (int16_t)(set->count + 1);
+    return set->count++;
+}
+
+void value_set_clear(ValueSet *set)
+{
+    for (int i = 0; i < set->count; i++)
+        free(set->values[i]);
+    memset(set, 0, sizeof(*set));
+}
+
+void dict_free(Dictionary *dict)
+{
+    if (!dict)
+        return;
+    for (int i = 0; i < dict->field_count; i++)
+        value_set_clear(&dict->fields[i].set);
+    free(dict);
+}
+
+DictField *dict_field(Dictionary *dict, const char *key, size_t key_len)
+{
+    if (!dict)
+        return NULL;
+    for (int i = 0; i < dict->field_count; i++)
+    {
+        if (strlen(dict->fields[i].field) == key_len && strncmp(dict->fields[i].field, key, key_len) == 0)
+            return &dict->fields[i];
+    }
+    return NULL;
+}
+
+DictField *dict_add_field(Dictionary *dict, const char *name)
+{
+    DictField *df = dict_field(dict, name, strlen(name));
+    if (df || dict->field_count == DICT_MAX_FIELDS)
+        return df;
+
+    df = &dict->fields[dict->field_count++];
+    memset(df, 0, sizeof(*df));
+    strncpy(df->field, name, sizeof(df->field) - 1);
+    dict->dirty = true;
+    return df;
+}
+
+// Write the encoded form of a code; returns its length (2 or 3 bytes)
+size_t dict_put_code(char *out, int code)
+{
+    out[0] = DICT_MARKER;
+    if (code < 127)
+    {
+        out[1] = (char)(0x80 + code);
+        return 2;
+    }
+    out[1] = (char)0xFF;
+    out[2] = (char)(0x80 + (code - 127));
+    return 3;
+}
+
+// Read a code from an encoded value, -1 if the value is plain text
+int dict_get_code(const char *value, size_t len)
+{
+    if (len < 2 || value[0] != DICT_MARKER)
+        return -1;
+
+    unsigned char b = (unsigned char)value[1];
+    if (b < 0x80)
+        return -1;
+    if (b < 0xFF)
+        return b - 0x80;
+    if (len < 3)
+        return -1;
+    return 127 + ((unsigned char)value[2] - 0x80);
+}
+
+// Copy `record` into `out`, replacing values of dictionary fields by codes.
+// New values are added to the dictionary until it is full.
+bool dict_encode(Dictionary *dict, const char *record, char *out, size_t out_size)
+{
+    size_t op = 0;
+    const char *copied = record;
+    const char *cursor = record;
+    RecordField f;
+
+    while (record_next_field(&cursor, &f))
+    {
+        DictField *df = dict_field(dict, f.key, f.key_len);
+        if (!df || f.value_len == 0 || f.value[0] == DICT_MARKER)
+            continue;
+
+        int before = df->set.count;
+        int code = value_set_add(&df->set, f.value, f.value_len);
+        if (code < 0)
+            continue;
+        if (df->set.count != before)
+            dict->dirty = true;
+
+        size_t prefix = (size_t)(f.value - copied);
+        if (op + prefix + 3 >= out_size)
+            return false;
+        memcpy(out + op, copied, prefix);
+        op += prefix;
+        op += dict_put_code(out + op, code);
+        copied = f.value + f.value_len;
+    }
+
+    size_t rest = strlen(copied);
+    if (op + rest >= out_size)
+        return false;
+    memcpy(out + op, copied, rest + 1);
+    return true;
+}
+
+// Expand dictionary codes in a stored record back to text
+bool dict_decode(Dictionary *dict, const char *record, char *out, size_t out_size)
+{
+    size_t op = 0;
+    const char *copied = record;
+    const char *cursor = record;
+    RecordField f;
+
+    while (record_next_field(&cursor, &f))
+    {
+        int code = dict_get_code(f.value, f.value_len);
+        if (code < 0)
+            continue;
+
+        DictField *df = dict_field(dict, f.key, f.key_len);
+        if (!df || code >= df->set.count)
+            continue;
+
+        const char *value = df->set.values[code];
+        size_t prefix = (size_t)(f.value - copied);
+        size_t value_len = strlen(value);
+        if (op + prefix + value_len >= out_size)
+            return false;
+
+        memcpy(out + op, copied, prefix);
+        op += prefix;
+        memcpy(out + op, value, value_len);
+        op += value_len;
+        copied = f.value + f.value_len;
+    }
+
+    size_t rest = strlen(copied);
+    if (op + rest >= out_size)
+        return false;
+    memcpy(out + op, copied, rest + 1);
+    return true;
+}
+
+// Load <table>.dict; NULL if the table has no dictionary
+Dictionary *dict_load(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return NULL;
+
+    Dictionary *dict = calloc(1, sizeof(Dictionary));
+    char line[PAGE_SIZE];
+
+    if (!dict || !fgets(line, sizeof(line), file) || strncmp(line, DICT_MAGIC, strlen(DICT_MAGIC)) != 0)
+    {
+        print_error("Error: Dictionary '%s' is corrupt.\n", path);
+        dict_free(dict);
+        fclose(file);
+        return NULL;
+    }
+
+    DictField *df = NULL;
+    int remaining = 0;
+
+    while (fgets(line, sizeof(line), file))
+    {
+        line[strcspn(line, "\n")] = '\0';
+
+        if (remaining > 0 && df)
+        {
+            value_set_add(&df->set, line, strlen(line));
+            remaining--;
+            continue;
+        }
+
+        char name[100];
+        if (sscanf(line, "field %99s %d", name, &remaining) == 2)
+            df = dict_add_field(dict, name);
+    }
+
+    fclose(file);
+    dict->dirty = false;
+    return dict;
+}
+
+bool dict_save(Dictionary *dict, const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (!file)
+        return false;
+
+    fprintf(file, "%s\n", DICT_MAGIC);
+    for (int i = 0; i < dict->field_count; i++)
+    {
+        DictField *df = &dict->fields[i];
+        fprintf(file, "field %s %d\n", df->field, df->set.count);
+        for (int v = 0; v < df->set.count; v++)
+            fprintf(file, "%s\n", df->set.values[v]);
+    }
+
+    bool ok = fclose(file) == 0;
+    if (ok)
+        dict->dirty = false;
+    return ok;
+}
+
+// LIKE matching of value[0..len): % matches any run of bytes, _ any one
+// byte, and \ makes the next character literal. Backtracks only to the
+// last %, so a match takes at most len * pattern steps.
+bool like_matches(const char *value, size_t len, const char *pattern)
+{
+    const char *p = pattern;
+    const char *star = NULL;
+    size_t star_v = 0, v = 0;
+    while (v < len)
+    {
+        if (*p == '%')
+        {
+            star = ++p;
+            star_v = v;
+            continue;
+        }
+
+        bool escaped = *p == '\\' && p[1] != '\0';
+        char c = escaped ? p[1] : *p;
+        if (c != '\0' && ((!escaped && c == '_') || c == value[v]))
+        {
+            p += escaped ? 2 : 1;
+            v++;
+        }
+        else if (star)
+        {
+            p = star;
+            v = ++star_v;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    while (*p == '%')
+        p++;
+    return *p == '\0';
+}
+
+// The literal start of a pattern, up to its first wildcard, unescaped into
+// `out`; its length
+size_t like_prefix(const char *pattern, char *out, size_t size)
+{
+    size_t n = 0;
+    for (const char *p = pattern; *p && *p != '%' && *p != '_' && n + 1 < size; p++)
+    {
+        if (*p == '\\' && p[1] != '\0')
+            p++;
+        out[n++] = *p;
+    }
+    out[n] = '\0';
+    return n;
+}
+
+// The values of a "field in (v1, v2, ...)" filter, unquoted, in a hash set
+// so that checking a row costs one probe however long the list is. For id
+// filters whose values are all numbers the ids are also kept sorted, so
+// scans can skip shards and compressed blocks that hold none of them.
+typedef struct
+{
+    char *text; // the values back to back, each NUL terminated
+    char **values;
+    size_t count;
+    uint32_t *slots; // value index + 1, 0 = empty
+    size_t capacity; // a power of two, at least twice the count
+    uint32_t *ids;   // sorted, NULL unless this is an id filter
+} FilterSet;
+
+bool filter_set_find(const FilterSet *set, const char *value, size_t len, size_t *slot)
+{
+    *slot = hash_bytes(value, len) & (set->capacity - 1);
+    while (set->slots[*slot] != 0)
+    {
+        const char *v = set->values[set->slots[*slot] - 1];
+        if (strlen(v) == len && memcmp(v, value, len) == 0)
+            return true;
+        *slot = (*slot + 1) & (set->capacity - 1);
+    }
+    return false;
+}
+
+// Whether a stored value (quoted or not) is in the set
+bool filter_set_contains(const FilterSet *set, const char *value, size_t len)
+{
+    size_t slot;
+    unquote_value(&value, &len);
+    return filter_set_find(set, value, len, &slot);
+}
+
+void filter_set_free(FilterSet *set)
+{
+    free(set->text);
+    free(set->values);
+    free(set->slots);
+    free(set->ids);
+    memset(set, 0, sizeof(*set));
+}
+
+int compare_ids(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Fill `set` from the text between the parentheses of "field in (...)".
+// Values are separated by commas, quoted ones may contain commas, and
+// repeated values are kept once. False on an empty value or when memory
+// runs out.
+bool filter_set_parse(FilterSet *set, const char *field, const char *list)
+{
+    memset(set, 0, sizeof(*set));
+    size_t most = 1;
+    for (const char *p = list; *p; p++)
+        most += *p == ',';
+    set->capacity = 16;
+    while (set->capacity < most * 2)
+        set->capacity *= 2;
+
+    set->text = malloc(strlen(list) + 1);
+    set->values = malloc(most * sizeof(char *));
+    set->slots = calloc(set->capacity, sizeof(uint32_t));
+    bool ok = set->text && set->values && set->slots;
+
+    char *out = set->text;
+    const char *p = list;
+    while (ok)
+    {
+        const char *start = p;
+        bool quoted = false;
+        while (*p && (quoted || *p != ','))
+        {
+            if (*p == '"')
+                quoted = !quoted;
+            p++;
+        }
+
+        const char *stop = p;
+        while (start < stop && is_blank(*start))
+            start++;
+        while (stop > start && is_blank(stop[-1]))
+            stop--;
+        size_t len = (size_t)(stop - start);
+        unquote_value(&start, &len);
+        ok = len > 0;
+
+        size_t slot;
+        if (ok && !filter_set_find(set, start, len, &slot))
+        {
+            memcpy(out, start, len);
+            out[len] = '\0';
+            set->values[set->count] = out;
+            set->slots[slot] = (uint32_t)++set->count;
+            out += len + 1;
+        }
+        if (*p == '\0')
+            break;
+        p++;
+    }
+
+    if (ok && strcmp(field, "id") == 0)
+    {
+        set->ids = malloc(set->count * sizeof(uint32_t));
+        for (size_t i = 0; set->ids && i < set->count; i++)
+        {
+            char *end;
+            unsigned long id = strtoul(set->values[i], &end, 10);
+            if (*end != '\0' || set->values[i][0] == '-' || id > UINT32_MAX)
+            {
+                free(set->ids);
+                set->ids = NULL;
+                break;
+            }
+            set->ids[i] = (uint32_t)id;
+        }
+        if (set->ids)
+            qsort(set->ids, set->count, sizeof(uint32_t), compare_ids);
+    }
+
+    if (!ok)
+        filter_set_free(set);
+    return ok;
+}
+
+// A "field:value" predicate evaluated on stored (possibly encoded) records.
+// For dictionary fields the value is resolved to codes once, so matching a
+// row is a code comparison instead of a string compare. A like filter
+// matches `value` as a pattern instead, and an in filter probes its set.
+typedef struct
+{
+    const char *field;
+    const char *value;
+    const FilterSet *in; // field in (...), NULL otherwise
+    bool like;
+    bool use_codes;
+    unsigned char codes[32]; // bitmap of codes whose value equals (or is like) `value`
+} RecordFilter;
+
+bool filter_value_matches(const RecordFilter *filter, const char *value, size_t len)
+{
+    if (filter->in)
+        return filter_set_contains(filter->in, value, len);
+    if (!filter->like)
+        return record_value_equals(value, len, filter->value);
+    unquote_value(&value, &len);
+    return like_matches(value, len, filter->value);
+}
+
+void filter_setup(RecordFilter *filter, Dictionary *dict, const char *field, const char *value, bool like,
+                  const FilterSet *in)
+{
+    memset(filter, 0, sizeof(*filter));
+    filter->field = field;
+    filter->value = value;
+    filter->like = like;
+    filter->in = in;
+
+    DictField *df = dict_field(dict, field, strlen(field));
+    if (!df)
+        return;
+
+    filter->use_codes = true;
+    for (int code = 0; code < df->set.count; code++)
+    {
+        const char *v = df->set.values[code];
+        if (filter_value_matches(filter, v, strlen(v)))
+            filter->codes[code / 8] |= (unsigned char)(1u << (code % 8));
+    }
+}
+
+void filter_init(RecordFilter *filter, Dictionary *dict, const char *field, const char *value)
+{
+    filter_setup(filter, dict, field, value, false, NULL);
+}
+
+// field like <pattern> (already unquoted)
+void filter_init_like(RecordFilter *filter, Dictionary *dict, const char *field, const char *pattern)
+{
+    filter_setup(filter, dict, field, pattern, true, NULL);
+}
+
+// field in (...)
+void filter_init_in(RecordFilter *filter, Dictionary *dict, const char *field, const FilterSet *in)
+{
+    filter_setup(filter, dict, field, NULL, false, in);
+}
+
+bool filter_matches(const RecordFilter *filter, const char *stored)
+{
+    const char *value;
+    size_t len;
+    if (!record_find_field(stored, filter->field, &value, &len))
+        return false;
+
+    if (filter->use_codes)
+    {
+        int code = dict_get_code(value, len);
+        if (code >= 0)
+            return (filter->codes[code / 8] >> (code % 8)) & 1u;
+    }
+    return filter_value_matches(filter, value, len);
+}
+
+// Smallest and largest record id stored in a data page; false if it is empty
+bool page_id_range(const unsigned char *page, uint32_t *min_id, uint32_t *max_id)
+{
+    char record[PAGE_SIZE];
+    bool found = false;
+    uint16_t count = page_slot_count(page);
+
+    for (uint16_t s = 0; s < count; s++)
+    {
+        uint16_t offset = page_slot_offset(page, s);
+        uint16_t length = page_slot_length(page, s);
+        if (offset == 0 || offset + length > PAGE_SIZE)
+            continue;
+
+        memcpy(record, page + offset, length);
+        record[length] = '\0';
+        uint32_t id = record_id(record);
+
+        if (!found || id < *min_id)
+            *min_id = id;
+        if (!found || id > *max_id)
+            *max_id = id;
+        found = true;
+    }
+    return found;
+}
+
+// ---------------------------------------------------------------------------
+// Memtable and segments
+// ---------------------------------------------------------------------------
+
+// Newest version of a row kept outside the page file. A NULL record marks a
+// deleted row. In the memtable, `seq` is the commit that wrote the version
+// and `older` the versions a running scan may still see (see "Snapshots").
+typedef struct MemEntry
+{
+    uint32_t id;
+    char *record;
+    uint64_t seq;
+    struct MemEntry *older; // newest first
+} MemEntry;
+
+// Recent writes sorted by id. New rows always carry the largest id, so
+// inserts append; updates and deletes of older rows binary-search their spot.
+typedef struct
+{
+    MemEntry *entries;
+    size_t count;
+    size_t capacity;
+    size_t bytes; // memory charged against memtable_limit
+} Memtable;
+
+// Every entry of a table's segment files, newest version per id, loaded on
+// first use. Open addressing on the id; id 0 marks an empty slot.
+typedef struct
+{
+    MemEntry *slots;
+    size_t capacity; // power of two
+    size_t count;
+    bool loaded;
+    size_t bytes; // record bytes held
+} SegmentView;
+
+size_t memtable_limit = (size_t)DEFAULT_MEMTABLE_KB * 1024;
+
+// Position of `id`, or where it would be inserted
+size_t memtable_position(const Memtable *m, uint32_t id)
+{
+    size_t lo = 0, hi = m->count;
+    if (hi > 0 && m->entries[hi - 1].id < id)
+        return hi;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (m->entries[mid].id < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+MemEntry *memtable_find(Memtable *m, uint32_t id)
+{
+    size_t pos = memtable_position(m, id);
+    return pos < m->count && m->entries[pos].id == id ? &m->entries[pos] : NULL;
+}
+
+// Store the newest version of a row (NULL records a delete)
+bool memtable_put(Memtable *m, uint32_t id, const char *record)
+{
+    char *copy = NULL;
+    if (record && !(copy = strdup(record)))
+        return false;
+
+    size_t pos = memtable_position(m, id);
+    if (pos < m->count && m->entries[pos].id == id)
+    {
+        MemEntry *e = &m->entries[pos];
+        if (e->record)
+            m->bytes -= strlen(e->record);
+        free(e->record);
+        e->record = copy;
+        if (copy)
+            m->bytes += strlen(copy);
+        return true;
+    }
+
+    if (m->count == m->capacity)
+    {
+        size_t capacity = m->capacity ? m->capacity * 2 : 256;
+        MemEntry *entries = realloc(m->entries, capacity * sizeof(MemEntry));
+        if (!entries)
+        {
+            free(copy);
+            return false;
+        }
+        m->entries = entries;
+        m->capacity = capacity;
+    }
+
+    memmove(&m->entries[pos + 1], &m->entries[pos], (m->count - pos) * sizeof(MemEntry));
+    m->entries[pos] = (MemEntry){id, copy, 0, NULL};
+    m->count++;
+    m->bytes += MEM_ENTRY_OVERHEAD + (copy ? strlen(copy) : 0);
+    return true;
+}
+
+// Free the older versions kept behind an entry
+void mem_entry_free_older(MemEntry *e)
+{
+    while (e->older)
+    {
+        MemEntry *older = e->older;
+        e->older = older->older;
+        free(older->record);
+        free(older);
+    }
+}
+
+void memtable_clear(Memtable *m)
+{
+    for (size_t i = 0; i < m->count; i++)
+    {
+        free(m->entries[i].record);
+        mem_entry_free_older(&m->entries[i]);
+    }
+    free(m->entries);
+    memset(m, 0, sizeof(*m));
+}
+
+size_t segment_view_slot(const SegmentView *v, uint32_t id)
+{
+    size_t slot = (size_t)(id * 2654435761u) & (v->capacity - 1);
+    while (v->slots[slot].id != 0 && v->slots[slot].id != id)
+        slot = (slot + 1) & (v->capacity - 1);
+    return slot;
+}
+
+MemEntry *segment_view_find(SegmentView *v, uint32_t id)
+{
+    if (v->count == 0)
+        return NULL;
+    MemEntry *e = &v->slots[segment_view_slot(v, id)];
+    return e->id == id ? e : NULL;
+}
+
+// Add or replace an entry; the view takes ownership of `record`
+bool segment_view_put(SegmentView *v, uint32_t id, char *record)
+{
+    if ((v->count + 1) * 2 > v->capacity)
+    {
+        SegmentView grown = {NULL, v->capacity ? v->capacity * 2 : 1024, 0, v->loaded, v->bytes};
+        grown.slots = calloc(grown.capacity, sizeof(MemEntry));
+        if (!grown.slots)
+            return false;
+
+        for (size_t i = 0; i < v->capacity; i++)
+        {
+            if (v->slots[i].id != 0)
+                grown.slots[segment_view_slot(&grown, v->slots[i].id)] = v->slots[i];
+        }
+        grown.count = v->count;
+        free(v->slots);
+        *v = grown;
+    }
+
+    MemEntry *e = &v->slots[segment_view_slot(v, id)];
+    if (e->id == id)
+    {
+        if (e->record)
+            v->bytes -= strlen(e->record);
+        free(e->record);
+    }
+    else
+    {
+        e->id = id;
+        v->count++;
+    }
+    e->record = record;
+    if (record)
+        v->bytes += strlen(record);
+    return true;
+}
+
+void segment_view_clear(SegmentView *v)
+{
+    for (size_t i = 0; i < v->capacity; i++)
+        free(v->slots[i].record);
+    free(v->slots);
+    memset(v, 0, sizeof(*v));
+}
+
+// A segment file is the memtable written out in id order: the magic, the
+// entry count, then [id:u32][length:u32][record bytes] per entry. Deletes
+// are stored with length UINT32_MAX and no bytes.
+bool segment_write(const char *path, const Memtable *m)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file)
+        return false;
+
+    uint32_t count = (uint32_t)m->count;
+    bool ok = fwrite(SEGMENT_MAGIC, 1, 8, file) == 8 && fwrite(&count, sizeof(count), 1, file) == 1;
+
+    for (size_t i = 0; ok && i < m->count; i++)
+    {
+        const MemEntry *e = &m->entries[i];
+        uint32_t len = e->record ? (uint32_t)strlen(e->record) : UINT32_MAX;
+        ok = fwrite(&e->id, sizeof(e->id), 1, file) == 1 && fwrite(&len, sizeof(len), 1, file) == 1 &&
+             (!e->record || fwrite(e->record, 1, len, file) == len);
+        metrics.bytes_written += 8 + (e->record ? len : 0);
+    }
+
+    if (fclose(file) != 0)
+        ok = false;
+    metrics.bytes_written += 12;
+    metrics.syncs++;
+    if (!ok)
+        remove(path);
+    return ok;
+}
+
+// Read a segment file into the view; later segments overwrite older entries
+bool segment_read(const char *path, SegmentView *v)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return false;
+
+    char magic[8];
+    uint32_t count;
+    bool ok = fread(magic, 1, 8, file) == 8 && memcmp(magic, SEGMENT_MAGIC, 8) == 0 &&
+              fread(&count, sizeof(count), 1, file) == 1;
+
+    for (uint32_t i = 0; ok && i < count; i++)
+    {
+        uint32_t id, len;
+        char *record = NULL;
+        ok = fread(&id, sizeof(id), 1, file) == 1 && fread(&len, sizeof(len), 1, file) == 1 && id != 0 &&
+             (len == UINT32_MAX || len <= MAX_RECORD_SIZE);
+        metrics.bytes_read += 8;
+
+        if (ok && len != UINT32_MAX)
+        {
+            record = malloc(len + 1);
+            ok = record && fread(record, 1, len, file) == len;
+            metrics.bytes_read += len;
+            if (ok)
+                record[len] = '\0';
+        }
+
+        if (ok)
+            ok = segment_view_put(v, id, record);
+        if (!ok)
+            free(record);
+    }
+
+    fclose(file);
+    return ok;
+}
+
+int compare_mem_entries(const void *a, const void *b)
+{
+    uint32_t x = ((const MemEntry *)a)->id, y = ((const MemEntry *)b)->id;
+    return (x > y) - (x < y);
+}
+
+// ---------------------------------------------------------------------------
+// Table statistics
+//
+// analyze <table> scans the table once and keeps, per field, the rows that
+// have it, an estimate of its distinct values, its most common values with
+// their frequencies and, for numeric fields, an equi-depth histogram. They
+// are saved in <table>.stats and used by the planner to estimate how many
+// rows a filter keeps. Statistics are not updated by writes; row estimates
+// are scaled to the current row count until the next analyze.
+//
+// Distinct counts come from a KMV sketch (the STATS_SKETCH smallest value
+// hashes), common values and histograms from a per-field sample of
+// STATS_SAMPLE values, so analyze needs bounded memory on any table.
+// ---------------------------------------------------------------------------
+
+#define STATS_MAGIC "NANOSTATS1"
+#define STATS_MAX_FIELDS 32
+#define STATS_MAX_VALUE 100
+#define STATS_MCV 8
+#define STATS_BUCKETS 8
+#define STATS_SKETCH 256
+#define STATS_SAMPLE 1024
+
+typedef struct
+{
+    char name[100];
+    uint32_t present; // rows that have the field
+    uint32_t distinct;
+    int mcv_count;
+    char mcv_values[STATS_MCV][STATS_MAX_VALUE]; // unquoted
+    double mcv_freqs[STATS_MCV];                 // fraction of all rows
+    int bucket_count;                            // 0 unless every sampled value is a number
+    double bounds[STATS_BUCKETS + 1];
+} FieldStats;
+
+typedef struct
+{
+    uint32_t rows;
+    int field_count;
+    FieldStats fields[STATS_MAX_FIELDS];
+} TableStats;
+
+void stats_free(TableStats *stats)
+{
+    free(stats);
+}
+
+FieldStats *stats_field(TableStats *stats, const char *field)
+{
+    for (int i = 0; stats && i < stats->field_count; i++)
+    {
+        if (strcmp(stats->fields[i].name, field) == 0)
+            return &stats->fields[i];
+    }
+    return NULL;
+}
+
+// Load <table>.stats; NULL if the table was never analyzed
+TableStats *stats_load(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return NULL;
+
+    TableStats *stats = calloc(1, sizeof(TableStats));
+    char line[PAGE_SIZE];
+
+    if (!stats || !fgets(line, sizeof(line), file) || strncmp(line, STATS_MAGIC, strlen(STATS_MAGIC)) != 0)
+    {
+        print_error("Error: Statistics '%s' are corrupt.\n", path);
+        stats_free(stats);
+        fclose(file);
+        return NULL;
+    }
+
+    FieldStats *fs = NULL;
+    while (fgets(line, sizeof(line), file))
+    {
+        line[strcspn(line, "\n")] = '\0';
+
+        FieldStats next = {0};
+        int value_at = 0;
+        if (sscanf(line, "rows %u", &stats->rows) == 1)
+            continue;
+
+        if (sscanf(line, "field %99s %u %u", next.name, &next.present, &next.distinct) == 3)
+        {
+            fs = stats->field_count < STATS_MAX_FIELDS ? &stats->fields[stats->field_count++] : NULL;
+            if (fs)
+                *fs = next;
+        }
+        else if (fs && fs->mcv_count < STATS_MCV &&
+                 sscanf(line, "mcv %lf %n", &fs->mcv_freqs[fs->mcv_count], &value_at) == 1 && value_at > 0)
+        {
+            snprintf(fs->mcv_values[fs->mcv_count++], STATS_MAX_VALUE, "%s", line + value_at);
+        }
+        else if (fs && strncmp(line, "bounds ", 7) == 0)
+        {
+            char *p = line + 7, *end;
+            fs->bucket_count = 0;
+            while (fs->bucket_count <= STATS_BUCKETS)
+            {
+                double bound = strtod(p, &end);
+                if (end == p)
+                    break;
+                fs->bounds[fs->bucket_count++] = bound;
+                p = end;
+            }
+            fs->bucket_count = fs->bucket_count > 1 ? fs->bucket_count - 1 : 0;
+        }
+    }
+
+    fclose(file);
+    return stats;
+}
+
+bool stats_save(TableStats *stats, const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (!file)
+        return false;
+
+    fprintf(file, "%s\nrows %u\n", STATS_MAGIC, stats->rows);
+    for (int i = 0; i < stats->field_count; i++)
+    {
+        FieldStats *fs = &stats->fields[i];
+        fprintf(file, "field %s %u %u\n", fs->name, fs->present, fs->distinct);
+        for (int m = 0; m < fs->mcv_count; m++)
+            fprintf(file, "mcv %.17g %s\n", fs->mcv_freqs[m], fs->mcv_values[m]);
+        if (fs->bucket_count > 0)
+        {
+            fprintf(file, "bounds");
+            for (int b = 0; b <= fs->bucket_count; b++)
+                fprintf(file, " %.17g", fs->bounds[b]);
+            fprintf(file, "\n");
+        }
+    }
+    return fclose(file) == 0;
+}
+
+// Fraction of rows whose `field` equals `value`: the value's own frequency
+// if it is a common value, 0 outside a numeric field's range, otherwise the
+// rows left after the common values shared evenly by the other distinct
+// values. -1 without statistics.
+double stats_selectivity(TableStats *stats, const char *field, const char *value)
+{
+    if (!stats || stats->rows == 0)
+        return -1;
+
+    FieldStats *fs = stats_field(stats, field);
+    if (!fs || fs->present == 0)
+        return 0;
+
+    size_t len = strlen(value);
+    unquote_value(&value, &len);
+
+    double common = 0;
+    for (int m = 0; m < fs->mcv_count; m++)
+    {
+        if (strlen(fs->mcv_values[m]) == len && strncmp(fs->mcv_values[m], value, len) == 0)
+            return fs->mcv_freqs[m];
+        common += fs->mcv_freqs[m];
+    }
+
+    if (fs->bucket_count > 0)
+    {
+        char number[64], *end;
+        snprintf(number, sizeof(number), "%.*s", (int)len, value);
+        double x = strtod(number, &end);
+        if (end != number && *end == '\0' && (x < fs->bounds[0] || x > fs->bounds[fs->bucket_count]))
+            return 0;
+    }
+
+    double rest = (double)fs->present / (double)stats->rows - common;
+    int others = (int)fs->distinct - fs->mcv_count;
+    if (rest <= 0 || others <= 0)
+        return 0;
+    return rest / (double)others;
+}
+
+// ---------------------------------------------------------------------------
+// Full-text indexes
+//
+// create fulltext index <table> <field> splits the field of every row into
+// words (runs of letters and digits, lowercased) and keeps, per word, the
+// sorted list of the rows that contain it. A row is named by its location
+// (shard, page, slot), so a hit is read straight from its page. Lists are
+// stored as varint deltas, one or two bytes per row for common words.
+//
+// The index covers the rows in the pages. A search checks the memtable and
+// the segments directly, and compaction adds the rows it writes to the
+// index. Entries left behind by updates, deletes and moved rows are never
+// removed: a search reads every candidate row and checks its words again,
+// so a stale entry only costs a wasted read.
+//
+// create prefix index <table> <field> is the same structure keyed by whole
+// field values (quotes removed, case kept) instead of words. Its keys are
+// sorted when a lookup first needs them, so the values that start with a
+// prefix are one range of keys found by binary search.
+//
+// <table>.fts holds one run per index, followed by the runs each compaction
+// appends; loading merges them. After FULLTEXT_MAX_RUNS appended runs the
+// file is written again as one run per index.
+// ---------------------------------------------------------------------------
+
+#define FULLTEXT_EXT ".fts"
+#define FULLTEXT_MAGIC "NANOFTS2"
+#define MAX_FULLTEXT_INDEXES 8
+#define FULLTEXT_MAX_RUNS 32
+#define FULLTEXT_MAX_WORD 64 // longer words and prefix keys are cut to this many bytes, less one
+
+// One word and the rows that contain it
+typedef struct
+{
+    char *word;              // NULL marks an empty slot
+    unsigned char *postings; // varint deltas of increasing row locations
+    size_t size;
+    size_t capacity;
+    uint32_t count;
+    uint64_t last; // largest location in the list
+} FulltextWord;
+
+typedef struct
+{
+    char field[100];
+    bool prefix;           // keys are whole field values, not words
+    FulltextWord *words;   // open addressing on the word hash
+    size_t capacity;       // power of two
+    size_t count;
+    char **keys;           // prefix indexes: every key, in order up to `keys_sorted`
+    size_t keys_sorted;
+    size_t keys_capacity;
+} FulltextIndex;
+
+// The full-text indexes of a table. `pending[i]` collects the rows a running
+// compaction writes for `indexes[i]` until they are merged in.
+typedef struct
+{
+    FulltextIndex indexes[MAX_FULLTEXT_INDEXES];
+    FulltextIndex pending[MAX_FULLTEXT_INDEXES];
+    int count;
+    int runs; // runs appended to the file since it was last written whole
+} FulltextSet;
+
+size_t varint_put(unsigned char *out, uint64_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80)
+    {
+        out[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (unsigned char)v;
+    return n;
+}
+
+// Read one varint; NULL when it runs past `end`
+const unsigned char *varint_get(const unsigned char *p, const unsigned char *end, uint64_t *v)
+{
+    *v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7)
+    {
+        unsigned char b = *p++;
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return p;
+    }
+    return NULL;
+}
+
+// Letters, digits and every byte of a UTF-8 sequence belong to words
+bool is_word_byte(unsigned char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+// The next word of text[0..len) from *pos, lowercased into `word`
+// (FULLTEXT_MAX_WORD bytes); its length, 0 when there are no more words
+size_t next_word(const char *text, size_t len, size_t *pos, char *word)
+{
+    size_t p = *pos;
+    while (p < len && !is_word_byte((unsigned char)text[p]))
+        p++;
+
+    size_t n = 0;
+    while (p < len && is_word_byte((unsigned char)text[p]))
+    {
+        char c = text[p++];
+        if (n + 1 < FULLTEXT_MAX_WORD)
+            word[n++] = c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c;
+    }
+    word[n] = '\0';
+    *pos = p;
+    return n;
+}
+
+bool postings_reserve(FulltextWord *w, size_t extra)
+{
+    if (w->size + extra <= w->capacity)
+        return true;
+
+    size_t capacity = w->capacity ? w->capacity * 2 : 16;
+    while (capacity < w->size + extra)
+        capacity *= 2;
+    unsigned char *postings = realloc(w->postings, capacity);
+    if (!postings)
+        return false;
+    w->postings = postings;
+    w->capacity = capacity;
+    return true;
+}
+
+// Append a location larger than every one in the list
+bool postings_append(FulltextWord *w, uint64_t location)
+{
+    if (!postings_reserve(w, 10))
+        return false;
+    w->size += varint_put(w->postings + w->size, location - (w->count ? w->last : 0));
+    w->last = location;
+    w->count++;
+    return true;
+}
+
+// The locations of a list, in order, into `out` (room for w->count)
+void postings_decode(const FulltextWord *w, uint64_t *out)
+{
+    const unsigned char *p = w->postings, *end = w->postings + w->size;
+    uint64_t location = 0, delta;
+    for (uint32_t i = 0; i < w->count && (p = varint_get(p, end, &delta)) != NULL; i++)
+    {
+        location += delta;
+        out[i] = location;
+    }
+}
+
+// Merge sorted `locations` into the list. Locations past its end are
+// appended; otherwise the list is decoded and written again.
+bool postings_merge(FulltextWord *w, const uint64_t *locations, size_t count)
+{
+    if (count == 0)
+        return true;
+    if (w->count == 0 || locations[0] > w->last)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            if (!postings_append(w, locations[i]))
+                return false;
+        }
+        return true;
+    }
+
+    uint64_t *old = malloc(w->count * sizeof(uint64_t));
+    if (!old)
+        return false;
+    postings_decode(w, old);
+
+    size_t a = 0, b = 0, old_count = w->count;
+    w->size = 0;
+    w->count = 0;
+    bool ok = true;
+    while (ok && (a < old_count || b < count))
+    {
+        uint64_t next;
+        if (b == count || (a < old_count && old[a] <= locations[b]))
+            next = old[a++];
+        else
+            next = locations[b++];
+        if (w->count == 0 || next > w->last)
+            ok = postings_append(w, next);
+    }
+    free(old);
+    return ok;
+}
+
+// The entry for `word`, added when `create` is set; NULL if missing or out
+// of memory
+FulltextWord *fulltext_word(FulltextIndex *ix, const char *word, size_t len, bool create)
+{
+    if (create && (ix->count + 1) * 4 > ix->capacity * 3)
+    {
+        size_t capacity = ix->capacity ? ix->capacity * 2 : 256;
+        FulltextWord *words = calloc(capacity, sizeof(FulltextWord));
+        if (!words)
+            return NULL;
+        for (size_t i = 0; i < ix->capacity; i++)
+        {
+            if (!ix->words[i].word)
+                continue;
+            size_t h = hash_bytes(ix->words[i].word, strlen(ix->words[i].word)) & (capacity - 1);
+            while (words[h].word)
+                h = (h + 1) & (capacity - 1);
+            words[h] = ix->words[i];
+        }
+        free(ix->words);
+        ix->words = words;
+        ix->capacity = capacity;
+    }
+    if (ix->capacity == 0)
+        return NULL;
+
+    size_t h = hash_bytes(word, len) & (ix->capacity - 1);
+    while (ix->words[h].word)
+    {
+        if (strncmp(ix->words[h].word, word, len) == 0 && ix->words[h].word[len] == '\0')
+            return &ix->words[h];
+        h = (h + 1) & (ix->capacity - 1);
+    }
+    if (!create)
+        return NULL;
+
+    char *copy = malloc(len + 1);
+    if (!copy)
+        return NULL;
+    memcpy(copy, word, len);
+    copy[len] = '\0';
+    // A prefix index lists its new keys after the sorted ones
+    if (ix->prefix && ix->count == ix->keys_capacity)
+    {
+        size_t capacity = ix->keys_capacity ? ix->keys_capacity * 2 : 256;
+        char **keys = realloc(ix->keys, capacity * sizeof(char *));
+        if (!keys)
+        {
+            free(copy);
+            return NULL;
+        }
+        ix->keys = keys;
+        ix->keys_capacity = capacity;
+    }
+    if (ix->prefix)
+        ix->keys[ix->count] = copy;
+
+    ix->words[h].word = copy;
+    ix->count++;
+    return &ix->words[h];
+}
+
+// Add `location` to the list of every word of a field value, or of the
+// value itself in a prefix index
+bool fulltext_add_value(FulltextIndex *ix, const char *value, size_t len, uint64_t location)
+{
+    if (ix->prefix)
+    {
+        unquote_value(&value, &len);
+        if (len == 0)
+            return true;
+        FulltextWord *w = fulltext_word(ix, value, len < FULLTEXT_MAX_WORD ? len : FULLTEXT_MAX_WORD - 1, true);
+        return w && postings_merge(w, &location, 1);
+    }
+
+    char word[FULLTEXT_MAX_WORD];
+    size_t pos = 0, n;
+    while ((n = next_word(value, len, &pos, word)) > 0)
+    {
+        FulltextWord *w = fulltext_word(ix, word, n, true);
+        if (!w || !postings_merge(w, &location, 1))
+            return false;
+    }
+    return true;
+}
+
+void fulltext_index_clear(FulltextIndex *ix)
+{
+    for (size_t i = 0; i < ix->capacity; i++)
+    {
+        free(ix->words[i].word);
+        free(ix->words[i].postings);
+    }
+    free(ix->words);
+    free(ix->keys);
+    ix->words = NULL;
+    ix->keys = NULL;
+    ix->capacity = 0;
+    ix->count = 0;
+    ix->keys_sorted = 0;
+    ix->keys_capacity = 0;
+}
+
+// Bytes of posting lists in an index
+size_t fulltext_index_bytes(const FulltextIndex *ix)
+{
+    size_t bytes = 0;
+    for (size_t i = 0; i < ix->capacity; i++)
+        bytes += ix->words[i].size;
+    return bytes;
+}
+
+void fulltext_free(FulltextSet *set)
+{
+    if (!set)
+        return;
+    for (int i = 0; i < MAX_FULLTEXT_INDEXES; i++)
+    {
+        fulltext_index_clear(&set->indexes[i]);
+        fulltext_index_clear(&set->pending[i]);
+    }
+    free(set);
+}
+
+// The full-text (or prefix) index on `field`, NULL if there is none
+FulltextIndex *fulltext_find(FulltextSet *set, const char *field, bool prefix)
+{
+    for (int i = 0; set && i < set->count; i++)
+    {
+        if (set->indexes[i].prefix == prefix && strcmp(set->indexes[i].field, field) == 0)
+            return &set->indexes[i];
+    }
+    return NULL;
+}
+
+int compare_keys(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Put the keys of a prefix index in order: the keys added since the last
+// call are sorted and merged in. False when out of memory.
+bool fulltext_sort_keys(FulltextIndex *ix)
+{
+    size_t old = ix->keys_sorted, added = ix->count - old;
+    if (added == 0)
+        return true;
+
+    // Keys loaded from a run come in order already
+    bool ordered = true;
+    for (size_t i = old + 1; ordered && i < ix->count; i++)
+        ordered = strcmp(ix->keys[i - 1], ix->keys[i]) <= 0;
+    if (!ordered)
+        qsort(ix->keys + old, added, sizeof(char *), compare_keys);
+    if (old > 0 && strcmp(ix->keys[old - 1], ix->keys[old]) > 0)
+    {
+        char **merged = malloc(ix->count * sizeof(char *));
+        if (!merged)
+            return false;
+        size_t a = 0, b = old, n = 0;
+        while (a < old || b < ix->count)
+        {
+            if (b == ix->count || (a < old && strcmp(ix->keys[a], ix->keys[b]) <= 0))
+                merged[n++] = ix->keys[a++];
+            else
+                merged[n++] = ix->keys[b++];
+        }
+        memcpy(ix->keys, merged, ix->count * sizeof(char *));
+        free(merged);
+    }
+    ix->keys_sorted = ix->count;
+    return true;
+}
+
+// A run: [field length:u16][field][prefix:u8][word count:u32], then per word
+// [length:u16][word][row count:u32][last location:u64][bytes:u32][varints].
+// `ix` holds the words and `def` the field and kind they belong to. A prefix
+// index writes its keys in order, so that loading does not sort them again.
+bool fulltext_write_run(FILE *file, const FulltextIndex *def, FulltextIndex *ix)
+{
+    uint16_t field_len = (uint16_t)strlen(def->field);
+    uint8_t prefix = def->prefix;
+    uint32_t word_count = (uint32_t)ix->count;
+    bool ok = fwrite(&field_len, sizeof(field_len), 1, file) == 1 &&
+              fwrite(def->field, 1, field_len, file) == field_len && fwrite(&prefix, 1, 1, file) == 1 &&
+              fwrite(&word_count, sizeof(word_count), 1, file) == 1;
+
+    bool ordered = ix->prefix && fulltext_sort_keys(ix);
+    for (size_t i = 0; ok && i < (ordered ? ix->count : ix->capacity); i++)
+    {
+        const FulltextWord *w = ordered ? fulltext_word(ix, ix->keys[i], strlen(ix->keys[i]), false) : &ix->words[i];
+        if (!w->word)
+            continue;
+        uint16_t len = (uint16_t)strlen(w->word);
+        uint32_t size = (uint32_t)w->size;
+        ok = fwrite(&len, sizeof(len), 1, file) == 1 && fwrite(w->word, 1, len, file) == len &&
+             fwrite(&w->count, sizeof(w->count), 1, file) == 1 && fwrite(&w->last, sizeof(w->last), 1, file) == 1 &&
+             fwrite(&size, sizeof(size), 1, file) == 1 && fwrite(w->postings, 1, size, file) == size;
+        metrics.bytes_written += 18 + len + size;
+    }
+    return ok;
+}
+
+// Read one run and merge it into the index on its field, adding the index
+// the first time the field is seen
+bool fulltext_read_run(FILE *file, FulltextSet *set)
+{
+    char field[100];
+    uint16_t field_len;
+    uint8_t prefix;
+    uint32_t word_count;
+    if (fread(&field_len, sizeof(field_len), 1, file) != 1 || field_len == 0 || field_len >= sizeof(field) ||
+        fread(field, 1, field_len, file) != field_len || fread(&prefix, 1, 1, file) != 1 || prefix > 1 ||
+        fread(&word_count, sizeof(word_count), 1, file) != 1)
+        return false;
+    field[field_len] = '\0';
+
+    FulltextIndex *ix = fulltext_find(set, field, prefix);
+    if (!ix)
+    {
+        if (set->count == MAX_FULLTEXT_INDEXES)
+            return false;
+        ix = &set->indexes[set->count++];
+        strcpy(ix->field, field);
+        ix->prefix = prefix;
+    }
+
+    FulltextWord run = {0};
+    bool ok = true;
+    for (uint32_t i = 0; ok && i < word_count; i++)
+    {
+        char word[FULLTEXT_MAX_WORD];
+        uint16_t len;
+        uint32_t size;
+        ok = fread(&len, sizeof(len), 1, file) == 1 && len > 0 && len < FULLTEXT_MAX_WORD &&
+             fread(word, 1, len, file) == len && fread(&run.count, sizeof(run.count), 1, file) == 1 &&
+             fread(&run.last, sizeof(run.last), 1, file) == 1 && fread(&size, sizeof(size), 1, file) == 1 &&
+             size <= (uint64_t)run.count * 10;
+        if (ok)
+        {
+            run.size = 0;
+            ok = postings_reserve(&run, size) && fread(run.postings, 1, size, file) == size;
+            run.size = size;
+            metrics.bytes_read += 18 + len + size;
+        }
+
+        FulltextWord *w = ok ? fulltext_word(ix, word, len, true) : NULL;
+        if (!w)
+        {
+            ok = false;
+        }
+        else if (w->count == 0)
+        {
+            // A word new to the index takes the run's list as it is
+            free(w->postings);
+            w->postings = run.postings;
+            w->size = run.size;
+            w->capacity = run.capacity;
+            w->count = run.count;
+            w->last = run.last;
+            run.postings = NULL;
+            run.capacity = 0;
+        }
+        else
+        {
+            uint64_t *locations = malloc(((size_t)run.count + 1) * sizeof(uint64_t));
+            if (locations)
+                postings_decode(&run, locations);
+            ok = locations && postings_merge(w, locations, run.count);
+            free(locations);
+        }
+    }
+    free(run.postings);
+    return ok;
+}
+
+// Write every index as a single run, replacing the file
+bool fulltext_save(FulltextSet *set, const char *path)
+{
+    char new_path[310];
+    snprintf(new_path, sizeof(new_path), "%s.new", path);
+    if (set->count == 0)
+    {
+        remove(path);
+        set->runs = 0;
+        return true;
+    }
+
+    FILE *file = fopen(new_path, "wb");
+    if (!file)
+        return false;
+
+    bool ok = fwrite(FULLTEXT_MAGIC, 1, 8, file) == 8;
+    for (int i = 0; ok && i < set->count; i++)
+        ok = fulltext_write_run(file, &set->indexes[i], &set->indexes[i]);
+    if (fclose(file) != 0)
+        ok = false;
+    metrics.syncs++;
+
+#ifdef _WIN32
+    if (ok)
+        remove(path);
+#endif
+    if (!ok || rename(new_path, path) != 0)
+    {
+        remove(new_path);
+        return false;
+    }
+    set->runs = 0;
+    return true;
+}
+
+// Append the pending rows of each index as one run per index
+bool fulltext_append(FulltextSet *set, const char *path)
+{
+    if (set->runs + set->count > FULLTEXT_MAX_RUNS)
+        return fulltext_save(set, path);
+
+    FILE *file = fopen(path, "ab");
+    if (!file)
+        return false;
+
+    bool ok = true;
+    for (int i = 0; ok && i < set->count; i++)
+    {
+        if (set->pending[i].count == 0)
+            continue;
+        ok = fulltext_write_run(file, &set->indexes[i], &set->pending[i]);
+        set->runs++;
+    }
+    if (fclose(file) != 0)
+        ok = false;
+    metrics.syncs++;
+    return ok;
+}
+
+// Load <table>.fts; NULL when the table has no full-text index or the file
+// is damaged (the indexes can be created again)
+FulltextSet *fulltext_load(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+
+    FulltextSet *set = calloc(1, sizeof(FulltextSet));
+    char magic[8];
+    bool ok = set && fread(magic, 1, 8, file) == 8 && memcmp(magic, FULLTEXT_MAGIC, 8) == 0;
+    metrics.bytes_read += 8;
+
+    int runs = 0;
+    while (ok)
+    {
+        int c = fgetc(file);
+        if (c == EOF)
+            break;
+        ungetc(c, file);
+        ok = fulltext_read_run(file, set);
+        runs++;
+    }
+    ok = ok && runs > 0;
+    fclose(file);
+
+    if (!ok)
+    {
+        printf("Warning: Ignoring damaged full-text index file '%s'.\n", path);
+        fulltext_free(set);
+        return NULL;
+    }
+    set->runs = runs - set->count;
+    return set;
+}
+
+// ---------------------------------------------------------------------------
+// Tables
+// ---------------------------------------------------------------------------
+
+typedef struct
+{
+    char magic[8];
+    uint32_t page_size;
+    uint32_t next_id;
+    uint32_t row_count;
+    uint32_t flags; // TABLE_FLAG_*
+    uint32_t dict_check_rows; // row count at which to look for dictionary fields again
+    uint32_t heap_max_id;     // largest id ever written to the pages
+    uint32_t seg_base;        // live segment files are numbered seg_base..seg_next-1
+    uint32_t seg_next;
+    uint32_t shard_count;     // page files the rows are hashed over; 0 in unsharded tables
+    uint32_t default_ttl;     // seconds an inserted row lives when it names no ttl; 0 for ever
+    uint64_t feed_seq;        // sequence number of the next change feed entry; 0 before the first
+} TableHeader;
+
+typedef struct
+{
+    uint32_t page_no;
+    uint16_t slot;
+    uint16_t shard;
+} RecordId;
+
+// Position of every FEED_MARK_EVERY-th change feed entry, for seeking
+typedef struct
+{
+    uint64_t seq;
+    uint64_t offset;
+} FeedMark;
+
+// An open <table>.feed (see "Change feed")
+typedef struct
+{
+    FILE *file;
+    FILE *index;        // <table>.feedx: the marks
+    uint64_t first_seq; // sequence number the file starts at
+    uint64_t end;       // offset after the last whole entry
+    bool at_end;        // file positioned at `end`, so appends need no seek
+    uint64_t entries;
+    FeedMark *marks;
+    size_t mark_count;
+    size_t mark_capacity;
+} ChangeFeed;
+
+typedef struct
+{
+    bool in_use;
+    char db[50];
+    char name[100];
+    int file_id; // <table>.tbl: the header, and the rows of shard 0
+    int shard_count;
+    int shard_files[MAX_SHARDS]; // shard_files[0] == file_id
+    TableHeader header;
+    bool header_dirty;
+    Dictionary *dict; // NULL when no field is dictionary encoded
+    Memtable mem;     // writes not yet in a segment file
+    SegmentView segs;
+    TableStats *stats; // NULL until the table is analyzed
+    FulltextSet *fulltext; // NULL when no field has a full-text index
+    ChangeFeed *feed;      // NULL until the change feed is first written or read
+    FILE *wal;             // <table>.wal, NULL until the memtable is written to
+    bool wal_pending;      // log entries not yet followed by a commit
+    uint64_t version;  // new on every write and every open, for the result cache
+    uint32_t expiry_cursor; // data page the expiry pass continues from
+    uint32_t readers;       // scans running on the table
+    uint64_t read_seq;      // snapshot of the newest of them
+    unsigned long last_used;
+} Table;
+
+Table open_tables[MAX_OPEN_TABLES];
+unsigned long table_clock = 0;
+uint64_t table_version_clock = 0;
+
+// Files stored next to <table>.tbl that belong to the table
+const char *table_sidecar_exts[] = {BLOCK_INDEX_EXT, DICT_EXT, STATS_EXT, FULLTEXT_EXT, FEED_EXT, FEED_INDEX_EXT, WAL_EXT};
+#define TABLE_SIDECAR_COUNT (sizeof(table_sidecar_exts) / sizeof(table_sidecar_exts[0]))
+
+// Remove the <table><ext><N> files of a table (segments and shards)
+void remove_numbered_files(const char *db_name, const char *table_name, const char *ext)
+{
+    char prefix[120];
+    snprintf(prefix, sizeof(prefix), "%s%s", table_name, ext);
+    size_t prefix_len = strlen(prefix);
+
+#ifdef _WIN32
+    struct _finddata_t data;
+    char search_path[300];
+    snprintf(search_path, sizeof(search_path), "db\\%s\\%s*", db_name, prefix);
+
+    intptr_t handle = _findfirst(search_path, &data);
+    if (handle == -1)
+        return;
+    do
+    {
+        if (data.name[prefix_len] != '\0' && strspn(data.name + prefix_len, "0123456789") == strlen(data.name + prefix_len))
+        {
+            char file_path[300];
+            snprintf(file_path, sizeof(file_path), "db\\%s\\%s", db_name, data.name);
+            remove(file_path);
+        }
+    } while (_findnext(handle, &data) == 0);
+    _findclose(handle);
+#else
+    char db_path[300];
+    snprintf(db_path, sizeof(db_path), "db/%s", db_name);
+
+    DIR *dir = opendir(db_path);
+    if (!dir)
+        return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        const char *suffix = entry->d_name + prefix_len;
+        if (strncmp(entry->d_name, prefix, prefix_len) == 0 && *suffix != '\0' &&
+            strspn(suffix, "0123456789") == strlen(suffix))
+        {
+            char file_path[300];
+            snprintf(file_path, sizeof(file_path), "db/%s/%s", db_name, entry->d_name);
+            remove(file_path);
+        }
+    }
+    closedir(dir);
+#endif
+}
+
+// Remove a table file together with its sidecar, segment and shard files
+void remove_table_files(const char *db_name, const char *table_name)
+{
+    char path[300];
+    remove_numbered_files(db_name, table_name, SEGMENT_EXT);
+    remove_numbered_files(db_name, table_name, SHARD_EXT);
+    for (size_t i = 0; i < TABLE_SIDECAR_COUNT; i++)
+    {
+        build_table_path(path, sizeof(path), db_name, table_name, table_sidecar_exts[i]);
+        remove(path);
+    }
+    build_table_path(path, sizeof(path), db_name, table_name, TABLE_EXT);
+    remove(path);
+}
+
+// Called for every live record of a scan; return false to stop the scan
+typedef bool (*record_visitor)(const char *record, RecordId rid, void *ctx);
+
+bool table_flush_memtable(Table *t);
+
+// Defined with the change feed: close <table>.feed and free its marks
+void feed_close(ChangeFeed *f);
+
+// Defined with the write-ahead log: close <table>.wal, replay it on open
+void wal_close(Table *t);
+bool wal_recover(Table *t);
+
+// Write the cached header into page 0 and push dirty pages to disk. The
+// change feed goes first, so the header never counts entries it lacks.
+bool table_sync(Table *t)
+{
+    if (t->feed && (fflush(t->feed->file) != 0 || fflush(t->feed->index) != 0))
+        return false;
+
+    if (t->header_dirty)
+    {
+        unsigned char *page = pool_fetch_page(t->file_id, 0, false);
+        if (!page)
+            return false;
+        memcpy(page, &t->header, sizeof(t->header));
+        pool_unpin(page, true);
+        t->header_dirty = false;
+    }
+
+    bool ok = true;
+    if (t->dict && t->dict->dirty)
+    {
+        char path[300];
+        build_table_path(path, sizeof(path), t->db, t->name, DICT_EXT);
+        ok = dict_save(t->dict, path);
+    }
+    for (int shard = 0; shard < t->shard_count; shard++)
+        ok = pool_flush_file(t->shard_files[shard]) && ok;
+    return ok;
+}
+
+// Persist everything: the memtable goes to a segment file, pages to disk
+bool table_flush(Table *t)
+{
+    MetricsPhase previous = metrics_enter(PHASE_WRITE);
+    bool ok = table_flush_memtable(t);
+    ok = table_sync(t) && ok;
+    metrics_leave(previous);
+    return ok;
+}
+
+// Close a table handle. Pass flush=false when the file is about to be removed.
+void table_close(Table *t, bool flush)
+{
+    if (!t || !t->in_use)
+        return;
+
+    if (flush)
+        table_flush(t);
+
+    for (int shard = 0; shard < t->shard_count; shard++)
+    {
+        pool_discard_file(t->shard_files[shard]);
+        paged_close(t->shard_files[shard]);
+    }
+    dict_free(t->dict);
+    t->dict = NULL;
+    stats_free(t->stats);
+    t->stats = NULL;
+    fulltext_free(t->fulltext);
+    t->fulltext = NULL;
+    feed_close(t->feed);
+    t->feed = NULL;
+    wal_close(t);
+    memtable_clear(&t->mem);
+    segment_view_clear(&t->segs);
+    t->in_use = false;
+}
+
+// Close every open table of a database
+void table_close_db(const char *db_name, bool flush)
+{
+    for (int i = 0; i < MAX_OPEN_TABLES; i++)
+    {
+        if (open_tables[i].in_use && strcmp(open_tables[i].db, db_name) == 0)
+            table_close(&open_tables[i], flush);
+    }
+}
+
+// Find an open handle, NULL if the table is not open
+Table *table_find_open(const char *db_name, const char *table_name)
+{
+    for (int i = 0; i < MAX_OPEN_TABLES; i++)
+    {
+        Table *t = &open_tables[i];
+        if (t->in_use && strcmp(t->db, db_name) == 0 && strcmp(t->name, table_name) == 0)
+        {
+            t->last_used = ++table_clock;
+            return t;
+        }
+    }
+    return NULL;
+}
+
+// Grab a free handle slot, closing the least recently used table if needed.
+// Tables being scanned stay open; NULL when all of them are.
+Table *table_slot()
+{
+    Table *victim = NULL;
+    for (int i = 0; i < MAX_OPEN_TABLES; i++)
+    {
+        if (!open_tables[i].in_use)
+            return &open_tables[i];
+        if (open_tables[i].readers == 0 && (!victim || open_tables[i].last_used < victim->last_used))
+            victim = &open_tables[i];
+    }
+
+    if (!victim)
+    {
+        print_error("Error: Too many tables are being scanned.\n");
+        return NULL;
+    }
+    table_close(victim, true);
+    return victim;
+}
+
+// NULL when no handle slot is free
+Table *table_attach(const char *db_name, const char *table_name, int file_id)
+{
+    Table *t = table_slot();
+    if (!t)
+        return NULL;
+    memset(t, 0, sizeof(*t));
+    t->in_use = true;
+    strncpy(t->db, db_name, sizeof(t->db) - 1);
+    strncpy(t->name, table_name, sizeof(t->name) - 1);
+    t->file_id = file_id;
+    t->shard_count = 1;
+    t->shard_files[0] = file_id;
+    t->last_used = ++table_clock;
+    t->version = ++table_version_clock;
+    return t;
+}
+
+// Shard that holds row `id`. The multiplier spreads consecutive ids evenly
+// over the shards.
+int table_shard_of(const Table *t, uint32_t id)
+{
+    if (t->shard_count < 2)
+        return 0;
+    return (int)((id * 2654435761u) % (uint32_t)t->shard_count);
+}
+
+// Data pages of one shard (page 0 holds no rows)
+uint32_t table_shard_pages(const Table *t, int shard)
+{
+    uint32_t page_count = paged_files[t->shard_files[shard]].page_count;
+    return page_count > 0 ? page_count - 1 : 0;
+}
+
+// Data pages of all shards together
+uint32_t table_data_pages(const Table *t)
+{
+    uint32_t pages = 0;
+    for (int shard = 0; shard < t->shard_count; shard++)
+        pages += table_shard_pages(t, shard);
+    return pages;
+}
+
+// Shard file <table>.shard<N>; shard 0 is the table file itself
+void table_shard_path(const char *db_name, const char *table_name, int shard, char *out, size_t size)
+{
+    char ext[32];
+    snprintf(ext, sizeof(ext), "%s%d", SHARD_EXT, shard);
+    build_table_path(out, size, db_name, table_name, ext);
+}
+
+// Close least recently used tables other than `keep` until `count` more
+// page files can be opened
+void table_free_files(int count, const Table *keep)
+{
+    while (true)
+    {
+        int free_files = 0;
+        for (int i = 0; i < MAX_PAGED_FILES; i++)
+        {
+            if (!paged_files[i].in_use)
+                free_files++;
+        }
+        if (free_files >= count)
+            return;
+
+        Table *victim = NULL;
+        for (int i = 0; i < MAX_OPEN_TABLES; i++)
+        {
+            Table *o = &open_tables[i];
+            if (o->in_use && o != keep && o->readers == 0 && (!victim || o->last_used < victim->last_used))
+                victim = o;
+        }
+        if (!victim)
+            return;
+        table_close(victim, true);
+    }
+}
+
+// Open (or create) shard files 1..N-1 of a table whose header is loaded.
+// A shard file starts with an empty page 0 so its rows start at page 1,
+// like in the table file.
+bool table_open_shards(Table *t, bool create)
+{
+    int count = t->header.shard_count > 1 ? (int)t->header.shard_count : 1;
+    if (count > MAX_SHARDS)
+    {
+        print_error("Error: Table '%s' has too many shards (%d, max %d).\n", t->name, count, MAX_SHARDS);
+        return false;
+    }
+
+    table_free_files(count - 1, t);
+    for (int shard = 1; shard < count; shard++)
+    {
+        char path[300];
+        table_shard_path(t->db, t->name, shard, path, sizeof(path));
+        int file_id = paged_open(path, create);
+        if (file_id < 0)
+            return false;
+        t->shard_files[shard] = file_id;
+        t->shard_count = shard + 1;
+
+        if (create)
+        {
+            unsigned char *page = pool_fetch_page(file_id, paged_allocate(file_id), true);
+            if (!page)
+                return false;
+            pool_unpin(page, true);
+        }
+    }
+    return true;
+}
+
+// Create an empty table file (truncating an existing one) and open it. With
+// shards > 1 the rows are spread over that many page files.
+Table *table_create(const char *db_name, const char *table_name, uint32_t flags, int shards)
+{
+    Table *existing = table_find_open(db_name, table_name);
+    if (existing)
+        table_close(existing, false);
+
+    remove_table_files(db_name, table_name);
+
+    char path[300], index_path[300];
+    build_table_path(path, sizeof(path), db_name, table_name, TABLE_EXT);
+    build_table_path(index_path, sizeof(index_path), db_name, table_name, BLOCK_INDEX_EXT);
+
+    int file_id = paged_open(path, true);
+    if (file_id < 0)
+        return NULL;
+
+    Table *t = table_attach(db_name, table_name, file_id);
+    if (!t)
+    {
+        paged_close(file_id);
+        remove(path);
+        return NULL;
+    }
+    memcpy(t->header.magic, TABLE_MAGIC, sizeof(t->header.magic));
+    t->header.page_size = PAGE_SIZE;
+    t->header.next_id = 1;
+    t->header.row_count = 0;
+    t->header.flags = flags;
+    t->header.shard_count = shards > 1 ? (uint32_t)shards : 0;
+
+    uint32_t page_no = paged_allocate(file_id);
+    unsigned char *page = pool_fetch_page(file_id, page_no, true);
+    if (!page)
+    {
+        table_close(t, false);
+        return NULL;
+    }
+    pool_unpin(page, true);
+
+    if (!table_open_shards(t, true))
+    {
+        table_close(t, false);
+        remove_table_files(db_name, table_name);
+        return NULL;
+    }
+
+    if ((flags & TABLE_FLAG_COMPRESSED) && !paged_enable_compression(file_id, index_path))
+    {
+        table_close(t, false);
+        return NULL;
+    }
+
+    t->header_dirty = true;
+    table_flush(t);
+    return t;
+}
+
+// Apply the table dictionary to a record before it is written to a page
+const char *table_encode(Table *t, const char *record, char *buffer, size_t size)
+{
+    if (!t->dict || !dict_encode(t->dict, record, buffer, size))
+        return record;
+    return buffer;
+}
+
+// Append a record to the last page of its shard, starting a new page when
+// it is full
+bool table_append_record(Table *t, const char *record, RecordId *rid)
+{
+    uint32_t id = record_id(record);
+    if (id > t->header.heap_max_id)
+    {
+        t->header.heap_max_id = id;
+        t->header_dirty = true;
+    }
+    int shard = table_shard_of(t, id);
+    int file_id = t->shard_files[shard];
+
+    char encoded[PAGE_SIZE];
+    record = table_encode(t, record, encoded, sizeof(encoded));
+
+    size_t len = strlen(record);
+    if (len > MAX_RECORD_SIZE)
+    {
+        print_error("Error: Record is too large (%zu bytes, max %d).\n", len, MAX_RECORD_SIZE);
+        return false;
+    }
+
+    uint32_t page_count = paged_files[file_id].page_count;
+    if (page_count > 1)
+    {
+        uint32_t last = page_count - 1;
+        unsigned char *page = pool_fetch_page(file_id, last, false);
+        if (!page)
+            return false;
+
+        int slot = page_insert(page, record, len);
+        pool_unpin(page, slot >= 0);
+
+        if (slot >= 0)
+        {
+            if (rid)
+            {
+                rid->page_no = last;
+                rid->slot = (uint16_t)slot;
+                rid->shard = (uint16_t)shard;
+            }
+            return true;
+        }
+    }
+
+    uint32_t page_no = paged_allocate(file_id);
+    unsigned char *page = pool_fetch_page(file_id, page_no, true);
+    if (!page)
+        return false;
+
+    page_init(page);
+    int slot = page_insert(page, record, len);
+    pool_unpin(page, true);
+
+    if (rid)
+    {
+        rid->page_no = page_no;
+        rid->slot = (uint16_t)slot;
+        rid->shard = (uint16_t)shard;
+    }
+    return true;
+}
+
+// Import a legacy line-per-record .txt table into the paged format. The
+// text file is kept as <table>.txt.bak, which is not read again.
+Table *table_import_legacy(const char *db_name, const char *table_name, const char *txt_path)
+{
+    FILE *file = fopen(txt_path, "r");
+    if (!file)
+        return NULL;
+
+    Table *t = table_create(db_name, table_name, 0, 1);
+    if (!t)
+    {
+        fclose(file);
+        return NULL;
+    }
+
+    char line[PAGE_SIZE];
+    uint32_t last_id = 0;
+    bool ok = true;
+
+    while (ok && fgets(line, sizeof(line), file))
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0')
+            continue;
+
+        uint32_t id = record_id(line);
+        if (id > last_id)
+            last_id = id;
+        ok = table_append_record(t, line, NULL);
+        t->header.row_count++;
+    }
+    fclose(file);
+
+    if (!ok)
+    {
+        char path[300];
+        build_table_path(path, sizeof(path), db_name, table_name, TABLE_EXT);
+        table_close(t, false);
+        remove(path);
+        return NULL;
+    }
+
+    t->header.next_id = last_id + 1;
+    t->header_dirty = true;
+    table_flush(t);
+
+    // The .tbl file takes over; if the rename fails the .txt stays, and is
+    // ignored while the .tbl exists
+    char backup_path[300];
+    build_table_path(backup_path, sizeof(backup_path), db_name, table_name, LEGACY_BACKUP_EXT);
+    if (!file_exists(backup_path))
+        rename(txt_path, backup_path);
+    return t;
+}
+
+// Open a table, reusing the cached handle when there is one
+Table *table_open(const char *db_name, const char *table_name)
+{
+    Table *t = table_find_open(db_name, table_name);
+    if (t)
+        return t;
+
+    char path[300];
+    build_table_path(path, sizeof(path), db_name, table_name, TABLE_EXT);
+
+    if (!file_exists(path))
+    {
+        char txt_path[300];
+        build_table_path(txt_path, sizeof(txt_path), db_name, table_name, LEGACY_TABLE_EXT);
+        if (file_exists(txt_path))
+            return table_import_legacy(db_name, table_name, txt_path);
+        return NULL;
+    }
+
+    int file_id = paged_open(path, false);
+    if (file_id < 0)
+        return NULL;
+
+    t = table_attach(db_name, table_name, file_id);
+    if (!t)
+    {
+        paged_close(file_id);
+        return NULL;
+    }
+
+    unsigned char *page = pool_fetch_page(file_id, 0, false);
+    if (!page)
+    {
+        table_close(t, false);
+        return NULL;
+    }
+    memcpy(&t->header, page, sizeof(t->header));
+    pool_unpin(page, false);
+
+    // Headers written before segments existed: every assigned id may be in the pages
+    if (t->header.heap_max_id == 0 && t->header.seg_next == 0 && t->header.next_id > 1)
+        t->header.heap_max_id = t->header.next_id - 1;
+
+    if (memcmp(t->header.magic, TABLE_MAGIC, sizeof(t->header.magic)) != 0 || t->header.page_size != PAGE_SIZE)
+    {
+        print_error("Error: '%s' is not a valid table file.\n", path);
+        table_close(t, false);
+        return NULL;
+    }
+
+    if (!table_open_shards(t, false))
+    {
+        print_error("Error: Failed to open the shards of table '%s'.\n", table_name);
+        table_close(t, false);
+        return NULL;
+    }
+
+    if (t->header.flags & TABLE_FLAG_COMPRESSED)
+    {
+        char index_path[300];
+        build_table_path(index_path, sizeof(index_path), db_name, table_name, BLOCK_INDEX_EXT);
+        if (!paged_enable_compression(file_id, index_path))
+        {
+            table_close(t, false);
+            return NULL;
+        }
+    }
+
+    char dict_path[300];
+    build_table_path(dict_path, sizeof(dict_path), db_name, table_name, DICT_EXT);
+    t->dict = dict_load(dict_path);
+
+    char stats_path[300];
+    build_table_path(stats_path, sizeof(stats_path), db_name, table_name, STATS_EXT);
+    t->stats = stats_load(stats_path);
+
+    char fulltext_path[300];
+    build_table_path(fulltext_path, sizeof(fulltext_path), db_name, table_name, FULLTEXT_EXT);
+    t->fulltext = fulltext_load(fulltext_path);
+
+    if (!wal_recover(t))
+    {
+        table_close(t, false);
+        return NULL;
+    }
+    return t;
+}
+
+// Segment file <table>.seg<N>
+void table_segment_path(Table *t, uint32_t seg, char *out, size_t size)
+{
+    char ext[32];
+    snprintf(ext, sizeof(ext), "%s%u", SEGMENT_EXT, seg);
+    build_table_path(out, size, t->db, t->name, ext);
+}
+
+// Read the live segment files into memory the first time they are needed
+bool table_load_segments(Table *t)
+{
+    if (t->segs.loaded)
+        return true;
+
+    char path[300];
+    for (uint32_t seg = t->header.seg_base; seg < t->header.seg_next; seg++)
+    {
+        table_segment_path(t, seg, path, sizeof(path));
+        if (!segment_read(path, &t->segs))
+        {
+            print_error("Error: Failed to read segment '%s'.\n", path);
+            segment_view_clear(&t->segs);
+            return false;
+        }
+    }
+    t->segs.loaded = true;
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Write-ahead log
+//
+// Writes stay in the memtable until it is flushed to a segment file, so each
+// one is also appended to <table>.wal, in the segment entry format:
+// [id:u32][length:u32][record bytes], length UINT32_MAX for a delete. The
+// log starts with its magic and the number of the segment the memtable will
+// be flushed to. A command that wrote to the table ends its entries with a
+// commit, id 0 followed by the header's next_id, row_count and flags, and
+// pushes the log to disk, so a command's writes survive a crash once it has
+// returned. Opening the table replays the committed commands, drops a torn
+// last one and flushes the result to a segment. The log is removed once its
+// entries are in a segment and the header that lists the segment is on disk.
+// ---------------------------------------------------------------------------
+
+void wal_close(Table *t)
+{
+    if (t->wal)
+        fclose(t->wal);
+    t->wal = NULL;
+    t->wal_pending = false;
+}
+
+// Append one row version to the log, opening it on the first write
+bool wal_append(Table *t, uint32_t id, const char *record)
+{
+    if (!t->wal)
+    {
+        char path[300];
+        build_table_path(path, sizeof(path), t->db, t->name, WAL_EXT);
+        t->wal = fopen(path, "ab");
+        bool ok = t->wal && fseek(t->wal, 0, SEEK_END) == 0;
+        if (ok && ftell(t->wal) == 0)
+        {
+            ok = fwrite(WAL_MAGIC, 1, 8, t->wal) == 8 && fwrite(&t->header.seg_next, sizeof(uint32_t), 1, t->wal) == 1;
+            metrics.bytes_written += 12;
+        }
+        if (!ok)
+        {
+            wal_close(t);
+            print_error("Error: Failed to write the log of table '%s'.\n", t->name);
+            return false;
+        }
+    }
+
+    uint32_t len = record ? (uint32_t)strlen(record) : UINT32_MAX;
+    if (fwrite(&id, sizeof(id), 1, t->wal) != 1 || fwrite(&len, sizeof(len), 1, t->wal) != 1 ||
+        (record && fwrite(record, 1, len, t->wal) != len))
+    {
+        print_error("Error: Failed to write the log of table '%s'.\n", t->name);
+        return false;
+    }
+    metrics.bytes_written += 8 + (record ? len : 0);
+    t->wal_pending = true;
+    return true;
+}
+
+// End the command's entries with a commit and push the log to disk
+bool wal_commit(Table *t)
+{
+    if (!t->wal || !t->wal_pending)
+        return true;
+
+    uint32_t commit[4] = {0, t->header.next_id, t->header.row_count, t->header.flags};
+    t->wal_pending = false;
+    metrics.bytes_written += sizeof(commit);
+    metrics.syncs++;
+    if (fwrite(commit, sizeof(commit), 1, t->wal) != 1 || fflush(t->wal) != 0)
+    {
+        print_error("Error: Failed to write the log of table '%s'.\n", t->name);
+        return false;
+    }
+    return true;
+}
+
+// Commit the logs of every table the command wrote to; run after each command
+bool wal_commit_all()
+{
+    bool ok = true;
+    for (int i = 0; i < MAX_OPEN_TABLES; i++)
+    {
+        if (open_tables[i].in_use)
+            ok = wal_commit(&open_tables[i]) && ok;
+    }
+    return ok;
+}
+
+// Drop the log once the memtable it covers is in a segment the header lists
+void wal_remove(Table *t)
+{
+    char path[300];
+    wal_close(t);
+    build_table_path(path, sizeof(path), t->db, t->name, WAL_EXT);
+    remove(path);
+}
+
+// Replay <table>.wal into the memtable and flush it to a segment. A log for
+// a segment the header already lists was flushed before a crash and is only
+// removed.
+bool wal_recover(Table *t)
+{
+    char path[300];
+    build_table_path(path, sizeof(path), t->db, t->name, WAL_EXT);
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return true;
+
+    char magic[8];
+    uint32_t seg;
+    bool live = fread(magic, 1, 8, file) == 8 && memcmp(magic, WAL_MAGIC, 8) == 0 &&
+                fread(&seg, sizeof(seg), 1, file) == 1 && seg >= t->header.seg_next;
+
+    // Entries wait here until their commit is read
+    Memtable command = {0};
+    bool ok = true;
+    while (live && ok)
+    {
+        uint32_t id, len;
+        if (fread(&id, sizeof(id), 1, file) != 1)
+            break;
+
+        if (id == 0)
+        {
+            uint32_t fields[3];
+            if (fread(fields, sizeof(fields), 1, file) != 1)
+                break;
+            for (size_t i = 0; ok && i < command.count; i++)
+                ok = memtable_put(&t->mem, command.entries[i].id, command.entries[i].record);
+            memtable_clear(&command);
+
+            if (fields[0] > t->header.next_id)
+                t->header.next_id = fields[0];
+            t->header.row_count = fields[1];
+            // Only the flags a write sets; the others may have changed since
+            t->header.flags |= fields[2] & TABLE_FLAG_TTL;
+            t->header_dirty = true;
+            continue;
+        }
+
+        if (fread(&len, sizeof(len), 1, file) != 1 || (len != UINT32_MAX && len > MAX_RECORD_SIZE))
+            break;
+        char record[MAX_RECORD_SIZE + 1];
+        if (len != UINT32_MAX && fread(record, 1, len, file) != len)
+            break;
+        if (len != UINT32_MAX)
+            record[len] = '\0';
+        ok = memtable_put(&command, id, len == UINT32_MAX ? NULL : record);
+    }
+    memtable_clear(&command);
+    fclose(file);
+
+    if (ok && t->mem.count > 0)
+        ok = table_flush_memtable(t) && table_sync(t);
+    if (!ok)
+    {
+        print_error("Error: Failed to recover table '%s' from its log.\n", t->name);
+        return false;
+    }
+    wal_remove(t);
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Snapshots
+//
+// A scan sees the table as it was when the scan started, even when rows are
+// written while it runs: from its own visitor, e.g. a nanodb_scan callback
+// that updates the rows it is handed. Every write takes the next commit
+// sequence number (one per statement, so an update or delete of many rows
+// becomes visible at once) and tags its memtable version with it. A scan
+// pins the current number; a memtable version written after that is skipped
+// in favour of the one before it, which the write kept as an older version
+// of the entry instead of freeing it. Writers never wait for the scan.
+//
+// Pages and segments only change when the memtable is flushed, compacted or
+// rebuilt, so those wait until the last scan of the table ends (a flush is
+// deferred, compaction and rebuilds are refused). Older versions are
+// garbage collected when the memtable is flushed, once no scan needs them.
+// ---------------------------------------------------------------------------
+
+uint64_t commit_seq = 0; // last commit sequence number handed out
+int active_scans = 0;    // scans running on any table
+
+bool table_check_memtable(Table *t);
+
+// Sequence number a lookup sees: the newest pinned snapshot while a scan
+// runs, everything otherwise. Nested scans pin newer snapshots; each walks
+// to its own version since older versions are kept for the newest.
+uint64_t table_snapshot(const Table *t)
+{
+    return t->readers > 0 ? t->read_seq : UINT64_MAX;
+}
+
+// Pin a snapshot for a scan. Returns the one to restore when it ends.
+uint64_t table_begin_snapshot(Table *t)
+{
+    uint64_t previous = t->read_seq;
+    t->readers++;
+    t->read_seq = commit_seq;
+    active_scans++;
+    return previous;
+}
+
+// Release a scan's snapshot and run the flush it may have deferred
+void table_end_snapshot(Table *t, uint64_t previous)
+{
+    t->readers--;
+    t->read_seq = previous;
+    active_scans--;
+    if (t->readers == 0)
+        table_check_memtable(t);
+}
+
+// Put a version of a row into the table's memtable as commit `seq`. The
+// version it replaces is kept when a running scan can see it.
+bool table_mem_put(Table *t, uint32_t id, const char *record, uint64_t seq)
+{
+    MemEntry *e = memtable_find(&t->mem, id);
+    MemEntry *kept = NULL;
+    if (e && t->readers > 0 && e->seq <= t->read_seq)
+    {
+        if (!(kept = malloc(sizeof(MemEntry))))
+            return false;
+        *kept = *e;
+        e->older = kept;
+        e->record = NULL; // now owned by `kept`, its bytes stay charged
+        t->mem.bytes += MEM_ENTRY_OVERHEAD;
+    }
+
+    if (!memtable_put(&t->mem, id, record))
+    {
+        if (kept)
+        {
+            *e = *kept;
+            free(kept);
+            t->mem.bytes -= MEM_ENTRY_OVERHEAD;
+        }
+        return false;
+    }
+    memtable_find(&t->mem, id)->seq = seq;
+    return wal_append(t, id, record);
+}
+
+// Newest version of `id` held outside the page file that the current
+// snapshot sees, NULL if there is none. An entry with a NULL record means
+// the row was deleted.
+const MemEntry *table_overlay_find(Table *t, uint32_t id)
+{
+    uint64_t snapshot = table_snapshot(t);
+    for (const MemEntry *e = memtable_find(&t->mem, id); e; e = e->older)
+    {
+        if (e->seq <= snapshot)
+            return e;
+    }
+    return segment_view_find(&t->segs, id);
+}
+
+// Version of a memtable entry that the current snapshot sees, NULL when the
+// row was first written after it
+const MemEntry *table_visible_version(const Table *t, const MemEntry *e)
+{
+    uint64_t snapshot = table_snapshot(t);
+    while (e && e->seq > snapshot)
+        e = e->older;
+    return e;
+}
+
+// Memtable and segment entries for ids from `first` on, newest visible
+// version per id and sorted by id. The records are borrowed. Returns NULL
+// when out of memory.
+MemEntry *table_overlay_from(Table *t, uint32_t first, size_t *count)
+{
+    size_t mem_start = memtable_position(&t->mem, first);
+    size_t mem_count = 0;
+    for (size_t i = mem_start; i < t->mem.count; i++)
+    {
+        if (table_visible_version(t, &t->mem.entries[i]))
+            mem_count++;
+    }
+
+    MemEntry *tail = malloc((mem_count + t->segs.count + 1) * sizeof(MemEntry));
+    if (!tail)
+        return NULL;
+
+    size_t n = 0;
+    for (size_t i = 0; i < t->segs.capacity; i++)
+    {
+        const MemEntry *e = &t->segs.slots[i];
+        if (e->id >= first && !table_visible_version(t, memtable_find(&t->mem, e->id)))
+            tail[n++] = *e;
+    }
+    qsort(tail, n, sizeof(MemEntry), compare_mem_entries);
+
+    // Merge the (already sorted) memtable entries in from the back
+    size_t total = n + mem_count;
+    size_t a = n, b = t->mem.count, out = total;
+    while (b > mem_start)
+    {
+        const MemEntry *m = table_visible_version(t, &t->mem.entries[b - 1]);
+        if (!m)
+            b--;
+        else if (a > 0 && tail[a - 1].id > m->id)
+            tail[--out] = tail[--a];
+        else
+        {
+            tail[--out] = *m;
+            b--;
+        }
+    }
+
+    *count = total;
+    return tail;
+}
+
+// Overlay entries for ids the pages have never held: rows inserted since the
+// last compaction
+MemEntry *table_overlay_tail(Table *t, size_t *count)
+{
+    return table_overlay_from(t, t->header.heap_max_id + 1, count);
+}
+
+bool table_compact(Table *t);
+
+// Write the memtable out as the next immutable segment file; once enough
+// segments pile up they are folded into the pages
+bool table_flush_memtable(Table *t)
+{
+    // Deferred until the last scan ends (see "Snapshots")
+    if (t->mem.count == 0 || t->readers > 0)
+        return true;
+
+    char path[300];
+    table_segment_path(t, t->header.seg_next, path, sizeof(path));
+    if (!segment_write(path, &t->mem))
+    {
+        print_error("Error: Failed to write segment '%s'.\n", path);
+        return false;
+    }
+    t->header.seg_next++;
+    t->header_dirty = true;
+
+    // A loaded view takes the entries over instead of re-reading the file
+    for (size_t i = 0; t->segs.loaded && i < t->mem.count; i++)
+    {
+        if (segment_view_put(&t->segs, t->mem.entries[i].id, t->mem.entries[i].record))
+            t->mem.entries[i].record = NULL;
+        else
+            segment_view_clear(&t->segs);
+    }
+    memtable_clear(&t->mem);
+
+    // The log goes once the header that lists the segment is on disk
+    if (!table_sync(t))
+        return false;
+    wal_remove(t);
+
+    if (t->header.seg_next - t->header.seg_base >= SEGMENT_COMPACT_AT)
+        return table_compact(t);
+    return true;
+}
+
+// Flush the memtable once it has outgrown memtable_limit
+bool table_check_memtable(Table *t)
+{
+    if (t->mem.bytes < memtable_limit)
+        return true;
+
+    MetricsPhase previous = metrics_enter(PHASE_WRITE);
+    bool ok = table_flush_memtable(t);
+    metrics_leave(previous);
+    return ok;
+}
+
+// ---------------------------------------------------------------------------
+// Change feed
+//
+// A table with TABLE_FLAG_FEED logs every insert, update and delete to
+// <table>.feed as it is applied, numbered by a sequence the header keeps, so
+// numbers are never reused across restarts or after the feed is turned off.
+// The file is the magic and the sequence number it starts at, then per change
+// [seq:u64][op:u8][id:u32][length:u32][record bytes], with deletes stored
+// as length UINT32_MAX and no bytes. It is written through stdio and reaches
+// the disk with the rest of the table.
+//
+// The offset of every FEED_MARK_EVERY-th entry is kept in <table>.feedx.
+// Opening the feed loads these marks and reads on from the last one to find
+// the end. watch <table> from <seq> seeks to the mark before <seq>. Both
+// read only the tail of the feed, however long it has grown. Watchers
+// registered through the library are called with each change as it is
+// applied.
+// ---------------------------------------------------------------------------
+
+#define FEED_MAGIC "NANOFED1"
+#define FEED_HEADER_SIZE 16 // magic and first sequence number
+#define FEED_ENTRY_SIZE 17  // seq, op, id and length before the record bytes
+#define FEED_MARK_EVERY 256
+#define FEED_MARK_SIZE 16 // seq and offset in <table>.feedx
+#define MAX_FEED_WATCHERS 16
+
+// Values match NANODB_INSERT, NANODB_UPDATE and NANODB_DELETE
+typedef enum
+{
+    FEED_INSERT = 1,
+    FEED_UPDATE,
+    FEED_DELETE
+} FeedOp;
+
+typedef struct
+{
+    uint64_t seq;
+    FeedOp op;
+    uint32_t id;
+    const char *record; // NULL for deletes
+} FeedChange;
+
+// Called for each change in sequence order; return false to stop
+typedef bool (*change_visitor)(const FeedChange *change, void *ctx);
+
+typedef struct
+{
+    bool in_use;
+    char db[50];
+    char table[100];
+    change_visitor visit;
+    void *ctx;
+} FeedWatcher;
+
+FeedWatcher feed_watchers[MAX_FEED_WATCHERS];
+int feed_watcher_count = 0;
+
+const char *feed_op_name(FeedOp op)
+{
+    if (op == FEED_INSERT)
+        return "insert";
+    if (op == FEED_UPDATE)
+        return "update";
+    return "delete";
+}
+
+void feed_close(ChangeFeed *f)
+{
+    if (!f)
+        return;
+    if (f->file)
+        fclose(f->file);
+    if (f->index)
+        fclose(f->index);
+    free(f->marks);
+    free(f);
+}
+
+// Count an entry written or found at `offset`, marking every
+// FEED_MARK_EVERY-th one, and with `save` adding the mark to <table>.feedx
+bool feed_note_entry(ChangeFeed *f, uint64_t seq, uint64_t offset, bool save)
+{
+    if (f->entries++ % FEED_MARK_EVERY != 0)
+        return true;
+
+    if (f->mark_count == f->mark_capacity)
+    {
+        size_t capacity = f->mark_capacity ? f->mark_capacity * 2 : 64;
+        FeedMark *marks = realloc(f->marks, capacity * sizeof(FeedMark));
+        if (!marks)
+            return false;
+        f->marks = marks;
+        f->mark_capacity = capacity;
+    }
+    f->marks[f->mark_count].seq = seq;
+    f->marks[f->mark_count].offset = offset;
+    if (save)
+    {
+        if (seek_file(f->index, (uint64_t)f->mark_count * FEED_MARK_SIZE) != 0 ||
+            fwrite(&seq, sizeof(seq), 1, f->index) != 1 || fwrite(&offset, sizeof(offset), 1, f->index) != 1)
+            return false;
+        metrics.bytes_written += FEED_MARK_SIZE;
+    }
+    f->mark_count++;
+    return true;
+}
+
+// Read the entry at the current position into `change`, its record into
+// `buffer`. False at the end of the feed or at a torn entry.
+bool feed_read_entry(FILE *file, FeedChange *change, char *buffer, uint32_t *length)
+{
+    uint8_t op;
+    if (fread(&change->seq, sizeof(change->seq), 1, file) != 1 || fread(&op, 1, 1, file) != 1 ||
+        fread(&change->id, sizeof(change->id), 1, file) != 1 || fread(length, sizeof(*length), 1, file) != 1)
+        return false;
+    if (op < FEED_INSERT || op > FEED_DELETE || (*length == UINT32_MAX) != (op == FEED_DELETE))
+        return false;
+
+    change->op = (FeedOp)op;
+    change->record = NULL;
+    if (*length == UINT32_MAX)
+        return true;
+    if (*length > MAX_RECORD_SIZE || fread(buffer, 1, *length, file) != *length)
+        return false;
+    buffer[*length] = '\0';
+    change->record = buffer;
+    return true;
+}
+
+uint64_t feed_entry_bytes(uint32_t length)
+{
+    return FEED_ENTRY_SIZE + (length == UINT32_MAX ? 0 : length);
+}
+
+// The open feed of a table, opening or creating <table>.feed on first use.
+// A crash can leave a torn entry at the end; the feed stops before it, or
+// before any entry whose sequence number does not increase, and the next
+// write goes over it.
+ChangeFeed *table_feed(Table *t)
+{
+    if (t->feed)
+        return t->feed;
+
+    ChangeFeed *f = calloc(1, sizeof(ChangeFeed));
+    if (!f)
+        return NULL;
+    if (t->header.feed_seq == 0)
+    {
+        t->header.feed_seq = 1;
+        t->header_dirty = true;
+    }
+
+    char path[300], index_path[300], magic[8];
+    build_table_path(path, sizeof(path), t->db, t->name, FEED_EXT);
+    build_table_path(index_path, sizeof(index_path), t->db, t->name, FEED_INDEX_EXT);
+    bool ok;
+    f->file = fopen(path, "r+b");
+    if (f->file)
+    {
+        ok = fread(magic, 1, 8, f->file) == 8 && memcmp(magic, FEED_MAGIC, 8) == 0 &&
+             fread(&f->first_seq, sizeof(f->first_seq), 1, f->file) == 1;
+        f->index = fopen(index_path, "r+b");
+    }
+    else
+    {
+        f->file = fopen(path, "w+b");
+        f->first_seq = t->header.feed_seq;
+        ok = f->file && fwrite(FEED_MAGIC, 1, 8, f->file) == 8 &&
+             fwrite(&f->first_seq, sizeof(f->first_seq), 1, f->file) == 1;
+        metrics.bytes_written += FEED_HEADER_SIZE;
+    }
+    if (!f->index)
+        f->index = fopen(index_path, "w+b");
+    ok = ok && f->index;
+
+    // Load the saved marks; the scan for the end starts at the last one
+    FeedMark mark;
+    while (ok && fread(&mark.seq, sizeof(mark.seq), 1, f->index) == 1 &&
+           fread(&mark.offset, sizeof(mark.offset), 1, f->index) == 1)
+    {
+        ok = feed_note_entry(f, mark.seq, mark.offset, false);
+        f->entries += FEED_MARK_EVERY - 1;
+    }
+    metrics.bytes_read += f->mark_count * FEED_MARK_SIZE;
+
+    FeedChange change;
+    uint32_t length;
+    char record[PAGE_SIZE];
+    uint64_t last = 0;
+    f->end = FEED_HEADER_SIZE;
+    if (ok && f->mark_count > 0)
+    {
+        // Rescan from the last mark, or from the start if it does not point
+        // at its entry
+        mark = f->marks[--f->mark_count];
+        if (seek_file(f->file, mark.offset) == 0 && feed_read_entry(f->file, &change, record, &length) &&
+            change.seq == mark.seq)
+        {
+            f->end = mark.offset;
+            f->entries = f->mark_count * FEED_MARK_EVERY;
+            last = mark.seq - 1;
+        }
+        else
+        {
+            f->mark_count = 0;
+            f->entries = 0;
+        }
+    }
+
+    ok = ok && seek_file(f->file, f->end) == 0;
+    uint64_t scan_start = f->end;
+    while (ok && feed_read_entry(f->file, &change, record, &length) && change.seq >= f->first_seq &&
+           change.seq > last)
+    {
+        ok = feed_note_entry(f, change.seq, f->end, true);
+        f->end += feed_entry_bytes(length);
+        last = change.seq;
+    }
+    metrics.bytes_read += f->end - scan_start;
+
+    if (!ok)
+    {
+        print_error("Error: '%s' is not a valid change feed.\n", path);
+        feed_close(f);
+        return NULL;
+    }
+
+    // The header is written after the feed, so it can lag behind it
+    if (last >= t->header.feed_seq)
+    {
+        t->header.feed_seq = last + 1;
+        t->header_dirty = true;
+    }
+    t->feed = f;
+    return f;
+}
+
+// Stop a watcher; its slot can be reused
+void feed_unwatch(int slot)
+{
+    if (slot < 0 || slot >= MAX_FEED_WATCHERS || !feed_watchers[slot].in_use)
+        return;
+    feed_watchers[slot].in_use = false;
+    feed_watcher_count--;
+}
+
+// Register `visit` for the changes of a table from now on. Returns its slot,
+// or -1 when all MAX_FEED_WATCHERS slots are taken.
+int feed_watch(const char *db_name, const char *table_name, change_visitor visit, void *ctx)
+{
+    for (int i = 0; i < MAX_FEED_WATCHERS; i++)
+    {
+        FeedWatcher *w = &feed_watchers[i];
+        if (w->in_use)
+            continue;
+        w->in_use = true;
+        strncpy(w->db, db_name, sizeof(w->db) - 1);
+        w->db[sizeof(w->db) - 1] = '\0';
+        strncpy(w->table, table_name, sizeof(w->table) - 1);
+        w->table[sizeof(w->table) - 1] = '\0';
+        w->visit = visit;
+        w->ctx = ctx;
+        feed_watcher_count++;
+        return i;
+    }
+    return -1;
+}
+
+// Append one change to the feed and hand it to the table's watchers
+bool feed_append(Table *t, FeedOp op, uint32_t id, const char *record)
+{
+    ChangeFeed *f = table_feed(t);
+    if (!f)
+        return false;
+
+    FeedChange change = {t->header.feed_seq, op, id, record};
+    uint8_t op_byte = (uint8_t)op;
+    uint32_t length = record ? (uint32_t)strlen(record) : UINT32_MAX;
+    // A seek would flush the stdio buffer, so appends in a row skip it
+    bool ok = (f->at_end || seek_file(f->file, f->end) == 0) && fwrite(&change.seq, sizeof(change.seq), 1, f->file) == 1 &&
+              fwrite(&op_byte, 1, 1, f->file) == 1 && fwrite(&id, sizeof(id), 1, f->file) == 1 &&
+              fwrite(&length, sizeof(length), 1, f->file) == 1 &&
+              (!record || fwrite(record, 1, length, f->file) == length);
+    f->at_end = ok;
+    if (!ok || !feed_note_entry(f, change.seq, f->end, true))
+        return false;
+
+    f->end += feed_entry_bytes(length);
+    metrics.bytes_written += feed_entry_bytes(length);
+    t->header.feed_seq++;
+    t->header_dirty = true;
+
+    for (int i = 0; feed_watcher_count > 0 && i < MAX_FEED_WATCHERS; i++)
+    {
+        FeedWatcher *w = &feed_watchers[i];
+        if (w->in_use && strcmp(w->db, t->db) == 0 && strcmp(w->table, t->name) == 0 && !w->visit(&change, w->ctx))
+            feed_unwatch(i);
+    }
+    return true;
+}
+
+// Log a write of a table that has its feed turned on
+void feed_record(Table *t, FeedOp op, uint32_t id, const char *record)
+{
+    if ((t->header.flags & TABLE_FLAG_FEED) && !feed_append(t, op, id, record))
+        print_error("Error: Failed to add %s of record %u to the change feed of '%s'.\n", feed_op_name(op), id,
+                    t->name);
+}
+
+// Visit the changes from sequence `from` on, at most `limit` of them (0 for
+// no limit). `next` gets the sequence number to continue from. False when
+// the feed cannot be read.
+bool feed_read(Table *t, uint64_t from, uint64_t limit, change_visitor visit, void *ctx, uint64_t *next)
+{
+    ChangeFeed *f = table_feed(t);
+    if (!f)
+        return false;
+
+    // Start at the last mark at or before `from`
+    size_t lo = 0, hi = f->mark_count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (f->marks[mid].seq <= from)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    uint64_t offset = lo > 0 ? f->marks[lo - 1].offset : FEED_HEADER_SIZE;
+
+    *next = from;
+    uint64_t visited = 0;
+    f->at_end = false;
+    bool ok = seek_file(f->file, offset) == 0;
+    FeedChange change;
+    uint32_t length;
+    char record[PAGE_SIZE];
+    while (ok && offset < f->end && (limit == 0 || visited < limit))
+    {
+        ok = feed_read_entry(f->file, &change, record, &length);
+        offset += feed_entry_bytes(length);
+        metrics.bytes_read += feed_entry_bytes(length);
+        if (!ok || change.seq < from)
+            continue;
+
+        visited++;
+        metrics.rows_scanned++;
+        *next = change.seq + 1;
+        if (!visit(&change, ctx))
+            return true;
+    }
+
+    // Sequence numbers lost with a crash are never handed out again
+    if (ok && offset >= f->end && *next < t->header.feed_seq)
+        *next = t->header.feed_seq;
+    return ok;
+}
+
+// Turn the feed on; changes are logged from the next sequence number
+bool table_enable_feed(Table *t)
+{
+    if (t->header.flags & TABLE_FLAG_FEED)
+        return true;
+    t->header.flags |= TABLE_FLAG_FEED;
+    t->header_dirty = true;
+    return table_feed(t) != NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Row expiry
+//
+// insert ... ttl <seconds>, or a table default set with ttl=<seconds>, stores
+// the time a row expires as its _expires field (unix seconds, right after
+// the id). Reads skip expired rows, so they disappear on time without any
+// write. Their space is reclaimed in bulk: compaction drops expired versions
+// instead of writing them to the pages, and the expiry pass deletes expired
+// rows from the pages in place, a page at a time. Between commands, at most
+// once per EXPIRY_INTERVAL_SECONDS, the pass moves on through the next
+// EXPIRY_PAGES_PER_PASS pages of the open tables that have TTLs;
+// expire <table> runs it over a whole table. Rows still in the row count
+// after expiring are only counted until they are reclaimed, so count scans
+// tables with TTLs.
+// ---------------------------------------------------------------------------
+
+#define TTL_FIELD "_expires"
+#define MAX_TTL_SECONDS 3153600000u // 100 years
+#define EXPIRY_INTERVAL_SECONDS 1
+#define EXPIRY_PAGES_PER_PASS 64
+
+int64_t expiry_now = 0; // the time rows are checked against, read once per command
+int64_t last_expiry_pass = 0;
+int expiry_next_table = 0; // open table the next pass starts with
+
+void expiry_refresh_clock()
+{
+    expiry_now = (int64_t)time(NULL);
+}
+
+// True when a record carries an expiry time that has passed. Tables that
+// never had a TTL skip the field lookup.
+bool record_expired(const Table *t, const char *record)
+{
+    if (!(t->header.flags & TABLE_FLAG_TTL))
+        return false;
+
+    const char *value;
+    size_t len;
+    if (!record_find_field(record, TTL_FIELD, &value, &len))
+        return false;
+    return strtoll(value, NULL, 10) <= expiry_now;
+}
+
+// Delete the expired rows of one page in place. Rows with a newer version in
+// the memtable or a segment are left to compaction. The number deleted, -1
+// when the page cannot be read.
+int table_expire_page(Table *t, int shard, uint32_t page_no, bool overlay)
+{
+    unsigned char *page = pool_fetch_page(t->shard_files[shard], page_no, false);
+    if (!page)
+        return -1;
+
+    char stored[PAGE_SIZE];
+    int expired = 0;
+    uint16_t count = page_slot_count(page);
+    for (uint16_t s = 0; s < count; s++)
+    {
+        uint16_t offset = page_slot_offset(page, s);
+        if (offset == 0)
+            continue;
+
+        uint16_t length = page_slot_length(page, s);
+        memcpy(stored, page + offset, length);
+        stored[length] = '\0';
+        if (!record_expired(t, stored) || (overlay && table_overlay_find(t, record_id(stored))))
+            continue;
+
+        page_delete(page, s);
+        expired++;
+    }
+    pool_unpin(page, expired > 0);
+    return expired;
+}
+
+// Run the expiry pass over the next `max_pages` data pages of a table, or
+// all of them when it is 0. The number of rows deleted, -1 on a read error.
+long table_expire(Table *t, uint32_t max_pages)
+{
+    uint32_t total = table_data_pages(t);
+    if (!(t->header.flags & TABLE_FLAG_TTL) || total == 0)
+        return 0;
+    if (!table_load_segments(t))
+        return -1;
+
+    bool overlay = t->mem.count > 0 || t->segs.count > 0;
+    uint32_t pages = max_pages == 0 || max_pages > total ? total : max_pages;
+    long expired = 0;
+    for (uint32_t i = 0; i < pages; i++)
+    {
+        // Data pages are numbered over all shards, from 0
+        uint32_t page = t->expiry_cursor++ % total;
+        int shard = 0;
+        while (page >= table_shard_pages(t, shard))
+            page -= table_shard_pages(t, shard++);
+
+        int n = table_expire_page(t, shard, page + 1, overlay);
+        if (n < 0)
+        {
+            expired = -1;
+            break;
+        }
+        expired += n;
+    }
+    t->expiry_cursor %= total;
+
+    if (expired > 0)
+    {
+        t->header.row_count -= (uint32_t)expired;
+        t->header_dirty = true;
+    }
+    return expired;
+}
+
+// Between commands: read the clock, and once per EXPIRY_INTERVAL_SECONDS
+// reclaim expired rows from up to EXPIRY_PAGES_PER_PASS pages, taking the
+// open tables in turn
+void expiry_tick()
+{
+    expiry_refresh_clock();
+    if (expiry_now - last_expiry_pass < EXPIRY_INTERVAL_SECONDS)
+        return;
+    last_expiry_pass = expiry_now;
+
+    uint32_t budget = EXPIRY_PAGES_PER_PASS;
+    for (int i = 0; i < MAX_OPEN_TABLES && budget > 0; i++)
+    {
+        Table *t = &open_tables[(expiry_next_table + i) % MAX_OPEN_TABLES];
+        if (!t->in_use || !(t->header.flags & TABLE_FLAG_TTL) || t->readers > 0)
+            continue;
+
+        uint32_t pages = table_data_pages(t);
+        if (pages > budget)
+        {
+            pages = budget;
+            expiry_next_table = (expiry_next_table + i) % MAX_OPEN_TABLES;
+        }
+        budget -= pages;
+        if (pages > 0 && table_expire(t, pages) < 0)
+            printf("Warning: Expiry pass failed on table '%s'.\n", t->name);
+    }
+}
+
+// Insert a record, assigning it the next auto-increment id. Returns the id or 0.
+// The row only goes to the memtable, so no page is touched. A row with a
+// ttl (or a table default) gets its expiry time as its first field.
+uint32_t table_insert_record(Table *t, const char *attributes, uint32_t ttl)
+{
+    char record[PAGE_SIZE];
+    uint32_t id = t->header.next_id;
+    if (ttl == 0)
+        ttl = t->header.default_ttl;
+
+    int written;
+    if (ttl > 0)
+        written = snprintf(record, sizeof(record), "id:%u, %s:%lld, %s", id, TTL_FIELD,
+                           (long long)(expiry_now + ttl), attributes);
+    else
+        written = snprintf(record, sizeof(record), "id:%u, %s", id, attributes);
+    if (written < 0 || (size_t)written > MAX_RECORD_SIZE)
+    {
+        print_error("Error: Record is too large.\n");
+        return 0;
+    }
+
+    if (!table_mem_put(t, id, record, ++commit_seq))
+        return 0;
+
+    t->header.next_id++;
+    t->header.row_count++;
+    if (ttl > 0)
+        t->header.flags |= TABLE_FLAG_TTL;
+    t->header_dirty = true;
+    t->version = ++table_version_clock;
+    feed_record(t, FEED_INSERT, id, record);
+    table_check_memtable(t);
+    return id;
+}
+
+// Narrow a filter to an id range for block skipping: the id of "id:<n>",
+// or the smallest to the largest id of "id in (...)"
+void filter_id_range(const RecordFilter *filter, uint32_t *min_id, uint32_t *max_id)
+{
+    *min_id = 0;
+    *max_id = UINT32_MAX;
+    if (!filter)
+        return;
+
+    if (filter->in)
+    {
+        if (filter->in->ids)
+        {
+            *min_id = filter->in->ids[0];
+            *max_id = filter->in->ids[filter->in->count - 1];
+        }
+        return;
+    }
+
+    char *end;
+    unsigned long id = strtoul(filter->value, &end, 10);
+    if (strcmp(filter->field, "id") == 0 && end != filter->value && *end == '\0')
+        *min_id = *max_id = (uint32_t)id;
+}
+
+// The sorted ids of an "id in (...)" filter, NULL for other filters
+const FilterSet *filter_id_set(const RecordFilter *filter)
+{
+    return filter && filter->in && filter->in->ids ? filter->in : NULL;
+}
+
+// Whether `shard` can hold one of the ids of an id set
+bool shard_has_ids(Table *t, const FilterSet *ids, int shard)
+{
+    if (t->shard_count == 1)
+        return true;
+    for (size_t i = 0; i < ids->count; i++)
+    {
+        if (table_shard_of(t, ids->ids[i]) == shard)
+            return true;
+    }
+    return false;
+}
+
+// Whether a scan with an id filter can skip a page: its compressed block
+// holds none of the ids and it is not cached (cached pages are always read
+// because their block entry may be stale)
+bool scan_skips_page(const RecordFilter *filter, int file_id, uint32_t page_no, uint32_t min_id, uint32_t max_id)
+{
+    const FilterSet *ids = filter_id_set(filter);
+    bool excluded = ids ? paged_block_excludes_ids(file_id, page_no, ids->ids, ids->count)
+                        : paged_block_excludes(file_id, page_no, min_id, max_id);
+    return excluded && pool_lookup(file_id, page_no) < 0;
+}
+
+// The version of a stored row that a scan sees: its memtable or segment
+// version if there is one (from_overlay is then set), otherwise the row
+// itself, decoded into `record` when asked. NULL when the row is deleted,
+// expired or does not match the filter.
+const char *scan_row(Table *t, const RecordFilter *filter, bool decode, bool overlay, const char *stored,
+                     char *record, bool *from_overlay)
+{
+    const MemEntry *e = overlay ? table_overlay_find(t, record_id(stored)) : NULL;
+    *from_overlay = e != NULL;
+
+    if (e)
+    {
+        if (!e->record || (filter && !filter_matches(filter, e->record)) || record_expired(t, e->record))
+            return NULL;
+        return e->record;
+    }
+
+    if ((filter && !filter_matches(filter, stored)) || record_expired(t, stored))
+        return NULL;
+    if (decode && t->dict && dict_decode(t->dict, stored, record, PAGE_SIZE))
+        return record;
+    return stored;
+}
+
+// Visit the rows inserted since the last compaction (ids past the pages)
+bool table_scan_tail(Table *t, const RecordFilter *filter, uint32_t min_id, uint32_t max_id, record_visitor visit,
+                     void *ctx)
+{
+    RecordId overlay_rid = {0, 0, 0};
+    size_t tail_count;
+    MemEntry *tail = table_overlay_tail(t, &tail_count);
+    if (!tail)
+        return false;
+
+    for (size_t i = 0; i < tail_count; i++)
+    {
+        if (!tail[i].record || tail[i].id < min_id || tail[i].id > max_id)
+            continue;
+        metrics.rows_scanned++;
+        if ((filter && !filter_matches(filter, tail[i].record)) || record_expired(t, tail[i].record))
+            continue;
+        if (!visit(tail[i].record, overlay_rid, ctx))
+            break;
+    }
+    free(tail);
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Read-ahead
+//
+// A serial scan of a file larger than half the buffer pool reads its pages
+// through a read-ahead thread instead of the pool: the thread issues large
+// positioned reads into a ring of READAHEAD_DEPTH buffers while the scan
+// filters the pages it has already got, so the disk and the CPU work at the
+// same time. Pages are handed out in order; once the scan moves past a
+// buffer the thread refills it with the next range. Reads start at
+// READAHEAD_FIRST pages and double up to READAHEAD_PAGES, so a scan that
+// stops early (a limit, an id) reads little past where it stopped.
+// Reading around the pool also keeps a big scan from evicting every cached
+// page of the other tables.
+//
+// The file's dirty pages are written back first, so the disk holds every
+// page as the pool does. Nothing writes the pages of a table while it is
+// scanned (see "Snapshots"), so the buffers stay current until the scan ends.
+// ---------------------------------------------------------------------------
+
+// Whether a serial scan of `t` with `filter` reads one of its files ahead:
+// a scan that is not narrowed by ids, of a file larger than half the pool
+bool scan_reads_ahead(Table *t, const RecordFilter *filter)
+{
+#ifdef _WIN32
+    (void)t;
+    (void)filter;
+#else
+    uint32_t min_id, max_id;
+    filter_id_range(filter, &min_id, &max_id);
+    if (min_id != 0 || max_id != UINT32_MAX || filter_id_set(filter))
+        return false;
+
+    for (int shard = 0; shard < t->shard_count; shard++)
+    {
+        if (table_shard_pages(t, shard) > (uint32_t)pool_size_setting / 2)
+            return true;
+    }
+#endif
+    return false;
+}
+
+#ifndef _WIN32
+// Defined with the memory governor
+extern size_t readahead_memory;
+bool memory_fits(size_t bytes);
+
+typedef struct
+{
+    int file_id;
+    uint32_t next_page; // first page the thread has not read yet
+    uint32_t end_page;
+    uint32_t window;        // pages of the next read
+    unsigned char *buffers; // READAHEAD_DEPTH * READAHEAD_PAGES pages
+    uint32_t first[READAHEAD_DEPTH]; // pages held by each buffer
+    uint32_t count[READAHEAD_DEPTH];
+    bool failed[READAHEAD_DEPTH];
+    int head;   // buffer the scan reads from
+    int filled; // buffers read and not yet released by the scan
+    bool stop;
+    bool done; // the thread has read its last range
+    uint64_t bytes_read;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t thread;
+} ReadAhead;
+
+// Read pages first..first+count-1 into `buffer`, with one read when the file
+// is not compressed
+bool readahead_read(ReadAhead *ra, uint32_t first, uint32_t count, unsigned char *buffer)
+{
+    PagedFile *pf = &paged_files[ra->file_id];
+    if (pf->compressed)
+    {
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (!paged_pread_page(ra->file_id, first + i, buffer + (size_t)i * PAGE_SIZE, &ra->bytes_read))
+                return false;
+        }
+        return true;
+    }
+
+    // A short read at the end of the file leaves the rest zero-filled
+    size_t want = (size_t)count * PAGE_SIZE;
+    ssize_t n = pread(fileno(pf->fp), buffer, want, (off_t)first * PAGE_SIZE);
+    if (n < 0)
+        return false;
+    memset(buffer + n, 0, want - (size_t)n);
+    ra->bytes_read += (uint64_t)n;
+    return true;
+}
+
+void *readahead_main(void *arg)
+{
+    ReadAhead *ra = arg;
+    pthread_mutex_lock(&ra->lock);
+    for (;;)
+    {
+        while (ra->filled == READAHEAD_DEPTH && !ra->stop)
+            pthread_cond_wait(&ra->changed, &ra->lock);
+        if (ra->stop || ra->next_page >= ra->end_page)
+            break;
+
+        int slot = (ra->head + ra->filled) % READAHEAD_DEPTH;
+        uint32_t first = ra->next_page;
+        uint32_t count = ra->end_page - first < ra->window ? ra->end_page - first : ra->window;
+        ra->next_page += count;
+        if (ra->window < READAHEAD_PAGES)
+            ra->window *= 2;
+        pthread_mutex_unlock(&ra->lock);
+
+        bool ok = readahead_read(ra, first, count, ra->buffers + (size_t)slot * READAHEAD_PAGES * PAGE_SIZE);
+
+        pthread_mutex_lock(&ra->lock);
+        ra->first[slot] = first;
+        ra->count[slot] = count;
+        ra->failed[slot] = !ok;
+        ra->filled++;
+        pthread_cond_broadcast(&ra->changed);
+    }
+    ra->done = true;
+    pthread_cond_broadcast(&ra->changed);
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+// Start reading pages first..end-1 of a file ahead of a scan. NULL when the
+// file is small enough for the pool, the buffers do not fit under the memory
+// limit or the thread cannot start; the scan then reads through the pool.
+ReadAhead *readahead_start(int file_id, uint32_t first, uint32_t end)
+{
+    size_t buffer_bytes = (size_t)READAHEAD_DEPTH * READAHEAD_PAGES * PAGE_SIZE;
+    if (end <= first || end - first <= (uint32_t)pool_size_setting / 2 || !memory_fits(buffer_bytes))
+        return NULL;
+
+    for (int i = 0; i < pool.frame_count; i++)
+    {
+        if (pool.frames[i].file_id == file_id && pool.frames[i].dirty && !pool_write_frame(i))
+            return NULL;
+    }
+    if (fflush(paged_files[file_id].fp) != 0)
+        return NULL;
+
+    ReadAhead *ra = calloc(1, sizeof(ReadAhead));
+    if (!ra)
+        return NULL;
+    ra->buffers = malloc(buffer_bytes);
+    ra->file_id = file_id;
+    ra->next_page = first;
+    ra->end_page = end;
+    ra->window = READAHEAD_FIRST;
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->changed, NULL);
+    if (!ra->buffers || pthread_create(&ra->thread, NULL, readahead_main, ra) != 0)
+    {
+        pthread_mutex_destroy(&ra->lock);
+        pthread_cond_destroy(&ra->changed);
+        free(ra->buffers);
+        free(ra);
+        return NULL;
+    }
+    readahead_memory += buffer_bytes;
+    return ra;
+}
+
+// The contents of `page_no`, which must not be lower than the last page
+// asked for. NULL on a read error or past the end of the range.
+const unsigned char *readahead_page(ReadAhead *ra, uint32_t page_no)
+{
+    pthread_mutex_lock(&ra->lock);
+    for (;;)
+    {
+        while (ra->filled == 0 && !ra->done)
+            pthread_cond_wait(&ra->changed, &ra->lock);
+        if (ra->filled == 0)
+        {
+            pthread_mutex_unlock(&ra->lock);
+            return NULL;
+        }
+
+        int slot = ra->head;
+        if (page_no < ra->first[slot] + ra->count[slot])
+        {
+            pthread_mutex_unlock(&ra->lock);
+            if (ra->failed[slot])
+                return NULL;
+            return ra->buffers + ((size_t)slot * READAHEAD_PAGES + (page_no - ra->first[slot])) * PAGE_SIZE;
+        }
+
+        // Done with this buffer: hand it back for the next range
+        ra->head = (ra->head + 1) % READAHEAD_DEPTH;
+        ra->filled--;
+        pthread_cond_broadcast(&ra->changed);
+    }
+}
+
+// Stop the thread, also when the scan ends early, and count its reads
+void readahead_stop(ReadAhead *ra)
+{
+    if (!ra)
+        return;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->stop = true;
+    pthread_cond_broadcast(&ra->changed);
+    pthread_mutex_unlock(&ra->lock);
+    pthread_join(ra->thread, NULL);
+
+    metrics.bytes_read += ra->bytes_read;
+    readahead_memory -= (size_t)READAHEAD_DEPTH * READAHEAD_PAGES * PAGE_SIZE;
+    pthread_mutex_destroy(&ra->lock);
+    pthread_cond_destroy(&ra->changed);
+    free(ra->buffers);
+    free(ra);
+}
+#else
+// Windows scans read every page through the pool
+typedef struct ReadAhead ReadAhead;
+
+ReadAhead *readahead_start(int file_id, uint32_t first, uint32_t end)
+{
+    (void)file_id;
+    (void)first;
+    (void)end;
+    return NULL;
+}
+
+const unsigned char *readahead_page(ReadAhead *ra, uint32_t page_no)
+{
+    (void)ra;
+    (void)page_no;
+    return NULL;
+}
+
+void readahead_stop(ReadAhead *ra)
+{
+    (void)ra;
+}
+#endif
+
+// Visit the live records that match `filter` (NULL visits all of them).
+// The filter runs on the stored form, so only matching records are decoded
+// (and only when `decode` is set).
+// Compressed blocks whose id range cannot match are skipped without being
+// read; cached pages are always visited because their block entry may be
+// stale. An id filter reads only the shard of its id and stops at its row,
+// since ids are unique; an "id in (...)" filter reads only the shards and
+// blocks that can hold its ids and stops once it has found all of them.
+// Rows with a newer version in the memtable or a segment are replaced by
+// that version (which is visited with page 0 in its RecordId); rows inserted
+// since the last compaction follow the pages in id order. Full scans of
+// large files read ahead (see "Read-ahead").
+bool table_scan_pages(Table *t, const RecordFilter *filter, bool decode, record_visitor visit, void *ctx)
+{
+    char stored[PAGE_SIZE];
+    char record[PAGE_SIZE];
+    uint32_t min_id = 0, max_id = UINT32_MAX;
+    RecordId overlay_rid = {0, 0, 0};
+
+    if (!table_load_segments(t))
+        return false;
+    bool overlay = t->mem.count > 0 || t->segs.count > 0;
+
+    filter_id_range(filter, &min_id, &max_id);
+    bool single_id = min_id == max_id && !filter->in;
+    const FilterSet *ids = filter_id_set(filter);
+    size_t ids_left = ids ? ids->count : 0;
+
+    // The newest version of a single id can be answered without the pages
+    if (overlay && single_id)
+    {
+        const MemEntry *e = table_overlay_find(t, min_id);
+        if (e)
+        {
+            metrics.rows_scanned++;
+            if (e->record && filter_matches(filter, e->record) && !record_expired(t, e->record))
+                visit(e->record, overlay_rid, ctx);
+            return true;
+        }
+    }
+
+    int first_shard = single_id ? table_shard_of(t, min_id) : 0;
+    int end_shard = single_id ? first_shard + 1 : t->shard_count;
+    for (int shard = first_shard; shard < end_shard; shard++)
+    {
+        if (ids && !shard_has_ids(t, ids, shard))
+            continue;
+
+        int file_id = t->shard_files[shard];
+        uint32_t page_count = paged_files[file_id].page_count;
+
+        // Id filters skip most pages, so only full scans read ahead
+        ReadAhead *ra = single_id || ids ? NULL : readahead_start(file_id, 1, page_count);
+        for (uint32_t page_no = 1; page_no < page_count; page_no++)
+        {
+            if (scan_skips_page(filter, file_id, page_no, min_id, max_id))
+                continue;
+
+            unsigned char *pinned = ra ? NULL : pool_fetch_page(file_id, page_no, false);
+            const unsigned char *page = ra ? readahead_page(ra, page_no) : pinned;
+            if (!page)
+            {
+                if (ra)
+                    print_error("Error: Failed to read page %u of '%s'.\n", page_no, paged_files[file_id].path);
+                readahead_stop(ra);
+                return false;
+            }
+
+            uint16_t count = page_slot_count(page);
+            for (uint16_t s = 0; s < count; s++)
+            {
+                uint16_t offset = page_slot_offset(page, s);
+                if (offset == 0)
+                    continue;
+
+                uint16_t length = page_slot_length(page, s);
+                memcpy(stored, page + offset, length);
+                stored[length] = '\0';
+                metrics.rows_scanned++;
+
+                bool from_overlay;
+                const char *out = scan_row(t, filter, decode, overlay, stored, record, &from_overlay);
+                if (!out)
+                    continue;
+
+                RecordId rid = {page_no, s, (uint16_t)shard};
+                if (!visit(out, from_overlay ? overlay_rid : rid, ctx) || single_id || (ids && --ids_left == 0))
+                {
+                    if (pinned)
+                        pool_unpin(pinned, false);
+                    readahead_stop(ra);
+                    return true;
+                }
+            }
+            if (pinned)
+                pool_unpin(pinned, false);
+        }
+        readahead_stop(ra);
+    }
+
+    if (!overlay)
+        return true;
+    return table_scan_tail(t, filter, min_id, max_id, visit, ctx);
+}
+
+// Defined with the memory governor: memory a query may buffer before
+// spilling, and the rows sorts, joins and aggregates hold
+size_t work_memory_budget();
+extern size_t query_memory;
+void memory_query_grew();
+
+#ifndef _WIN32
+
+// A parallel scan splits the pages into one contiguous range per worker
+// thread, numbering the data pages of all shards one after the other.
+// Workers read cached pages straight from the pool and the others with
+// positioned reads, and copy the matching rows into their own buffer as
+// [page:u32][slot:u16][shard:u16][length:u16][bytes\0]. Once every worker is done
+// the rows are visited in page order on the calling thread, so visitors
+// need not be thread-safe and the order matches a serial scan. Nothing else
+// touches the pool or the table while the workers run.
+typedef struct
+{
+    Table *t;
+    const RecordFilter *filter;
+    bool decode;
+    uint32_t first_page; // data pages first..end-1 over all shards, from 0
+    uint32_t end_page;
+    size_t memory_cap; // a worker that needs more gives up
+    char *rows;
+    size_t used;
+    size_t capacity;
+    uint64_t bytes_read;
+    uint64_t rows_scanned;
+    bool failed;
+} ScanWorker;
+
+bool scan_worker_add(ScanWorker *w, RecordId rid, const char *record)
+{
+    uint16_t length = (uint16_t)strlen(record);
+    size_t need = 10 + (size_t)length + 1;
+    if (w->used + need > w->memory_cap)
+        return false;
+
+    if (w->used + need > w->capacity)
+    {
+        size_t capacity = w->capacity ? w->capacity * 2 : 64 * 1024;
+        while (capacity < w->used + need)
+            capacity *= 2;
+        char *rows = realloc(w->rows, capacity);
+        if (!rows)
+            return false;
+        w->rows = rows;
+        w->capacity = capacity;
+    }
+
+    char *p = w->rows + w->used;
+    memcpy(p, &rid.page_no, 4);
+    memcpy(p + 4, &rid.slot, 2);
+    memcpy(p + 6, &rid.shard, 2);
+    memcpy(p + 8, &length, 2);
+    memcpy(p + 10, record, (size_t)length + 1);
+    w->used += need;
+    return true;
+}
+
+void *scan_worker_main(void *arg)
+{
+    ScanWorker *w = arg;
+    Table *t = w->t;
+    bool overlay = t->mem.count > 0 || t->segs.count > 0;
+    unsigned char buffer[PAGE_SIZE];
+    char stored[PAGE_SIZE];
+    char record[PAGE_SIZE];
+
+    uint32_t base = 0; // data pages in the shards before this one
+    for (int shard = 0; shard < t->shard_count && base < w->end_page && !w->failed; shard++)
+    {
+        int file_id = t->shard_files[shard];
+        uint32_t pages = table_shard_pages(t, shard);
+        uint32_t first = w->first_page > base ? w->first_page - base : 0;
+        uint32_t end = w->end_page - base < pages ? w->end_page - base : pages;
+        base += pages;
+
+        for (uint32_t page_no = first + 1; page_no <= end && !w->failed; page_no++)
+        {
+            const unsigned char *page = buffer;
+            int frame = pool_lookup(file_id, page_no);
+            if (frame >= 0)
+                page = pool_frame_data(frame);
+            else if (!paged_pread_page(file_id, page_no, buffer, &w->bytes_read))
+                w->failed = true;
+
+            uint16_t count = w->failed ? 0 : page_slot_count(page);
+            for (uint16_t s = 0; s < count && !w->failed; s++)
+            {
+                uint16_t offset = page_slot_offset(page, s);
+                if (offset == 0)
+                    continue;
+
+                uint16_t length = page_slot_length(page, s);
+                memcpy(stored, page + offset, length);
+                stored[length] = '\0';
+                w->rows_scanned++;
+
+                bool from_overlay;
+                const char *out = scan_row(t, w->filter, w->decode, overlay, stored, record, &from_overlay);
+                RecordId rid = {0, 0, 0};
+                if (!from_overlay)
+                    rid = (RecordId){page_no, s, (uint16_t)shard};
+                if (out && !scan_worker_add(w, rid, out))
+                    w->failed = true;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Scan with `degree` worker threads. False when the scan could not run in
+// parallel (a worker ran out of memory or failed to read) and nothing was
+// visited, so the caller can fall back to a serial scan.
+bool table_scan_parallel(Table *t, const RecordFilter *filter, bool decode, int degree, record_visitor visit,
+                         void *ctx)
+{
+    uint32_t pages = table_data_pages(t);
+    if (degree > MAX_PARALLEL_WORKERS)
+        degree = MAX_PARALLEL_WORKERS;
+    if ((uint32_t)degree > pages)
+        degree = (int)pages;
+    if (degree < 2 || !table_load_segments(t))
+        return false;
+    for (int shard = 0; shard < t->shard_count; shard++)
+    {
+        if (fflush(paged_files[t->shard_files[shard]].fp) != 0)
+            return false;
+    }
+
+    ScanWorker workers[MAX_PARALLEL_WORKERS];
+    pthread_t threads[MAX_PARALLEL_WORKERS];
+    bool started[MAX_PARALLEL_WORKERS];
+    memset(workers, 0, sizeof(workers));
+
+    for (int i = 0; i < degree; i++)
+    {
+        ScanWorker *w = &workers[i];
+        w->t = t;
+        w->filter = filter;
+        w->decode = decode;
+        w->first_page = (uint32_t)((uint64_t)pages * (uint64_t)i / (uint64_t)degree);
+        w->end_page = (uint32_t)((uint64_t)pages * (uint64_t)(i + 1) / (uint64_t)degree);
+        w->memory_cap = work_memory_budget() / (size_t)degree;
+        started[i] = pthread_create(&threads[i], NULL, scan_worker_main, w) == 0;
+    }
+
+    bool complete = true;
+    size_t buffered = 0;
+    for (int i = 0; i < degree; i++)
+    {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            scan_worker_main(&workers[i]);
+        metrics.bytes_read += workers[i].bytes_read;
+        metrics.rows_scanned += workers[i].rows_scanned;
+        complete = complete && !workers[i].failed;
+        buffered += workers[i].capacity;
+    }
+    query_memory += buffered;
+    memory_query_grew();
+
+    bool more = complete;
+    for (int i = 0; i < degree && more; i++)
+    {
+        for (size_t pos = 0; pos < workers[i].used && more; )
+        {
+            const char *p = workers[i].rows + pos;
+            RecordId rid;
+            uint16_t length;
+            memcpy(&rid.page_no, p, 4);
+            memcpy(&rid.slot, p + 4, 2);
+            memcpy(&rid.shard, p + 6, 2);
+            memcpy(&length, p + 8, 2);
+            more = visit(p + 10, rid, ctx);
+            pos += 10 + (size_t)length + 1;
+        }
+    }
+
+    for (int i = 0; i < degree; i++)
+        free(workers[i].rows);
+    query_memory -= buffered;
+
+    if (!complete)
+        return false;
+    if (more && (t->mem.count > 0 || t->segs.count > 0))
+        table_scan_tail(t, filter, 0, UINT32_MAX, visit, ctx);
+    return true;
+}
+#endif
+
+// Defined with the planner: worker threads it picks for a filtered scan
+int scan_parallel_degree(Table *t, const RecordFilter *filter);
+
+// table_scan_pages, timed as the scan phase, in parallel when the planner
+// finds that cheaper
+bool table_scan_timed(Table *t, const RecordFilter *filter, bool decode, record_visitor visit, void *ctx)
+{
+    MetricsPhase previous = metrics_enter(PHASE_SCAN);
+    uint64_t previous_seq = table_begin_snapshot(t);
+    bool ok = true;
+    bool done = false;
+#ifndef _WIN32
+    int degree = filter ? scan_parallel_degree(t, filter) : 1;
+    if (degree > 1)
+        done = table_scan_parallel(t, filter, decode, degree, visit, ctx);
+#endif
+    if (!done)
+        ok = table_scan_pages(t, filter, decode, visit, ctx);
+    table_end_snapshot(t, previous_seq);
+    metrics_leave(previous);
+    return ok;
+}
+
+bool table_scan_where(Table *t, const RecordFilter *filter, record_visitor visit, void *ctx)
+{
+    return table_scan_timed(t, filter, true, visit, ctx);
+}
+
+// Visit every live record in page order
+bool table_scan(Table *t, record_visitor visit, void *ctx)
+{
+    return table_scan_timed(t, NULL, true, visit, ctx);
+}
+
+// Visit records in their stored form, dictionary codes left in place
+bool table_scan_stored(Table *t, record_visitor visit, void *ctx)
+{
+    return table_scan_timed(t, NULL, false, visit, ctx);
+}
+
+// Defined with full-text indexes: build the indexes of `set` again from the
+// pages of `t` and attach them
+bool fulltext_reindex(Table *t, FulltextSet *set);
+
+// Copy every live record of `t` into a fresh file with the given flags and
+// dictionary (NULL keeps the current one). This drops dead space left by
+// deletes and relocated updates, and folds in the memtable and segments.
+// The old handle is closed; the rebuilt table is returned, with its
+// full-text indexes built again for the new row locations.
+bool rebuild_visitor(const char *record, RecordId rid, void *ctx)
+{
+    (void)rid;
+    Table *dst = ctx;
+    dst->header.row_count++;
+    return table_append_record(dst, record, NULL);
+}
+
+Table *table_rebuild(Table *t, uint32_t flags, Dictionary *dict)
+{
+    char db_name[50], table_name[100], tmp_name[110];
+    strcpy(db_name, t->db);
+    strcpy(table_name, t->name);
+    snprintf(tmp_name, sizeof(tmp_name), "%s.new", table_name);
+
+    if (t->readers > 0)
+    {
+        print_error("Error: Table '%s' is being scanned; try again when the scan ends.\n", t->name);
+        dict_free(dict);
+        return NULL;
+    }
+
+    Table *dst = table_create(db_name, tmp_name, flags, t->shard_count);
+    if (!dst)
+    {
+        dict_free(dict);
+        return NULL;
+    }
+
+    // The old dictionary keeps decoding the source while the copy encodes
+    dst->dict = dict ? dict : t->dict;
+    if (dst->dict)
+        dst->dict->dirty = true;
+
+    if (!table_scan(t, rebuild_visitor, dst))
+    {
+        if (!dict)
+            dst->dict = NULL;
+        table_close(dst, false);
+        remove_table_files(db_name, tmp_name);
+        return NULL;
+    }
+
+    dst->header.next_id = t->header.next_id;
+    dst->header.dict_check_rows = t->header.dict_check_rows;
+    dst->header.default_ttl = t->header.default_ttl;
+    dst->header.feed_seq = t->header.feed_seq;
+    dst->header_dirty = true;
+    if (!dict)
+        t->dict = NULL;
+    table_close(dst, true);
+
+    // The rows are the same, so the statistics carry over
+    TableStats *stats = t->stats;
+    FulltextSet *fulltext = t->fulltext;
+    t->stats = NULL;
+    t->fulltext = NULL;
+    table_close(t, false);
+
+    // The change feed describes the same rows, so it moves with them
+    char path[300], new_path[300];
+    const char *feed_exts[] = {FEED_EXT, FEED_INDEX_EXT};
+    for (int i = 0; i < 2; i++)
+    {
+        build_table_path(path, sizeof(path), db_name, table_name, feed_exts[i]);
+        build_table_path(new_path, sizeof(new_path), db_name, tmp_name, feed_exts[i]);
+        if (file_exists(path))
+            rename(path, new_path);
+    }
+    remove_table_files(db_name, table_name);
+    for (size_t i = 0; i <= TABLE_SIDECAR_COUNT; i++)
+    {
+        const char *ext = i < TABLE_SIDECAR_COUNT ? table_sidecar_exts[i] : TABLE_EXT;
+        build_table_path(path, sizeof(path), db_name, table_name, ext);
+        build_table_path(new_path, sizeof(new_path), db_name, tmp_name, ext);
+        if (file_exists(new_path) && rename(new_path, path) != 0)
+        {
+            print_error("Error: Failed to replace '%s'.\n", path);
+            stats_free(stats);
+            fulltext_free(fulltext);
+            return NULL;
+        }
+    }
+    for (int shard = 1; shard < MAX_SHARDS; shard++)
+    {
+        table_shard_path(db_name, table_name, shard, path, sizeof(path));
+        table_shard_path(db_name, tmp_name, shard, new_path, sizeof(new_path));
+        if (!file_exists(new_path))
+            break;
+        if (rename(new_path, path) != 0)
+        {
+            print_error("Error: Failed to replace '%s'.\n", path);
+            stats_free(stats);
+            fulltext_free(fulltext);
+            return NULL;
+        }
+    }
+
+    Table *rebuilt = table_open(db_name, table_name);
+    if (rebuilt && stats)
+    {
+        build_table_path(path, sizeof(path), db_name, table_name, STATS_EXT);
+        stats_save(stats, path);
+        rebuilt->stats = stats;
+    }
+    else
+    {
+        stats_free(stats);
+    }
+
+    if (rebuilt && fulltext)
+        fulltext_reindex(rebuilt, fulltext);
+    else
+        fulltext_free(fulltext);
+    return rebuilt;
+}
+
+typedef struct
+{
+    char field[100];
+    uint32_t rows;
+    size_t bytes;
+    bool overflow; // more distinct values than a dictionary can hold
+    ValueSet values;
+} FieldProfile;
+
+typedef struct
+{
+    int count;
+    FieldProfile fields[PROFILE_MAX_FIELDS];
+} TableProfile;
+
+bool profile_visitor(const char *record, RecordId rid, void *ctx)
+{
+    (void)rid;
+    TableProfile *profile = ctx;
+    const char *cursor = record;
+    RecordField f;
+
+    while (record_next_field(&cursor, &f))
+    {
+        if (field_key_is(&f, "id") || field_key_is(&f, TTL_FIELD) || f.key_len == 0 ||
+            f.key_len >= sizeof(profile->fields[0].field))
+            continue;
+
+        FieldProfile *fp = NULL;
+        for (int i = 0; i < profile->count && !fp; i++)
+        {
+            if (strlen(profile->fields[i].field) == f.key_len && strncmp(profile->fields[i].field, f.key, f.key_len) == 0)
+                fp = &profile->fields[i];
+        }
+
+        if (!fp)
+        {
+            if (profile->count == PROFILE_MAX_FIELDS)
+                continue;
+            fp = &profile->fields[profile->count++];
+            memcpy(fp->field, f.key, f.key_len);
+            fp->field[f.key_len] = '\0';
+        }
+
+        fp->rows++;
+        fp->bytes += f.value_len;
+        if (!fp->overflow && value_set_find(&fp->values, f.value, f.value_len) < 0 &&
+            value_set_add(&fp->values, f.value, f.value_len) < 0)
+        {
+            fp->overflow = true;
+            value_set_clear(&fp->values);
+        }
+    }
+    return true;
+}
+
+// Look for low-cardinality string fields and, if new ones turn up, rebuild
+// the table with them dictionary encoded. Runs again each time the table
+// doubles in size, so the cost stays proportional to the inserts.
+Table *table_auto_dictionary(Table *t)
+{
+    // A rebuild has to wait for running scans; the next insert checks again
+    if (t->readers > 0 || t->header.row_count < DICT_MIN_ROWS || t->header.row_count < t->header.dict_check_rows)
+        return t;
+
+    TableProfile *profile = calloc(1, sizeof(TableProfile));
+    if (!profile)
+        return t;
+
+    t->header.dict_check_rows = t->header.row_count * 2;
+    t->header_dirty = true;
+
+    Dictionary *dict = NULL;
+    if (table_scan(t, profile_visitor, profile))
+    {
+        for (int i = 0; i < profile->count; i++)
+        {
+            FieldProfile *fp = &profile->fields[i];
+            bool low_cardinality = !fp->overflow && fp->rows >= DICT_MIN_ROWS &&
+                                   (uint32_t)fp->values.count * DICT_MIN_REPEAT <= fp->rows &&
+                                   fp->bytes >= (size_t)fp->rows * DICT_MIN_VALUE_LEN;
+
+            if (!low_cardinality || dict_field(t->dict, fp->field, strlen(fp->field)))
+                continue;
+
+            // New dictionary field: start from the current one
+            if (!dict)
+            {
+                dict = calloc(1, sizeof(Dictionary));
+                if (!dict)
+                    break;
+                for (int d = 0; t->dict && d < t->dict->field_count; d++)
+                {
+                    DictField *src = &t->dict->fields[d];
+                    DictField *df = dict_add_field(dict, src->field);
+                    for (int v = 0; df && v < src->set.count; v++)
+                        value_set_add(&df->set, src->set.values[v], strlen(src->set.values[v]));
+                }
+            }
+
+            DictField *df = dict_add_field(dict, fp->field);
+            for (int v = 0; df && v < fp->values.count; v++)
+                value_set_add(&df->set, fp->values.values[v], strlen(fp->values.values[v]));
+        }
+    }
+
+    for (int i = 0; i < profile->count; i++)
+        value_set_clear(&profile->fields[i].values);
+    free(profile);
+
+    if (!dict)
+        return t;
+
+    char db_name[50], table_name[100];
+    strcpy(db_name, t->db);
+    strcpy(table_name, t->name);
+
+    Table *rebuilt = table_rebuild(t, t->header.flags, dict);
+    return rebuilt ? rebuilt : table_open(db_name, table_name);
+}
+
+// Bytes the table occupies on disk
+uint64_t table_disk_bytes(Table *t)
+{
+    uint64_t bytes = 0;
+    for (int shard = 0; shard < t->shard_count; shard++)
+    {
+        PagedFile *pf = &paged_files[t->shard_files[shard]];
+        bytes += pf->compressed ? pf->data_end : (uint64_t)pf->page_count * PAGE_SIZE;
+    }
+    return bytes;
+}
+
+// Remove a record from its page
+bool table_delete_record(Table *t, RecordId rid)
+{
+    unsigned char *page = pool_fetch_page(t->shard_files[rid.shard], rid.page_no, false);
+    if (!page)
+        return false;
+
+    page_delete(page, rid.slot);
+    pool_unpin(page, true);
+    return true;
+}
+
+// A row whose new version no longer fits in its page
+typedef struct
+{
+    RecordId rid;
+    const char *record;
+} PendingMove;
+
+// Overlay entries that replace or delete rows already in the pages, counted
+// per shard
+size_t table_overlay_overwrites(Table *t, size_t *per_shard)
+{
+    uint32_t heap_max_id = t->header.heap_max_id;
+    size_t count = memtable_position(&t->mem, heap_max_id + 1);
+
+    memset(per_shard, 0, MAX_SHARDS * sizeof(size_t));
+    for (size_t i = 0; i < count; i++)
+        per_shard[table_shard_of(t, t->mem.entries[i].id)]++;
+
+    for (size_t i = 0; i < t->segs.capacity; i++)
+    {
+        uint32_t id = t->segs.slots[i].id;
+        if (id != 0 && id <= heap_max_id && !memtable_find(&t->mem, id))
+        {
+            per_shard[table_shard_of(t, id)]++;
+            count++;
+        }
+    }
+    return count;
+}
+
+// Defined with full-text indexes: collect a row compaction wrote to the
+// pages, then merge the collected rows into the indexes
+bool fulltext_note_row(Table *t, RecordId rid, const char *record);
+bool fulltext_finish_compaction(Table *t);
+
+// Fold the segments and the memtable into the pages, then drop the segment
+// files. Rows are rewritten in place where they fit; rows inserted since the
+// last compaction are appended in id order. The page pass only visits shards
+// with overwritten rows and stops once all of them have been found, so
+// insert-only workloads skip it. Expired versions are dropped like deletes.
+bool table_compact(Table *t)
+{
+    if (t->readers > 0)
+    {
+        print_error("Error: Table '%s' is being scanned; try again when the scan ends.\n", t->name);
+        return false;
+    }
+    if (!table_load_segments(t))
+        return false;
+
+    char stored[PAGE_SIZE];
+    char encoded[PAGE_SIZE];
+    PendingMove *moves = NULL;
+    size_t move_count = 0, move_capacity = 0;
+    uint32_t expired = 0;
+    size_t overwrites[MAX_SHARDS];
+    table_overlay_overwrites(t, overwrites);
+    bool ok = true;
+
+    for (int shard = 0; ok && shard < t->shard_count; shard++)
+    {
+        int file_id = t->shard_files[shard];
+        uint32_t page_count = paged_files[file_id].page_count;
+        for (uint32_t page_no = 1; ok && overwrites[shard] > 0 && page_no < page_count; page_no++)
+        {
+            unsigned char *page = pool_fetch_page(file_id, page_no, false);
+            if (!page)
+            {
+                ok = false;
+                break;
+            }
+
+            bool dirty = false;
+            uint16_t count = page_slot_count(page);
+            for (uint16_t s = 0; ok && s < count; s++)
+            {
+                uint16_t offset = page_slot_offset(page, s);
+                if (offset == 0)
+                    continue;
+
+                uint16_t length = page_slot_length(page, s);
+                memcpy(stored, page + offset, length);
+                stored[length] = '\0';
+
+                const MemEntry *e = table_overlay_find(t, record_id(stored));
+                if (!e)
+                    continue;
+
+                dirty = true;
+                overwrites[shard]--;
+                if (!e->record || record_expired(t, e->record))
+                {
+                    expired += e->record != NULL;
+                    page_delete(page, s);
+                    continue;
+                }
+
+                const char *record = table_encode(t, e->record, encoded, sizeof(encoded));
+                if (page_update(page, s, record, strlen(record)))
+                {
+                    ok = fulltext_note_row(t, (RecordId){page_no, s, (uint16_t)shard}, e->record);
+                    continue;
+                }
+
+                if (move_count == move_capacity)
+                {
+                    move_capacity = move_capacity ? move_capacity * 2 : 16;
+                    PendingMove *grown = realloc(moves, move_capacity * sizeof(PendingMove));
+                    if (!grown)
+                    {
+                        ok = false;
+                        break;
+                    }
+                    moves = grown;
+                }
+                moves[move_count].rid = (RecordId){page_no, s, (uint16_t)shard};
+                moves[move_count].record = e->record;
+                move_count++;
+            }
+            pool_unpin(page, dirty);
+        }
+    }
+
+    for (size_t i = 0; ok && i < move_count; i++)
+    {
+        RecordId rid;
+        ok = table_delete_record(t, moves[i].rid) && table_append_record(t, moves[i].record, &rid) &&
+             fulltext_note_row(t, rid, moves[i].record);
+    }
+    free(moves);
+
+    size_t tail_count = 0;
+    MemEntry *tail = ok ? table_overlay_tail(t, &tail_count) : NULL;
+    if (!tail)
+        ok = false;
+    for (size_t i = 0; ok && i < tail_count; i++)
+    {
+        RecordId rid;
+        if (tail[i].record && record_expired(t, tail[i].record))
+            expired++;
+        else if (tail[i].record)
+            ok = table_append_record(t, tail[i].record, &rid) && fulltext_note_row(t, rid, tail[i].record);
+    }
+    free(tail);
+
+    // Rows written before a failure are in the pages, so they are indexed too
+    ok = fulltext_finish_compaction(t) && ok;
+    if (!ok)
+    {
+        print_error("Error: Failed to compact table '%s'.\n", t->name);
+        return false;
+    }
+
+    // The pages now hold everything; only then are the segments dropped
+    uint32_t first = t->header.seg_base, last = t->header.seg_next;
+    memtable_clear(&t->mem);
+    segment_view_clear(&t->segs);
+    t->segs.loaded = true;
+    t->header.seg_base = last;
+    t->header.row_count -= expired;
+    t->header_dirty = true;
+    if (!table_sync(t))
+        return false;
+    wal_remove(t);
+
+    char path[300];
+    for (uint32_t seg = first; seg < last; seg++)
+    {
+        table_segment_path(t, seg, path, sizeof(path));
+        remove(path);
+    }
+    return true;
+}
+
+// Flush every open table; used by `flush` and at logout
+bool storage_flush_all()
+{
+    MetricsPhase previous = metrics_enter(PHASE_WRITE);
+    bool ok = true;
+    for (int i = 0; i < MAX_OPEN_TABLES; i++)
+    {
+        if (open_tables[i].in_use)
+            ok = table_flush(&open_tables[i]) && ok;
+    }
+    ok = pool_flush_all() && ok;
+    metrics_leave(previous);
+    return ok;
+}
+
+// Flush and close everything before the process exits
+void storage_shutdown()
+{
+    for (int i = 0; i < MAX_OPEN_TABLES; i++)
+        table_close(&open_tables[i], true);
+}
+
+// ---------------------------------------------------------------------------
+// Query plans: explain [analyze] <command>
+// explain runs the command's own parsing and table lookup, prints the
+// access path the command would take with its row estimate, and stops
+// before reading rows. explain analyze prints the same plan, then runs the
+// command without printing its rows and reports the actual rows, time per
+// phase and I/O from the instrumentation counters.
+// ---------------------------------------------------------------------------
+
+#define DEFAULT_SELECTIVITY 10 // a filter on a field without statistics keeps 1 row in 10
+
+typedef enum
+{
+    EXPLAIN_OFF,
+    EXPLAIN_PLAN,
+    EXPLAIN_ANALYZE
+} ExplainMode;
+
+ExplainMode explain_mode = EXPLAIN_OFF;
+
+// Print one plan node, indented by its depth
+void explain_line(int depth, const char *format, ...)
+{
+    va_list args;
+    printf("  %*s", depth * 2, "");
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("\n");
+}
+
+uint64_t estimate_rows(Table *t, const RecordFilter *filter);
+
+// Rows expected to pass "field in (...)": one per listed id, otherwise the
+// sum of the estimates for each value
+uint64_t estimate_in_rows(Table *t, const RecordFilter *filter, uint64_t rows)
+{
+    uint64_t total = 0;
+    if (strcmp(filter->field, "id") == 0)
+        total = filter->in->count;
+    else
+    {
+        for (size_t i = 0; i < filter->in->count && total < rows; i++)
+        {
+            RecordFilter one;
+            filter_init(&one, t->dict, filter->field, filter->in->values[i]);
+            total += estimate_rows(t, &one);
+        }
+    }
+    return total < rows ? total : rows;
+}
+
+// Rows expected to pass `filter` (NULL passes all)
+uint64_t estimate_rows(Table *t, const RecordFilter *filter)
+{
+    uint64_t rows = t->header.row_count;
+    if (!filter || rows == 0)
+        return rows;
+
+    if (filter->in)
+        return estimate_in_rows(t, filter, rows);
+
+    uint32_t min_id, max_id;
+    filter_id_range(filter, &min_id, &max_id);
+    if (min_id == max_id)
+        return 1;
+
+    // Statistics from analyze, scaled to the rows written since
+    double selectivity = filter->like ? -1 : stats_selectivity(t->stats, filter->field, filter->value);
+    if (selectivity >= 0)
+        return (uint64_t)(selectivity * (double)rows + 0.5);
+
+    // A dictionary field knows its distinct values; assume they are equally common
+    DictField *df = dict_field(t->dict, filter->field, strlen(filter->field));
+    if (filter->like && df && df->set.count > 0)
+    {
+        int matching = 0;
+        for (int code = 0; code < df->set.count; code++)
+            matching += (filter->codes[code / 8] >> (code % 8)) & 1;
+        return rows * (uint64_t)matching / (uint64_t)df->set.count;
+    }
+    uint64_t distinct = df && df->set.count > 0 ? (uint64_t)df->set.count : DEFAULT_SELECTIVITY;
+    return rows / distinct > 0 ? rows / distinct : 1;
+}
+
+// Average bytes a row takes on disk, for memory estimates
+uint64_t table_row_bytes(Table *t)
+{
+    return t->header.row_count ? table_disk_bytes(t) / t->header.row_count : 0;
+}
+
+// ---------------------------------------------------------------------------
+// Planner
+//
+// Chooses how get, update and delete (and the scans of order by, joins and
+// count) read a table: a point lookup when the id's newest version is in
+// the memtable or a segment, otherwise a scan of the pages that skips
+// compressed blocks outside an id filter and stops at the id, or a parallel
+// scan that splits the pages between worker threads. Costs are in units of
+// one page read; the parallel scan is picked only when it is cheaper and
+// its matching rows, which it buffers, fit in work memory.
+// ---------------------------------------------------------------------------
+
+#define SCAN_PAGE_COST 1.0
+#define SCAN_ROW_COST 0.01
+#define PARALLEL_SETUP_COST 50.0 // starting the worker threads
+#define PARALLEL_ROW_COST 0.02   // buffering a matching row for the calling thread
+#define AUTO_PARALLEL_WORKERS 8  // most workers `set parallel 0` picks
+
+typedef enum
+{
+    PATH_FULL_SCAN,
+    PATH_POINT_LOOKUP,
+    PATH_PARALLEL_SCAN
+} AccessPath;
+
+typedef struct
+{
+    AccessPath path;
+    int degree;
+    uint64_t rows;     // estimated rows that pass the filter
+    uint32_t pages;    // data pages in the table file
+    uint32_t skipped;  // compressed blocks an id filter skips
+    uint32_t cached;   // blocks out of the id range that are scanned anyway because they are cached
+    double cost;
+    double serial_cost; // the same scan on one thread
+} ScanPlan;
+
+int parallel_workers = 0; // 0 = one per CPU, up to AUTO_PARALLEL_WORKERS
+
+// Worker threads available to a parallel scan
+int parallel_degree_limit()
+{
+#ifdef _WIN32
+    return 1;
+#else
+    if (parallel_workers > 0)
+        return parallel_workers;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        return 1;
+    return cpus > AUTO_PARALLEL_WORKERS ? AUTO_PARALLEL_WORKERS : (int)cpus;
+#endif
+}
+
+ScanPlan plan_scan(Table *t, const RecordFilter *filter)
+{
+    ScanPlan plan = {PATH_FULL_SCAN, 1, estimate_rows(t, filter), 0, 0, 0, 0, 0};
+    plan.pages = table_data_pages(t);
+
+    uint32_t min_id = 0, max_id = UINT32_MAX;
+    filter_id_range(filter, &min_id, &max_id);
+    bool single_id = min_id == max_id && !filter->in;
+    bool overlay_loaded = table_load_segments(t);
+
+    if (single_id && overlay_loaded && table_overlay_find(t, min_id))
+    {
+        plan.path = PATH_POINT_LOOKUP;
+        plan.cost = plan.serial_cost = SCAN_ROW_COST;
+        return plan;
+    }
+
+    double rows = (double)t->header.row_count + (double)t->mem.count + (double)t->segs.count;
+    plan.cost = (double)plan.pages * SCAN_PAGE_COST + rows * SCAN_ROW_COST;
+
+    const FilterSet *ids = filter_id_set(filter);
+    if (ids)
+    {
+        // Only the shards and blocks that can hold a listed id are read
+        int shards = 0;
+        plan.pages = 0;
+        for (int shard = 0; shard < t->shard_count; shard++)
+        {
+            if (!shard_has_ids(t, ids, shard))
+                continue;
+            int file_id = t->shard_files[shard];
+            uint32_t pages = table_shard_pages(t, shard);
+            for (uint32_t page_no = 1; page_no <= pages; page_no++)
+            {
+                if (!paged_block_excludes_ids(file_id, page_no, ids->ids, ids->count))
+                    continue;
+                if (pool_lookup(file_id, page_no) < 0)
+                    plan.skipped++;
+                else
+                    plan.cached++;
+            }
+            plan.pages += pages;
+            shards++;
+        }
+
+        rows = rows * shards / t->shard_count;
+        plan.cost = (double)(plan.pages - plan.skipped) * SCAN_PAGE_COST + rows * SCAN_ROW_COST;
+        plan.serial_cost = plan.cost;
+        return plan;
+    }
+
+    if (single_id)
+    {
+        // Only the id's shard is read; cached pages are scanned even when
+        // their block is out of range
+        int shard = table_shard_of(t, min_id);
+        int file_id = t->shard_files[shard];
+        plan.pages = table_shard_pages(t, shard);
+        if (t->shard_count > 1)
+            rows /= t->shard_count;
+        for (uint32_t page_no = 1; page_no <= plan.pages; page_no++)
+        {
+            if (!paged_block_excludes(file_id, page_no, min_id, max_id))
+                continue;
+            if (pool_lookup(file_id, page_no) < 0)
+                plan.skipped++;
+            else
+                plan.cached++;
+        }
+
+        // The scan stops at the id, on average halfway through what is left
+        plan.cost = ((double)(plan.pages - plan.skipped) * SCAN_PAGE_COST + rows * SCAN_ROW_COST) / 2;
+        plan.serial_cost = plan.cost;
+        return plan;
+    }
+
+    plan.serial_cost = plan.cost;
+    int degree = parallel_degree_limit();
+    if (degree > MAX_PARALLEL_WORKERS)
+        degree = MAX_PARALLEL_WORKERS;
+    if ((uint32_t)degree > plan.pages)
+        degree = (int)plan.pages;
+    if (!filter || degree < 2)
+        return plan;
+
+    double parallel_cost = plan.cost / degree + PARALLEL_SETUP_COST + (double)plan.rows * PARALLEL_ROW_COST;
+    uint64_t buffered = plan.rows * (table_row_bytes(t) + 10);
+    if (parallel_cost < plan.cost && buffered <= work_memory_budget())
+    {
+        plan.path = PATH_PARALLEL_SCAN;
+        plan.degree = degree;
+        plan.cost = parallel_cost;
+    }
+    return plan;
+}
+
+int scan_parallel_degree(Table *t, const RecordFilter *filter)
+{
+    ScanPlan plan = plan_scan(t, filter);
+    return plan.path == PATH_PARALLEL_SCAN ? plan.degree : 1;
+}
+
+// The access path of a scan of `t` with an optional filter; returns its degree
+int explain_scan(Table *t, const RecordFilter *filter, int depth)
+{
+    ScanPlan plan = plan_scan(t, filter);
+
+    if (plan.path == PATH_POINT_LOOKUP)
+    {
+        explain_line(depth, "Point lookup on %s: the id is in the memtable or a segment, no pages read", t->name);
+        return 1;
+    }
+
+    if (plan.path == PATH_PARALLEL_SCAN)
+        explain_line(depth, "Parallel scan on %s: %d workers over %u page(s), cost %.1f (%.1f serial)", t->name,
+                     plan.degree, plan.pages, plan.cost, plan.serial_cost);
+    else
+    {
+        explain_line(depth, "Full scan on %s: %u row(s) in %u page(s), %u segment(s), %zu memtable entries, cost %.1f",
+                     t->name, t->header.row_count, plan.pages, t->header.seg_next - t->header.seg_base, t->mem.count,
+                     plan.cost);
+        if (scan_reads_ahead(t, filter))
+            explain_line(depth + 1, "Read-ahead: %d to %d pages per read, %d reads in flight, around the buffer pool",
+                         READAHEAD_FIRST, READAHEAD_PAGES, READAHEAD_DEPTH);
+    }
+
+    if (!filter)
+        return plan.degree;
+
+    if (filter->in)
+        explain_line(depth + 1, "Filter: %s in (%zu value(s))%s", filter->field, filter->in->count,
+                     filter->use_codes ? " (compared as dictionary codes)" : " (one hash probe per row)");
+    else if (filter->like)
+        explain_line(depth + 1, "Filter: %s like \"%s\"%s", filter->field, filter->value,
+                     filter->use_codes ? " (matched once per dictionary value, compared as codes)" : "");
+    else
+        explain_line(depth + 1, "Filter: %s=%s%s", filter->field, filter->value,
+                     filter->use_codes ? " (compared as dictionary codes)" : "");
+
+    uint32_t min_id, max_id;
+    filter_id_range(filter, &min_id, &max_id);
+    if (filter_id_set(filter))
+    {
+        if (t->shard_count > 1)
+            explain_line(depth + 1, "Shards: reads the shards of the listed ids, %u page(s)", plan.pages);
+        if (paged_files[t->file_id].compressed)
+            explain_line(depth + 1, "Block skipping: skips %u of %u block(s) by id (%u more are cached)", plan.skipped,
+                         plan.pages, plan.cached);
+        explain_line(depth + 1, "Stops once all %zu id(s) are found", filter->in->count);
+    }
+    else if (min_id == max_id && t->shard_count > 1)
+    {
+        explain_line(depth + 1, "Shards: reads shard %d of %d, %u page(s); stops at the id", table_shard_of(t, min_id),
+                     t->shard_count, plan.pages);
+    }
+    else if (min_id == max_id)
+    {
+        if (!paged_files[t->file_id].compressed)
+            explain_line(depth + 1, "Block skipping: none, the table is not compressed; stops at the id");
+        else
+            explain_line(depth + 1, "Block skipping: skips %u of %u block(s) by id range (%u more are cached)",
+                         plan.skipped, plan.pages, plan.cached);
+    }
+    else if (t->stats)
+    {
+        explain_line(depth + 1, "Statistics: analyzed at %u row(s)", t->stats->rows);
+    }
+    else
+    {
+        explain_line(depth + 1, "Statistics: none, run 'analyze %s' for better estimates", t->name);
+    }
+    return plan.degree;
+}
+
+// Print the estimate; true when the command should stop at its plan
+bool explain_finish(uint64_t estimated_rows, int degree)
+{
+    printf("Estimated rows: %llu\n", (unsigned long long)estimated_rows);
+    printf("Parallel degree: %d\n", degree);
+    return explain_mode == EXPLAIN_PLAN;
+}
+
+// explain analyze: what the command actually did
+void print_explain_actual()
+{
+    metrics_enter(PHASE_OTHER); // bring the phase times up to date
+
+    uint64_t total = 0;
+    for (int p = 0; p < PHASE_COUNT; p++)
+        total += metrics.phase_ns[p];
+
+    printf("Actual:\n");
+    printf("  rows: %llu returned, %llu scanned\n", (unsigned long long)metrics.rows_returned,
+           (unsigned long long)metrics.rows_scanned);
+    printf("  time: %.3f ms (", (double)total / 1e6);
+    for (int p = 1; p <= PHASE_COUNT; p++)
+        printf("%s %.3f%s", phase_names[p % PHASE_COUNT], (double)metrics.phase_ns[p % PHASE_COUNT] / 1e6,
+               p < PHASE_COUNT ? ", " : ")\n");
+    printf("  I/O: read %llu B, written %llu B, syncs %llu\n", (unsigned long long)metrics.bytes_read,
+           (unsigned long long)metrics.bytes_written, (unsigned long long)metrics.syncs);
+}
+
+// ---------------------------------------------------------------------------
+// Catalog
+// The databases and their tables, kept in memory so that checking a name on
+// every command costs no system call. It is read from db/.catalog at
+// startup (and rebuilt from the folders when that file is missing or
+// damaged), kept current by create, delete and drop, and written back after
+// each change. Database names cannot start with '.', so the file never
+// shares a path with a database folder. Both lists are sorted, so lookups
+// are a binary search and listings come out in name order. Folders changed
+// by hand are picked up by deleting db/.catalog.
+// ---------------------------------------------------------------------------
+
+#define CATALOG_FILE ".catalog"
+#define LEGACY_CATALOG_FILE "catalog" // used before, the folder of a database named catalog
+#define CATALOG_MAGIC "NANOCAT1"
+
+typedef struct
+{
+    char name[100];
+    char (*tables)[100]; // sorted
+    int table_count;
+    int table_capacity;
+} CatalogDb;
+
+typedef struct
+{
+    CatalogDb *dbs; // sorted by name
+    int db_count;
+    int db_capacity;
+} Catalog;
+
+Catalog catalog;
+
+// Defined with list_tables
+bool table_name_from_file(const char *file_name, char *table_name, size_t size);
+
+// Index of `name` in a sorted array of entries that start with their name,
+// or the index it would be inserted at when it is missing
+int catalog_search(const void *entries, size_t stride, int count, const char *name, bool *found)
+{
+    int low = 0, high = count;
+    *found = false;
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+        int cmp = strcmp((const char *)entries + (size_t)mid * stride, name);
+        if (cmp == 0)
+        {
+            *found = true;
+            return mid;
+        }
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+// Open a gap at `at` in a growable array; false when out of memory
+bool catalog_make_gap(void **entries, size_t stride, int *count, int *capacity, int at)
+{
+    if (*count == *capacity)
+    {
+        int grown = *capacity ? *capacity * 2 : 8;
+        void *bigger = realloc(*entries, (size_t)grown * stride);
+        if (!bigger)
+            return false;
+        *entries = bigger;
+        *capacity = grown;
+    }
+
+    char *base = *entries;
+    memmove(base + (size_t)(at + 1) * stride, base + (size_t)at * stride, (size_t)(*count - at) * stride);
+    (*count)++;
+    return true;
+}
+
+CatalogDb *catalog_find_db(const char *name)
+{
+    bool found;
+    int at = catalog_search(catalog.dbs, sizeof(CatalogDb), catalog.db_count, name, &found);
+    return found ? &catalog.dbs[at] : NULL;
+}
+
+bool catalog_has_table(const char *db_name, const char *table_name)
+{
+    CatalogDb *d = catalog_find_db(db_name);
+    bool found = false;
+    if (d)
+        catalog_search(d->tables, sizeof(d->tables[0]), d->table_count, table_name, &found);
+    return found;
+}
+
+CatalogDb *catalog_insert_db(const char *name)
+{
+    bool found;
+    int at = catalog_search(catalog.dbs, sizeof(CatalogDb), catalog.db_count, name, &found);
+    if (found)
+        return &catalog.dbs[at];
+    if (strlen(name) >= sizeof(catalog.dbs[0].name) ||
+        !catalog_make_gap((void **)&catalog.dbs, sizeof(CatalogDb), &catalog.db_count, &catalog.db_capacity, at))
+        return NULL;
+
+    CatalogDb *d = &catalog.dbs[at];
+    memset(d, 0, sizeof(*d));
+    strcpy(d->name, name);
+    return d;
+}
+
+bool catalog_insert_table(CatalogDb *d, const char *table_name)
+{
+    bool found;
+    int at = catalog_search(d->tables, sizeof(d->tables[0]), d->table_count, table_name, &found);
+    if (found)
+        return true;
+    if (strlen(table_name) >= sizeof(d->tables[0]) ||
+        !catalog_make_gap((void **)&d->tables, sizeof(d->tables[0]), &d->table_count, &d->table_capacity, at))
+        return false;
+
+    strcpy(d->tables[at], table_name);
+    return true;
+}
+
+// Remove entry `at` from a sorted array
+void catalog_close_gap(void *entries, size_t stride, int *count, int at)
+{
+    char *base = entries;
+    memmove(base + (size_t)at * stride, base + (size_t)(at + 1) * stride, (size_t)(*count - at - 1) * stride);
+    (*count)--;
+}
+
+// Read the table names of a database from its folder
+void catalog_scan_tables(CatalogDb *d)
+{
+    char table_name[100];
+    d->table_count = 0;
+
+#ifndef _WIN32
+    char path[300];
+    snprintf(path, sizeof(path), "db/%s", d->name);
+    DIR *dir = opendir(path);
+    if (!dir)
+        return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (table_name_from_file(entry->d_name, table_name, sizeof(table_name)))
+            catalog_insert_table(d, table_name);
+    }
+    closedir(dir);
+#else
+    struct _finddata_t data;
+    char search_path[300];
+    snprintf(search_path, sizeof(search_path), "db\\%s\\*.*", d->name);
+
+    intptr_t handle = _findfirst(search_path, &data);
+    if (handle == -1)
+        return;
+    do
+    {
+        if (table_name_from_file(data.name, table_name, sizeof(table_name)))
+            catalog_insert_table(d, table_name);
+    } while (_findnext(handle, &data) == 0);
+    _findclose(handle);
+#endif
+}
+
+void catalog_clear()
+{
+    for (int i = 0; i < catalog.db_count; i++)
+        free(catalog.dbs[i].tables);
+    free(catalog.dbs);
+    memset(&catalog, 0, sizeof(catalog));
+}
+
+// Rebuild the catalog from the database folders under db/
+void catalog_rebuild()
+{
+    catalog_clear();
+
+#ifndef _WIN32
+    DIR *dir = opendir(DB_DIR);
+    if (!dir)
+        return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        // ., .. and the catalog itself; no database name starts with '.'
+        if (entry->d_name[0] == '.')
+            continue;
+
+        char path[512];
+        snprintf(path, sizeof(path), "db/%s", entry->d_name);
+        struct stat statbuf;
+        CatalogDb *d;
+        if (stat(path, &statbuf) == 0 && S_ISDIR(statbuf.st_mode) && (d = catalog_insert_db(entry->d_name)))
+            catalog_scan_tables(d);
+    }
+    closedir(dir);
+#else
+    struct _finddata_t data;
+    intptr_t handle = _findfirst("db\\*", &data);
+    if (handle == -1)
+        return;
+    do
+    {
+        CatalogDb *d;
+        if ((data.attrib & _A_SUBDIR) && data.name[0] != '.' && (d = catalog_insert_db(data.name)))
+            catalog_scan_tables(d);
+    } while (_findnext(handle, &data) == 0);
+    _findclose(handle);
+#endif
+}
+
+void catalog_path(char *out, size_t size, const char *ext)
+{
+#ifdef _WIN32
+    snprintf(out, size, "%s\\%s%s", DB_DIR, CATALOG_FILE, ext);
+#else
+    snprintf(out, size, "%s/%s%s", DB_DIR, CATALOG_FILE, ext);
+#endif
+}
+
+// Write the catalog to a new file and swap it in, so a crash leaves the old one
+bool catalog_save()
+{
+    char path[300], new_path[300];
+    catalog_path(path, sizeof(path), "");
+    catalog_path(new_path, sizeof(new_path), ".new");
+
+    FILE *file = fopen(new_path, "w");
+    if (!file)
+        return false;
+
+    fprintf(file, "%s\n", CATALOG_MAGIC);
+    for (int i = 0; i < catalog.db_count; i++)
+    {
+        const CatalogDb *d = &catalog.dbs[i];
+        fprintf(file, "db %s\n", d->name);
+        for (int t = 0; t < d->table_count; t++)
+            fprintf(file, "table %s\n", d->tables[t]);
+    }
+
+    if (fclose(file) != 0)
+        return false;
+#ifdef _WIN32
+    remove(path);
+#endif
+    return rename(new_path, path) == 0;
+}
+
+// Save after a change, reporting a failure
+void catalog_changed()
+{
+    if (!catalog_save())
+        print_error("Error: Failed to write the catalog '%s/%s'.\n", DB_DIR, CATALOG_FILE);
+}
+
+// Read db/.catalog; false if it is missing or damaged
+bool catalog_read()
+{
+    char path[300];
+    catalog_path(path, sizeof(path), "");
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return false;
+
+    char line[256], name[100];
+    bool valid = fgets(line, sizeof(line), file) && strncmp(line, CATALOG_MAGIC, strlen(CATALOG_MAGIC)) == 0;
+    CatalogDb *d = NULL;
+    while (valid && fgets(line, sizeof(line), file))
+    {
+        if (sscanf(line, "db %99s", name) == 1)
+            valid = (d = catalog_insert_db(name)) != NULL;
+        else if (sscanf(line, "table %99s", name) == 1)
+            valid = d && catalog_insert_table(d, name);
+        else
+            valid = false;
+    }
+
+    fclose(file);
+    return valid;
+}
+
+// Load the catalog at startup
+void catalog_load()
+{
+    if (catalog_read())
+        return;
+
+    // An older catalog at db/catalog (and its db/catalog.new) is dropped for
+    // the rebuild below. Only a file starting with the magic is; a folder
+    // there is a database.
+    const char *legacy_exts[] = {"", ".new"};
+    for (int i = 0; i < 2; i++)
+    {
+        char legacy_path[300];
+        snprintf(legacy_path, sizeof(legacy_path), "%s/%s%s", DB_DIR, LEGACY_CATALOG_FILE, legacy_exts[i]);
+        FILE *legacy = fopen(legacy_path, "r");
+        if (!legacy)
+            continue;
+
+        char line[64];
+        bool is_catalog = fgets(line, sizeof(line), legacy) && strncmp(line, CATALOG_MAGIC, strlen(CATALOG_MAGIC)) == 0;
+        fclose(legacy);
+        if (is_catalog)
+            remove(legacy_path);
+    }
+
+    catalog_rebuild();
+    catalog_changed();
+}
+
+// The changes below are written to db/.catalog right away
+
+void catalog_add_db(const char *name)
+{
+    if (catalog_insert_db(name))
+        catalog_changed();
+}
+
+void catalog_remove_db(const char *name)
+{
+    CatalogDb *d = catalog_find_db(name);
+    if (!d)
+        return;
+
+    free(d->tables);
+    catalog_close_gap(catalog.dbs, sizeof(CatalogDb), &catalog.db_count, (int)(d - catalog.dbs));
+    catalog_changed();
+}
+
+void catalog_add_table(const char *db_name, const char *table_name)
+{
+    CatalogDb *d = catalog_find_db(db_name);
+    if (d && catalog_insert_table(d, table_name))
+        catalog_changed();
+}
+
+void catalog_remove_table(const char *db_name, const char *table_name)
+{
+    CatalogDb *d = catalog_find_db(db_name);
+    bool found = false;
+    int at = d ? catalog_search(d->tables, sizeof(d->tables[0]), d->table_count, table_name, &found) : 0;
+    if (!found)
+        return;
+
+    catalog_close_gap(d->tables, sizeof(d->tables[0]), &d->table_count, at);
+    catalog_changed();
+}
+
+// Re-read one database's tables, e.g. after a delete that stopped halfway
+void catalog_refresh_db(const char *name)
+{
+    CatalogDb *d = catalog_find_db(name);
+    if (!d)
+        return;
+
+    catalog_scan_tables(d);
+    catalog_changed();
+}
+
+// Create DB folder
+void create_db(const char *name)
+{
+    // Names starting with '.' are left to the catalog file
+    if (name == NULL || strlen(name) == 0 || name[0] == '.')
+    {
+        print_error("Invalid database name.\n");
+        return;
+    }
+
+    char path[300] = {0};
+#ifdef _WIN32
+    snprintf(path, sizeof(path), "db\\%s", name);
+#else
+    snprintf(path, sizeof(path), "db/%s", name);
+#endif
+
+    int result = make_dir(path);
+
+    if (result == 0)
+    {
+        catalog_add_db(name);
+        printf("Database '%s' created at %s\n", name, path);
+    }
+    else
+    {
+        print_error("Failed to create database. It may already exist.\n");
+    }
+}
+
+// List databases
+void list_dbs()
+{
+    if (catalog.db_count == 0)
+    {
+        printf("No databases found.\n");
+        return;
+    }
+
+    printf("Databases:\n");
+    for (int i = 0; i < catalog.db_count; i++)
+        printf(" - %s\n", catalog.dbs[i].name);
+}
+
+// void check DB exists -- to be implemented
+
+bool check_db_exists(const char *name)
+{
+    if (name == NULL || name[0] == '\0')
+    {
+        print_error("Invalid database name.\n");
+        return false;
+    }
+
+    return catalog_find_db(name) != NULL;
+}
+
+// create Table (paged file), optionally with compressed blocks or with its
+// rows spread over `shards` files
+void create_table(const char *name, const char *db_name, bool compressed, int shards, uint32_t ttl)
+{
+    // Check valid table name & db name
+    if (!name || name[0] == '\0' || !db_name || db_name[0] == '\0')
+    {
+        print_error("Invalid table or database name.\n");
+        return;
+    }
+
+    // Check if database folder exists
+    if (!check_db_exists(db_name))
+    {
+        print_error("Error: Database '%s' not found. Please create it first or use an existing database.\n", db_name);
+        return;
+    }
+
+    if (compressed && shards > 1)
+    {
+        print_error("Error: Sharded tables cannot be compressed.\n");
+        return;
+    }
+
+    // Create the table file
+    Table *t = table_create(db_name, name, compressed ? TABLE_FLAG_COMPRESSED : 0, shards);
+    if (!t)
+    {
+        print_error("Failed to create table file.\n");
+        return;
+    }
+
+    if (ttl > 0)
+    {
+        t->header.default_ttl = ttl;
+        t->header.flags |= TABLE_FLAG_TTL;
+        t->header_dirty = true;
+    }
+
+    catalog_add_table(db_name, name);
+    if (shards > 1)
+        printf("Table '%s' created successfully inside database '%s' with %d shards.\n", name, db_name, shards);
+    else
+        printf("Table '%s' created successfully inside database '%s'%s.\n",
+               name, db_name, compressed ? " with compression" : "");
+    if (ttl > 0)
+        printf("Rows inserted into '%s' expire after %u second(s) by default.\n", name, ttl);
+}
+
+// Check if table exists in a database
+bool check_table_exists(const char *db_name, const char *table_name)
+{
+    if (!db_name || db_name[0] == '\0' || !table_name || table_name[0] == '\0')
+        return false;
+
+    if (!check_db_exists(db_name))
+    {
+        print_error("Database '%s' does not exist.\n", db_name);
+        return false;
+    }
+
+    return catalog_has_table(db_name, table_name);
+}
+
+// Open a table for a command, printing the usual error when it is missing
+Table *open_table_or_report(const char *table_name, const char *db_name)
+{
+    MetricsPhase previous = metrics_enter(PHASE_LOOKUP);
+    Table *t = NULL;
+
+    if (!check_table_exists(db_name, table_name))
+        print_error("Error: Table '%s' does not exist in database '%s'.\n", table_name, db_name);
+    else if (!(t = table_open(db_name, table_name)))
+        print_error("Error: Failed to open table file.\n");
+
+    metrics_leave(previous);
+    return t;
+}
+
+// Parse a "field:value" clause. The value is the rest of the clause, so a
+// quoted one keeps its spaces (name:"John Smith"); false when either part
+// is empty or too long, or the value's quotes are not balanced.
+bool parse_field_value(const char *clause, char *field, char *value)
+{
+    while (is_blank(*clause))
+        clause++;
+    const char *colon = strchr(clause, ':');
+    if (!colon)
+        return false;
+
+    size_t field_len = (size_t)(colon - clause);
+    const char *rest = colon + 1;
+    size_t value_len = strlen(rest);
+    while (value_len > 0 && is_blank(rest[value_len - 1]))
+        value_len--;
+    if (field_len == 0 || field_len >= 100 || value_len == 0 || value_len >= 200)
+        return false;
+
+    bool quoted = false;
+    for (size_t i = 0; i < value_len; i++)
+    {
+        if (rest[i] == '"')
+            quoted = !quoted;
+    }
+    if (quoted)
+        return false;
+
+    memcpy(field, clause, field_len);
+    field[field_len] = '\0';
+    memcpy(value, rest, value_len);
+    value[value_len] = '\0';
+    return true;
+}
+
+// The where clause of get, update and delete: "field:value", or
+// "field in (v1, v2, ...)" with its values in a set. `label` is how
+// messages show it, "name=John" or "id in (3 values)".
+typedef struct
+{
+    const char *text; // the clause as given
+    char field[100];
+    char value[200];
+    bool in;
+    FilterSet set;
+    char label[300];
+} WhereClause;
+
+bool parse_where(const char *clause, WhereClause *where)
+{
+    memset(where, 0, sizeof(*where));
+    where->text = clause;
+
+    // The field of an in list is one word, so a quoted " in (" inside a
+    // field:value clause is not mistaken for one
+    const char *in = strstr(clause, " in (");
+    size_t field_len = in ? (size_t)(in - clause) : 0;
+    if (!in || field_len >= sizeof(where->field) || memchr(clause, ':', field_len) || memchr(clause, '"', field_len))
+    {
+        if (!parse_field_value(clause, where->field, where->value))
+            return false;
+        snprintf(where->label, sizeof(where->label), "%s=%s", where->field, where->value);
+        return true;
+    }
+
+    const char *list = in + 5;
+    size_t list_len = strlen(list);
+    while (list_len > 0 && is_blank(list[list_len - 1]))
+        list_len--;
+    if (field_len == 0 || list_len == 0 || list[list_len - 1] != ')')
+        return false;
+
+    char *values = malloc(list_len);
+    if (!values)
+        return false;
+    memcpy(values, list, list_len - 1);
+    values[list_len - 1] = '\0';
+    memcpy(where->field, clause, field_len);
+    where->in = filter_set_parse(&where->set, where->field, values);
+    free(values);
+    if (!where->in)
+        return false;
+
+    snprintf(where->label, sizeof(where->label), "%s in (%zu value%s)", where->field, where->set.count,
+             where->set.count == 1 ? "" : "s");
+    return true;
+}
+
+// The filter of a parsed where clause on table `t`
+void where_filter_init(RecordFilter *filter, Table *t, const WhereClause *where)
+{
+    if (where->in)
+        filter_init_in(filter, t->dict, where->field, &where->set);
+    else
+        filter_init(filter, t->dict, where->field, where->value);
+}
+
+void where_free(WhereClause *where)
+{
+    if (where->in)
+        filter_set_free(&where->set);
+    where->in = false;
+}
+
+typedef struct
+{
+    const char *set_field;
+    const char *set_value;
+    const char *attributes; // upsert: fields to set or add, instead of set_field
+    int updated_count;
+    Memtable changes; // new versions, applied once the scan is done
+} UpdateContext;
+
+bool update_visitor(const char *record, RecordId rid, void *arg)
+{
+    (void)rid;
+    UpdateContext *ctx = arg;
+    ctx->updated_count++;
+
+    // Field not found, keep the original record
+    char updated[PAGE_SIZE];
+    if (ctx->attributes ? !record_merge_fields(record, ctx->attributes, updated, sizeof(updated))
+                        : !record_set_field(record, ctx->set_field, ctx->set_value, updated, sizeof(updated)))
+        return true;
+
+    if (strlen(updated) > MAX_RECORD_SIZE)
+    {
+        print_error("Error: Updated record %u is too large, left unchanged.\n", record_id(record));
+        return true;
+    }
+
+    return memtable_put(&ctx->changes, record_id(record), updated);
+}
+
+// Move scanned changes into the table's memtable
+bool table_apply_changes(Table *t, const Memtable *changes)
+{
+    MetricsPhase previous = metrics_enter(PHASE_WRITE);
+    bool ok = true;
+    uint64_t seq = ++commit_seq; // all of the statement's rows commit together
+    for (size_t i = 0; ok && i < changes->count; i++)
+    {
+        const MemEntry *e = &changes->entries[i];
+        ok = table_mem_put(t, e->id, e->record, seq);
+        if (ok)
+            feed_record(t, e->record ? FEED_UPDATE : FEED_DELETE, e->id, e->record);
+    }
+    if (changes->count > 0)
+        t->version = ++table_version_clock;
+    ok = ok && table_check_memtable(t);
+    metrics_leave(previous);
+
+    if (ok)
+        metrics.rows_returned += changes->count;
+    return ok;
+}
+
+// Update specific records in a table based on where clause and set clause
+void update_record_in_table(const char *table_name, const char *db_name, const char *where_clause, const char *set_clause)
+{
+    Table *t = open_table_or_report(table_name, db_name);
+    if (!t)
+        return;
+
+    // Parse the where clause to extract field and value (or values)
+    WhereClause where;
+    if (!parse_where(where_clause, &where))
+    {
+        print_error("Error: Invalid where clause format. Use 'field:value' (e.g., id:1) or 'field in (v1, v2, ...)'\n");
+        return;
+    }
+
+    // Parse the set clause to extract field and value
+    char set_field[100], set_value[200];
+    if (!parse_field_value(set_clause, set_field, set_value))
+    {
+        print_error("Error: Invalid set clause format. Use 'field:value' (e.g., name:NewName)\n");
+        where_free(&where);
+        return;
+    }
+
+    RecordFilter filter;
+    where_filter_init(&filter, t, &where);
+
+    if (explain_mode != EXPLAIN_OFF)
+    {
+        explain_line(0, "Update %s set %s=%s: new versions go to the memtable (%zu of %zu KB used)", table_name,
+                     set_field, set_value, t->mem.bytes / 1024, memtable_limit / 1024);
+        int degree = explain_scan(t, &filter, 1);
+        if (explain_finish(estimate_rows(t, &filter), degree))
+        {
+            where_free(&where);
+            return;
+        }
+    }
+
+    UpdateContext ctx = {set_field, set_value, NULL, 0, {0}};
+    bool ok = table_scan_where(t, &filter, update_visitor, &ctx) && table_apply_changes(t, &ctx.changes);
+    memtable_clear(&ctx.changes);
+    where_free(&where);
+
+    if (!ok)
+    {
+        print_error("Error: Failed to update table '%s'.\n", table_name);
+        return;
+    }
+
+    if (ctx.updated_count > 0)
+    {
+        printf("Updated %d record(s) in table '%s' where %s, set %s=%s.\n",
+               ctx.updated_count, table_name, where.label, set_field, set_value);
+    }
+    else
+    {
         printf("No records found matching the where clause.\n");
     }
-}
+}
+
+bool delete_visitor(const char *record, RecordId rid, void *arg)
+{
+    (void)rid;
+    return memtable_put(arg, record_id(record), NULL);
+}
+
+// Delete specific records from a table based on query
+void delete_record_from_table(const char *table_name, const char *db_name, const char *query)
+{
+    Table *t = open_table_or_report(table_name, db_name);
+    if (!t)
+        return;
+
+    // Parse the query to extract field and value (or values)
+    WhereClause where;
+    if (!parse_where(query, &where))
+    {
+        print_error("Error: Invalid query format. Use 'field:value' (e.g., id:1 or name:Hello) or 'field in (v1, v2, ...)'\n");
+        return;
+    }
+
+    RecordFilter filter;
+    where_filter_init(&filter, t, &where);
+
+    if (explain_mode != EXPLAIN_OFF)
+    {
+        explain_line(0, "Delete from %s: tombstones go to the memtable (%zu of %zu KB used)", table_name,
+                     t->mem.bytes / 1024, memtable_limit / 1024);
+        int degree = explain_scan(t, &filter, 1);
+        if (explain_finish(estimate_rows(t, &filter), degree))
+        {
+            where_free(&where);
+            return;
+        }
+    }
+
+    Memtable deletes = {0};
+    bool ok = table_scan_where(t, &filter, delete_visitor, &deletes) && table_apply_changes(t, &deletes);
+    size_t deleted_count = deletes.count;
+    memtable_clear(&deletes);
+    where_free(&where);
+
+    if (!ok)
+    {
+        print_error("Error: Failed to delete from table '%s'.\n", table_name);
+        return;
+    }
+
+    if (deleted_count > 0)
+    {
+        t->header.row_count -= (uint32_t)deleted_count;
+        t->header_dirty = true;
+        printf("Deleted %zu record(s) from table '%s' where %s.\n", deleted_count, table_name, where.label);
+    }
+    else
+    {
+        printf("No records found matching the query.\n");
+    }
+}
+
+// Per-field state while analyze scans a table
+typedef struct
+{
+    char name[100];
+    uint32_t present;
+    int sketch_count;
+    uint32_t sketch[STATS_SKETCH]; // smallest value hashes, ascending
+    int sample_count;
+    char *sample[STATS_SAMPLE];
+} FieldSketch;
+
+typedef struct
+{
+    uint32_t rows;
+    int field_count;
+    FieldSketch fields[STATS_MAX_FIELDS];
+    uint64_t rng;
+} StatsBuilder;
+
+// hash_bytes with a final mix, so the low values the sketch keeps are spread evenly
+uint32_t stats_hash(const char *value, size_t len)
+{
+    uint32_t h = hash_bytes(value, len);
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+void sketch_add(FieldSketch *fs, uint32_t h)
+{
+    if (fs->sketch_count == STATS_SKETCH && h >= fs->sketch[STATS_SKETCH - 1])
+        return;
+
+    int lo = 0, hi = fs->sketch_count;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (fs->sketch[mid] < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < fs->sketch_count && fs->sketch[lo] == h)
+        return;
+
+    int keep = fs->sketch_count < STATS_SKETCH ? fs->sketch_count : STATS_SKETCH - 1;
+    memmove(&fs->sketch[lo + 1], &fs->sketch[lo], (size_t)(keep - lo) * sizeof(uint32_t));
+    fs->sketch[lo] = h;
+    if (fs->sketch_count < STATS_SKETCH)
+        fs->sketch_count++;
+}
+
+uint32_t sketch_distinct(const FieldSketch *fs)
+{
+    if (fs->sketch_count < STATS_SKETCH)
+        return (uint32_t)fs->sketch_count;
+    double estimate = (double)(STATS_SKETCH - 1) * 4294967296.0 / ((double)fs->sketch[STATS_SKETCH - 1] + 1.0);
+    return estimate < (double)fs->present ? (uint32_t)estimate : fs->present;
+}
+
+bool stats_visitor(const char *record, RecordId rid, void *ctx)
+{
+    (void)rid;
+    StatsBuilder *b = ctx;
+    const char *cursor = record;
+    RecordField f;
+    b->rows++;
+
+    while (record_next_field(&cursor, &f))
+    {
+        if (field_key_is(&f, "id") || f.key_len == 0 || f.key_len >= sizeof(b->fields[0].name))
+            continue;
+
+        FieldSketch *fs = NULL;
+        for (int i = 0; i < b->field_count && !fs; i++)
+        {
+            if (strlen(b->fields[i].name) == f.key_len && strncmp(b->fields[i].name, f.key, f.key_len) == 0)
+                fs = &b->fields[i];
+        }
+
+        if (!fs)
+        {
+            if (b->field_count == STATS_MAX_FIELDS)
+                continue;
+            fs = &b->fields[b->field_count++];
+            memcpy(fs->name, f.key, f.key_len);
+            fs->name[f.key_len] = '\0';
+        }
+
+        const char *value = f.value;
+        size_t len = f.value_len;
+        unquote_value(&value, &len);
+        if (len >= STATS_MAX_VALUE)
+            len = STATS_MAX_VALUE - 1;
+
+        fs->present++;
+        sketch_add(fs, stats_hash(value, len));
+
+        // Reservoir sample: every value seen so far is kept with equal chance
+        int slot = fs->sample_count;
+        if (fs->sample_count == STATS_SAMPLE)
+        {
+            b->rng = b->rng * 6364136223846793005ull + 1442695040888963407ull;
+            uint64_t pick = (b->rng >> 33) % fs->present;
+            if (pick >= STATS_SAMPLE)
+                continue;
+            slot = (int)pick;
+            free(fs->sample[slot]);
+        }
+        else
+        {
+            fs->sample_count++;
+        }
+
+        fs->sample[slot] = malloc(len + 1);
+        if (!fs->sample[slot])
+            return false;
+        memcpy(fs->sample[slot], value, len);
+        fs->sample[slot][len] = '\0';
+    }
+    return true;
+}
+
+int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Common values and histogram of one field from its sample
+void stats_finish_field(FieldStats *out, FieldSketch *fs, uint32_t rows)
+{
+    snprintf(out->name, sizeof(out->name), "%s", fs->name);
+    out->present = fs->present;
+    out->distinct = sketch_distinct(fs);
+    if (fs->sample_count == 0)
+        return;
+
+    // Values sampled at least twice, most frequent first
+    qsort(fs->sample, (size_t)fs->sample_count, sizeof(char *), compare_strings);
+    double scale = (double)fs->present / (double)rows / (double)fs->sample_count;
+    for (int start = 0, end; start < fs->sample_count; start = end)
+    {
+        for (end = start + 1; end < fs->sample_count && strcmp(fs->sample[end], fs->sample[start]) == 0; end++)
+            ;
+        double freq = (double)(end - start) * scale;
+        if (end - start < 2 || (out->mcv_count == STATS_MCV && freq <= out->mcv_freqs[STATS_MCV - 1]))
+            continue;
+
+        int m = out->mcv_count < STATS_MCV ? out->mcv_count++ : STATS_MCV - 1;
+        while (m > 0 && out->mcv_freqs[m - 1] < freq)
+        {
+            out->mcv_freqs[m] = out->mcv_freqs[m - 1];
+            memcpy(out->mcv_values[m], out->mcv_values[m - 1], STATS_MAX_VALUE);
+            m--;
+        }
+        out->mcv_freqs[m] = freq;
+        snprintf(out->mcv_values[m], STATS_MAX_VALUE, "%s", fs->sample[start]);
+    }
+
+    // Equi-depth histogram when every sampled value is a number
+    double *numbers = malloc((size_t)fs->sample_count * sizeof(double));
+    if (!numbers)
+        return;
+    int n = 0;
+    for (; n < fs->sample_count; n++)
+    {
+        char *end;
+        numbers[n] = strtod(fs->sample[n], &end);
+        if (end == fs->sample[n] || *end != '\0')
+            break;
+    }
+    if (n == fs->sample_count && n >= 2)
+    {
+        qsort(numbers, (size_t)n, sizeof(double), compare_doubles);
+        out->bucket_count = n > STATS_BUCKETS ? STATS_BUCKETS : n - 1;
+        for (int i = 0; i <= out->bucket_count; i++)
+            out->bounds[i] = numbers[(size_t)i * (size_t)(n - 1) / (size_t)out->bucket_count];
+    }
+    free(numbers);
+}
+
+// Turn the builder into statistics (NULL when out of memory) and free it
+TableStats *stats_build(StatsBuilder *b)
+{
+    TableStats *stats = calloc(1, sizeof(TableStats));
+    if (stats)
+    {
+        stats->rows = b->rows;
+        stats->field_count = b->field_count;
+        for (int i = 0; i < b->field_count; i++)
+            stats_finish_field(&stats->fields[i], &b->fields[i], b->rows);
+    }
+
+    for (int i = 0; i < b->field_count; i++)
+    {
+        for (int s = 0; s < b->fields[i].sample_count; s++)
+            free(b->fields[i].sample[s]);
+    }
+    free(b);
+    return stats;
+}
+
+// Collect statistics for the planner and print a summary per field
+void analyze_table(const char *table_name, const char *db_name)
+{
+    Table *t = open_table_or_report(table_name, db_name);
+    if (!t)
+        return;
+
+    StatsBuilder *builder = calloc(1, sizeof(StatsBuilder));
+    if (!builder)
+    {
+        print_error("Error: Out of memory.\n");
+        return;
+    }
+    builder->rng = 0x9e3779b97f4a7c15ull;
+
+    bool scanned = table_scan(t, stats_visitor, builder);
+    TableStats *stats = stats_build(builder);
+    char path[300];
+    build_table_path(path, sizeof(path), db_name, table_name, STATS_EXT);
+
+    if (!scanned || !stats || !stats_save(stats, path))
+    {
+        print_error("Error: Failed to analyze table '%s'.\n", table_name);
+        stats_free(stats);
+        return;
+    }
+    stats_free(t->stats);
+    t->stats = stats;
+
+    printf("Table '%s' analyzed: %u row(s), %d field(s).\n", table_name, stats->rows, stats->field_count);
+    for (int i = 0; i < stats->field_count; i++)
+    {
+        FieldStats *fs = &stats->fields[i];
+        double null_frac = stats->rows ? 1.0 - (double)fs->present / (double)stats->rows : 0.0;
+        printf("  %s: %u present, null_frac %.3f, ~%u distinct", fs->name, fs->present, null_frac, fs->distinct);
+
+        if (fs->bucket_count > 0)
+            printf(", range %g..%g", fs->bounds[0], fs->bounds[fs->bucket_count]);
+        for (int m = 0; m < fs->mcv_count && m < 3; m++)
+            printf("%s%s (%.1f%%)", m ? ", " : ", common: ", fs->mcv_values[m], fs->mcv_freqs[m] * 100.0);
+        printf("\n");
+    }
+}
+
+// Convert a table to compressed blocks (or recompress it to reclaim space)
+void compress_table(const char *table_name, const char *db_name)
+{
+    Table *t = open_table_or_report(table_name, db_name);
+    if (!t)
+        return;
+
+    if (t->shard_count > 1)
+    {
+        print_error("Error: Sharded tables cannot be compressed.\n");
+        return;
+    }
+
+    uint64_t before = table_disk_bytes(t);
+
+    MetricsPhase previous = metrics_enter(PHASE_WRITE);
+    t = table_rebuild(t, t->header.flags | TABLE_FLAG_COMPRESSED, NULL);
+    metrics_leave(previous);
+    if (!t)
+    {
+        print_error("Error: Failed to compress table '%s'.\n", table_name);
+        return;
+    }
+
+    uint64_t after = table_disk_bytes(t);
+    uint32_t pages = paged_files[t->file_id].page_count;
+
+    printf("Table '%s' compressed: %u page(s), %llu KB -> %llu KB (%.1fx).\n",
+           table_name, pages, (unsigned long long)(before / 1024), (unsigned long long)(after / 1024),
+           after > 0 ? (double)before / (double)after : 1.0);
+}
+
+// set ttl <table> <seconds>: the default for rows inserted from now on, 0
+// for none. Rows already in the table keep their expiry time.
+void set_table_ttl(const char *table_name, const char *db_name, uint32_t seconds)
+{
+    Table *t = open_table_or_report(table_name, db_name);
+    if (!t)
+        return;
+
+    t->header.default_ttl = seconds;
+    if (seconds > 0)
+        t->header.flags |= TABLE_FLAG_TTL;
+    t->header_dirty = true;
+
+    if (seconds > 0)
+        printf("Rows inserted into '%s' expire after %u second(s) by default.\n", table_name, seconds);
+    else
+        printf("Rows inserted into '%s' no longer expire by default.\n", table_name);
+}
+
+// expire <table>: reclaim the space of every expired row now, by compacting
+// the recent writes and running the expiry pass over all pages
+void expire_table(const char *table_name, const char *db_name)
+{
+    Table *t = open_table_or_report(table_name, db_name);
+    if (!t)
+        return;
+
+    uint32_t before = t->header.row_count;
+    MetricsPhase previous = metrics_enter(PHASE_WRITE);
+    bool ok = !(t->header.flags & TABLE_FLAG_TTL) || (table_compact(t) && table_expire(t, 0) >= 0);
+    metrics_leave(previous);
+    if (!ok)
+    {
+        print_error("Error: Failed to expire rows of table '%s'.\n", table_name);
+        return;
+    }
+
+    printf("Reclaimed %u expired record(s) from table '%s'.\n", before - t->header.row_count, table_name);
+}
+
+bool print_change(const FeedChange *change, void *arg)
+{
+    unsigned long *count = arg;
+    (*count)++;
+    if (change->record)
+        printf("#%llu %s %s\n", (unsigned long long)change->seq, feed_op_name(change->op), change->record);
+    else
+        printf("#%llu %s id:%u\n", (unsigned long long)change->seq, feed_op_name(change->op), change->id);
+    return true;
+}
+
+// watch <table> [from <seq>] [limit <n>]: print the changes from a sequence
+// number on, reading only the feed. The first watch of a table turns its
+// feed on.
+void watch_table(const char *table_name, const char *db_name, uint64_t from, uint64_t limit)
+{
+    Table *t = open_table_or_report(table_name, db_name);
+    if (!t)
+        return;
+
+    if (!(t->header.flags & TABLE_FLAG_FEED))
+    {
+        if (!table_enable_feed(t))
+        {
+            print_error("Error: Failed to start the change feed of '%s'.\n", table_name);
+            return;
+        }
+        printf("Change feed of '%s' started at sequence %llu.\n", table_name,
+               (unsigned long long)t->header.feed_seq);
+    }
+
+    unsigned long count = 0;
+    uint64_t next;
+    printf("Changes to '%s' from sequence %llu:\n", table_name, (unsigned long long)from);
+    printf("-----------------------------------\n");
+    bool ok = feed_read(t, from, limit, print_change, &count, &next);
+    printf("-----------------------------------\n");
+    if (!ok)
+    {
+        print_error("Error: Failed to read the change feed of '%s'.\n", table_name);
+        return;
+    }
+
+    if (t->feed->first_seq > from && t->feed->first_seq > 1)
+        printf("Note: The feed starts at sequence %llu; earlier changes were not recorded.\n",
+               (unsigned long long)t->feed->first_seq);
+    printf("Total changes: %lu. Continue with 'watch %s from %llu'.\n", count, table_name, (unsigned long long)next);
+    metrics.rows_returned += count;
+}
+
+// unwatch <table>: turn the change feed off and remove its files
+void unwatch_table(const char *table_name, const char *db_name)
+{
+    Table *t = open_table_or_report(table_name, db_name);
+    if (!t)
+        return;
+
+    if (!(t->header.flags & TABLE_FLAG_FEED))
+    {
+        printf("Table '%s' has no change feed.\n", table_name);
+        return;
+    }
+
+    t->header.flags &= ~TABLE_FLAG_FEED;
+    t->header_dirty = true;
+    feed_close(t->feed);
+    t->feed = NULL;
+
+    char path[300];
+    build_table_path(path, sizeof(path), db_name, table_name, FEED_EXT);
+    remove(path);
+    build_table_path(path, sizeof(path), db_name, table_name, FEED_INDEX_EXT);
+    remove(path);
+    printf("Change feed of '%s' stopped at sequence %llu.\n", table_name, (unsigned long long)t->header.feed_seq);
+}
+
+// Delete entire table
+void delete_table(const char *table_name, const char *db_name)
+{
+    if (!check_table_exists(db_name, table_name))
+    {
+        print_error("Error: Table '%s' does not exist in database '%s'.\n", table_name, db_name);
+        return;
+    }
+
+    Table *t = table_find_open(db_name, table_name);
+    if (t)
+        table_close(t, false);
+
+    char table_path[300] = {0};
+    build_table_path(table_path, sizeof(table_path), db_name, table_name, TABLE_EXT);
+    bool removed;
+    if (file_exists(table_path))
+    {
+        remove_table_files(db_name, table_name);
+        removed = !file_exists(table_path);
+    }
+    else
+    {
+        build_table_path(table_path, sizeof(table_path), db_name, table_name, LEGACY_TABLE_EXT);
+        removed = remove(table_path) == 0;
+    }
+
+    if (removed)
+    {
+        catalog_remove_table(db_name, table_name);
+        printf("Table '%s' deleted successfully from database '%s'.\n", table_name, db_name);
+    }
+    else
+    {
+        print_error("Error: Failed to delete table '%s'.\n", table_name);
+    }
+}
+
+// Delete entire database (recursive deletion)
+void delete_database(const char *db_name)
+{
+    if (!check_db_exists(db_name))
+    {
+        print_error("Error: Database '%s' does not exist.\n", db_name);
+        return;
+    }
+
+    // Open table files would keep their pages cached, drop them first
+    table_close_db(db_name, false);
+
+    char db_path[300];
+#ifndef _WIN32
+    snprintf(db_path, sizeof(db_path), "db/%s", db_name);
+#else
+    snprintf(db_path, sizeof(db_path), "db\\%s", db_name);
+#endif
+
+    // First, delete all files in the database directory
+#ifdef _WIN32
+    struct _finddata_t data;
+    intptr_t handle;
+    char search_path[300];
+    snprintf(search_path, sizeof(search_path), "db\\%s\\*.*", db_name);
+
+    handle = _findfirst(search_path, &data);
+    if (handle != -1)
+    {
+        do
+        {
+            if (strcmp(data.name, ".") != 0 && strcmp(data.name, "..") != 0)
+            {
+                char file_path[300];
+                snprintf(file_path, sizeof(file_path), "db\\%s\\%s", db_name, data.name);
+                remove(file_path);
+            }
+        } while (_findnext(handle, &data) == 0);
+        _findclose(handle);
+    }
+#else
+    DIR *dir = opendir(db_path);
+    if (dir)
+    {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            {
+                char file_path[300];
+                snprintf(file_path, sizeof(file_path), "db/%s/%s", db_name, entry->d_name);
+                remove(file_path);
+            }
+        }
+        closedir(dir);
+    }
+#endif
+
+    // Now remove the directory itself
+#ifdef _WIN32
+    if (_rmdir(db_path) == 0)
+#else
+    if (rmdir(db_path) == 0)
+#endif
+    {
+        catalog_remove_db(db_name);
+        printf("Database '%s' deleted successfully.\n", db_name);
+    }
+    else
+    {
+        catalog_refresh_db(db_name);
+        print_error("Error: Failed to delete database '%s'.\n", db_name);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Query result cache
+//
+// With `set result_cache <KB>`, the rows printed by get (all rows, filtered,
+// ordered or limited; not joins) are kept under the normalized query text
+// together with the version of the table they came from. Every write gives
+// the table a new version, and so does reopening it, so a cached result is
+// only used while the table is unchanged. Stale entries are dropped when a
+// lookup finds them and otherwise age out of the LRU list. A repeated query
+// then costs a hash lookup instead of a scan. One result may use at most a
+// quarter of the cache so a large scan cannot flush it.
+// ---------------------------------------------------------------------------
+
+#define RESULT_CACHE_BUCKETS 1024
+#define RESULT_ENTRY_OVERHEAD 64 // bookkeeping bytes charged per entry
+
+typedef struct ResultEntry
+{
+    struct ResultEntry *hash_next;
+    struct ResultEntry *lru_prev;
+    struct ResultEntry *lru_next;
+    uint64_t version; // of the table when the result was read
+    int row_count;
+    size_t size;      // bytes charged against the cache limit
+    char *key;
+    char *rows;       // the records, each followed by '\n'
+    size_t rows_len;
+} ResultEntry;
+
+typedef struct
+{
+    size_t limit; // 0 = off
+    size_t bytes;
+    size_t count;
+    ResultEntry *buckets[RESULT_CACHE_BUCKETS];
+    ResultEntry *lru_head; // least recently used
+    ResultEntry *lru_tail;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} ResultCache;
+
+ResultCache result_cache = {0};
+
+// Rows of a result being collected for the cache
+typedef struct
+{
+    bool active;
+    int count;
+    char *rows;
+    size_t used;
+    size_t capacity;
+} ResultCapture;
+
+// "get <db>/<table>[ <field>=<value>]<suffix>", with the value unquoted, so
+// name:"John" and name:John share an entry; an in list is keyed by its text
+void result_cache_key(char *out, size_t size, Table *t, const WhereClause *where, const char *suffix)
+{
+    if (!where)
+    {
+        snprintf(out, size, "get %s/%s%s", t->db, t->name, suffix);
+        return;
+    }
+    if (where->in)
+    {
+        snprintf(out, size, "get %s/%s %s%s", t->db, t->name, where->text, suffix);
+        return;
+    }
+
+    const char *value = where->value;
+    size_t len = strlen(value);
+    unquote_value(&value, &len);
+    snprintf(out, size, "get %s/%s %s=%.*s%s", t->db, t->name, where->field, (int)len, value, suffix);
+}
+
+void result_cache_unlink(ResultEntry *e)
+{
+    if (e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        result_cache.lru_head = e->lru_next;
+    if (e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        result_cache.lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+void result_cache_push_back(ResultEntry *e)
+{
+    e->lru_prev = result_cache.lru_tail;
+    e->lru_next = NULL;
+    if (result_cache.lru_tail)
+        result_cache.lru_tail->lru_next = e;
+    else
+        result_cache.lru_head = e;
+    result_cache.lru_tail = e;
+}
+
+void result_cache_remove(ResultEntry *e)
+{
+    ResultEntry **link = &result_cache.buckets[hash_bytes(e->key, strlen(e->key)) % RESULT_CACHE_BUCKETS];
+    while (*link && *link != e)
+        link = &(*link)->hash_next;
+    if (*link)
+        *link = e->hash_next;
+
+    result_cache_unlink(e);
+    result_cache.bytes -= e->size;
+    result_cache.count--;
+    free(e->key);
+    free(e->rows);
+    free(e);
+}
+
+// Evict least recently used entries until `bytes` more fit
+void result_cache_make_room(size_t bytes)
+{
+    while (result_cache.lru_head && result_cache.bytes + bytes > result_cache.limit)
+    {
+        result_cache_remove(result_cache.lru_head);
+        result_cache.evictions++;
+    }
+}
+
+void result_cache_resize(size_t limit)
+{
+    result_cache.limit = limit;
+    result_cache_make_room(0);
+}
+
+// The cached result of `key` if it was read from the current version of `t`.
+// Rows of a table with TTLs can expire without a write, so its results are
+// not cached.
+ResultEntry *result_cache_find(Table *t, const char *key)
+{
+    if (result_cache.limit == 0 || explain_mode != EXPLAIN_OFF || (t->header.flags & TABLE_FLAG_TTL))
+        return NULL;
+
+    ResultEntry *e = result_cache.buckets[hash_bytes(key, strlen(key)) % RESULT_CACHE_BUCKETS];
+    while (e && strcmp(e->key, key) != 0)
+        e = e->hash_next;
+
+    if (e && e->version != t->version)
+    {
+        result_cache_remove(e);
+        e = NULL;
+    }
+
+    if (!e)
+    {
+        result_cache.misses++;
+        metrics.cache_misses++;
+        return NULL;
+    }
+
+    result_cache_unlink(e);
+    result_cache_push_back(e);
+    result_cache.hits++;
+    metrics.cache_hits++;
+    return e;
+}
+
+// Print the rows of a cache hit
+void result_cache_print(const ResultEntry *e)
+{
+    fwrite(e->rows, 1, e->rows_len, stdout);
+    metrics.rows_returned += (uint64_t)e->row_count;
+}
+
+// Start collecting a result when the cache is on
+void result_capture_start(ResultCapture *c)
+{
+    memset(c, 0, sizeof(*c));
+    c->active = result_cache.limit > 0 && explain_mode == EXPLAIN_OFF;
+}
+
+void result_capture_add(ResultCapture *c, const char *record)
+{
+    if (!c || !c->active)
+        return;
+
+    size_t len = strlen(record);
+    if (c->used + len + 1 > result_cache.limit / 4)
+    {
+        c->active = false;
+        return;
+    }
+
+    if (c->used + len + 1 > c->capacity)
+    {
+        size_t capacity = c->capacity ? c->capacity * 2 : 1024;
+        while (capacity < c->used + len + 1)
+            capacity *= 2;
+        char *rows = realloc(c->rows, capacity);
+        if (!rows)
+        {
+            c->active = false;
+            return;
+        }
+        c->rows = rows;
+        c->capacity = capacity;
+    }
+
+    memcpy(c->rows + c->used, record, len);
+    c->rows[c->used + len] = '\n';
+    c->used += len + 1;
+    c->count++;
+}
+
+// Defined with the memory governor
+bool memory_fits(size_t bytes);
+extern uint64_t memory_evictions;
+
+// Keep a complete result under `key` (taking its rows) and free the capture
+void result_capture_finish(ResultCapture *c, Table *t, const char *key, bool complete)
+{
+    ResultEntry *e = NULL;
+    size_t size = sizeof(ResultEntry) + RESULT_ENTRY_OVERHEAD + strlen(key) + c->used;
+
+    if (c->active && complete && size <= result_cache.limit / 4 && !(t->header.flags & TABLE_FLAG_TTL))
+        e = calloc(1, sizeof(ResultEntry));
+    if (e)
+        e->key = malloc(strlen(key) + 1);
+    if (!e || !e->key)
+    {
+        free(e);
+        free(c->rows);
+        memset(c, 0, sizeof(*c));
+        return;
+    }
+
+    strcpy(e->key, key);
+    e->version = t->version;
+    e->row_count = c->count;
+    e->rows = c->rows;
+    e->rows_len = c->used;
+    e->size = size;
+    memset(c, 0, sizeof(*c));
+
+    // A newer copy of the same query replaces the old one
+    uint32_t b = hash_bytes(key, strlen(key)) % RESULT_CACHE_BUCKETS;
+    for (ResultEntry *old = result_cache.buckets[b]; old; old = old->hash_next)
+    {
+        if (strcmp(old->key, key) == 0)
+        {
+            result_cache_remove(old);
+            break;
+        }
+    }
+
+    result_cache_make_room(size);
+
+    // Under the memory limit older results make room too
+    while (result_cache.lru_head && !memory_fits(size))
+    {
+        result_cache_remove(result_cache.lru_head);
+        result_cache.evictions++;
+        memory_evictions++;
+    }
+    if (!memory_fits(size))
+    {
+        free(e->key);
+        free(e->rows);
+        free(e);
+        return;
+    }
+
+    e->hash_next = result_cache.buckets[b];
+    result_cache.buckets[b] = e;
+    result_cache_push_back(e);
+    result_cache.bytes += size;
+    result_cache.count++;
+}
+
+// Last line of stats when the cache is on
+void print_result_cache_summary()
+{
+    if (result_cache.limit == 0 && result_cache.hits + result_cache.misses == 0)
+        return;
+
+    uint64_t lookups = result_cache.hits + result_cache.misses;
+    printf("Result cache: %zu entries, %zu of %zu KB, %llu hits, %llu misses (%.1f%% hit rate), %llu evictions\n",
+           result_cache.count, result_cache.bytes / 1024, result_cache.limit / 1024,
+           (unsigned long long)result_cache.hits, (unsigned long long)result_cache.misses,
+           lookups ? 100.0 * (double)result_cache.hits / (double)lookups : 0.0,
+           (unsigned long long)result_cache.evictions);
+}
+
+typedef struct
+{
+    int count;
+    ResultCapture *capture; // NULL when the result is not cached
+} PrintContext;
+
+bool print_visitor(const char *record, RecordId rid, void *arg)
+{
+    (void)rid;
+    PrintContext *ctx = arg;
+    if (explain_mode != EXPLAIN_ANALYZE)
+        printf("%s\n", record);
+    result_capture_add(ctx->capture, record);
+    ctx->count++;
+    metrics.rows_returned++;
+    return true;
+}
+
+// Get all data from a table
+void get_all_data(const char *table_name, const char *db_name)
+{
+    Table *t = open_table_or_report(table_name, db_name);
+    if (!t)
+        return;
+
+    if (explain_mode != EXPLAIN_OFF)
+    {
+        int degree = explain_scan(t, NULL, 0);
+        if (explain_finish(t->header.row_count, degree))
+            return;
+    }
+
+    char key[MAX_INPUT_SIZE + 200];
+    result_cache_key(key, sizeof(key), t, NULL, "");
+    const ResultEntry *cached = result_cache_find(t, key);
+    ResultCapture capture;
+    result_capture_start(&capture);
+    PrintContext ctx = {0, &capture};
+
+    printf("Data from table '%s':\n", table_name);
+    printf("-----------------------------------\n");
+
+    if (cached)
+    {
+        result_cache_print(cached);
+        ctx.count = cached->row_count;
+    }
+    else
+    {
+        bool ok = table_scan(t, print_visitor, &ctx);
+        result_capture_finish(&capture, t, key, ok);
+    }
+
+    printf("-----------------------------------\n");
+    printf("Total records: %d\n", ctx.count);
+}
+
+// Get filtered data from a table based on query (e.g., id:1 or name:Hello)
+void get_filtered_data(const char *table_name, const char *db_name, const char *query)
+{
+    Table *t = open_table_or_report(table_name, db_name);
+    if (!t)
+        return;
+
+    // Parse the query to extract field and value (e.g., "id:1" or "name:Hello")
+    // or the values of "field in (...)"
+    WhereClause where;
+    if (!parse_where(query, &where))
+    {
+        print_error("Error: Invalid query format. Use 'field:value' (e.g., id:1 or name:Hello) or 'field in (v1, v2, ...)'\n");
+        return;
+    }
+
+    RecordFilter filter;
+    where_filter_init(&filter, t, &where);
+
+    if (explain_mode != EXPLAIN_OFF)
+    {
+        int degree = explain_scan(t, &filter, 0);
+        if (explain_finish(estimate_rows(t, &filter), degree))
+        {
+            where_free(&where);
+            return;
+        }
+    }
+
+    char key[MAX_INPUT_SIZE + 200];
+    result_cache_key(key, sizeof(key), t, &where, "");
+    const ResultEntry *cached = result_cache_find(t, key);
+    ResultCapture capture;
+    result_capture_start(&capture);
+    PrintContext ctx = {0, &capture};
+
+    printf("Filtered data from table '%s' where %s:\n", table_name, where.label);
+    printf("-----------------------------------\n");
+
+    if (cached)
+    {
+        result_cache_print(cached);
+        ctx.count = cached->row_count;
+    }
+    else
+    {
+        bool ok = table_scan_where(t, &filter, print_visitor, &ctx);
+        result_capture_finish(&capture, t, key, ok);
+    }
+    where_free(&where);
+
+    printf("-----------------------------------\n");
+    if (ctx.count > 0)
+    {
+        printf("Total matching records: %d\n", ctx.count);
+    }
+    else
+    {
+        printf("No records found matching the query.\n");
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Full-text search: get <table> <field> contains "<words>"
+//
+// A row matches when its field has every query word as a whole word, case
+// insensitively. A word may start or end with * to match any word that
+// ends or starts with it (*son, jo*), or both to match inside words
+// (*ass*). With a full-text index on the field, the posting lists of the
+// query words are intersected and only the candidate rows are read;
+// wildcard words take the union of the lists of every matching word in the
+// index. Without one, every row is checked.
+// ---------------------------------------------------------------------------
+
+#define MAX_SEARCH_WORDS 16
+
+typedef struct
+{
+    char word[FULLTEXT_MAX_WORD];
+    size_t len;
+    bool any_start; // *word: the word may end another word
+    bool any_end;   // word*: ...or start it
+} SearchWord;
+
+typedef struct
+{
+    SearchWord words[MAX_SEARCH_WORDS];
+    int count;
+} TextQuery;
+
+// Split search text into words; false when it has none or too many
+bool text_query_parse(const char *text, TextQuery *q)
+{
+    memset(q, 0, sizeof(*q));
+    const char *p = text;
+    while (*p)
+    {
+        while (*p && *p != '*' && !is_word_byte((unsigned char)*p))
+            p++;
+        const char *start = p;
+        while (*p == '*' || is_word_byte((unsigned char)*p))
+            p++;
+        if (p == start)
+            break;
+
+        SearchWord w = {{0}, 0, *start == '*', p[-1] == '*'};
+        size_t pos = 0;
+        w.len = next_word(start, (size_t)(p - start), &pos, w.word);
+        if (w.len == 0)
+            continue;
+        if (q->count == MAX_SEARCH_WORDS)
+            return false;
+        q->words[q->count++] = w;
+    }
+    return q->count > 0;
+}
+
+bool search_word_matches(const SearchWord *w, const char *word, size_t len)
+{
+    if (len < w->len)
+        return false;
+    if (!w->any_start && !w->any_end)
+        return len == w->len && memcmp(word, w->word, len) == 0;
+    if (!w->any_start)
+        return memcmp(word, w->word, w->len) == 0;
+    if (!w->any_end)
+        return memcmp(word + len - w->len, w->word, w->len) == 0;
+
+    for (size_t i = 0; i + w->len <= len; i++)
+    {
+        if (memcmp(word + i, w->word, w->len) == 0)
+            return true;
+    }
+    return false;
+}
+
+// True when the field of a (decoded) record holds every query word
+bool record_contains(const char *record, const char *field, const TextQuery *q)
+{
+    const char *value;
+    size_t len;
+    if (!record_find_field(record, field, &value, &len))
+        return false;
+
+    for (int i = 0; i < q->count; i++)
+    {
+        char word[FULLTEXT_MAX_WORD];
+        size_t pos = 0, n;
+        bool found = false;
+        while (!found && (n = next_word(value, len, &pos, word)) > 0)
+            found = search_word_matches(&q->words[i], word, n);
+        if (!found)
+            return false;
+    }
+    return true;
+}
+
+// Row locations order by shard, then page, then slot
+uint64_t fulltext_location(RecordId rid)
+{
+    return ((uint64_t)rid.shard << 48) | ((uint64_t)rid.page_no << 16) | rid.slot;
+}
+
+RecordId fulltext_rid(uint64_t location)
+{
+    RecordId rid = {(uint32_t)(location >> 16), (uint16_t)location, (uint16_t)(location >> 48)};
+    return rid;
+}
+
+int compare_locations(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Sort locations and drop repeats; the count left
+size_t locations_unique(uint64_t *locations, size_t n)
+{
+    qsort(locations, n, sizeof(uint64_t), compare_locations);
+    size_t unique = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (unique == 0 || locations[i] != locations[unique - 1])
+            locations[unique++] = locations[i];
+    }
+    return unique;
+}
+
+// Sorted locations of the rows that have a word matching `w`; NULL when out
+// of memory
+uint64_t *fulltext_candidates(FulltextIndex *ix, const SearchWord *w, size_t *count)
+{
+    *count = 0;
+    if (!w->any_start && !w->any_end)
+    {
+        FulltextWord *entry = fulltext_word(ix, w->word, w->len, false);
+        uint64_t *out = malloc(((entry ? entry->count : 0) + 1) * sizeof(uint64_t));
+        if (out && entry)
+        {
+            postings_decode(entry, out);
+            *count = entry->count;
+        }
+        return out;
+    }
+
+    size_t total = 0;
+    for (size_t i = 0; i < ix->capacity; i++)
+    {
+        const FulltextWord *entry = &ix->words[i];
+        if (entry->word && search_word_matches(w, entry->word, strlen(entry->word)))
+            total += entry->count;
+    }
+
+    uint64_t *out = malloc((total + 1) * sizeof(uint64_t));
+    if (!out)
+        return NULL;
+    size_t n = 0;
+    for (size_t i = 0; i < ix->capacity; i++)
+    {
+        const FulltextWord *entry = &ix->words[i];
+        if (entry->word && search_word_matches(w, entry->word, strlen(entry->word)))
+        {
+            postings_decode(entry, out + n);
+            n += entry->count;
+        }
+    }
+
+    // Several words can hold the same row
+    *count = locations_unique(out, n);
+    return out;
+}
+
+// Rows that may match every query word: the intersection of their
+// candidate lists, smallest list first. NULL when out of memory.
+uint64_t *fulltext_lookup(FulltextIndex *ix, const TextQuery *q, size_t *count)
+{
+    uint64_t *lists[MAX_SEARCH_WORDS] = {0};
+    size_t counts[MAX_SEARCH_WORDS] = {0};
+    bool ok = true;
+    int smallest = 0;
+    for (int i = 0; i < q->count; i++)
+    {
+        lists[i] = fulltext_candidates(ix, &q->words[i], &counts[i]);
+        ok = ok && lists[i];
+        if (counts[i] < counts[smallest])
+            smallest = i;
+    }
+    if (!ok)
+    {
+        for (int i = 0; i < q->count; i++)
+            free(lists[i]);
+        return NULL;
+    }
+
+    uint64_t *result = lists[smallest];
+    size_t n = counts[smallest];
+    for (int i = 0; i < q->count; i++)
+    {
+        if (i == smallest)
+            continue;
+
+        // Both lists are sorted: walk them together, keeping common rows
+        size_t kept = 0, b = 0;
+        for (size_t a = 0; a < n; a++)
+        {
+            while (b < counts[i] && lists[i][b] < result[a])
+                b++;
+            if (b < counts[i] && lists[i][b] == result[a])
+                result[kept++] = result[a];
+        }
+        n = kept;
+        free(lists[i]);
+    }
+
+    *count = n;
+    return result;
+}
+
+typedef struct
+{
+    const char *field;
+    const TextQuery *query;
+    record_visitor visit;
+    void *ctx;
+} ContainsContext;
+
+bool contains_visitor(const char *record, RecordId rid, void *arg)
+{
+    ContainsContext *c = arg;
+    if (!record_contains(record, c->field, c->query))
+        return true;
+    return c->visit(record, rid, c->ctx);
+}
+
+// Visit the rows at sorted `locations` through `visit`, which checks them
+// again, then every row of the memtable and the segments in id order.
+bool table_visit_locations(Table *t, const uint64_t *locations, size_t count, record_visitor visit, void *ctx)
+{
+    char stored[PAGE_SIZE];
+    char record[PAGE_SIZE];
+    bool overlay = t->mem.count > 0 || t->segs.count > 0;
+    bool more = true;
+    for (size_t i = 0; more && i < count; i++)
+    {
+        RecordId rid = fulltext_rid(locations[i]);
+        if (rid.shard >= t->shard_count || rid.page_no == 0 ||
+            rid.page_no >= paged_files[t->shard_files[rid.shard]].page_count)
+            continue;
+
+        unsigned char *page = pool_fetch_page(t->shard_files[rid.shard], rid.page_no, false);
+        if (!page)
+            return false;
+
+        // The row may be gone, replaced or moved since it was indexed
+        bool live = rid.slot < page_slot_count(page) && page_slot_offset(page, rid.slot) != 0;
+        if (live)
+        {
+            uint16_t length = page_slot_length(page, rid.slot);
+            memcpy(stored, page + page_slot_offset(page, rid.slot), length);
+            stored[length] = '\0';
+        }
+        pool_unpin(page, false);
+        if (!live || (overlay && table_overlay_find(t, record_id(stored))))
+            continue;
+
+        metrics.rows_scanned++;
+        if (record_expired(t, stored))
+            continue;
+        const char *out = t->dict && dict_decode(t->dict, stored, record, PAGE_SIZE) ? record : stored;
+        more = visit(out, rid, ctx);
+    }
+
+    size_t entry_count;
+    MemEntry *entries = more && overlay ? table_overlay_from(t, 1, &entry_count) : NULL;
+    if (more && overlay && !entries)
+        return false;
+
+    RecordId overlay_rid = {0, 0, 0};
+    for (size_t i = 0; entries && more && i < entry_count; i++)
+    {
+        metrics.rows_scanned++;
+        if (entries[i].record && !record_expired(t, entries[i].record))
+            more = visit(entries[i].record, overlay_rid, ctx);
+    }
+    free(entries);
+    return true;
+}
+
+// table_visit_locations under a snapshot, like a scan
+bool table_visit_candidates(Table *t, const uint64_t *locations, size_t count, record_visitor visit, void *ctx)
+{
+    uint64_t previous_seq = table_begin_snapshot(t);
+    bool ok = table_visit_locations(t, locations, count, visit, ctx);
+    table_end_snapshot(t, previous_seq);
+    return ok;
+}
+
+// Visit the rows whose `field` holds every query word: the candidates from
+// the index in page order, then the matching rows of the memtable and the
+// segments in id order. Without an index every row is checked.
+bool table_search_text(Table *t, const char *field, const TextQuery *q, record_visitor visit, void *ctx)
+{
+    ContainsContext c = {field, q, visit, ctx};
+    FulltextIndex *ix = fulltext_find(t->fulltext, field, false);
+    if (!ix)
+        return table_scan(t, contains_visitor, &c);
+
+    if (!table_load_segments(t))
+        return false;
+
+    size_t count;
+    uint64_t *candidates = fulltext_lookup(ix, q, &count);
+    if (!candidates)
+        return false;
+
+    bool ok = table_visit_candidates(t, candidates, count, contains_visitor, &c);
+    free(candidates);
+    return ok;
+}
+
+bool fulltext_build_visitor(const char *record, RecordId rid, void *arg)
+{
+    FulltextIndex *ix = arg;
+    const char *value;
+    size_t len;
+
+    // Rows from the memtable and the segments are indexed by compaction
+    if (rid.page_no == 0 || !record_find_field(record, ix->field, &value, &len))
+        return true;
+    return fulltext_add_value(ix, value, len, fulltext_location(rid));
+}
+
+// Fill an (empty) index from the rows in the pages
+bool fulltext_build(Table *t, FulltextIndex *ix)
+{
+    MetricsPhase previous = metrics_enter(PHASE_WRITE);
+    bool ok = table_scan(t, fulltext_build_visitor, ix);
+    metrics_leave(previous);
+    return ok;
+}
+
+bool fulltext_save_table(Table *t)
+{
+    char path[300];
+    build_table_path(path, sizeof(path), t->db, t->name, FULLTEXT_EXT);
+    return fulltext_save(t->fulltext, path);
+}
+
+bool fulltext_reindex(Table *t, FulltextSet *set)
+{
+    t->fulltext = set;
+    bool ok = true;
+    for (int i = 0; ok && i < set->count; i++)
+    {
+        fulltext_index_clear(&set->indexes[i]);
+        ok = fulltext_build(t, &set->indexes[i]);
+    }
+    ok = ok && fulltext_save_table(t);
+    if (!ok)
+        print_error("Error: Failed to rebuild the full-text indexes of table '%s'.\n", t->name);
+    return ok;
+}
+
+bool fulltext_note_row(Table *t, RecordId rid, const char *record)
+{
+    FulltextSet *set = t->fulltext;
+    for (int i = 0; set && i < set->count; i++)
+    {
+        const char *value;
+        size_t len;
+        set->pending[i].prefix = set->indexes[i].prefix;
+        if (record_find_field(record, set->indexes[i].field, &value, &len) &&
+            !fulltext_add_value(&set->pending[i], value, len, fulltext_location(rid)))
+            return false;
+    }
+    return true;
+}
+
+bool fulltext_finish_compaction(Table *t)
+{
+    FulltextSet *set = t->fulltext;
+    if (!set)
+        return true;
+
+    bool ok = true;
+    bool any = false;
+    for (int i = 0; i < set->count; i++)
+    {
+        FulltextIndex *pending = &set->pending[i];
+        for (size_t w = 0; ok && w < pending->capacity; w++)
+        {
+            const FulltextWord *src = &pending->words[w];
+            if (!src->word)
+                continue;
+            FulltextWord *dst = fulltext_word(&set->indexes[i], src->word, strlen(src->word), true);
+            uint64_t *locations = malloc(((size_t)src->count + 1) * sizeof(uint64_t));
+            if (locations)
+                postings_decode(src, locations);
+            ok = dst && locations && postings_merge(dst, locations, src->count);
+            free(locations);
+            any = true;
+        }
+    }
+
+    char path[300];
+    build_table_path(path, sizeof(path), t->db, t->name, FULLTEXT_EXT);
+    if (ok && any)
+        ok = fulltext_append(set, path);
+    for (int i = 0; i < set->count; i++)
+        fulltext_index_clear(&set->pending[i]);
+
+    if (!ok)
+        print_error("Error: Failed to update the full-text indexes of table '%s'.\n", t->name);
+    return ok;
+}
+
+const char *index_kind_name(bool prefix)
+{
+    return prefix ? "prefix" : "full-text";
+}
+
+// create fulltext index <table> <field> / create prefix index <table> <field>
+void create_fulltext_index(const char *table_name, const char *db_name, const char *field, bool prefix)
+{
+    Table *t = open_table_or_report(table_name, db_name);
+    if (!t)
+        return;
+
+    const char *kind = index_kind_name(prefix);
+    if (fulltext_find(t->fulltext, field, prefix))
+    {
+        print_error("Error: Table '%s' already has a %s index on '%s'.\n", table_name, kind, field);
+        return;
+    }
+    if (!t->fulltext && !(t->fulltext = calloc(1, sizeof(FulltextSet))))
+    {
+        print_error("Error: Out of memory.\n");
+        return;
+    }
+    if (t->fulltext->count == MAX_FULLTEXT_INDEXES || strlen(field) >= sizeof(t->fulltext->indexes[0].field))
+    {
+        print_error("Error: A table can have at most %d full-text and prefix indexes.\n", MAX_FULLTEXT_INDEXES);
+        return;
+    }
+
+    // Fold recent writes into the pages first so that the index covers them
+    if (!table_compact(t))
+        return;
+
+    FulltextIndex *ix = &t->fulltext->indexes[t->fulltext->count++];
+    strcpy(ix->field, field);
+    ix->prefix = prefix;
+    if (!fulltext_build(t, ix) || !fulltext_save_table(t))
+    {
+        fulltext_index_clear(ix);
+        t->fulltext->count--;
+        memset(ix, 0, sizeof(*ix));
+        print_error("Error: Failed to create the %s index on '%s'.\n", kind, field);
+        return;
+    }
+
+    printf("%s index on '%s.%s' created: %zu %s, %zu KB of posting lists.\n", prefix ? "Prefix" : "Full-text",
+           table_name, field, ix->count, prefix ? "distinct value(s)" : "word(s)",
+           (fulltext_index_bytes(ix) + 1023) / 1024);
+}
+
+// drop fulltext index <table> <field> / drop prefix index <table> <field>
+void drop_fulltext_index(const char *table_name, const char *db_name, const char *field, bool prefix)
+{
+    Table *t = open_table_or_report(table_name, db_name);
+    if (!t)
+        return;
+
+    const char *kind = index_kind_name(prefix);
+    FulltextIndex *ix = fulltext_find(t->fulltext, field, prefix);
+    if (!ix)
+    {
+        print_error("Error: Table '%s' has no %s index on '%s'.\n", table_name, kind, field);
+        return;
+    }
+
+    FulltextSet *set = t->fulltext;
+    int i = (int)(ix - set->indexes);
+    fulltext_index_clear(ix);
+    memmove(&set->indexes[i], &set->indexes[i + 1], (size_t)(set->count - i - 1) * sizeof(FulltextIndex));
+    set->count--;
+    memset(&set->indexes[set->count], 0, sizeof(FulltextIndex));
+
+    if (!fulltext_save_table(t))
+        print_error("Error: Failed to save the indexes of table '%s'.\n", table_name);
+    else
+        printf("%s index on '%s.%s' dropped.\n", prefix ? "Prefix" : "Full-text", table_name, field);
+}
+
+// get <table> <field> contains "<words>"
+void get_text_data(const char *table_name, const char *db_name, const char *field, const char *text)
+{
+    Table *t = open_table_or_report(table_name, db_name);
+    if (!t)
+        return;
+
+    const char *shown = text;
+    size_t shown_len = strlen(text);
+    unquote_value(&shown, &shown_len);
+
+    TextQuery query;
+    if (!text_query_parse(text, &query))
+    {
+        print_error("Error: Search text needs 1 to %d words.\n", MAX_SEARCH_WORDS);
+        return;
+    }
+
+    if (explain_mode != EXPLAIN_OFF)
+    {
+        FulltextIndex *ix = fulltext_find(t->fulltext, field, false);
+        size_t candidates = t->header.row_count;
+        int degree = 1;
+        if (ix && table_load_segments(t))
+        {
+            uint64_t *rows = fulltext_lookup(ix, &query, &candidates);
+            free(rows);
+            explain_line(0, "Full-text lookup on %s.%s: %d word(s), %zu candidate row(s), %zu recent write(s) checked",
+                         table_name, field, query.count, candidates, t->mem.count + t->segs.count);
+        }
+        else
+        {
+            explain_line(0, "Full scan on %s: %u row(s), every row checked (no full-text index on '%s')", table_name,
+                         t->header.row_count, field);
+        }
+        explain_line(1, "Filter: %s contains \"%.*s\"", field, (int)shown_len, shown);
+        if (explain_finish(candidates, degree))
+            return;
+    }
+
+    char key[MAX_INPUT_SIZE + 200];
+    snprintf(key, sizeof(key), "get %s/%s %s contains %s", t->db, t->name, field, text);
+    const ResultEntry *cached = result_cache_find(t, key);
+    ResultCapture capture;
+    result_capture_start(&capture);
+    PrintContext ctx = {0, &capture};
+
+    printf("Data from table '%s' where %s contains \"%.*s\":\n", table_name, field, (int)shown_len, shown);
+    printf("-----------------------------------\n");
+
+    if (cached)
+    {
+        result_cache_print(cached);
+        ctx.count = cached->row_count;
+    }
+    else
+    {
+        MetricsPhase previous = metrics_enter(PHASE_SCAN);
+        bool ok = table_search_text(t, field, &query, print_visitor, &ctx);
+        metrics_leave(previous);
+        result_capture_finish(&capture, t, key, ok);
+        if (!ok)
+            print_error("Error: Failed to search table '%s'.\n", table_name);
+    }
+
+    printf("-----------------------------------\n");
+    if (ctx.count > 0)
+        printf("Total matching records: %d\n", ctx.count);
+    else
+        printf("No records found matching the query.\n");
+}
+
+// ---------------------------------------------------------------------------
+// Pattern search: get <table> <field> like "<pattern>" / startswith "<prefix>"
+//
+// like matches the whole value, case sensitively: % stands for any run of
+// characters, _ for any one, and \ makes the next one literal. startswith
+// "abc" is like "abc%" with its wildcards escaped. With a prefix index on
+// the field, the literal start of the pattern picks one range of the sorted
+// keys and only their rows are read and matched. A pattern that starts with
+// a wildcard, or a field without a prefix index, is a filtered scan: the
+// planner may run it in parallel, and a dictionary field matches the pattern
+// once per distinct value and then compares codes.
+// ---------------------------------------------------------------------------
+
+// Sorted locations of the rows whose key starts with prefix[0..len) in a
+// prefix index, with the number of keys in that range; NULL when out of
+// memory
+uint64_t *prefix_lookup(FulltextIndex *ix, const char *prefix, size_t len, size_t *count, size_t *keys)
+{
+    *count = *keys = 0;
+    if (!fulltext_sort_keys(ix))
+        return NULL;
+    if (len >= FULLTEXT_MAX_WORD)
+        len = FULLTEXT_MAX_WORD - 1; // keys are cut there too
+
+    // First key whose start is not below the prefix
+    size_t lo = 0, hi = ix->count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strncmp(ix->keys[mid], prefix, len) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    size_t end = lo, total = 0;
+    for (; end < ix->count && strncmp(ix->keys[end], prefix, len) == 0; end++)
+        total += fulltext_word(ix, ix->keys[end], strlen(ix->keys[end]), false)->count;
+
+    uint64_t *out = malloc((total + 1) * sizeof(uint64_t));
+    if (!out)
+        return NULL;
+    size_t n = 0;
+    for (size_t i = lo; i < end; i++)
+    {
+        const FulltextWord *w = fulltext_word(ix, ix->keys[i], strlen(ix->keys[i]), false);
+        postings_decode(w, out + n);
+        n += w->count;
+    }
+
+    // An updated row can be listed under its old and its new value
+    *count = locations_unique(out, n);
+    *keys = end - lo;
+    return out;
+}
+
+typedef struct
+{
+    const RecordFilter *filter;
+    record_visitor visit;
+    void *ctx;
+} FilterContext;
+
+bool filter_visitor(const char *record, RecordId rid, void *arg)
+{
+    FilterContext *c = arg;
+    if (!filter_matches(c->filter, record))
+        return true;
+    return c->visit(record, rid, c->ctx);
+}
+
+// Visit the rows that pass a like filter: the rows of the prefix range when
+// the field has a prefix index and the pattern a literal start, otherwise
+// those of a filtered scan
+bool table_search_pattern(Table *t, const RecordFilter *filter, record_visitor visit, void *ctx)
+{
+    char prefix[FULLTEXT_MAX_WORD];
+    size_t len = like_prefix(filter->value, prefix, sizeof(prefix));
+    FulltextIndex *ix = fulltext_find(t->fulltext, filter->field, true);
+    if (!ix || len == 0)
+        return table_scan_where(t, filter, visit, ctx);
+
+    if (!table_load_segments(t))
+        return false;
+
+    size_t count, keys;
+    uint64_t *candidates = prefix_lookup(ix, prefix, len, &count, &keys);
+    if (!candidates)
+        return false;
+
+    FilterContext c = {filter, visit, ctx};
+    MetricsPhase previous = metrics_enter(PHASE_SCAN);
+    bool ok = table_visit_candidates(t, candidates, count, filter_visitor, &c);
+    metrics_leave(previous);
+    free(candidates);
+    return ok;
+}
+
+// get <table> <field> like "<pattern>" / get <table> <field> startswith "<prefix>"
+void get_pattern_data(const char *table_name, const char *db_name, const char *field, const char *text,
+                      bool startswith)
+{
+    Table *t = open_table_or_report(table_name, db_name);
+    if (!t)
+        return;
+
+    const char *shown = text;
+    size_t shown_len = strlen(text);
+    unquote_value(&shown, &shown_len);
+
+    // startswith "a_b" is like "a\_b%"
+    char pattern[MAX_INPUT_SIZE * 2];
+    size_t n = 0;
+    for (size_t i = 0; i < shown_len && n + 3 < sizeof(pattern); i++)
+    {
+        if (startswith && (shown[i] == '%' || shown[i] == '_' || shown[i] == '\\'))
+            pattern[n++] = '\\';
+        pattern[n++] = shown[i];
+    }
+    if (startswith)
+        pattern[n++] = '%';
+    pattern[n] = '\0';
+
+    RecordFilter filter;
+    filter_init_like(&filter, t->dict, field, pattern);
+    const char *op = startswith ? "startswith" : "like";
+
+    if (explain_mode != EXPLAIN_OFF)
+    {
+        char prefix[FULLTEXT_MAX_WORD];
+        size_t len = like_prefix(pattern, prefix, sizeof(prefix));
+        FulltextIndex *ix = fulltext_find(t->fulltext, field, true);
+        uint64_t estimate;
+        int degree = 1;
+        if (ix && len > 0 && table_load_segments(t))
+        {
+            size_t candidates, keys;
+            free(prefix_lookup(ix, prefix, len, &candidates, &keys));
+            explain_line(0, "Prefix index range on %s.%s: keys starting \"%s\", %zu key(s), %zu candidate row(s), "
+                            "%zu recent write(s) checked",
+                         table_name, field, prefix, keys, candidates, t->mem.count + t->segs.count);
+            explain_line(1, "Filter: %s like \"%s\"", field, pattern);
+            estimate = candidates;
+        }
+        else
+        {
+            degree = explain_scan(t, &filter, 0);
+            if (ix)
+                explain_line(1, "Prefix index: not used, the pattern starts with a wildcard");
+            estimate = estimate_rows(t, &filter);
+        }
+        if (explain_finish(estimate, degree))
+            return;
+    }
+
+    char key[MAX_INPUT_SIZE * 4];
+    snprintf(key, sizeof(key), "get %s/%s %s like %s", t->db, t->name, field, pattern);
+    const ResultEntry *cached = result_cache_find(t, key);
+    ResultCapture capture;
+    result_capture_start(&capture);
+    PrintContext ctx = {0, &capture};
+
+    printf("Data from table '%s' where %s %s \"%.*s\":\n", table_name, field, op, (int)shown_len, shown);
+    printf("-----------------------------------\n");
+
+    if (cached)
+    {
+        result_cache_print(cached);
+        ctx.count = cached->row_count;
+    }
+    else
+    {
+        bool ok = table_search_pattern(t, &filter, print_visitor, &ctx);
+        result_capture_finish(&capture, t, key, ok);
+        if (!ok)
+            print_error("Error: Failed to search table '%s'.\n", table_name);
+    }
+
+    printf("-----------------------------------\n");
+    if (ctx.count > 0)
+        printf("Total matching records: %d\n", ctx.count);
+    else
+        printf("No records found matching the query.\n");
+}
+
+// ---------------------------------------------------------------------------
+// Sorting: get ... order by <field> [desc] [limit N]
+// ---------------------------------------------------------------------------
+
+// Memory an order by or join may hold before it spills to temporary files
+size_t work_memory_limit = (size_t)DEFAULT_WORK_MEMORY_KB * 1024;
+
+// Defined with the memory governor: whether an operator holding `bytes`
+// spills, also because of the memory limit
+bool work_memory_exceeded(size_t bytes);
+
+// Spill files hold records as [length:u32][bytes]
+bool spill_write_record(FILE *file, const char *record)
+{
+    uint32_t len = (uint32_t)strlen(record);
+    metrics.bytes_written += sizeof(len) + len;
+    return fwrite(&len, sizeof(len), 1, file) == 1 && fwrite(record, 1, len, file) == len;
+}
+
+// Next record of a spill file (malloc'd), NULL at the end
+char *spill_read_record(FILE *file)
+{
+    uint32_t len;
+    if (fread(&len, sizeof(len), 1, file) != 1 || len > MAX_RECORD_SIZE)
+        return NULL;
+
+    char *record = malloc(len + 1);
+    if (!record)
+        return NULL;
+    if (fread(record, 1, len, file) != len)
+    {
+        free(record);
+        return NULL;
+    }
+    record[len] = '\0';
+    metrics.bytes_read += sizeof(len) + len;
+    return record;
+}
+
+typedef struct
+{
+    const char *field; // NULL keeps scan order
+    bool desc;
+    size_t limit; // 0 means no limit
+} SortSpec;
+
+// A row being sorted, with its sort key parsed once
+typedef struct
+{
+    char *record;
+    uint32_t id;
+    const char *key; // points into record, NULL when the field is missing
+    size_t key_len;
+    bool numeric;
+    double number;
+} SortRow;
+
+typedef struct
+{
+    const SortSpec *spec;
+    SortRow *rows;
+    size_t count;
+    size_t capacity;
+    size_t bytes;  // memory held by rows, checked against work_memory_limit
+    bool top_n;    // rows is a heap of the best `limit` rows so far
+    FILE **runs;   // sorted run files spilled when rows outgrow the budget
+    int run_count;
+    bool failed;
+} Sorter;
+
+bool sort_descending = false; // direction used by compare_sort_rows
+
+// Fill a row from a record it takes ownership of
+void sort_row_init(SortRow *row, char *record, const char *field)
+{
+    row->record = record;
+    row->id = record_id(record);
+    row->key = NULL;
+    row->key_len = 0;
+    row->numeric = false;
+
+    const char *value;
+    size_t len;
+    if (!record_find_field(record, field, &value, &len))
+        return;
+
+    unquote_value(&value, &len);
+    row->key = value;
+    row->key_len = len;
+
+    char number[64];
+    if (len > 0 && len < sizeof(number))
+    {
+        memcpy(number, value, len);
+        number[len] = '\0';
+        char *end;
+        row->number = strtod(number, &end);
+        row->numeric = *end == '\0';
+    }
+}
+
+size_t sort_row_bytes(const SortRow *row)
+{
+    return sizeof(SortRow) + strlen(row->record) + 1;
+}
+
+// Numbers compare by value, other keys byte-wise; rows without the field
+// come last and ties keep id order
+int compare_sort_rows(const void *pa, const void *pb)
+{
+    const SortRow *a = pa, *b = pb;
+    int cmp = 0;
+
+    if (!a->key || !b->key)
+    {
+        if (a->key != b->key)
+            return a->key ? -1 : 1;
+    }
+    else if (a->numeric && b->numeric)
+    {
+        cmp = (a->number > b->number) - (a->number < b->number);
+    }
+    else
+    {
+        size_t n = a->key_len < b->key_len ? a->key_len : b->key_len;
+        cmp = memcmp(a->key, b->key, n);
+        if (cmp == 0)
+            cmp = (a->key_len > b->key_len) - (a->key_len < b->key_len);
+    }
+
+    if (cmp != 0)
+        return sort_descending ? -cmp : cmp;
+    return (a->id > b->id) - (a->id < b->id);
+}
+
+// Top-N heap: the row that sorts last sits on top so it can be replaced
+void top_heap_sift_down(SortRow *heap, size_t count, size_t i)
+{
+    for (;;)
+    {
+        size_t worst = i, left = 2 * i + 1, right = left + 1;
+        if (left < count && compare_sort_rows(&heap[left], &heap[worst]) > 0)
+            worst = left;
+        if (right < count && compare_sort_rows(&heap[right], &heap[worst]) > 0)
+            worst = right;
+        if (worst == i)
+            return;
+
+        SortRow tmp = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = tmp;
+        i = worst;
+    }
+}
+
+void top_heap_sift_up(SortRow *heap, size_t i)
+{
+    while (i > 0)
+    {
+        size_t parent = (i - 1) / 2;
+        if (compare_sort_rows(&heap[i], &heap[parent]) <= 0)
+            return;
+
+        SortRow tmp = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+// Next row of a run file; false at the end of the run
+bool sort_read_row(FILE *file, SortRow *row, const char *field)
+{
+    char *record = spill_read_record(file);
+    if (!record)
+        return false;
+    sort_row_init(row, record, field);
+    return true;
+}
+
+void sort_clear_rows(Sorter *sorter)
+{
+    for (size_t i = 0; i < sorter->count; i++)
+        free(sorter->rows[i].record);
+    sorter->count = 0;
+    query_memory -= sorter->bytes;
+    sorter->bytes = 0;
+}
+
+// Sort the buffered rows and write them out as a new run file
+bool sort_spill(Sorter *sorter)
+{
+    FILE **runs = realloc(sorter->runs, (size_t)(sorter->run_count + 1) * sizeof(FILE *));
+    if (!runs)
+        return false;
+    sorter->runs = runs;
+
+    FILE *run = tmpfile();
+    if (!run)
+    {
+        print_error("Error: Failed to create a sort run file.\n");
+        return false;
+    }
+
+    qsort(sorter->rows, sorter->count, sizeof(SortRow), compare_sort_rows);
+    bool ok = true;
+    for (size_t i = 0; ok && i < sorter->count; i++)
+        ok = spill_write_record(run, sorter->rows[i].record);
+
+    sort_clear_rows(sorter);
+    if (!ok)
+    {
+        fclose(run);
+        return false;
+    }
+
+    rewind(run);
+    sorter->runs[sorter->run_count++] = run;
+    return true;
+}
+
+bool sort_visitor(const char *record, RecordId rid, void *arg)
+{
+    (void)rid;
+    Sorter *sorter = arg;
+
+    char *copy = strdup(record);
+    if (!copy)
+    {
+        sorter->failed = true;
+        return false;
+    }
+
+    SortRow row;
+    sort_row_init(&row, copy, sorter->spec->field);
+
+    // Top-N: a full heap only takes rows that beat its current worst row
+    if (sorter->top_n && sorter->count == sorter->spec->limit)
+    {
+        if (compare_sort_rows(&row, &sorter->rows[0]) >= 0)
+        {
+            free(copy);
+            return true;
+        }
+        sorter->bytes -= sort_row_bytes(&sorter->rows[0]);
+        query_memory -= sort_row_bytes(&sorter->rows[0]);
+        free(sorter->rows[0].record);
+        sorter->rows[0] = row;
+        sorter->bytes += sort_row_bytes(&row);
+        query_memory += sort_row_bytes(&row);
+        memory_query_grew();
+        top_heap_sift_down(sorter->rows, sorter->count, 0);
+        return true;
+    }
+
+    if (sorter->count == sorter->capacity)
+    {
+        size_t capacity = sorter->capacity ? sorter->capacity * 2 : 1024;
+        SortRow *rows = realloc(sorter->rows, capacity * sizeof(SortRow));
+        if (!rows)
+        {
+            free(copy);
+            sorter->failed = true;
+            return false;
+        }
+        sorter->rows = rows;
+        sorter->capacity = capacity;
+    }
+
+    sorter->rows[sorter->count++] = row;
+    sorter->bytes += sort_row_bytes(&row);
+    query_memory += sort_row_bytes(&row);
+    memory_query_grew();
+    if (sorter->top_n)
+        top_heap_sift_up(sorter->rows, sorter->count - 1);
+
+    // Past the budget: a large limit falls back to a full external sort
+    if (work_memory_exceeded(sorter->bytes))
+    {
+        sorter->top_n = false;
+        if (!sort_spill(sorter))
+        {
+            sorter->failed = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Head row of a run during a merge
+typedef struct
+{
+    SortRow row; // first member, so a cursor compares as its row
+    FILE *run;
+} MergeCursor;
+
+void merge_sift_down(MergeCursor *heap, size_t count, size_t i)
+{
+    for (;;)
+    {
+        size_t best = i, left = 2 * i + 1, right = left + 1;
+        if (left < count && compare_sort_rows(&heap[left], &heap[best]) < 0)
+            best = left;
+        if (right < count && compare_sort_rows(&heap[right], &heap[best]) < 0)
+            best = right;
+        if (best == i)
+            return;
+
+        MergeCursor tmp = heap[i];
+        heap[i] = heap[best];
+        heap[best] = tmp;
+        i = best;
+    }
+}
+
+// k-way merge of runs [first, first+count) into `out`, or into `emit` when
+// it is given
+bool sort_merge_runs(Sorter *sorter, int first, int count, record_visitor emit, void *ctx, FILE *out)
+{
+    MergeCursor *heap = malloc((size_t)count * sizeof(MergeCursor));
+    if (!heap)
+        return false;
+
+    size_t live = 0;
+    for (int r = 0; r < count; r++)
+    {
+        heap[live].run = sorter->runs[first + r];
+        if (sort_read_row(heap[live].run, &heap[live].row, sorter->spec->field))
+            live++;
+    }
+    for (size_t i = live / 2; i-- > 0;)
+        merge_sift_down(heap, live, i);
+
+    bool ok = true;
+    bool stop = false;
+    RecordId rid = {0, 0, 0};
+    while (live > 0 && ok && !stop)
+    {
+        if (emit)
+            stop = !emit(heap[0].row.record, rid, ctx);
+        else
+            ok = spill_write_record(out, heap[0].row.record);
+        free(heap[0].row.record);
+
+        if (!sort_read_row(heap[0].run, &heap[0].row, sorter->spec->field))
+            heap[0] = heap[--live];
+        merge_sift_down(heap, live, 0);
+    }
+
+    for (size_t i = 0; i < live; i++)
+        free(heap[i].row.record);
+    free(heap);
+    return ok;
+}
+
+// Emit the sorted rows. Spilled runs are merged SORT_MERGE_FANIN at a time
+// until one pass can stream them out.
+bool sort_finish(Sorter *sorter, record_visitor emit, void *ctx)
+{
+    RecordId rid = {0, 0, 0};
+
+    if (sorter->run_count == 0)
+    {
+        qsort(sorter->rows, sorter->count, sizeof(SortRow), compare_sort_rows);
+        for (size_t i = 0; i < sorter->count; i++)
+        {
+            if (!emit(sorter->rows[i].record, rid, ctx))
+                break;
+        }
+        return true;
+    }
+
+    if (sorter->count > 0 && !sort_spill(sorter))
+        return false;
+
+    while (sorter->run_count > SORT_MERGE_FANIN)
+    {
+        FILE *merged = tmpfile();
+        if (!merged || !sort_merge_runs(sorter, 0, SORT_MERGE_FANIN, NULL, NULL, merged))
+        {
+            if (merged)
+                fclose(merged);
+            return false;
+        }
+        rewind(merged);
+
+        for (int r = 0; r < SORT_MERGE_FANIN; r++)
+            fclose(sorter->runs[r]);
+        memmove(sorter->runs, sorter->runs + SORT_MERGE_FANIN,
+                (size_t)(sorter->run_count - SORT_MERGE_FANIN) * sizeof(FILE *));
+        sorter->run_count -= SORT_MERGE_FANIN;
+        sorter->runs[sorter->run_count++] = merged;
+    }
+
+    return sort_merge_runs(sorter, 0, sorter->run_count, emit, ctx, NULL);
+}
+
+void sort_free(Sorter *sorter)
+{
+    sort_clear_rows(sorter);
+    free(sorter->rows);
+    for (int r = 0; r < sorter->run_count; r++)
+        fclose(sorter->runs[r]);
+    free(sorter->runs);
+    memset(sorter, 0, sizeof(*sorter));
+}
+
+typedef struct
+{
+    int count;
+    size_t limit;
+    ResultCapture *capture; // NULL when the result is not cached
+} LimitContext;
+
+bool limit_print_visitor(const char *record, RecordId rid, void *arg)
+{
+    (void)rid;
+    LimitContext *ctx = arg;
+    if (ctx->limit > 0 && (size_t)ctx->count >= ctx->limit)
+        return false;
+    if (explain_mode != EXPLAIN_ANALYZE)
+        printf("%s\n", record);
+    result_capture_add(ctx->capture, record);
+    ctx->count++;
+    metrics.rows_returned++;
+    return true;
+}
+
+// get <table> [<field:value>] [order by <field> [desc]] [limit N]
+void get_ordered_data(const char *table_name, const char *db_name, const char *query, const SortSpec *spec)
+{
+    Table *t = open_table_or_report(table_name, db_name);
+    if (!t)
+        return;
+
+    WhereClause where = {0};
+    RecordFilter filter;
+    if (query)
+    {
+        if (!parse_where(query, &where))
+        {
+            print_error("Error: Invalid query format. Use 'field:value' (e.g., id:1 or name:Hello) or 'field in (v1, v2, ...)'\n");
+            return;
+        }
+        where_filter_init(&filter, t, &where);
+    }
+
+    if (explain_mode != EXPLAIN_OFF)
+    {
+        uint64_t estimate = estimate_rows(t, query ? &filter : NULL);
+        uint64_t sort_bytes = estimate * (table_row_bytes(t) + sizeof(SortRow));
+        const char *direction = spec->desc ? " desc" : "";
+        int depth = 0;
+
+        if (spec->limit)
+            explain_line(depth++, "Limit %zu", spec->limit);
+        if (spec->field && spec->limit)
+            explain_line(depth++, "Top-N sort by %s%s: keeps the best %zu row(s) in a heap", spec->field, direction,
+                         spec->limit);
+        else if (spec->field && sort_bytes <= work_memory_limit)
+            explain_line(depth++, "Sort by %s%s in memory: about %llu KB of %zu KB work memory", spec->field,
+                         direction, (unsigned long long)(sort_bytes / 1024), work_memory_limit / 1024);
+        else if (spec->field)
+            explain_line(depth++, "External merge sort by %s%s: about %llu run file(s), merged %d at a time",
+                         spec->field, direction, (unsigned long long)(sort_bytes / work_memory_limit + 1),
+                         SORT_MERGE_FANIN);
+        int degree = explain_scan(t, query ? &filter : NULL, depth);
+
+        if (spec->limit && estimate > spec->limit)
+            estimate = spec->limit;
+        if (explain_finish(estimate, degree))
+        {
+            where_free(&where);
+            return;
+        }
+    }
+
+    if (query)
+        printf("Filtered data from table '%s' where %s", table_name, where.label);
+    else
+        printf("Data from table '%s'", table_name);
+    if (spec->field)
+        printf(" ordered by %s%s", spec->field, spec->desc ? " desc" : "");
+    printf(":\n");
+    printf("-----------------------------------\n");
+
+    char suffix[160], key[MAX_INPUT_SIZE + 200];
+    snprintf(suffix, sizeof(suffix), "%s%s%s", spec->field ? " order by " : "", spec->field ? spec->field : "",
+             spec->desc ? " desc" : "");
+    if (spec->limit)
+        snprintf(suffix + strlen(suffix), sizeof(suffix) - strlen(suffix), " limit %zu", spec->limit);
+    result_cache_key(key, sizeof(key), t, query ? &where : NULL, suffix);
+    const ResultEntry *cached = result_cache_find(t, key);
+
+    ResultCapture capture;
+    result_capture_start(&capture);
+    LimitContext out = {0, spec->limit, &capture};
+    bool ok;
+    if (cached)
+    {
+        result_cache_print(cached);
+        out.count = cached->row_count;
+        ok = true;
+    }
+    else if (!spec->field)
+    {
+        ok = table_scan_where(t, query ? &filter : NULL, limit_print_visitor, &out);
+    }
+    else
+    {
+        Sorter sorter = {0};
+        sorter.spec = spec;
+        sorter.top_n = spec->limit > 0;
+        sort_descending = spec->desc;
+
+        ok = table_scan_where(t, query ? &filter : NULL, sort_visitor, &sorter) && !sorter.failed;
+        int runs = sorter.run_count > 0 && sorter.count > 0 ? sorter.run_count + 1 : sorter.run_count;
+
+        MetricsPhase previous = metrics_enter(PHASE_SORT);
+        ok = ok && sort_finish(&sorter, limit_print_visitor, &out);
+        metrics_leave(previous);
+        sort_free(&sorter);
+
+        if (ok && explain_mode == EXPLAIN_ANALYZE)
+        {
+            if (runs > 0)
+                printf("Sort: spilled %d run file(s)\n", runs);
+            else
+                printf("Sort: in memory\n");
+        }
+    }
+    if (!cached)
+        result_capture_finish(&capture, t, key, ok);
+    where_free(&where);
+
+    printf("-----------------------------------\n");
+    if (!ok)
+        print_error("Error: Failed to sort table '%s'.\n", table_name);
+    else if (!query)
+        printf("Total records: %d\n", out.count);
+    else if (out.count > 0)
+        printf("Total matching records: %d\n", out.count);
+    else
+        printf("No records found matching the query.\n");
+}
+
+// ---------------------------------------------------------------------------
+// Hash join: get <a> join <b> on <a>.<field> = <b>.<field> [where ...]
+// ---------------------------------------------------------------------------
+
+// A build-side row chained in its hash bucket
+typedef struct JoinRow
+{
+    struct JoinRow *next;
+    uint32_t hash;
+    const char *key; // points into record
+    size_t key_len;
+    char record[];
+} JoinRow;
+
+typedef struct
+{
+    JoinRow **buckets;
+    size_t bucket_count; // power of two
+    size_t count;
+    size_t bytes;
+} JoinTable;
+
+typedef struct
+{
+    const char *left_name;
+    const char *right_name;
+    const char *build_field;
+    const char *probe_field;
+    bool build_is_left;
+    JoinTable table;
+    bool partitioned; // build side outgrew work_memory_limit
+    FILE *build_parts[JOIN_PARTITIONS];
+    FILE *probe_parts[JOIN_PARTITIONS];
+    int matches;
+    bool failed;
+} JoinContext;
+
+// Join key of a record, quotes stripped; false when the field is missing
+bool join_key(const char *record, const char *field, const char **key, size_t *len)
+{
+    if (!record_find_field(record, field, key, len))
+        return false;
+    unquote_value(key, len);
+    return true;
+}
+
+bool join_table_add(JoinTable *jt, const char *record, const char *field)
+{
+    if (jt->count >= jt->bucket_count)
+    {
+        size_t bucket_count = jt->bucket_count ? jt->bucket_count * 2 : 1024;
+        JoinRow **buckets = calloc(bucket_count, sizeof(JoinRow *));
+        if (!buckets)
+            return false;
+
+        for (size_t i = 0; i < jt->bucket_count; i++)
+        {
+            JoinRow *row = jt->buckets[i];
+            while (row)
+            {
+                JoinRow *next = row->next;
+                size_t b = row->hash & (bucket_count - 1);
+                row->next = buckets[b];
+                buckets[b] = row;
+                row = next;
+            }
+        }
+        free(jt->buckets);
+        jt->buckets = buckets;
+        jt->bucket_count = bucket_count;
+    }
+
+    size_t len = strlen(record);
+    JoinRow *row = malloc(sizeof(JoinRow) + len + 1);
+    if (!row)
+        return false;
+    memcpy(row->record, record, len + 1);
+    join_key(row->record, field, &row->key, &row->key_len);
+    row->hash = hash_bytes(row->key, row->key_len);
+
+    size_t b = row->hash & (jt->bucket_count - 1);
+    row->next = jt->buckets[b];
+    jt->buckets[b] = row;
+    jt->count++;
+    jt->bytes += sizeof(JoinRow) + sizeof(JoinRow *) + len + 1;
+    query_memory += sizeof(JoinRow) + sizeof(JoinRow *) + len + 1;
+    memory_query_grew();
+    return true;
+}
+
+void join_table_clear(JoinTable *jt)
+{
+    for (size_t i = 0; i < jt->bucket_count; i++)
+    {
+        JoinRow *row = jt->buckets[i];
+        while (row)
+        {
+            JoinRow *next = row->next;
+            free(row);
+            row = next;
+        }
+    }
+    free(jt->buckets);
+    query_memory -= jt->bytes;
+    memset(jt, 0, sizeof(*jt));
+}
+
+// Append the fields of `record` to `out` as "<table>.<key>:<value>"
+size_t join_append_fields(char *out, size_t size, size_t used, const char *table, const char *record)
+{
+    const char *cursor = record;
+    RecordField f;
+
+    while (record_next_field(&cursor, &f) && used < size)
+    {
+        int n = snprintf(out + used, size - used, "%s%s.%.*s:%.*s", used ? ", " : "", table,
+                         (int)f.key_len, f.key, (int)f.value_len, f.value);
+        if (n < 0)
+            break;
+        used += (size_t)n;
+    }
+    return used < size ? used : size - 1;
+}
+
+void join_emit(JoinContext *ctx, const char *build_record, const char *probe_record)
+{
+    const char *left = ctx->build_is_left ? build_record : probe_record;
+    const char *right = ctx->build_is_left ? probe_record : build_record;
+
+    char joined[PAGE_SIZE * 2];
+    size_t used = join_append_fields(joined, sizeof(joined), 0, ctx->left_name, left);
+    join_append_fields(joined, sizeof(joined), used, ctx->right_name, right);
+    if (explain_mode != EXPLAIN_ANALYZE)
+        printf("%s\n", joined);
+    ctx->matches++;
+    metrics.rows_returned++;
+}
+
+// Look a probe row up in the in-memory build table
+void join_probe(JoinContext *ctx, const char *record)
+{
+    const char *key;
+    size_t len;
+    if (ctx->table.count == 0 || !join_key(record, ctx->probe_field, &key, &len))
+        return;
+
+    uint32_t hash = hash_bytes(key, len);
+    for (JoinRow *row = ctx->table.buckets[hash & (ctx->table.bucket_count - 1)]; row; row = row->next)
+    {
+        if (row->hash == hash && row->key_len == len && memcmp(row->key, key, len) == 0)
+            join_emit(ctx, row->record, record);
+    }
+}
+
+// Route a record to the partition file of its key. Partitions use the top
+// hash bits, buckets the bottom ones.
+bool join_partition(FILE **parts, const char *record, const char *field)
+{
+    const char *key;
+    size_t len;
+    if (!join_key(record, field, &key, &len))
+        return true;
+
+    int p = (int)((hash_bytes(key, len) >> 24) % JOIN_PARTITIONS);
+    if (!parts[p] && !(parts[p] = tmpfile()))
+    {
+        print_error("Error: Failed to create a join partition file.\n");
+        return false;
+    }
+    return spill_write_record(parts[p], record);
+}
+
+// Switch to a partitioned (Grace) join: the rows built so far go to the
+// build partitions and the rest of both inputs follow them there
+bool join_spill(JoinContext *ctx)
+{
+    ctx->partitioned = true;
+    for (size_t i = 0; i < ctx->table.bucket_count; i++)
+    {
+        for (JoinRow *row = ctx->table.buckets[i]; row; row = row->next)
+        {
+            if (!join_partition(ctx->build_parts, row->record, ctx->build_field))
+                return false;
+        }
+    }
+    join_table_clear(&ctx->table);
+    return true;
+}
+
+bool join_build_visitor(const char *record, RecordId rid, void *arg)
+{
+    (void)rid;
+    JoinContext *ctx = arg;
+    const char *key;
+    size_t len;
+
+    // Inner join: rows without the key can never match
+    if (!join_key(record, ctx->build_field, &key, &len))
+        return true;
+
+    bool ok;
+    if (ctx->partitioned)
+        ok = join_partition(ctx->build_parts, record, ctx->build_field);
+    else
+        ok = join_table_add(&ctx->table, record, ctx->build_field) &&
+             (!work_memory_exceeded(ctx->table.bytes) || join_spill(ctx));
+
+    ctx->failed = !ok;
+    return ok;
+}
+
+bool join_probe_visitor(const char *record, RecordId rid, void *arg)
+{
+    (void)rid;
+    JoinContext *ctx = arg;
+
+    if (!ctx->partitioned)
+    {
+        join_probe(ctx, record);
+        return true;
+    }
+
+    bool ok = join_partition(ctx->probe_parts, record, ctx->probe_field);
+    ctx->failed = !ok;
+    return ok;
+}
+
+// Join each pair of partitions in memory
+bool join_partitions(JoinContext *ctx)
+{
+    for (int p = 0; p < JOIN_PARTITIONS; p++)
+    {
+        if (!ctx->build_parts[p] || !ctx->probe_parts[p])
+            continue;
+
+        rewind(ctx->build_parts[p]);
+        rewind(ctx->probe_parts[p]);
+
+        char *record;
+        while ((record = spill_read_record(ctx->build_parts[p])) != NULL)
+        {
+            bool ok = join_table_add(&ctx->table, record, ctx->build_field);
+            free(record);
+            if (!ok)
+                return false;
+        }
+
+        while ((record = spill_read_record(ctx->probe_parts[p])) != NULL)
+        {
+            join_probe(ctx, record);
+            free(record);
+        }
+        join_table_clear(&ctx->table);
+    }
+    return true;
+}
+
+void join_free(JoinContext *ctx)
+{
+    join_table_clear(&ctx->table);
+    for (int p = 0; p < JOIN_PARTITIONS; p++)
+    {
+        if (ctx->build_parts[p])
+            fclose(ctx->build_parts[p]);
+        if (ctx->probe_parts[p])
+            fclose(ctx->probe_parts[p]);
+    }
+}
+
+// Split "<table>.<field>" and check the table is one of the joined ones.
+// Returns 0 for the left table, 1 for the right one, -1 otherwise.
+int join_column_side(const char *column, const char *left, const char *right, const char **field)
+{
+    const char *dot = strchr(column, '.');
+    if (!dot || dot[1] == '\0')
+        return -1;
+
+    size_t len = (size_t)(dot - column);
+    *field = dot + 1;
+    if (strlen(left) == len && strncmp(column, left, len) == 0)
+        return 0;
+    if (strlen(right) == len && strncmp(column, right, len) == 0)
+        return 1;
+    return -1;
+}
+
+// get <left> join <right> on <left>.<f> = <right>.<f> [where [<table>.]<field>:<value>]
+// The smaller table (by row count) is hashed; the larger one probes it.
+void join_tables(const char *left_name, const char *right_name, const char *db_name, const char *left_column,
+                 const char *right_column, const char *where)
+{
+    const char *left_field, *right_field;
+    int left_side = join_column_side(left_column, left_name, right_name, &left_field);
+    int right_side = join_column_side(right_column, left_name, right_name, &right_field);
+    if (left_side < 0 || right_side < 0 || left_side == right_side)
+    {
+        print_error("Error: Join columns must be written as <table>.<field>, one for each joined table.\n");
+        return;
+    }
+    if (left_side == 1)
+    {
+        const char *tmp = left_field;
+        left_field = right_field;
+        right_field = tmp;
+    }
+
+    // The where clause filters the table it names, the left one by default
+    char where_field[100], where_value[200];
+    int where_side = 0;
+    const char *filter_field = where_field;
+    if (where)
+    {
+        if (!parse_field_value(where, where_field, where_value))
+        {
+            print_error("Error: Invalid where clause format. Use 'field:value' (e.g., id:1)\n");
+            return;
+        }
+        if (strchr(where_field, '.'))
+            where_side = join_column_side(where_field, left_name, right_name, &filter_field);
+        if (where_side < 0)
+        {
+            print_error("Error: Where clause names a table that is not part of the join.\n");
+            return;
+        }
+    }
+
+    Table *left = open_table_or_report(left_name, db_name);
+    if (!left)
+        return;
+    Table *right = open_table_or_report(right_name, db_name);
+    if (!right)
+        return;
+    // Opening the right table may have recycled the left handle
+    if (!(left = table_open(db_name, left_name)))
+        return;
+
+    RecordFilter filters[2];
+    if (where)
+        filter_init(&filters[where_side], where_side == 0 ? left->dict : right->dict, filter_field, where_value);
+    const RecordFilter *left_filter = where && where_side == 0 ? &filters[0] : NULL;
+    const RecordFilter *right_filter = where && where_side == 1 ? &filters[1] : NULL;
+
+    JoinContext ctx = {0};
+    ctx.left_name = left_name;
+    ctx.right_name = right_name;
+    ctx.build_is_left = left->header.row_count <= right->header.row_count;
+    ctx.build_field = ctx.build_is_left ? left_field : right_field;
+    ctx.probe_field = ctx.build_is_left ? right_field : left_field;
+
+    Table *build = ctx.build_is_left ? left : right;
+    Table *probe = ctx.build_is_left ? right : left;
+    const RecordFilter *build_filter = ctx.build_is_left ? left_filter : right_filter;
+    const RecordFilter *probe_filter = ctx.build_is_left ? right_filter : left_filter;
+
+    if (explain_mode != EXPLAIN_OFF)
+    {
+        uint64_t build_rows = estimate_rows(build, build_filter);
+        uint64_t build_bytes = build_rows * (table_row_bytes(build) + sizeof(JoinRow));
+        if (build_bytes <= work_memory_limit)
+            explain_line(0, "Hash join on %s = %s: hash table in memory, about %llu KB of %zu KB work memory",
+                         left_column, right_column, (unsigned long long)(build_bytes / 1024), work_memory_limit / 1024);
+        else
+            explain_line(0, "Hash join on %s = %s: partitioned into %d file(s) per side, about %llu KB to build",
+                         left_column, right_column, JOIN_PARTITIONS, (unsigned long long)(build_bytes / 1024));
+        explain_line(1, "Build: %s (the smaller table)", build->name);
+        int degree = explain_scan(build, build_filter, 2);
+        explain_line(1, "Probe: %s", probe->name);
+        int probe_degree = explain_scan(probe, probe_filter, 2);
+
+        // Assume each probe row finds one match
+        if (explain_finish(estimate_rows(probe, probe_filter), probe_degree > degree ? probe_degree : degree))
+            return;
+    }
+
+    printf("Joined data from tables '%s' and '%s' on %s = %s:\n", left_name, right_name, left_column, right_column);
+    printf("-----------------------------------\n");
+
+    bool ok = table_scan_where(build, build_filter, join_build_visitor, &ctx) && !ctx.failed &&
+              table_scan_where(probe, probe_filter, join_probe_visitor, &ctx) && !ctx.failed;
+    if (ok && ctx.partitioned)
+    {
+        MetricsPhase previous = metrics_enter(PHASE_JOIN);
+        ok = join_partitions(&ctx);
+        metrics_leave(previous);
+    }
+    join_free(&ctx);
+
+    if (ok && explain_mode == EXPLAIN_ANALYZE)
+        printf("Join: %s\n", ctx.partitioned ? "partitioned (spilled to disk)" : "in memory");
+
+    printf("-----------------------------------\n");
+    if (!ok)
+        print_error("Error: Failed to join tables '%s' and '%s'.\n", left_name, right_name);
+    else if (ctx.matches > 0)
+        printf("Total joined records: %d\n", ctx.matches);
+    else
+        printf("No records found matching the join.\n");
+}
+
+// String -> count hash map used for grouping
+typedef struct
+{
+    char *key;
+    uint32_t count;
+} CountEntry;
+
+typedef struct
+{
+    CountEntry *entries;
+    size_t capacity; // power of two
+    size_t size;
+    size_t bytes; // charged to query_memory
+} CountMap;
+
+// Account a change of a map's size as query operator memory
+void count_map_charge(CountMap *map, size_t bytes)
+{
+    query_memory += bytes - map->bytes;
+    map->bytes = bytes;
+    memory_query_grew();
+}
+
+bool count_map_add(CountMap *map, const char *key, size_t len, uint32_t n)
+{
+    if ((map->size + 1) * 2 > map->capacity)
+    {
+        size_t capacity = map->capacity ? map->capacity * 2 : 64;
+        CountEntry *entries = calloc(capacity, sizeof(CountEntry));
+        if (!entries)
+            return false;
+
+        for (size_t i = 0; i < map->capacity; i++)
+        {
+            if (!map->entries[i].key)
+                continue;
+            size_t slot = hash_bytes(map->entries[i].key, strlen(map->entries[i].key)) & (capacity - 1);
+            while (entries[slot].key)
+                slot = (slot + 1) & (capacity - 1);
+            entries[slot] = map->entries[i];
+        }
+        free(map->entries);
+        count_map_charge(map, map->bytes + (capacity - map->capacity) * sizeof(CountEntry));
+        map->entries = entries;
+        map->capacity = capacity;
+    }
+
+    size_t slot = hash_bytes(key, len) & (map->capacity - 1);
+    while (map->entries[slot].key)
+    {
+        if (strlen(map->entries[slot].key) == len && memcmp(map->entries[slot].key, key, len) == 0)
+        {
+            map->entries[slot].count += n;
+            return true;
+        }
+        slot = (slot + 1) & (map->capacity - 1);
+    }
+
+    char *copy = malloc(len + 1);
+    if (!copy)
+        return false;
+    memcpy(copy, key, len);
+    copy[len] = '\0';
+
+    map->entries[slot].key = copy;
+    map->entries[slot].count = n;
+    map->size++;
+    count_map_charge(map, map->bytes + len + 1);
+    return true;
+}
+
+void count_map_free(CountMap *map)
+{
+    for (size_t i = 0; i < map->capacity; i++)
+        free(map->entries[i].key);
+    free(map->entries);
+    count_map_charge(map, 0);
+    memset(map, 0, sizeof(*map));
+}
+
+int compare_count_entries(const void *a, const void *b)
+{
+    return strcmp(((const CountEntry *)a)->key, ((const CountEntry *)b)->key);
+}
+
+typedef struct
+{
+    const char *field;
+    uint32_t code_counts[DICT_MAX_VALUES]; // rows per dictionary code
+    CountMap values;                       // rows per plain value
+    uint32_t missing;                      // rows without the field
+} GroupCountContext;
+
+// Group on the stored form: dictionary codes are counted in an array and
+// only plain values go through the hash map.
+bool group_count_visitor(const char *record, RecordId rid, void *arg)
+{
+    (void)rid;
+    GroupCountContext *ctx = arg;
+    const char *value;
+    size_t len;
+
+    if (!record_find_field(record, ctx->field, &value, &len))
+    {
+        ctx->missing++;
+        return true;
+    }
+
+    int code = dict_get_code(value, len);
+    if (code >= 0)
+    {
+        ctx->code_counts[code]++;
+        return true;
+    }
+
+    unquote_value(&value, &len);
+    return count_map_add(&ctx->values, value, len, 1);
+}
+
+bool count_visitor(const char *record, RecordId rid, void *arg)
+{
+    (void)record;
+    (void)rid;
+    (*(uint32_t *)arg)++;
+    return true;
+}
+
+// Count records, optionally grouped by a field
+void count_records(const char *table_name, const char *db_name, const char *field)
+{
+    Table *t = open_table_or_report(table_name, db_name);
+    if (!t)
+        return;
+
+    // Expired rows stay in the header count until they are reclaimed
+    bool ttl = (t->header.flags & TABLE_FLAG_TTL) != 0;
+    if (explain_mode != EXPLAIN_OFF)
+    {
+        if (!field && !ttl)
+        {
+            explain_line(0, "Row count from the table header of %s, no scan", table_name);
+            if (explain_finish(1, 1))
+                return;
+        }
+        else if (!field)
+        {
+            explain_line(0, "Row count by scan: rows of %s with a TTL are checked for expiry", table_name);
+            int degree = explain_scan(t, NULL, 1);
+            if (explain_finish(1, degree))
+                return;
+        }
+        else
+        {
+            DictField *df = dict_field(t->dict, field, strlen(field));
+            uint64_t groups = df ? (uint64_t)df->set.count : estimate_rows(t, NULL) / DEFAULT_SELECTIVITY;
+            explain_line(0, "Hash aggregate by %s", field);
+            int degree = explain_scan(t, NULL, 1);
+            if (explain_finish(groups > 0 || t->header.row_count == 0 ? groups : 1, degree))
+                return;
+        }
+    }
+
+    if (!field)
+    {
+        uint32_t rows = ttl ? 0 : t->header.row_count;
+        if (ttl && !table_scan_stored(t, count_visitor, &rows))
+        {
+            print_error("Error: Failed to read table '%s'.\n", table_name);
+            return;
+        }
+        printf("Total records in table '%s': %u\n", table_name, rows);
+        metrics.rows_returned++;
+        return;
+    }
+
+    GroupCountContext *ctx = calloc(1, sizeof(GroupCountContext));
+    if (!ctx)
+        return;
+    ctx->field = field;
+
+    if (!table_scan_stored(t, group_count_visitor, ctx))
+    {
+        print_error("Error: Failed to read table '%s'.\n", table_name);
+        count_map_free(&ctx->values);
+        free(ctx);
+        return;
+    }
+
+    // Fold dictionary codes into the same map so both forms print together
+    DictField *df = dict_field(t->dict, field, strlen(field));
+    for (int code = 0; df && code < df->set.count; code++)
+    {
+        if (ctx->code_counts[code] == 0)
+            continue;
+        const char *value = df->set.values[code];
+        size_t len = strlen(value);
+        unquote_value(&value, &len);
+        count_map_add(&ctx->values, value, len, ctx->code_counts[code]);
+    }
+
+    CountEntry *groups = malloc((ctx->values.size + 1) * sizeof(CountEntry));
+    size_t group_count = 0;
+    for (size_t i = 0; groups && i < ctx->values.capacity; i++)
+    {
+        if (ctx->values.entries[i].key)
+            groups[group_count++] = ctx->values.entries[i];
+    }
+    if (groups)
+        qsort(groups, group_count, sizeof(CountEntry), compare_count_entries);
+
+    printf("Record counts in table '%s' by %s:\n", table_name, field);
+    printf("-----------------------------------\n");
+    for (size_t i = 0; i < group_count; i++)
+        printf("%s: %u\n", groups[i].key, groups[i].count);
+    if (ctx->missing > 0)
+        printf("(no %s): %u\n", field, ctx->missing);
+    printf("-----------------------------------\n");
+    printf("Groups: %zu\n", group_count);
+    metrics.rows_returned += group_count;
+
+    free(groups);
+    count_map_free(&ctx->values);
+    free(ctx);
+}
+
+// Seconds from a ttl option; 0 (after printing why) when it is not a
+// number from 1 to MAX_TTL_SECONDS
+uint32_t parse_ttl(const char *text)
+{
+    char *end;
+    long long seconds = strtoll(text, &end, 10);
+    if (end == text || *end != '\0' || seconds < 1 || seconds > MAX_TTL_SECONDS)
+    {
+        print_error("Error: Invalid ttl '%s'. Use a number of seconds from 1 to %u.\n", text, MAX_TTL_SECONDS);
+        return 0;
+    }
+    return (uint32_t)seconds;
+}
+
+// Insert a row and print its id; `seconds` is 0 for the table default
+void insert_and_report(Table *t, const char *table_name, const char *attributes, uint32_t seconds)
+{
+    MetricsPhase previous = metrics_enter(PHASE_WRITE);
+    uint32_t next_id = table_insert_record(t, attributes, seconds);
+    metrics_leave(previous);
+    if (next_id == 0)
+    {
+        print_error("Error: Failed to insert into table '%s'.\n", table_name);
+        return;
+    }
+
+    printf("Inserted record with ID %u into table '%s'.\n", next_id, table_name);
+    metrics.rows_returned++;
+
+    // Growing tables are checked for fields worth dictionary encoding
+    table_auto_dictionary(t);
+}
+
+// insert into table with attributes; `ttl` is NULL for the table default
+void insert_table_with_attributes(const char *table_name, const char *db_name, const char *attributes,
+                                  const char *ttl)
+{
+    Table *t = open_table_or_report(table_name, db_name);
+    if (!t)
+        return;
+
+    uint32_t seconds = 0;
+    if (ttl && (seconds = parse_ttl(ttl)) == 0)
+        return;
+
+    if (explain_mode != EXPLAIN_OFF)
+    {
+        explain_line(0, "Insert into the memtable of %s (%zu of %zu KB used), next id %u", table_name,
+                     t->mem.bytes / 1024, memtable_limit / 1024, t->header.next_id);
+        if (explain_finish(1, 1))
+            return;
+    }
+
+    insert_and_report(t, table_name, attributes, seconds);
+}
+
+// upsert <table> key:<field> set <attributes> [ttl <seconds>]: the rows
+// whose <field> has the value the attributes give it get every attribute
+// set or added, in one scan that finds and rewrites them; when there are
+// none, the attributes are inserted as a new row
+void upsert_record(const char *table_name, const char *db_name, const char *key_field, const char *attributes,
+                   const char *ttl)
+{
+    Table *t = open_table_or_report(table_name, db_name);
+    if (!t)
+        return;
+
+    if (strcmp(key_field, "id") == 0)
+    {
+        print_error("Error: Ids are assigned on insert and cannot be an upsert key; use update <table> id:<n> ...\n");
+        return;
+    }
+
+    const char *found;
+    size_t found_len;
+    char key_value[200];
+    if (!record_find_field(attributes, key_field, &found, &found_len) || found_len == 0 ||
+        found_len >= sizeof(key_value))
+    {
+        print_error("Error: The attributes of an upsert must set its key field '%s'.\n", key_field);
+        return;
+    }
+    memcpy(key_value, found, found_len);
+    key_value[found_len] = '\0';
+
+    uint32_t seconds = 0;
+    if (ttl && (seconds = parse_ttl(ttl)) == 0)
+        return;
+
+    RecordFilter filter;
+    filter_init(&filter, t->dict, key_field, key_value);
+
+    if (explain_mode != EXPLAIN_OFF)
+    {
+        explain_line(0, "Upsert into %s on %s=%s: matching rows get new versions in the memtable, otherwise one is "
+                        "inserted (%zu of %zu KB used)", table_name, key_field, key_value, t->mem.bytes / 1024,
+                     memtable_limit / 1024);
+        int degree = explain_scan(t, &filter, 1);
+        if (explain_finish(estimate_rows(t, &filter), degree))
+            return;
+    }
+
+    // An explicit ttl also renews the expiry of the rows it updates
+    char changes[MAX_INPUT_SIZE + 64];
+    snprintf(changes, sizeof(changes), "%s", attributes);
+    if (seconds > 0)
+        snprintf(changes + strlen(changes), sizeof(changes) - strlen(changes), ", %s:%lld", TTL_FIELD,
+                 (long long)(expiry_now + seconds));
+
+    UpdateContext ctx = {NULL, NULL, changes, 0, {0}};
+    bool ok = table_scan_where(t, &filter, update_visitor, &ctx) && table_apply_changes(t, &ctx.changes);
+    memtable_clear(&ctx.changes);
+
+    if (!ok)
+    {
+        print_error("Error: Failed to upsert into table '%s'.\n", table_name);
+        return;
+    }
+
+    if (ctx.updated_count == 0)
+    {
+        insert_and_report(t, table_name, attributes, seconds);
+        return;
+    }
+
+    if (seconds > 0)
+    {
+        t->header.flags |= TABLE_FLAG_TTL;
+        t->header_dirty = true;
+    }
+    printf("Updated %d record(s) in table '%s' where %s=%s.\n", ctx.updated_count, table_name, key_field, key_value);
+}
+
+// Strip the table extension from a file name; false if it is not a table file
+bool table_name_from_file(const char *file_name, char *table_name, size_t size)
+{
+    size_t len = strlen(file_name);
+    size_t ext_len = strlen(TABLE_EXT);
+
+    if (len <= ext_len || len - ext_len >= size)
+        return false;
+
+    if (strcmp(file_name + len - ext_len, TABLE_EXT) != 0 && strcmp(file_name + len - ext_len, LEGACY_TABLE_EXT) != 0)
+        return false;
+
+    memcpy(table_name, file_name, len - ext_len);
+    table_name[len - ext_len] = '\0';
+    return true;
+}
+
+// List all tables in a given database
+void list_tables(const char *db_name)
+{
+    if (!db_name || db_name[0] == '\0')
+    {
+        print_error("Invalid database name.\n");
+        return;
+    }
 
-// Delete specific records from a table based on query
-void delete_record_from_table(const char *table_name, const char *db_name, const char *query)
-{
-    if (!check_table_exists(db_name, table_name))
+    if (!check_db_exists(db_name))
     {
-        printf("Error: Table '%s' does not exist in database '%s'.\n", table_name, db_name);
+        print_error("Database '%s' does not exist.\n", db_name);
         return;
     }
 
-    char table_path[300] = {0};
-#ifndef _WIN32
-    snprintf(table_path, sizeof(table_path), "db/%s/%s.txt", db_name, table_name);
-#else
-    snprintf(table_path, sizeof(table_path), "db\\%s\\%s.txt", db_name, table_name);
-#endif
+    printf("Tables in database '%s':\n", db_name);
+
+    const CatalogDb *d = catalog_find_db(db_name);
+    if (d->table_count == 0)
+        printf("No tables found.\n");
+    for (int i = 0; i < d->table_count; i++)
+        printf(" - %s\n", d->tables[i]);
+}
 
-    // Parse the query to extract field and value
-    char field[100], value[200];
-    if (sscanf(query, "%99[^:]:%199s", field, value) != 2)
+// drop DB folder
+void drop_db(const char *name)
+{
+    if (name == NULL || strlen(name) == 0)
     {
-        printf("Error: Invalid query format. Use 'field:value' (e.g., id:1 or name:Hello)\n");
+        print_error("Invalid database name.\n");
         return;
     }
 
-    // Create temporary file
-    char temp_path[300];
-#ifndef _WIN32
-    snprintf(temp_path, sizeof(temp_path), "db/%s/%s_temp.txt", db_name, table_name);
+    table_close_db(name, true);
+
+    char path[300] = {0};
+#ifdef _WIN32
+    snprintf(path, sizeof(path), "db\\%s", name);
 #else
-    snprintf(temp_path, sizeof(temp_path), "db\\%s\\%s_temp.txt", db_name, table_name);
+    snprintf(path, sizeof(path), "db/%s", name);
 #endif
+    int result = remove_dir_wrapper(path);
 
-    FILE *file = fopen(table_path, "r");
-    FILE *temp_file = fopen(temp_path, "w");
-
-    if (!file || !temp_file)
+    if (result == 0)
     {
-        printf("Error: Failed to open files for deletion.\n");
-        if (file)
-            fclose(file);
-        if (temp_file)
-            fclose(temp_file);
-        return;
+        catalog_remove_db(name);
+        printf("Database '%s' deleted from %s\n", name, path);
+    }
+    else
+    {
+        print_error("Failed to delete database. It may not exist or is not empty.\n");
     }
+}
 
-    char line[512];
-    int deleted_count = 0;
+// ---------------------------------------------------------------------------
+// Memory governor
+//
+// set memory_limit <KB> caps the memory nanoDB holds for data: the buffer
+// pool, the memtables, loaded segment entries, the result cache, the rows
+// held by sorts, joins and aggregates, and read-ahead buffers. Usage is
+// added up from the counters each of them already keeps, so it cannot
+// drift from what is really held; `memory` prints it.
+//
+// Under the limit each of them works within what is left:
+// - the buffer pool is sized by hand and may take at most half the limit;
+// - sorts and joins spill to disk once the total passes the limit (or they
+//   outgrow work_memory), and parallel scans buffer no more than is left;
+// - read-ahead only starts when its buffers fit, results are only cached
+//   when they fit, evicting older results to make room.
+// Between commands memory_reclaim brings the total back under the limit,
+// freeing what is cheapest to get back first: cached results, then the
+// memtables of the largest tables, flushed to segment files, then their
+// loaded segment entries, which are read again on next use. Tables being
+// scanned are left alone. Aggregates (count by) cannot spill; their groups
+// are counted and make the others give way.
+// ---------------------------------------------------------------------------
+
+#define MIN_WORK_MEMORY (64 * 1024) // below this a query operator does not spill for the limit
+
+size_t memory_limit = 0;     // 0: no limit
+size_t query_memory = 0;     // rows held by sorts, joins and aggregates
+size_t readahead_memory = 0; // buffers of running read-aheads
+size_t query_memory_peak = 0;
+
+// Memory freed or saved because of the limit
+uint64_t memory_evictions = 0; // cached results dropped
+uint64_t memory_flushes = 0;   // memtables flushed early
+uint64_t memory_unloads = 0;   // segment views dropped
+uint64_t memory_spills = 0;    // sorts and joins spilled before work_memory
+
+size_t memory_pool_bytes()
+{
+    return (size_t)pool.frame_count * (PAGE_SIZE + sizeof(BufferFrame) + 2 * sizeof(int));
+}
 
-    // Read each line and write to temp file if it doesn't match
-    while (fgets(line, sizeof(line), file))
+size_t memory_segment_bytes(const Table *t)
+{
+    return t->segs.capacity * sizeof(MemEntry) + t->segs.bytes;
+}
+
+size_t memory_used()
+{
+    size_t used = memory_pool_bytes() + result_cache.bytes + query_memory + readahead_memory;
+    for (int i = 0; i < MAX_OPEN_TABLES; i++)
     {
-        bool should_delete = false;
+        if (open_tables[i].in_use)
+            used += open_tables[i].mem.bytes + memory_segment_bytes(&open_tables[i]);
+    }
+    return used;
+}
+
+// Whether `bytes` more fit under the limit
+bool memory_fits(size_t bytes)
+{
+    return memory_limit == 0 || memory_used() + bytes <= memory_limit;
+}
 
-        // Check if the line contains the field=value or field:value pattern
-        char search_pattern_equals[300];
-        snprintf(search_pattern_equals, sizeof(search_pattern_equals), "%s=%s", field, value);
+// Called as a query operator grows: keeps the peak for `memory`
+void memory_query_grew()
+{
+    if (query_memory > query_memory_peak)
+        query_memory_peak = query_memory;
+}
 
-        char search_pattern_colon[300];
-        snprintf(search_pattern_colon, sizeof(search_pattern_colon), "%s:%s", field, value);
+// Whether a sort or join holding `bytes` has to spill: past work_memory, or
+// past the memory limit once it holds MIN_WORK_MEMORY
+bool work_memory_exceeded(size_t bytes)
+{
+    if (bytes > work_memory_limit)
+        return true;
+    if (bytes < MIN_WORK_MEMORY || memory_fits(0))
+        return false;
+    memory_spills++;
+    return true;
+}
 
-        char search_pattern_quoted[300];
-        snprintf(search_pattern_quoted, sizeof(search_pattern_quoted), "%s=\"%s\"", field, value);
+// Memory a query operator may plan to hold: work_memory, or what is left
+// under the limit when that is less (but at least MIN_WORK_MEMORY)
+size_t work_memory_budget()
+{
+    if (memory_limit == 0)
+        return work_memory_limit;
+    size_t used = memory_used();
+    size_t left = used < memory_limit ? memory_limit - used : 0;
+    if (left < MIN_WORK_MEMORY)
+        left = MIN_WORK_MEMORY;
+    return left < work_memory_limit ? left : work_memory_limit;
+}
 
-        if (strstr(line, search_pattern_equals) != NULL ||
-            strstr(line, search_pattern_colon) != NULL ||
-            strstr(line, search_pattern_quoted) != NULL)
+// The open table with the most memory to give back, NULL if none can
+Table *memory_reclaim_victim()
+{
+    Table *victim = NULL;
+    size_t most = 0;
+    for (int i = 0; i < MAX_OPEN_TABLES; i++)
+    {
+        Table *t = &open_tables[i];
+        size_t bytes = t->in_use && t->readers == 0 ? t->mem.bytes + memory_segment_bytes(t) : 0;
+        if (bytes > most)
         {
-            should_delete = true;
-            deleted_count++;
+            victim = t;
+            most = bytes;
         }
+    }
+    return victim;
+}
+
+// Bring the total back under the limit between commands
+void memory_reclaim()
+{
+    if (memory_limit == 0)
+        return;
+
+    while (!memory_fits(0) && result_cache.lru_head)
+    {
+        result_cache_remove(result_cache.lru_head);
+        result_cache.evictions++;
+        memory_evictions++;
+    }
 
-        // Write to temp file if not deleting
-        if (!should_delete)
+    Table *t;
+    while (!memory_fits(0) && (t = memory_reclaim_victim()) != NULL)
+    {
+        if (t->mem.count > 0)
+        {
+            MetricsPhase previous = metrics_enter(PHASE_WRITE);
+            bool ok = table_flush_memtable(t);
+            metrics_leave(previous);
+            if (!ok)
+                return;
+            memory_flushes++;
+        }
+        else if (t->segs.loaded)
         {
-            fputs(line, temp_file);
+            segment_view_clear(&t->segs);
+            memory_unloads++;
         }
+        else
+            return;
+    }
+}
+
+// memory: what each part holds and what the limit made them give up
+void print_memory()
+{
+    size_t mem = 0, segs = 0;
+    int mem_tables = 0, seg_tables = 0;
+    for (int i = 0; i < MAX_OPEN_TABLES; i++)
+    {
+        Table *t = &open_tables[i];
+        if (!t->in_use)
+            continue;
+        mem += t->mem.bytes;
+        segs += memory_segment_bytes(t);
+        mem_tables += t->mem.count > 0;
+        seg_tables += t->segs.loaded;
     }
 
-    fclose(file);
-    fclose(temp_file);
+    size_t used = memory_used();
+    if (memory_limit > 0)
+        printf("Memory: %zu KB of %zu KB (%.1f%%)\n", used / 1024, memory_limit / 1024,
+               100.0 * (double)used / (double)memory_limit);
+    else
+        printf("Memory: %zu KB, no limit\n", used / 1024);
+    printf("  %-16s %10zu KB  %d pages\n", "buffer pool", memory_pool_bytes() / 1024, pool.frame_count);
+    printf("  %-16s %10zu KB  %d table(s), flushed at %zu KB each\n", "memtables", mem / 1024, mem_tables,
+           memtable_limit / 1024);
+    printf("  %-16s %10zu KB  %d table(s) loaded\n", "segments", segs / 1024, seg_tables);
+    printf("  %-16s %10zu KB  %zu entries, at most %zu KB\n", "result cache", result_cache.bytes / 1024,
+           result_cache.count, result_cache.limit / 1024);
+    printf("  %-16s %10zu KB  peak %zu KB, work memory %zu KB\n", "query operators", query_memory / 1024,
+           query_memory_peak / 1024, work_memory_limit / 1024);
+    printf("  %-16s %10zu KB\n", "read-ahead", readahead_memory / 1024);
+    if (memory_limit > 0 || memory_evictions + memory_flushes + memory_unloads + memory_spills > 0)
+        printf("Under the limit: %llu result(s) evicted, %llu memtable(s) flushed early, %llu segment view(s) "
+               "dropped, %llu early spill(s)\n",
+               (unsigned long long)memory_evictions, (unsigned long long)memory_flushes,
+               (unsigned long long)memory_unloads, (unsigned long long)memory_spills);
+}
+
+// set memory_limit <KB>; 0 turns the limit off
+bool set_memory_limit(size_t limit)
+{
+    size_t pool_bytes = (size_t)pool_size_setting * PAGE_SIZE;
+    if (limit > 0 && pool_bytes > limit / 2)
+    {
+        print_error("Error: The buffer pool (%zu KB) must fit in half the memory limit; shrink it with "
+                    "'set buffer_pool' first.\n",
+                    pool_bytes / 1024);
+        return false;
+    }
+
+    memory_limit = limit;
+    memory_reclaim();
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Snapshots
+// snapshot db <name> to <file> writes every file of a database (pages,
+// block indexes, dictionaries, statistics, segments) into one container:
+//
+//   header     magic, page size, file count, database name
+//   directory  name, offset and size of each file
+//   files      each starting on a page boundary, in directory order
+//
+// restore db from <file> [as <name>] reads the directory and copies the
+// files back in one sequential pass, so restoring costs what reading the
+// snapshot costs; nothing is parsed or rebuilt. Open tables of the
+// database are flushed first so the snapshot is consistent.
+// ---------------------------------------------------------------------------
+
+#define SNAPSHOT_MAGIC "NANOSNP1"
+#define SNAPSHOT_MAX_FILES 65536
+#define SNAPSHOT_COPY_BUFFER (1024 * 1024)
+
+typedef struct
+{
+    char magic[8];
+    uint32_t page_size;
+    uint32_t file_count;
+    char db_name[112];
+} SnapshotHeader;
+
+typedef struct
+{
+    char name[104];
+    uint64_t offset; // from the start of the snapshot
+    uint64_t size;
+} SnapshotEntry;
+
+void snapshot_db_path(char *out, size_t size, const char *db_name, const char *file_name)
+{
+#ifdef _WIN32
+    snprintf(out, size, "db\\%s\\%s", db_name, file_name);
+#else
+    snprintf(out, size, "db/%s/%s", db_name, file_name);
+#endif
+}
+
+bool snapshot_add_entry(SnapshotEntry **entries, int *count, int *capacity, const char *name)
+{
+    if (strlen(name) >= sizeof((*entries)->name) || *count == SNAPSHOT_MAX_FILES)
+        return false;
+
+    int at = *count;
+    if (!catalog_make_gap((void **)entries, sizeof(SnapshotEntry), count, capacity, at))
+        return false;
+    memset(&(*entries)[at], 0, sizeof(SnapshotEntry));
+    strcpy((*entries)[at].name, name);
+    return true;
+}
+
+// The files in a database folder; false if one cannot be listed
+bool snapshot_list_files(const char *db_name, SnapshotEntry **entries, int *count)
+{
+    int capacity = 0;
+    bool ok = true;
+    *entries = NULL;
+    *count = 0;
+
+#ifndef _WIN32
+    char path[300];
+    snprintf(path, sizeof(path), "db/%s", db_name);
+    DIR *dir = opendir(path);
+    if (!dir)
+        return false;
+
+    struct dirent *entry;
+    while (ok && (entry = readdir(dir)) != NULL)
+    {
+        char file_path[512];
+        struct stat statbuf;
+        snprintf(file_path, sizeof(file_path), "db/%s/%s", db_name, entry->d_name);
+        if (stat(file_path, &statbuf) == 0 && S_ISREG(statbuf.st_mode))
+            ok = snapshot_add_entry(entries, count, &capacity, entry->d_name);
+    }
+    closedir(dir);
+#else
+    struct _finddata_t data;
+    char search_path[300];
+    snprintf(search_path, sizeof(search_path), "db\\%s\\*.*", db_name);
+
+    intptr_t handle = _findfirst(search_path, &data);
+    if (handle == -1)
+        return true;
+    do
+    {
+        if (!(data.attrib & _A_SUBDIR))
+            ok = snapshot_add_entry(entries, count, &capacity, data.name);
+    } while (ok && _findnext(handle, &data) == 0);
+    _findclose(handle);
+#endif
+    return ok;
+}
+
+// Copy `size` bytes, or up to the end of `from` when size is UINT64_MAX;
+// false on a read or write error
+bool snapshot_copy(FILE *from, FILE *to, uint64_t size, uint64_t *copied, char *buffer)
+{
+    *copied = 0;
+    while (*copied < size)
+    {
+        size_t want = size - *copied < SNAPSHOT_COPY_BUFFER ? (size_t)(size - *copied) : SNAPSHOT_COPY_BUFFER;
+        size_t got = fread(buffer, 1, want, from);
+        if (got > 0 && fwrite(buffer, 1, got, to) != got)
+            return false;
+
+        *copied += got;
+        metrics.bytes_read += got;
+        metrics.bytes_written += got;
+        if (got < want)
+            return size == UINT64_MAX && !ferror(from);
+    }
+    return true;
+}
+
+// Pad the output with zeros up to the next page boundary
+bool snapshot_align(FILE *file, uint64_t *position)
+{
+    static const char zeros[PAGE_SIZE];
+    size_t pad = (size_t)((PAGE_SIZE - *position % PAGE_SIZE) % PAGE_SIZE);
+    *position += pad;
+    metrics.bytes_written += pad;
+    return fwrite(zeros, 1, pad, file) == pad;
+}
 
-    // Replace original file with temp file
-    if (remove(table_path) != 0)
+// snapshot db <name> to <file>
+void snapshot_db(const char *db_name, const char *path)
+{
+    if (!check_db_exists(db_name))
+    {
+        print_error("Error: Database '%s' does not exist.\n", db_name);
+        return;
+    }
+    if (strlen(db_name) >= sizeof(((SnapshotHeader *)0)->db_name))
     {
-        printf("Error: Failed to remove original table file.\n");
-        remove(temp_path);
+        print_error("Error: Database name '%s' is too long for a snapshot.\n", db_name);
         return;
     }
 
-    if (rename(temp_path, table_path) != 0)
+    // Memtables and dirty pages go to disk first
+    table_close_db(db_name, true);
+
+    SnapshotEntry *entries;
+    int count;
+    if (!snapshot_list_files(db_name, &entries, &count))
     {
-        printf("Error: Failed to rename temporary file.\n");
+        print_error("Error: Failed to list the files of database '%s'.\n", db_name);
+        free(entries);
         return;
     }
 
-    if (deleted_count > 0)
+    FILE *out = fopen(path, "wb");
+    char *buffer = malloc(SNAPSHOT_COPY_BUFFER);
+    if (!out || !buffer)
     {
-        printf("Deleted %d record(s) from table '%s' where %s=%s.\n", deleted_count, table_name, field, value);
+        print_error("Error: Failed to create '%s'.\n", path);
+        if (out)
+            fclose(out);
+        free(buffer);
+        free(entries);
+        return;
     }
-    else
+
+    SnapshotHeader header = {{0}, PAGE_SIZE, (uint32_t)count, {0}};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    strcpy(header.db_name, db_name);
+
+    // The directory is written once the file sizes are known
+    uint64_t position = sizeof(header) + (uint64_t)count * sizeof(SnapshotEntry);
+    bool ok = seek_file(out, position) == 0 && snapshot_align(out, &position);
+    uint64_t total = 0;
+    for (int i = 0; ok && i < count; i++)
     {
-        printf("No records found matching the query.\n");
+        char file_path[512];
+        snapshot_db_path(file_path, sizeof(file_path), db_name, entries[i].name);
+        FILE *in = fopen(file_path, "rb");
+        entries[i].offset = position;
+        ok = in && snapshot_copy(in, out, UINT64_MAX, &entries[i].size, buffer);
+        if (in)
+            fclose(in);
+
+        position += entries[i].size;
+        total += entries[i].size;
+        ok = ok && snapshot_align(out, &position);
+    }
+
+    ok = ok && seek_file(out, 0) == 0 && fwrite(&header, sizeof(header), 1, out) == 1 &&
+         fwrite(entries, sizeof(SnapshotEntry), (size_t)count, out) == (size_t)count;
+    ok = fclose(out) == 0 && ok;
+    free(buffer);
+    free(entries);
+
+    if (!ok)
+    {
+        remove(path);
+        print_error("Error: Failed to write snapshot '%s'.\n", path);
+        return;
     }
+    printf("Database '%s' saved to '%s': %d file(s), %llu KB.\n", db_name, path, count,
+           (unsigned long long)(total / 1024));
 }
 
-// Delete entire table
-void delete_table(const char *table_name, const char *db_name)
+// Size of an open file, leaving it positioned at the end
+bool snapshot_file_size(FILE *fp, uint64_t *size)
 {
-    if (!check_table_exists(db_name, table_name))
+#ifdef _WIN32
+    if (_fseeki64(fp, 0, SEEK_END) != 0)
+        return false;
+    *size = (uint64_t)_ftelli64(fp);
+#else
+    if (fseeko(fp, 0, SEEK_END) != 0)
+        return false;
+    *size = (uint64_t)ftello(fp);
+#endif
+    return true;
+}
+
+// Names read from a snapshot must be terminated and stay inside db/
+bool snapshot_name_valid(const char *name, size_t size)
+{
+    size_t len = strnlen(name, size);
+    return len > 0 && len < size && !strchr(name, '/') && !strchr(name, '\\') && strcmp(name, ".") != 0 &&
+           strcmp(name, "..") != 0;
+}
+
+bool snapshot_entry_valid(const SnapshotEntry *e, uint64_t snapshot_size)
+{
+    return snapshot_name_valid(e->name, sizeof(e->name)) && e->offset <= snapshot_size &&
+           e->size <= snapshot_size - e->offset;
+}
+
+// Remove the first `count` restored files and the folder of a failed restore
+void snapshot_undo_restore(const char *db_name, const SnapshotEntry *entries, int count)
+{
+    for (int i = 0; i < count; i++)
     {
-        printf("Error: Table '%s' does not exist in database '%s'.\n", table_name, db_name);
-        return;
+        char file_path[512];
+        snapshot_db_path(file_path, sizeof(file_path), db_name, entries[i].name);
+        remove(file_path);
     }
 
-    char table_path[300] = {0};
-#ifndef _WIN32
-    snprintf(table_path, sizeof(table_path), "db/%s/%s.txt", db_name, table_name);
+    char path[300];
+#ifdef _WIN32
+    snprintf(path, sizeof(path), "db\\%s", db_name);
 #else
-    snprintf(table_path, sizeof(table_path), "db\\%s\\%s.txt", db_name, table_name);
+    snprintf(path, sizeof(path), "db/%s", db_name);
 #endif
+    remove_dir_wrapper(path);
+}
 
-    if (remove(table_path) == 0)
+// restore db from <file> [as <name>]
+void restore_db(const char *path, const char *as_name)
+{
+    FILE *in = fopen(path, "rb");
+    if (!in)
     {
-        printf("Table '%s' deleted successfully from database '%s'.\n", table_name, db_name);
+        print_error("Error: Failed to open snapshot '%s'.\n", path);
+        return;
     }
-    else
+
+    SnapshotHeader header;
+    SnapshotEntry *entries = NULL;
+    char *buffer = NULL;
+    uint64_t snapshot_size = 0;
+    bool ok = fread(&header, sizeof(header), 1, in) == 1 &&
+              memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) == 0 && header.page_size == PAGE_SIZE &&
+              header.file_count <= SNAPSHOT_MAX_FILES;
+    if (ok)
     {
-        printf("Error: Failed to delete table '%s'.\n", table_name);
+        entries = malloc((header.file_count ? header.file_count : 1) * sizeof(SnapshotEntry));
+        buffer = malloc(SNAPSHOT_COPY_BUFFER);
+        ok = entries && buffer &&
+             fread(entries, sizeof(SnapshotEntry), header.file_count, in) == header.file_count;
     }
-}
 
-// Delete entire database (recursive deletion)
-void delete_database(const char *db_name)
-{
-    if (!check_db_exists(db_name))
+    // The files must lie inside the snapshot
+    if (ok)
+        ok = snapshot_name_valid(header.db_name, sizeof(header.db_name)) && snapshot_file_size(in, &snapshot_size);
+    for (uint32_t i = 0; ok && i < header.file_count; i++)
+        ok = snapshot_entry_valid(&entries[i], snapshot_size);
+
+    if (!ok)
     {
-        printf("Error: Database '%s' does not exist.\n", db_name);
+        print_error("Error: '%s' is not a nanoDB snapshot or is damaged.\n", path);
+        fclose(in);
+        free(entries);
+        free(buffer);
         return;
     }
 
+    const char *db_name = as_name ? as_name : header.db_name;
     char db_path[300];
-#ifndef _WIN32
-    snprintf(db_path, sizeof(db_path), "db/%s", db_name);
-#else
+#ifdef _WIN32
     snprintf(db_path, sizeof(db_path), "db\\%s", db_name);
+#else
+    snprintf(db_path, sizeof(db_path), "db/%s", db_name);
 #endif
+    if (catalog_find_db(db_name) || make_dir(db_path) != 0)
+    {
+        print_error("Error: Database '%s' already exists. Use 'restore db from <file> as <name>'.\n", db_name);
+        fclose(in);
+        free(entries);
+        free(buffer);
+        return;
+    }
 
-    // First, delete all files in the database directory
-#ifdef _WIN32
-    struct _finddata_t data;
-    intptr_t handle;
-    char search_path[300];
-    snprintf(search_path, sizeof(search_path), "db\\%s\\*.*", db_name);
+    uint64_t total = 0;
+    int restored = 0;
+    for (; ok && restored < (int)header.file_count; restored++)
+    {
+        const SnapshotEntry *e = &entries[restored];
+        char file_path[512];
+        snapshot_db_path(file_path, sizeof(file_path), db_name, e->name);
+
+        uint64_t copied = 0;
+        FILE *out = fopen(file_path, "wb");
+        ok = out && seek_file(in, e->offset) == 0 && snapshot_copy(in, out, e->size, &copied, buffer);
+        if (out)
+            ok = fclose(out) == 0 && ok;
+        total += copied;
+    }
+    fclose(in);
+    free(buffer);
 
-    handle = _findfirst(search_path, &data);
-    if (handle != -1)
+    if (!ok)
     {
-        do
-        {
-            if (strcmp(data.name, ".") != 0 && strcmp(data.name, "..") != 0)
-            {
-                char file_path[300];
-                snprintf(file_path, sizeof(file_path), "db\\%s\\%s", db_name, data.name);
-                remove(file_path);
-            }
-        } while (_findnext(handle, &data) == 0);
-        _findclose(handle);
+        snapshot_undo_restore(db_name, entries, restored);
+        free(entries);
+        print_error("Error: Failed to restore database '%s' from '%s'.\n", db_name, path);
+        return;
     }
-#else
-    DIR *dir = opendir(db_path);
-    if (dir)
+    free(entries);
+
+    catalog_add_db(db_name);
+    catalog_refresh_db(db_name);
+    printf("Database '%s' restored from '%s': %d file(s), %llu KB.\n", db_name, path, restored,
+           (unsigned long long)(total / 1024));
+}
+
+// ---------------------------------------------------------------------------
+// Statements
+//
+// Data commands (get, joins, count, update, delete <table>, insert into
+// and upsert) are split into tokens and parsed once into a Statement, which
+// is run without looking at the text again. Parsed statements are kept in
+// a small cache keyed by the command text, so a command that repeats (a
+// dashboard query, a replayed trace) skips parsing entirely. Other commands
+// go through the command ladder in execute_command.
+//
+// prepare <name> as <command> parses a command whose table names and values
+// may be ? placeholders; execute <name> (<args>) fills them in order and
+// runs the statement without parsing it.
+// ---------------------------------------------------------------------------
+
+#define MAX_TOKENS (MAX_INPUT_SIZE / 2 + 1)
+#define STATEMENT_CACHE_SIZE 128
+#define STATEMENT_CACHE_BUCKETS 256
+#define MAX_PREPARED 32
+#define MAX_STATEMENT_PARAMS 16
+#define STATEMENT_FIELDS 12 // text fields a placeholder may stand in, see statement_fields
+
+typedef enum
+{
+    STMT_OTHER, // not a data command, left to execute_command
+    STMT_INVALID,
+    STMT_GET,
+    STMT_JOIN,
+    STMT_COUNT,
+    STMT_UPDATE,
+    STMT_DELETE,
+    STMT_INSERT,
+    STMT_UPSERT
+} StatementKind;
+
+typedef enum
+{
+    MATCH_CONTAINS,
+    MATCH_LIKE,
+    MATCH_STARTSWITH
+} TextMatch;
+
+typedef struct
+{
+    StatementKind kind;
+    const char *error; // STMT_INVALID: the message to print
+    char table[100];   // the left table of a join
+    char right_table[100];
+    char left_column[200];
+    char right_column[200];
+    char where[MAX_INPUT_SIZE]; // "field:value" or "field in (...)", empty for none
+    char text_field[100];  // get <field> contains|like|startswith <text>
+    TextMatch text_match;
+    char text[200];
+    char order_field[100]; // get: order by, count: by
+    bool desc;
+    size_t limit;
+    char set[200]; // update: "field:value"
+    char key[100]; // upsert: the field that identifies a row
+    char attributes[MAX_INPUT_SIZE];
+    char ttl[20]; // insert and upsert: seconds the row lives, empty for the table default
+} Statement;
+
+typedef struct
+{
+    const char *start;
+    size_t len;
+} Token;
+
+// Split a command at whitespace; a double quoted part stays in its token,
+// so name:"John Smith" is one token. Returns the count, -1 if too many.
+int lex_command(const char *input, Token *tokens, int max)
+{
+    int n = 0;
+    const char *p = input;
+
+    while (*p)
     {
-        struct dirent *entry;
-        while ((entry = readdir(dir)) != NULL)
+        while (is_blank(*p))
+            p++;
+        if (*p == '\0')
+            break;
+        if (n == max)
+            return -1;
+
+        const char *start = p;
+        bool quoted = false;
+        while (*p && (quoted || !is_blank(*p)))
         {
-            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
-            {
-                char file_path[300];
-                snprintf(file_path, sizeof(file_path), "db/%s/%s", db_name, entry->d_name);
-                remove(file_path);
-            }
+            if (*p == '"')
+                quoted = !quoted;
+            p++;
         }
-        closedir(dir);
+        tokens[n].start = start;
+        tokens[n].len = (size_t)(p - start);
+        n++;
     }
-#endif
+    return n;
+}
+
+bool token_is(const Token *token, const char *word)
+{
+    return strlen(word) == token->len && strncmp(token->start, word, token->len) == 0;
+}
+
+// Copy a token; false if it does not fit
+bool token_copy(const Token *token, char *out, size_t size)
+{
+    if (token->len >= size)
+        return false;
+    memcpy(out, token->start, token->len);
+    out[token->len] = '\0';
+    return true;
+}
+
+StatementKind statement_error(Statement *s, const char *error)
+{
+    s->kind = STMT_INVALID;
+    s->error = error;
+    return s->kind;
+}
+
+// "<field> in (<v1>, <v2>, ...)" from token i on, joined into `out` with
+// single spaces. Returns the number of tokens it takes, 0 when token i does
+// not start an in list, -1 when the list is not closed or does not fit.
+int parse_in_clause(const Token *t, int n, int i, char *out, size_t size)
+{
+    if (i + 2 >= n || !token_is(&t[i + 1], "in") || t[i + 2].start[0] != '(' || memchr(t[i].start, ':', t[i].len))
+        return 0;
 
-    // Now remove the directory itself
-#ifdef _WIN32
-    if (_rmdir(db_path) == 0)
-#else
-    if (rmdir(db_path) == 0)
-#endif
-    {
-        printf("Database '%s' deleted successfully.\n", db_name);
-    }
-    else
+    size_t used = 0;
+    for (int j = i; j < n; j++)
     {
-        printf("Error: Failed to delete database '%s'.\n", db_name);
+        if (used + t[j].len + 1 >= size)
+            return -1;
+        if (j > i)
+            out[used++] = ' ';
+        memcpy(out + used, t[j].start, t[j].len);
+        used += t[j].len;
+        out[used] = '\0';
+        if (j > i + 1 && t[j].start[t[j].len - 1] == ')')
+            return j - i + 1;
     }
+    return -1;
 }
 
-// Get all data from a table
-void get_all_data(const char *table_name, const char *db_name)
+// get <a> join <b> on <a>.<field> = <b>.<field> [where [<table>.]<field:value>]
+StatementKind parse_join(const Token *t, int n, Statement *s)
 {
-    if (!check_table_exists(db_name, table_name))
+    const char *error = "Invalid join syntax. Use 'get <a> join <b> on <a>.<field> = <b>.<field> [where <field:value>]'";
+    if (n < 6 || !token_is(&t[4], "on") || !token_copy(&t[1], s->table, sizeof(s->table)) ||
+        !token_copy(&t[3], s->right_table, sizeof(s->right_table)))
+        return statement_error(s, error);
+
+    // "a.x = b.y" with or without spaces around '='
+    char condition[MAX_INPUT_SIZE] = {0};
+    size_t used = 0;
+    int i = 5;
+    for (; i < n && !token_is(&t[i], "where"); i++)
     {
-        printf("Error: Table '%s' does not exist in database '%s'.\n", table_name, db_name);
-        return;
+        if (used + t[i].len >= sizeof(condition))
+            return statement_error(s, error);
+        memcpy(condition + used, t[i].start, t[i].len);
+        used += t[i].len;
     }
 
-    char table_path[300] = {0};
-#ifndef _WIN32
-    snprintf(table_path, sizeof(table_path), "db/%s/%s.txt", db_name, table_name);
-#else
-    snprintf(table_path, sizeof(table_path), "db\\%s\\%s.txt", db_name, table_name);
-#endif
+    char *eq = strchr(condition, '=');
+    if (!eq || eq == condition || eq[1] == '\0' || (size_t)(eq - condition) >= sizeof(s->left_column) ||
+        strlen(eq + 1) >= sizeof(s->right_column))
+        return statement_error(s, error);
+    memcpy(s->left_column, condition, (size_t)(eq - condition));
+    strcpy(s->right_column, eq + 1);
 
-    FILE *file = fopen(table_path, "r");
-    if (!file)
+    if (i < n && (i + 2 != n || !token_copy(&t[i + 1], s->where, sizeof(s->where))))
+        return statement_error(s, error);
+    return s->kind = STMT_JOIN;
+}
+
+// get <table> [<field:value>|<field> in (...)] [order by <field> [asc|desc]] [limit <n>]
+// get <table> <field> contains "<words>"
+// get <table> <field> like "<pattern>" / startswith "<prefix>"
+StatementKind parse_get(const Token *t, int n, Statement *s)
+{
+    const char *error = "Invalid get syntax. Use 'get <table> [<field:value>] [order by <field> [desc]] [limit <n>]'";
+    if (n >= 3 && token_is(&t[2], "join"))
+        return parse_join(t, n, s);
+    if (!token_copy(&t[1], s->table, sizeof(s->table)))
+        return statement_error(s, error);
+
+    // The text keeps its (optional) quotes, which the search skips
+    if (n >= 4 && (token_is(&t[3], "contains") || token_is(&t[3], "like") || token_is(&t[3], "startswith")))
     {
-        printf("Error: Failed to open table file.\n");
-        return;
+        s->text_match = token_is(&t[3], "like")         ? MATCH_LIKE
+                        : token_is(&t[3], "startswith") ? MATCH_STARTSWITH
+                                                        : MATCH_CONTAINS;
+        if (n != 5 || !token_copy(&t[2], s->text_field, sizeof(s->text_field)) ||
+            !token_copy(&t[4], s->text, sizeof(s->text)))
+            return statement_error(s, "Invalid syntax. Use 'get <table> <field> contains|like|startswith \"<text>\"'");
+        return s->kind = STMT_GET;
     }
 
-    char line[512];
-    int count = 0;
-
-    printf("Data from table '%s':\n", table_name);
-    printf("-----------------------------------\n");
-
-    while (fgets(line, sizeof(line), file))
+    for (int i = 2; i < n; i++)
     {
-        // Remove trailing newline
-        size_t len = strlen(line);
-        if (len > 0 && line[len - 1] == '\n')
-            line[len - 1] = '\0';
-
-        if (strlen(line) > 0)
+        if (token_is(&t[i], "order"))
         {
-            printf("%s\n", line);
-            count++;
+            if (s->order_field[0] || i + 2 >= n || !token_is(&t[i + 1], "by") ||
+                !token_copy(&t[i + 2], s->order_field, sizeof(s->order_field)))
+                return statement_error(s, error);
+            i += 2;
+        }
+        else if (s->order_field[0] && (token_is(&t[i], "asc") || token_is(&t[i], "desc")))
+        {
+            s->desc = token_is(&t[i], "desc");
+        }
+        else if (token_is(&t[i], "limit"))
+        {
+            char count[32];
+            long limit = i + 1 < n && token_copy(&t[i + 1], count, sizeof(count)) ? atol(count) : 0;
+            if (limit <= 0)
+                return statement_error(s, error);
+            s->limit = (size_t)limit;
+            i++;
+        }
+        else if (!s->where[0] && !s->order_field[0] && !s->limit)
+        {
+            int used = parse_in_clause(t, n, i, s->where, sizeof(s->where));
+            if (used < 0 || (used == 0 && !token_copy(&t[i], s->where, sizeof(s->where))))
+                return statement_error(s, error);
+            if (used > 0)
+                i += used - 1;
+        }
+        else
+        {
+            return statement_error(s, error);
         }
     }
-
-    printf("-----------------------------------\n");
-    printf("Total records: %d\n", count);
-
-    fclose(file);
+    return s->kind = STMT_GET;
 }
 
-// Get filtered data from a table based on query (e.g., id:1 or name:Hello)
-void get_filtered_data(const char *table_name, const char *db_name, const char *query)
+// The attributes of insert or upsert from token `first` on, with an optional
+// trailing "ttl <seconds>"
+StatementKind parse_attributes(const Token *t, int n, int first, Statement *s, StatementKind kind)
 {
-    if (!check_table_exists(db_name, table_name))
+    size_t len = strlen(t[first].start);
+    if (n - first >= 3 && token_is(&t[n - 2], "ttl"))
     {
-        printf("Error: Table '%s' does not exist in database '%s'.\n", table_name, db_name);
-        return;
+        if (!token_copy(&t[n - 1], s->ttl, sizeof(s->ttl)))
+            return statement_error(s, kind == STMT_UPSERT ? "Error: Invalid ttl for upsert." : "Error: Invalid ttl for insert.");
+        len = (size_t)(t[n - 2].start - t[first].start);
+        while (len > 0 && is_blank(t[first].start[len - 1]))
+            len--;
     }
+    if (len >= sizeof(s->attributes))
+        return statement_error(s, kind == STMT_UPSERT ? "Error: Attributes are too long for upsert."
+                                                      : "Error: Attributes are too long for insert.");
+    memcpy(s->attributes, t[first].start, len);
+    s->attributes[len] = '\0';
+    return s->kind = kind;
+}
 
-    char table_path[300] = {0};
-#ifndef _WIN32
-    snprintf(table_path, sizeof(table_path), "db/%s/%s.txt", db_name, table_name);
-#else
-    snprintf(table_path, sizeof(table_path), "db\\%s\\%s.txt", db_name, table_name);
-#endif
+// Parse a data command into `s`; STMT_OTHER for any other command
+StatementKind parse_statement(const char *input, Statement *s)
+{
+    Token t[MAX_TOKENS];
+    memset(s, 0, sizeof(*s));
 
-    FILE *file = fopen(table_path, "r");
-    if (!file)
+    int n = lex_command(input, t, MAX_TOKENS);
+    if (n < 2)
+        return STMT_OTHER;
+
+    if (token_is(&t[0], "get"))
+        return parse_get(t, n, s);
+
+    if (token_is(&t[0], "count"))
     {
-        printf("Error: Failed to open table file.\n");
-        return;
+        if (!token_copy(&t[1], s->table, sizeof(s->table)) ||
+            (n != 2 && (n != 4 || !token_is(&t[2], "by") || !token_copy(&t[3], s->order_field, sizeof(s->order_field)))))
+            return statement_error(s, "Invalid count syntax. Use 'count <table>' or 'count <table> by <field>'");
+        return s->kind = STMT_COUNT;
     }
 
-    // Parse the query to extract field and value (e.g., "id:1" or "name:Hello")
-    char field[100], value[200];
-    if (sscanf(query, "%99[^:]:%199s", field, value) != 2)
+    // update <table> <where_field:value>|<field> in (...) <set_field:value>
+    if (token_is(&t[0], "update"))
     {
-        printf("Error: Invalid query format. Use 'field:value' (e.g., id:1 or name:Hello)\n");
-        fclose(file);
-        return;
+        int used = parse_in_clause(t, n, 2, s->where, sizeof(s->where));
+        if (used == 0 && n > 2)
+            used = token_copy(&t[2], s->where, sizeof(s->where)) ? 1 : -1;
+        if (used <= 0 || n != 3 + used || !token_copy(&t[1], s->table, sizeof(s->table)) ||
+            !token_copy(&t[n - 1], s->set, sizeof(s->set)))
+            return statement_error(s, "Invalid update syntax. Use 'update <table> <where_field:value> <set_field:value>'\n"
+                                      "Example: update Users id:1 name:NewName or update Users id in (1, 2) name:NewName");
+        return s->kind = STMT_UPDATE;
     }
 
-    char line[512];
-    int count = 0;
-    bool found = false;
-
-    printf("Filtered data from table '%s' where %s=%s:\n", table_name, field, value);
-    printf("-----------------------------------\n");
-
-    while (fgets(line, sizeof(line), file))
+    if (token_is(&t[0], "delete"))
     {
-        // Remove trailing newline
-        size_t len = strlen(line);
-        if (len > 0 && line[len - 1] == '\n')
-            line[len - 1] = '\0';
-
-        if (strlen(line) > 0)
-        {
-            // Check if the line contains the field=value or field:value pattern
-            char search_pattern_equals[300];
-            snprintf(search_pattern_equals, sizeof(search_pattern_equals), "%s=%s", field, value);
-
-            char search_pattern_colon[300];
-            snprintf(search_pattern_colon, sizeof(search_pattern_colon), "%s:%s", field, value);
+        // delete db <name> and delete table <name> drop whole objects
+        if (n >= 3 && (token_is(&t[1], "db") || token_is(&t[1], "table")))
+            return STMT_OTHER;
+        int used = parse_in_clause(t, n, 2, s->where, sizeof(s->where));
+        if (used == 0 && n > 2)
+            used = token_copy(&t[2], s->where, sizeof(s->where)) ? 1 : -1;
+        if (used <= 0 || n != 2 + used || !token_copy(&t[1], s->table, sizeof(s->table)))
+            return statement_error(s, "Invalid delete syntax. Use:\n - delete <table> <field:value>\n"
+                                      " - delete <table> <field> in (<value>, ...)\n"
+                                      " - delete table <name>\n - delete db <name>");
+        return s->kind = STMT_DELETE;
+    }
 
-            // Also check for quoted values
-            char search_pattern_quoted[300];
-            snprintf(search_pattern_quoted, sizeof(search_pattern_quoted), "%s=\"%s\"", field, value);
+    // insert into <table> [set] name="jibon", roll=12, ...
+    if (token_is(&t[0], "insert") && token_is(&t[1], "into") && n >= 3)
+    {
+        int first = n > 3 && token_is(&t[3], "set") ? 4 : 3;
+        if (n == 3 || !token_copy(&t[2], s->table, sizeof(s->table)))
+            return statement_error(s, "Invalid insert syntax.");
+        if (first == n)
+            return statement_error(s, "Error: No attributes provided for insert.");
+        return parse_attributes(t, n, first, s, STMT_INSERT);
+    }
 
-            if (strstr(line, search_pattern_equals) != NULL ||
-                strstr(line, search_pattern_colon) != NULL ||
-                strstr(line, search_pattern_quoted) != NULL)
-            {
-                printf("%s\n", line);
-                count++;
-                found = true;
-            }
-        }
+    // upsert <table> key:<field> set name="jibon", roll=12, ... [ttl <seconds>]
+    if (token_is(&t[0], "upsert"))
+    {
+        if (n < 5 || !token_copy(&t[1], s->table, sizeof(s->table)) || t[2].len <= 4 ||
+            strncmp(t[2].start, "key:", 4) != 0 || t[2].len - 4 >= sizeof(s->key) || !token_is(&t[3], "set"))
+            return statement_error(s, "Invalid upsert syntax. Use 'upsert <table> key:<field> set <fields>'\n"
+                                      "Example: upsert users key:email set email:a@b.c, name:Ann");
+        memcpy(s->key, t[2].start + 4, t[2].len - 4);
+        s->key[t[2].len - 4] = '\0';
+        return parse_attributes(t, n, 4, s, STMT_UPSERT);
     }
+    return STMT_OTHER;
+}
 
-    printf("-----------------------------------\n");
-    if (found)
+void execute_statement(const Statement *s)
+{
+    if (s->kind == STMT_INVALID)
     {
-        printf("Total matching records: %d\n", count);
+        print_error("%s\n", s->error);
     }
-    else
+    else if (s->kind == STMT_GET && s->text_field[0] && s->text_match == MATCH_CONTAINS)
     {
-        printf("No records found matching the query.\n");
+        get_text_data(s->table, DB, s->text_field, s->text);
+    }
+    else if (s->kind == STMT_GET && s->text_field[0])
+    {
+        get_pattern_data(s->table, DB, s->text_field, s->text, s->text_match == MATCH_STARTSWITH);
+    }
+    else if (s->kind == STMT_GET && (s->order_field[0] || s->limit))
+    {
+        SortSpec spec = {s->order_field[0] ? s->order_field : NULL, s->desc, s->limit};
+        get_ordered_data(s->table, DB, s->where[0] ? s->where : NULL, &spec);
+    }
+    else if (s->kind == STMT_GET && s->where[0])
+    {
+        get_filtered_data(s->table, DB, s->where);
+    }
+    else if (s->kind == STMT_GET)
+    {
+        get_all_data(s->table, DB);
+    }
+    else if (s->kind == STMT_JOIN)
+    {
+        join_tables(s->table, s->right_table, DB, s->left_column, s->right_column, s->where[0] ? s->where : NULL);
+    }
+    else if (s->kind == STMT_COUNT)
+    {
+        count_records(s->table, DB, s->order_field[0] ? s->order_field : NULL);
     }
+    else if (s->kind == STMT_UPDATE)
+    {
+        update_record_in_table(s->table, DB, s->where, s->set);
+    }
+    else if (s->kind == STMT_DELETE)
+    {
+        delete_record_from_table(s->table, DB, s->where);
+    }
+    else if (s->kind == STMT_INSERT)
+    {
+        insert_table_with_attributes(s->table, DB, s->attributes, s->ttl[0] ? s->ttl : NULL);
+    }
+    else if (s->kind == STMT_UPSERT)
+    {
+        upsert_record(s->table, DB, s->key, s->attributes, s->ttl[0] ? s->ttl : NULL);
+    }
+}
 
-    fclose(file);
+// Parsed data commands by text; the least recently used one is replaced
+typedef struct
+{
+    bool in_use;
+    char text[MAX_INPUT_SIZE];
+    Statement stmt;
+    int hash_next; // index + 1, 0 ends the chain
+    unsigned long last_used;
+} CachedStatement;
+
+CachedStatement statement_cache[STATEMENT_CACHE_SIZE];
+int statement_buckets[STATEMENT_CACHE_BUCKETS]; // index + 1, 0 = empty
+unsigned long statement_clock = 0;
+uint64_t statement_cache_hits = 0;
+uint64_t statement_cache_misses = 0;
+
+void statement_cache_unlink(int i)
+{
+    const CachedStatement *c = &statement_cache[i];
+    int *link = &statement_buckets[hash_bytes(c->text, strlen(c->text)) % STATEMENT_CACHE_BUCKETS];
+    while (*link && *link != i + 1)
+        link = &statement_cache[*link - 1].hash_next;
+    if (*link)
+        *link = c->hash_next;
 }
 
-// insert into table with attributes
-void insert_table_with_attributes(const char *table_name, const char *db_name, const char *attributes)
+// The parsed form of a data command, parsed and cached on a miss; NULL for
+// other commands. Text too long to cache is parsed into `scratch`.
+const Statement *statement_cache_fetch(const char *input, Statement *scratch)
 {
-    if (!check_table_exists(db_name, table_name))
+    size_t len = strlen(input);
+    if (len >= MAX_INPUT_SIZE)
+        return parse_statement(input, scratch) == STMT_OTHER ? NULL : scratch;
+
+    uint32_t bucket = hash_bytes(input, len) % STATEMENT_CACHE_BUCKETS;
+    for (int i = statement_buckets[bucket]; i; i = statement_cache[i - 1].hash_next)
     {
-        printf("Error: Table '%s' does not exist in database '%s'.\n", table_name, db_name);
-        return;
+        CachedStatement *c = &statement_cache[i - 1];
+        if (strcmp(c->text, input) == 0)
+        {
+            c->last_used = ++statement_clock;
+            statement_cache_hits++;
+            return &c->stmt;
+        }
     }
-    char table_path[300] = {0};
-#ifndef _WIN32
-    snprintf(table_path, sizeof(table_path), "db/%s/%s.txt", db_name, table_name);
-#else
-    snprintf(table_path, sizeof(table_path), "db\\%s\\%s.txt", db_name, table_name);
-#endif
 
-    FILE *file = fopen(table_path, "a");
-    if (!file)
+    if (parse_statement(input, scratch) == STMT_OTHER)
+        return NULL;
+    statement_cache_misses++;
+
+    int slot = 0;
+    for (int i = 0; i < STATEMENT_CACHE_SIZE; i++)
     {
-        printf("Error: Failed to open table file for appending.\n");
-        return;
+        if (!statement_cache[i].in_use)
+        {
+            slot = i;
+            break;
+        }
+        if (statement_cache[i].last_used < statement_cache[slot].last_used)
+            slot = i;
     }
 
-    int next_id = get_next_id(db_name, table_name);
+    CachedStatement *c = &statement_cache[slot];
+    if (c->in_use)
+        statement_cache_unlink(slot);
+    c->in_use = true;
+    memcpy(c->text, input, len + 1);
+    c->stmt = *scratch;
+    c->last_used = ++statement_clock;
+    c->hash_next = statement_buckets[bucket];
+    statement_buckets[bucket] = slot + 1;
+    return &c->stmt;
+}
 
-    // Write the new record
-    fprintf(file, "id:%d, %s\n", next_id, attributes);
-    fflush(file); // Ensure data is written to disk
+void print_statement_cache_summary()
+{
+    uint64_t lookups = statement_cache_hits + statement_cache_misses;
+    if (lookups == 0)
+        return;
+    printf("Statement cache: %llu hits, %llu misses (%.1f%% of data commands skipped parsing)\n",
+           (unsigned long long)statement_cache_hits, (unsigned long long)statement_cache_misses,
+           100.0 * (double)statement_cache_hits / (double)lookups);
+}
 
-    printf("Inserted record with ID %d into table '%s'.\n", next_id, table_name);
+typedef struct
+{
+    bool in_use;
+    char name[50];
+    Statement stmt; // ? placeholders left in its text fields
+    int param_count;
+} PreparedStatement;
 
-    fclose(file);
-}
+PreparedStatement prepared_statements[MAX_PREPARED];
 
-// List all tables in a given database
-void list_tables(const char *db_name)
+// The text fields of a statement in the order they appear in its command,
+// which is the order its placeholders are numbered in
+int statement_fields(Statement *s, char **fields, size_t *sizes)
 {
-    if (!db_name || db_name[0] == '\0')
+    char *f[] = {s->table, s->right_table, s->left_column, s->right_column, s->where, s->text_field,
+                 s->text,  s->order_field, s->set,         s->key,          s->attributes, s->ttl};
+    size_t z[] = {sizeof(s->table),      sizeof(s->right_table), sizeof(s->left_column), sizeof(s->right_column),
+                  sizeof(s->where),      sizeof(s->text_field),  sizeof(s->text),        sizeof(s->order_field),
+                  sizeof(s->set),        sizeof(s->key),         sizeof(s->attributes),  sizeof(s->ttl)};
+    int count = (int)(sizeof(f) / sizeof(f[0]));
+    for (int i = 0; i < count; i++)
     {
-        printf("Invalid database name.\n");
-        return;
+        fields[i] = f[i];
+        sizes[i] = z[i];
     }
+    return count;
+}
 
-    if (!check_db_exists(db_name))
+// Placeholders outside double quotes
+int count_placeholders(const char *text)
+{
+    int count = 0;
+    bool quoted = false;
+    for (const char *p = text; *p; p++)
     {
-        printf("Database '%s' does not exist.\n", db_name);
-        return;
+        if (*p == '"')
+            quoted = !quoted;
+        else if (*p == '?' && !quoted)
+            count++;
     }
+    return count;
+}
 
-    printf("Tables in database '%s':\n", db_name);
-
-#ifndef _WIN32
-    char path[300];
-    snprintf(path, sizeof(path), "db/%s", db_name);
-    DIR *dir = opendir(path);
-
-    if (!dir)
+PreparedStatement *find_prepared(const char *name)
+{
+    for (int i = 0; i < MAX_PREPARED; i++)
     {
-        printf("No tables found.\n");
-        return;
+        if (prepared_statements[i].in_use && strcmp(prepared_statements[i].name, name) == 0)
+            return &prepared_statements[i];
     }
+    return NULL;
+}
 
-    struct dirent *entry;
-    bool found = false;
-
-    while ((entry = readdir(dir)) != NULL)
+// prepare <name> as <command>
+bool prepare_statement(const char *name, const char *command)
+{
+    size_t name_len = strlen(name);
+    if (name_len == 0 || name_len >= sizeof(prepared_statements[0].name) ||
+        strspn(name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_") != name_len)
     {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue;
-
-        // Only show .txt files (tables)
-        size_t len = strlen(entry->d_name);
-        if (len > 4 && strcmp(entry->d_name + len - 4, ".txt") == 0)
-        {
-            if (!found)
-                found = true;
-            // Remove .txt extension when printing
-            char table_name[100];
-            strncpy(table_name, entry->d_name, len - 4);
-            table_name[len - 4] = '\0';
-            printf(" - %s\n", table_name);
-        }
+        print_error("Error: Statement names use letters, digits and '_' (at most 49).\n");
+        return false;
     }
 
-    closedir(dir);
-
-    if (!found)
-        printf("No tables found.\n");
+    Statement stmt;
+    StatementKind kind = parse_statement(command, &stmt);
+    if (kind == STMT_OTHER)
+    {
+        print_error("Error: Only get, count, update, delete, insert and upsert commands can be prepared.\n");
+        return false;
+    }
+    if (kind == STMT_INVALID)
+    {
+        print_error("%s\n", stmt.error);
+        return false;
+    }
 
-#else
-    struct _finddata_t data;
-    intptr_t handle;
-    char search_path[300];
-    snprintf(search_path, sizeof(search_path), "db\\%s\\*.txt", db_name);
+    char *fields[STATEMENT_FIELDS];
+    size_t sizes[STATEMENT_FIELDS];
+    int params = 0;
+    int field_count = statement_fields(&stmt, fields, sizes);
+    for (int i = 0; i < field_count; i++)
+        params += count_placeholders(fields[i]);
+    if (params > MAX_STATEMENT_PARAMS)
+    {
+        print_error("Error: A statement takes at most %d parameters.\n", MAX_STATEMENT_PARAMS);
+        return false;
+    }
 
-    handle = _findfirst(search_path, &data);
-    if (handle == -1)
+    PreparedStatement *p = find_prepared(name);
+    for (int i = 0; i < MAX_PREPARED && !p; i++)
     {
-        printf("No tables found.\n");
-        return;
+        if (!prepared_statements[i].in_use)
+            p = &prepared_statements[i];
+    }
+    if (!p)
+    {
+        print_error("Error: Too many prepared statements (at most %d). Use 'deallocate <name>'.\n", MAX_PREPARED);
+        return false;
     }
 
-    bool found = false;
+    p->in_use = true;
+    strcpy(p->name, name);
+    p->stmt = stmt;
+    p->param_count = params;
+    printf("Statement '%s' prepared with %d parameter(s).\n", name, params);
+    return true;
+}
 
-    do
+// Split "(a, "b, c", 3)" into arguments; false on a syntax error
+bool parse_arguments(const char *text, char args[][MAX_INPUT_SIZE], int max, int *count)
+{
+    *count = 0;
+    while (is_blank(*text))
+        text++;
+    if (*text == '\0')
+        return true;
+
+    size_t len = strlen(text);
+    while (len > 0 && is_blank(text[len - 1]))
+        len--;
+    if (text[0] != '(' || text[len - 1] != ')')
+        return false;
+
+    const char *p = text + 1, *end = text + len - 1;
+    while (p < end && is_blank(*p))
+        p++;
+    if (p == end)
+        return true;
+
+    while (p <= end)
     {
-        char table_name[100];
-        size_t len = strlen(data.name);
-        if (len > 4 && strcmp(data.name + len - 4, ".txt") == 0)
+        const char *start = p;
+        bool quoted = false;
+        while (p < end && (quoted || *p != ','))
         {
-            if (!found)
-                found = true;
-            strncpy(table_name, data.name, len - 4);
-            table_name[len - 4] = '\0';
-            printf(" - %s\n", table_name);
+            if (*p == '"')
+                quoted = !quoted;
+            p++;
         }
-    } while (_findnext(handle, &data) == 0);
-
-    _findclose(handle);
 
-    if (!found)
-        printf("No tables found.\n");
-
-#endif
+        const char *stop = p;
+        while (start < stop && is_blank(*start))
+            start++;
+        while (stop > start && is_blank(stop[-1]))
+            stop--;
+        if (*count == max || stop == start || (size_t)(stop - start) >= MAX_INPUT_SIZE)
+            return false;
+
+        memcpy(args[*count], start, (size_t)(stop - start));
+        args[*count][stop - start] = '\0';
+        (*count)++;
+        p++; // past the ',' (or the closing parenthesis)
+    }
+    return true;
 }
 
-// drop DB folder
-void drop_db(const char *name)
+// execute <name> [(<args>)]
+bool execute_prepared(const char *name, const char *arguments)
 {
-    if (name == NULL || strlen(name) == 0)
+    PreparedStatement *p = find_prepared(name);
+    if (!p)
     {
-        printf("Invalid database name.\n");
-        return;
+        print_error("Error: No prepared statement '%s'.\n", name);
+        return false;
     }
-    char path[300] = {0};
-#ifdef _WIN32
-    snprintf(path, sizeof(path), "db\\%s", name);
-#else
-    snprintf(path, sizeof(path), "db/%s", name);
-#endif
-    int result = remove_dir_wrapper(path);
 
-    if (result == 0)
+    char args[MAX_STATEMENT_PARAMS][MAX_INPUT_SIZE];
+    int argc;
+    if (!parse_arguments(arguments, args, MAX_STATEMENT_PARAMS, &argc))
     {
-        printf("Database '%s' deleted from %s\n", name, path);
+        print_error("Invalid execute syntax. Use 'execute <name> (<value>, <value>, ...)'\n");
+        return false;
     }
-    else
+    if (argc != p->param_count)
+    {
+        print_error("Error: Statement '%s' takes %d argument(s), got %d.\n", name, p->param_count, argc);
+        return false;
+    }
+
+    // Fill the placeholders field by field
+    Statement stmt = p->stmt;
+    char *fields[STATEMENT_FIELDS];
+    size_t sizes[STATEMENT_FIELDS];
+    int field_count = statement_fields(&stmt, fields, sizes);
+    int next = 0;
+    for (int i = 0; i < field_count; i++)
+    {
+        if (count_placeholders(fields[i]) == 0)
+            continue;
+
+        char bound[MAX_INPUT_SIZE * 2];
+        size_t used = 0;
+        bool quoted = false;
+        for (const char *c = fields[i]; *c; c++)
+        {
+            const char *piece = c;
+            size_t piece_len = 1;
+            if (*c == '"')
+                quoted = !quoted;
+            else if (*c == '?' && !quoted)
+            {
+                piece = args[next++];
+                piece_len = strlen(piece);
+            }
+
+            if (used + piece_len >= sizes[i])
+            {
+                print_error("Error: Arguments are too long for statement '%s'.\n", name);
+                return false;
+            }
+            memcpy(bound + used, piece, piece_len);
+            used += piece_len;
+        }
+        bound[used] = '\0';
+        strcpy(fields[i], bound);
+    }
+    execute_statement(&stmt);
+    return true;
+}
+
+// deallocate <name>
+void deallocate_statement(const char *name)
+{
+    PreparedStatement *p = find_prepared(name);
+    if (!p)
     {
-        printf("Failed to delete database. It may not exist or is not empty.\n");
+        print_error("Error: No prepared statement '%s'.\n", name);
+        return;
     }
+    p->in_use = false;
+    printf("Statement '%s' deallocated.\n", name);
 }
 
 // Command run
-void process_command(const char *input)
+// Run one command; process_command wraps it with the instrumentation
+void execute_command(const char *input)
 {
     char cmd[50], type[50], name[100];
 
+    // get, count, update, delete <table> and insert into run from their parsed form
+    Statement scratch;
+    const Statement *stmt = statement_cache_fetch(input, &scratch);
+    if (stmt)
+    {
+        execute_statement(stmt);
+        return;
+    }
+
+    // From a nanodb_scan callback only data commands run: the others may
+    // close, rewrite or drop the table being scanned
+    if (active_scans > 0 && strncmp(input, "execute ", 8) != 0)
+    {
+        print_error("Error: Only get, count, insert, upsert, update, delete and execute can run during a scan.\n");
+        return;
+    }
+
     int parts = sscanf(input, "%49s %49s %99s", cmd, type, name);
 
     // create db <name>
@@ -1034,7 +11553,32 @@ void process_command(const char *input)
     // drop db <name>
     if (parts == 3 && strcmp(cmd, "drop") == 0 && strcmp(type, "db") == 0)
     {
-        drop_db(name);
+        drop_db(name);
+        return;
+    }
+
+    // snapshot db <name> to <file>
+    if (parts == 3 && strcmp(cmd, "snapshot") == 0 && strcmp(type, "db") == 0)
+    {
+        char path[300];
+        if (sscanf(input, "snapshot db %*s to %299s", path) == 1)
+            snapshot_db(name, path);
+        else
+            print_error("Invalid snapshot syntax. Use 'snapshot db <name> to <file>'\n");
+        return;
+    }
+
+    // restore db from <file> [as <name>]
+    if (parts == 3 && strcmp(cmd, "restore") == 0 && strcmp(type, "db") == 0 && strcmp(name, "from") == 0)
+    {
+        char path[300], as[10], db_name[100];
+        int scanned = sscanf(input, "restore db from %299s %9s %99s", path, as, db_name);
+        if (scanned == 1)
+            restore_db(path, NULL);
+        else if (scanned == 3 && strcmp(as, "as") == 0)
+            restore_db(path, db_name);
+        else
+            print_error("Invalid restore syntax. Use 'restore db from <file> [as <name>]'\n");
         return;
     }
 
@@ -1049,28 +11593,11 @@ void process_command(const char *input)
     {
         const char *dbname = type; // use `type` as the DB name
 
-        // Build path to database folder
-        char path[300];
-#ifdef _WIN32
-        snprintf(path, sizeof(path), "%s\\%s", DB_DIR, dbname);
-#else
-        snprintf(path, sizeof(path), "%s/%s", DB_DIR, dbname);
-#endif
-
-// Check if folder exists
-#ifdef _WIN32
-        if (_access(path, 0) != 0)
+        if (!catalog_find_db(dbname))
         {
-            printf("Database '%s' does not exist.\n", dbname);
+            print_error("Database '%s' does not exist.\n", dbname);
             return;
         }
-#else
-        if (access(path, F_OK) != 0)
-        {
-            printf("Database '%s' does not exist.\n", dbname);
-            return;
-        }
-#endif
         // Copy database name safely
         strncpy(DB, dbname, sizeof(DB) - 1);
         DB[sizeof(DB) - 1] = '\0';
@@ -1092,10 +11619,23 @@ void process_command(const char *input)
         printf("  list db                  List all databases\n");
         printf("  use <name>               Switch to a database\n");
         printf("  delete db <name>         Delete entire database with all tables\n");
-        printf("  drop db <name>           Remove an empty database folder\n\n");
+        printf("  drop db <name>           Remove an empty database folder\n");
+        printf("  snapshot db <name> to <file>        Save a database into one snapshot file\n");
+        printf("  restore db from <file> [as <name>]  Recreate a database from a snapshot\n\n");
 
         printf("TABLE MANAGEMENT:\n");
         printf("  create table <name>      Create a new table in current database\n");
+        printf("    [compression=on]       ...storing its pages as compressed blocks\n");
+        printf("    [shards=N]             ...spreading its rows over N files by id (up to 16)\n");
+        printf("    [ttl=<seconds>]        ...expiring its rows that long after they are inserted\n");
+        printf("  compress table <name>    Convert a table to compressed blocks\n");
+        printf("  set ttl <table> <secs>   Default time to live of new rows (0 = none)\n");
+        printf("  expire <table>           Reclaim the space of expired rows now\n");
+        printf("  analyze <table>          Collect field statistics for the query planner\n");
+        printf("  create fulltext index <table> <field>   Index the words of a field for contains\n");
+        printf("  drop fulltext index <table> <field>     Remove a full-text index\n");
+        printf("  create prefix index <table> <field>     Index whole values for like and startswith\n");
+        printf("  drop prefix index <table> <field>       Remove a prefix index\n");
         printf("  list table               List all tables in current database\n");
         printf("  delete table <name>      Delete entire table with all records\n");
         printf("  drop table <name>        Remove a table from current database\n\n");
@@ -1103,13 +11643,58 @@ void process_command(const char *input)
         printf("DATA OPERATIONS:\n");
         printf("  insert into <table> set <fields>        Insert a new record\n");
         printf("                                          Example: insert into users set name:John, age:30\n");
+        printf("  insert into <table> set <fields> ttl <seconds>  ...that expires after the given time\n");
         printf("  get <table>                             Retrieve all records from table\n");
         printf("  get <table> <field:value>               Retrieve filtered records\n");
         printf("                                          Example: get users id:1\n");
+        printf("  get <table> <field> in (<values>)       Retrieve the records with any of the values\n");
+        printf("                                          Example: get users id in (1, 5, 9)\n");
+        printf("  get <table> ... order by <field> [desc] Sort the result (numbers sort by value)\n");
+        printf("  get <table> ... limit <n>               Return at most n records\n");
+        printf("                                          Example: get users order by age desc limit 10\n");
+        printf("  get <table> <field> contains \"<words>\"  Rows whose field has every word (jo* = prefix)\n");
+        printf("                                          Example: get users name contains \"hasan\"\n");
+        printf("  get <table> <field> like \"<pattern>\"    Rows whose field matches (%% any text, _ any char)\n");
+        printf("                                          Example: get users email like \"admin@%%\"\n");
+        printf("  get <table> <field> startswith \"<text>\" Rows whose field starts with the text\n");
+        printf("  get <a> join <b> on <a.f> = <b.f>       Join two tables on equal field values\n");
+        printf("    [where [<table>.]<field:value>]       Example: get users join orders on users.id = orders.user\n");
+        printf("  count <table> [by <field>]              Count records, optionally per field value\n");
         printf("  update <table> <where> <set>            Update records matching condition\n");
         printf("                                          Example: update users id:1 name:Jane\n");
+        printf("                                          or: update users id in (1, 2, 3) name:Jane\n");
+        printf("  upsert <table> key:<field> set <fields> Update the rows with the key's value, else insert\n");
+        printf("                                          Example: upsert users key:email set email:a@b.c, age:3\n");
         printf("  delete <table> <field:value>            Delete records matching condition\n");
-        printf("                                          Example: delete users id:1\n\n");
+        printf("                                          Example: delete users id:1 or delete users id in (1, 2)\n");
+        printf("  watch <table> [from <seq>] [limit <n>]  Changes since a sequence number (turns the feed on)\n");
+        printf("                                          Example: watch users from 120\n");
+        printf("  unwatch <table>                         Turn the change feed off and remove it\n\n");
+
+        printf("PREPARED STATEMENTS:\n");
+        printf("  prepare <name> as <command>             Parse a data command once; ? marks a parameter\n");
+        printf("                                          Example: prepare by_id as get users id:?\n");
+        printf("  execute <name> [(<args>)]               Run it with the arguments in order\n");
+        printf("                                          Example: execute by_id (1)\n");
+        printf("  deallocate <name>                       Forget a prepared statement\n\n");
+
+        printf("STORAGE:\n");
+        printf("  set buffer_pool <pages>  Resize the page cache (%d-byte pages)\n", PAGE_SIZE);
+        printf("  set memtable <KB>        Buffer size for new writes before they go to a segment\n");
+        printf("  set work_memory <KB>     Memory for order by and joins before they spill to disk\n");
+        printf("  set parallel <workers>   Most threads a filtered scan may use (0 = one per CPU)\n");
+        printf("  set result_cache <KB>    Cache get results until their table changes (0 = off)\n");
+        printf("  set memory_limit <KB>    Cap the memory of caches, memtables and queries (0 = off)\n");
+        printf("  memory                   Memory held by the pool, memtables, caches and queries\n");
+        printf("  flush                    Write the memtables and all dirty pages to disk\n\n");
+
+        printf("INSTRUMENTATION:\n");
+        printf("  explain <command>        Show how a get/count/update/delete/insert/upsert would run\n");
+        printf("  explain analyze <cmd>    Run it without printing rows; report rows, time and I/O\n");
+        printf("  stats                    Latency, time split, I/O and rows per command type\n");
+        printf("  stats reset              Forget the recorded statistics\n");
+        printf("  stats dump [<file>]      Write the statistics as JSON lines (default %s/%s)\n", DB_DIR, METRICS_FILE);
+        printf("  timing on|off            Print the time and I/O of every command\n\n");
 
         printf("UTILITY COMMANDS:\n");
         printf("  help                     Display this help menu\n");
@@ -1153,10 +11738,130 @@ void process_command(const char *input)
         return;
     }
 
-    // create table <name>
+    // create table <name> [compression=on|off] [shards=N] [ttl=<seconds>]
     if (parts == 3 && strcmp(cmd, "create") == 0 && strcmp(type, "table") == 0)
     {
-        create_table(name, DB);
+        char options[3][50] = {{0}};
+        bool compressed = false;
+        int shards = 1;
+        uint32_t ttl = 0;
+
+        int option_count = sscanf(input, "create table %*s %49s %49s %49s", options[0], options[1], options[2]);
+        for (int i = 0; i < option_count; i++)
+        {
+            const char *option = options[i];
+            char *end;
+            if (strcmp(option, "compression=on") == 0)
+                compressed = true;
+            else if (strcmp(option, "compression=off") == 0)
+                compressed = false;
+            else if (strncmp(option, "shards=", 7) == 0)
+            {
+                long n = strtol(option + 7, &end, 10);
+                if (end == option + 7 || *end != '\0' || n < 1 || n > MAX_SHARDS)
+                {
+                    print_error("Error: Invalid shard count '%s'. Use a number from 1 to %d.\n", option + 7,
+                                MAX_SHARDS);
+                    return;
+                }
+                shards = (int)n;
+            }
+            else if (strncmp(option, "ttl=", 4) == 0)
+            {
+                if ((ttl = parse_ttl(option + 4)) == 0)
+                    return;
+            }
+            else
+            {
+                print_error("Error: Unknown table option '%s'. Use 'compression=on|off', 'shards=N' or 'ttl=<seconds>'.\n",
+                            option);
+                return;
+            }
+        }
+
+        create_table(name, DB, compressed, shards, ttl);
+        return;
+    }
+
+    // set ttl <table> <seconds>
+    if (parts == 3 && strcmp(cmd, "set") == 0 && strcmp(type, "ttl") == 0)
+    {
+        char table_name[100], seconds[20], extra[2];
+        uint32_t ttl = 0;
+        if (sscanf(input, "set ttl %99s %19s %1s", table_name, seconds, extra) != 2)
+            print_error("Invalid syntax. Use 'set ttl <table> <seconds>' (0 for none)\n");
+        else if (strcmp(seconds, "0") == 0 || (ttl = parse_ttl(seconds)) > 0)
+            set_table_ttl(table_name, DB, ttl);
+        return;
+    }
+
+    // watch <table> [from <seq>] [limit <n>]
+    if (parts >= 2 && strcmp(cmd, "watch") == 0)
+    {
+        char table_name[100], word[2][20], value[2][24], extra[2];
+        unsigned long long from = 1, limit = 0;
+        int n = sscanf(input, "watch %99s %19s %23s %19s %23s %1s", table_name, word[0], value[0], word[1], value[1],
+                       extra);
+        bool ok = n == 1 || n == 3 || n == 5;
+        for (int i = 0; ok && i < (n - 1) / 2; i++)
+        {
+            char *end;
+            unsigned long long number = strtoull(value[i], &end, 10);
+            ok = *end == '\0' && value[i][0] != '-';
+            if (strcmp(word[i], "from") == 0 && i == 0)
+                from = number;
+            else if (strcmp(word[i], "limit") == 0)
+                limit = number;
+            else
+                ok = false;
+        }
+        if (!ok)
+            print_error("Invalid syntax. Use 'watch <table> [from <seq>] [limit <n>]'\n");
+        else
+            watch_table(table_name, DB, from, limit);
+        return;
+    }
+
+    // unwatch <table>
+    if (parts == 2 && strcmp(cmd, "unwatch") == 0)
+    {
+        unwatch_table(type, DB);
+        return;
+    }
+
+    // expire <table>
+    if (parts == 2 && strcmp(cmd, "expire") == 0)
+    {
+        expire_table(type, DB);
+        return;
+    }
+
+    // create fulltext|prefix index <table> <field> / drop fulltext|prefix index <table> <field>
+    if (parts == 3 && (strcmp(cmd, "create") == 0 || strcmp(cmd, "drop") == 0) &&
+        (strcmp(type, "fulltext") == 0 || strcmp(type, "prefix") == 0) && strcmp(name, "index") == 0)
+    {
+        char table_name[100], field[100], extra[2];
+        bool prefix = strcmp(type, "prefix") == 0;
+        if (sscanf(input, "%*s %*s index %99s %99s %1s", table_name, field, extra) != 2)
+            print_error("Invalid syntax. Use '%s %s index <table> <field>'\n", cmd, type);
+        else if (strcmp(cmd, "create") == 0)
+            create_fulltext_index(table_name, DB, field, prefix);
+        else
+            drop_fulltext_index(table_name, DB, field, prefix);
+        return;
+    }
+
+    // compress table <name>
+    if (parts == 3 && strcmp(cmd, "compress") == 0 && strcmp(type, "table") == 0)
+    {
+        compress_table(name, DB);
+        return;
+    }
+
+    // analyze <table>
+    if (parts == 2 && strcmp(cmd, "analyze") == 0)
+    {
+        analyze_table(type, DB);
         return;
     }
 
@@ -1167,151 +11872,551 @@ void process_command(const char *input)
         return;
     }
 
-    // insert into <table> set name="jibon", roll=12, ...
-    if (parts >= 3 && strcmp(cmd, "insert") == 0 && strcmp(type, "into") == 0)
+    // delete table <name> - delete entire table
+    // delete db <name> - delete entire database
+    if (parts == 3 && strcmp(cmd, "delete") == 0)
+    {
+        if (strcmp(type, "db") == 0)
+            delete_database(name);
+        else
+            delete_table(name, DB);
+        return;
+    }
+
+    // drop table <name> (alias for delete table)
+    if (parts == 3 && strcmp(cmd, "drop") == 0 && strcmp(type, "table") == 0)
     {
-        char table_name[100];
-        char rest[300];
+        delete_table(name, DB);
+        return;
+    }
 
-        // Get table name and rest of the command
-        if (sscanf(input, "insert into %99s %299[^\n]", table_name, rest) != 2)
+    // set buffer_pool <pages>
+    if (parts == 3 && strcmp(cmd, "set") == 0 && strcmp(type, "buffer_pool") == 0)
+    {
+        int pages = atoi(name);
+        if (pages <= 0)
         {
-            printf("Invalid insert syntax.\n");
+            print_error("Error: Buffer pool size must be a positive number of pages.\n");
             return;
         }
 
-        // Check if command uses 'set'
-        char *attributes_ptr = strstr(rest, "set ");
-
-        if (attributes_ptr)
+        if (memory_limit > 0 && (size_t)pages * PAGE_SIZE > memory_limit / 2)
         {
-            // 'set' keyword found, move pointer after 'set '
-            attributes_ptr += 4;
+            print_error("Error: The buffer pool may take at most half the memory limit (%zu KB).\n",
+                        memory_limit / 2048);
+            return;
         }
-        else
+
+        if (pool_resize(pages))
         {
-            // No 'set' keyword, treat entire rest as attributes
-            attributes_ptr = rest;
+            printf("Buffer pool set to %d pages (%d KB).\n", pool.frame_count, pool.frame_count * PAGE_SIZE / 1024);
         }
+        return;
+    }
 
-        // Trim leading spaces
-        while (*attributes_ptr == ' ')
-            attributes_ptr++;
-
-        // Verify we have attributes to insert
-        if (*attributes_ptr == '\0')
+    // set memtable <KB>
+    if (parts == 3 && strcmp(cmd, "set") == 0 && strcmp(type, "memtable") == 0)
+    {
+        int kb = atoi(name);
+        if (kb <= 0)
         {
-            printf("Error: No attributes provided for insert.\n");
+            print_error("Error: Memtable size must be a positive number of KB.\n");
             return;
         }
 
-        // Insert into table by treating the attributes part as CSV-style data
-        insert_table_with_attributes(table_name, DB, attributes_ptr);
+        memtable_limit = (size_t)kb * 1024;
+        printf("Memtable limit set to %d KB.\n", kb);
         return;
     }
 
-    // get <table> or get <table> <query>
-    if (parts >= 2 && strcmp(cmd, "get") == 0)
+    // set work_memory <KB>
+    if (parts == 3 && strcmp(cmd, "set") == 0 && strcmp(type, "work_memory") == 0)
     {
-        char table_name[100];
-        char query[200] = {0};
+        int kb = atoi(name);
+        if (kb <= 0)
+        {
+            print_error("Error: Work memory must be a positive number of KB.\n");
+            return;
+        }
 
-        // Try to parse: get <table> <query>
-        int scan_result = sscanf(input, "get %99s %199s", table_name, query);
+        work_memory_limit = (size_t)kb * 1024;
+        printf("Work memory set to %d KB.\n", kb);
+        return;
+    }
 
-        if (scan_result == 1)
+    // set result_cache <KB>
+    if (parts == 3 && strcmp(cmd, "set") == 0 && strcmp(type, "result_cache") == 0)
+    {
+        char *end;
+        long kb = strtol(name, &end, 10);
+        if (end == name || *end != '\0' || kb < 0)
         {
-            // Only table name provided - get all data
-            get_all_data(table_name, DB);
+            print_error("Error: Result cache size must be a number of KB (0 turns it off).\n");
+            return;
         }
-        else if (scan_result == 2)
+
+        result_cache_resize((size_t)kb * 1024);
+        if (kb == 0)
+            printf("Result cache off.\n");
+        else
+            printf("Result cache set to %ld KB.\n", kb);
+        return;
+    }
+
+    // set memory_limit <KB>
+    if (parts == 3 && strcmp(cmd, "set") == 0 && strcmp(type, "memory_limit") == 0)
+    {
+        char *end;
+        long kb = strtol(name, &end, 10);
+        if (end == name || *end != '\0' || kb < 0)
         {
-            // Table name and query provided - filter data
-            get_filtered_data(table_name, DB, query);
+            print_error("Error: Memory limit must be a number of KB (0 turns it off).\n");
+            return;
         }
-        else
+
+        if (set_memory_limit((size_t)kb * 1024))
         {
-            printf("Invalid get syntax. Use 'get <table>' or 'get <table> <query>'\n");
+            if (kb == 0)
+                printf("Memory limit off.\n");
+            else
+                printf("Memory limit set to %ld KB.\n", kb);
         }
         return;
     }
 
-    // update <table> <where_clause> <set_clause>
-    if (parts >= 2 && strcmp(cmd, "update") == 0)
+    // memory
+    if (strcmp(input, "memory") == 0)
     {
-        char table_name[100];
-        char where_clause[200];
-        char set_clause[200];
-
-        // Try to parse: update <table> <field:value> <field:value>
-        int scan_result = sscanf(input, "update %99s %199s %199s", table_name, where_clause, set_clause);
+        print_memory();
+        return;
+    }
 
-        if (scan_result == 3)
+    // set parallel <workers>
+    if (parts == 3 && strcmp(cmd, "set") == 0 && strcmp(type, "parallel") == 0)
+    {
+        char *end;
+        long workers = strtol(name, &end, 10);
+        if (end == name || *end != '\0' || workers < 0 || workers > MAX_PARALLEL_WORKERS)
         {
-            update_record_in_table(table_name, DB, where_clause, set_clause);
+            print_error("Error: Parallel workers must be between 0 and %d.\n", MAX_PARALLEL_WORKERS);
+            return;
         }
+
+        parallel_workers = (int)workers;
+        if (workers == 0)
+            printf("Parallel scans use up to %d worker(s), one per CPU.\n", parallel_degree_limit());
         else
-        {
-            printf("Invalid update syntax. Use 'update <table> <where_field:value> <set_field:value>'\n");
-            printf("Example: update Users id:1 name:NewName\n");
-        }
+            printf("Parallel scans use up to %ld worker(s).\n", workers);
         return;
     }
 
-    // delete <table> <field:value> - delete specific records
-    // delete table <name> - delete entire table
-    // delete db <name> - delete entire database
-    if (parts >= 2 && strcmp(cmd, "delete") == 0)
+    // flush
+    if (strcmp(input, "flush") == 0)
+    {
+        if (storage_flush_all())
+            printf("All dirty pages written to disk.\n");
+        else
+            print_error("Error: Failed to write some pages to disk.\n");
+        return;
+    }
+
+    // prepare <name> as <command>
+    if (parts == 3 && strcmp(cmd, "prepare") == 0 && strcmp(name, "as") == 0)
+    {
+        int offset = 0;
+        sscanf(input, "%*s %*s %*s %n", &offset);
+        prepare_statement(type, input + offset);
+        return;
+    }
+
+    // execute <name> [(<args>)]
+    if (parts >= 2 && strcmp(cmd, "execute") == 0)
+    {
+        int offset = 0;
+        sscanf(input, "%*s %*s%n", &offset);
+        execute_prepared(type, input + offset);
+        return;
+    }
+
+    // deallocate <name>
+    if (parts == 2 && strcmp(cmd, "deallocate") == 0)
+    {
+        deallocate_statement(type);
+        return;
+    }
+
+    // explain [analyze] <get|count|update|delete|insert|upsert command>
+    if (parts >= 2 && strcmp(cmd, "explain") == 0)
     {
-        // delete db <name>
-        if (parts == 3 && strcmp(type, "db") == 0)
+        bool analyze = strcmp(type, "analyze") == 0;
+        const char *command = strstr(input, analyze ? "analyze" : type) + (analyze ? strlen("analyze") : 0);
+        while (*command == ' ')
+            command++;
+
+        char verb[50] = {0}, object[50] = {0};
+        sscanf(command, "%49s %49s", verb, object);
+        bool supported = strcmp(verb, "get") == 0 || strcmp(verb, "count") == 0 || strcmp(verb, "update") == 0 ||
+                         strcmp(verb, "upsert") == 0 ||
+                         (strcmp(verb, "delete") == 0 && strcmp(object, "table") != 0 && strcmp(object, "db") != 0) ||
+                         (strcmp(verb, "insert") == 0 && strcmp(object, "into") == 0);
+        if (!supported || explain_mode != EXPLAIN_OFF)
         {
-            delete_database(name);
+            print_error("Error: explain works on get, count, update, delete, insert and upsert commands.\n");
             return;
         }
 
-        // delete table <name>
-        if (parts == 3 && strcmp(type, "table") == 0)
+        printf("Query plan:\n");
+        explain_mode = analyze ? EXPLAIN_ANALYZE : EXPLAIN_PLAN;
+        execute_command(command);
+        explain_mode = EXPLAIN_OFF;
+
+        if (analyze)
+            print_explain_actual();
+        return;
+    }
+
+    // stats / stats reset / stats dump [<file>]
+    if (parts >= 1 && strcmp(cmd, "stats") == 0)
+    {
+        if (parts == 1)
         {
-            delete_table(name, DB);
-            return;
+            print_stats();
         }
-
-        // delete <table> <field:value>
-        if (parts == 3)
+        else if (parts == 2 && strcmp(type, "reset") == 0)
+        {
+            command_metrics_count = 0;
+            result_cache.hits = result_cache.misses = result_cache.evictions = 0;
+            statement_cache_hits = statement_cache_misses = 0;
+            printf("Statistics reset.\n");
+        }
+        else if (strcmp(type, "dump") == 0)
         {
-            char table_name[100];
-            char query[200];
+            char path[300];
+            if (parts == 3)
+                snprintf(path, sizeof(path), "%s", name);
+            else
+#ifdef _WIN32
+                snprintf(path, sizeof(path), "%s\\%s", DB_DIR, METRICS_FILE);
+#else
+                snprintf(path, sizeof(path), "%s/%s", DB_DIR, METRICS_FILE);
+#endif
 
-            if (sscanf(input, "delete %99s %199s", table_name, query) == 2)
-            {
-                delete_record_from_table(table_name, DB, query);
-            }
+            if (dump_stats(path))
+                printf("Statistics written to '%s'.\n", path);
             else
-            {
-                printf("Invalid delete syntax.\n");
-            }
-            return;
+                print_error("Error: Failed to write '%s'.\n", path);
+        }
+        else
+        {
+            print_error("Invalid stats syntax. Use 'stats', 'stats reset' or 'stats dump [<file>]'\n");
         }
-
-        printf("Invalid delete syntax. Use:\n");
-        printf(" - delete <table> <field:value>\n");
-        printf(" - delete table <name>\n");
-        printf(" - delete db <name>\n");
         return;
     }
 
-    // drop table <name> (alias for delete table)
-    if (parts == 3 && strcmp(cmd, "drop") == 0 && strcmp(type, "table") == 0)
+    // timing on|off
+    if (parts == 2 && strcmp(cmd, "timing") == 0 && (strcmp(type, "on") == 0 || strcmp(type, "off") == 0))
     {
-        delete_table(name, DB);
+        timing_enabled = strcmp(type, "on") == 0;
+        printf("Timing is %s.\n", timing_enabled ? "on" : "off");
         return;
     }
 
     // If we reach here, command was not recognized
-    printf("Error: Unrecognized command '%s'. Type 'help' to see available commands.\n", input);
+    print_error("Error: Unrecognized command '%s'. Type 'help' to see available commands.\n", input);
+}
+
+// Run a command, recording its latency, time split and I/O under its type
+void process_command(const char *input)
+{
+    // Expired rows are reclaimed a few pages at a time between commands,
+    // before the counters reset so the work is not charged to this command;
+    // so is memory over the limit
+    expiry_tick();
+    memory_reclaim();
+
+    memset(&metrics, 0, sizeof(metrics));
+    metrics_phase = PHASE_OTHER;
+    uint64_t start = clock_ns();
+    metrics_phase_start = start;
+
+    command_failed = false;
+    command_error[0] = '\0';
+    execute_command(input);
+
+    // The command's writes are on disk before the next one runs
+    metrics_enter(PHASE_WRITE);
+    wal_commit_all();
+    metrics_enter(PHASE_OTHER);
+    uint64_t elapsed = metrics_phase_start - start;
+
+    char type[32];
+    command_type_name(input, type, sizeof(type));
+    metrics_record(type, elapsed);
+
+    if (timing_enabled)
+        print_command_timing(elapsed);
+}
+
+// ---------------------------------------------------------------------------
+// Library API (nanodb.h)
+// libnanodb.a is this file built with NANODB_NO_MAIN. A handle wraps the
+// same globals the shell uses, so only one can be open at a time. The shell
+// below is a client of this API like any embedding program.
+// ---------------------------------------------------------------------------
+
+struct nanodb
+{
+    bool open;
+    char error[300];
+};
+
+nanodb library_handle;
+bool library_initialized = false;
+
+nanodb *nanodb_open(const char *db_name)
+{
+    const char *name = db_name ? db_name : DEFAULT_DB;
+    if (library_handle.open || strlen(name) >= sizeof(DB))
+        return NULL;
+
+    if (!library_initialized)
+    {
+        initialize();
+        library_initialized = true;
+    }
+
+    // The default database always exists
+    if (!catalog_find_db(name) && strcmp(name, DEFAULT_DB) == 0)
+    {
+        char path[300];
+#ifdef _WIN32
+        snprintf(path, sizeof(path), "%s\\%s", DB_DIR, name);
+#else
+        snprintf(path, sizeof(path), "%s/%s", DB_DIR, name);
+#endif
+        if (make_dir(path) == 0)
+            catalog_add_db(name);
+    }
+    if (!catalog_find_db(name))
+        return NULL;
+
+    strcpy(DB, name);
+    library_handle.open = true;
+    library_handle.error[0] = '\0';
+    return &library_handle;
+}
+
+void nanodb_close(nanodb *db)
+{
+    if (!db || !db->open)
+        return;
+
+    for (int i = 0; i < MAX_FEED_WATCHERS; i++)
+        feed_unwatch(i);
+    storage_shutdown();
+    db->open = false;
+}
+
+// NANODB_ERROR with the first line of the message the command printed, or
+// NANODB_OK when it did not fail
+int library_status(nanodb *db, bool ok)
+{
+    if (ok && !command_failed)
+        return NANODB_OK;
+
+    const char *message = command_error;
+    if (strncmp(message, "Error: ", 7) == 0)
+        message += 7;
+    size_t len = strcspn(message, "\n");
+    if (len == 0)
+    {
+        message = "The command failed.";
+        len = strlen(message);
+    }
+    snprintf(db->error, sizeof(db->error), "%.*s", (int)len, message);
+    return NANODB_ERROR;
+}
+
+int nanodb_execute(nanodb *db, const char *command)
+{
+    if (!db || !db->open || !command)
+        return NANODB_ERROR;
+
+    process_command(command);
+    return library_status(db, true);
+}
+
+int nanodb_prepare(nanodb *db, const char *name, const char *command)
+{
+    if (!db || !db->open || !name || !command)
+        return NANODB_ERROR;
+
+    command_failed = false;
+    command_error[0] = '\0';
+    return library_status(db, prepare_statement(name, command));
+}
+
+int nanodb_execute_prepared(nanodb *db, const char *name, const char *args)
+{
+    if (!db || !db->open || !name)
+        return NANODB_ERROR;
+
+    char arguments[MAX_INPUT_SIZE + 2] = "";
+    if (args && snprintf(arguments, sizeof(arguments), "(%s)", args) >= (int)sizeof(arguments))
+    {
+        snprintf(db->error, sizeof(db->error), "Arguments for '%s' are too long.", name);
+        return NANODB_ERROR;
+    }
+    command_failed = false;
+    command_error[0] = '\0';
+    bool ok = execute_prepared(name, arguments);
+    ok = wal_commit_all() && ok;
+    return library_status(db, ok);
+}
+
+typedef struct
+{
+    nanodb_record_fn visit;
+    void *ctx;
+    long count;
+} LibraryScan;
+
+bool library_visitor(const char *record, RecordId rid, void *arg)
+{
+    (void)rid;
+    LibraryScan *scan = arg;
+    nanodb_record view = {record_id(record), record, strlen(record)};
+    scan->count++;
+    return scan->visit(&view, scan->ctx);
+}
+
+long nanodb_scan(nanodb *db, const char *table, const char *filter, nanodb_record_fn visit, void *ctx)
+{
+    if (!db || !db->open || !table || !visit)
+        return NANODB_ERROR;
+
+    WhereClause where;
+    if (filter && !parse_where(filter, &where))
+    {
+        snprintf(db->error, sizeof(db->error), "Invalid filter '%s'. Use 'field:value' or 'field in (...)'.", filter);
+        return NANODB_ERROR;
+    }
+
+    Table *t = catalog_has_table(DB, table) ? table_open(DB, table) : NULL;
+    if (!t)
+    {
+        snprintf(db->error, sizeof(db->error), "Table '%s' does not exist in database '%s'.", table, DB);
+        if (filter)
+            where_free(&where);
+        return NANODB_ERROR;
+    }
+
+    expiry_refresh_clock();
+    memory_reclaim();
+    LibraryScan scan = {visit, ctx, 0};
+    command_failed = false;
+    command_error[0] = '\0';
+    bool ok;
+    if (filter)
+    {
+        RecordFilter f;
+        where_filter_init(&f, t, &where);
+        ok = table_scan_where(t, &f, library_visitor, &scan);
+        where_free(&where);
+    }
+    else
+    {
+        ok = table_scan(t, library_visitor, &scan);
+    }
+
+    // A scan that stopped on an I/O error or a damaged page is not a result
+    if (!ok)
+    {
+        if (command_error[0] == '\0')
+            snprintf(command_error, sizeof(command_error), "Error: Failed to scan table '%s'.\n", table);
+        return library_status(db, false);
+    }
+    return scan.count;
+}
+
+typedef struct
+{
+    nanodb_change_fn visit;
+    void *ctx;
+    uint64_t from; // changes before it are not delivered
+    bool stopped;
+} LibraryWatch;
+
+LibraryWatch library_watches[MAX_FEED_WATCHERS];
+
+bool library_change_visitor(const FeedChange *change, void *arg)
+{
+    LibraryWatch *watch = arg;
+    if (change->seq < watch->from)
+        return true;
+    nanodb_change view = {change->seq, (int)change->op, change->id, change->record,
+                          change->record ? strlen(change->record) : 0};
+    watch->stopped = !watch->visit(&view, watch->ctx);
+    return !watch->stopped;
+}
+
+int nanodb_watch(nanodb *db, const char *table, uint64_t from_seq, nanodb_change_fn visit, void *ctx)
+{
+    if (!db || !db->open || !table || !visit)
+        return NANODB_ERROR;
+
+    Table *t = catalog_has_table(DB, table) ? table_open(DB, table) : NULL;
+    if (!t)
+    {
+        snprintf(db->error, sizeof(db->error), "Table '%s' does not exist in database '%s'.", table, DB);
+        return NANODB_ERROR;
+    }
+
+    int slot = feed_watch(DB, table, library_change_visitor, NULL);
+    if (slot < 0)
+    {
+        snprintf(db->error, sizeof(db->error), "Too many watches; at most %d can be active.", MAX_FEED_WATCHERS);
+        return NANODB_ERROR;
+    }
+    LibraryWatch *watch = &library_watches[slot];
+    watch->visit = visit;
+    watch->ctx = ctx;
+    watch->from = from_seq;
+    watch->stopped = false;
+    feed_watchers[slot].ctx = watch;
+
+    // The backlog first; changes applied from now on are pushed by feed_append
+    uint64_t next;
+    if (!table_enable_feed(t) || !feed_read(t, from_seq, 0, library_change_visitor, watch, &next))
+    {
+        feed_unwatch(slot);
+        snprintf(db->error, sizeof(db->error), "Failed to read the change feed of '%s'.", table);
+        return NANODB_ERROR;
+    }
+    if (watch->stopped)
+        feed_unwatch(slot);
+    return slot;
 }
 
+void nanodb_unwatch(nanodb *db, int watch)
+{
+    (void)db;
+    feed_unwatch(watch);
+}
+
+const char *nanodb_database(nanodb *db)
+{
+    (void)db;
+    return DB;
+}
+
+const char *nanodb_error(nanodb *db)
+{
+    return db ? db->error : "No database handle.";
+}
+
+// Tools that embed the shell (bench.c) define NANODB_NO_MAIN and bring their own
+#ifndef NANODB_NO_MAIN
 int main()
 {
     const char *USERNAME_ADMIN = "admin";
@@ -1341,20 +12446,30 @@ int main()
         return 0;
     }
 
-    initialize();
+    nanodb *db = nanodb_open(NULL);
+    if (!db)
+    {
+        print_error("Error: Failed to open the default database '%s'.\n", DEFAULT_DB);
+        return 1;
+    }
 
     char buffer[MAX_INPUT_SIZE] = {0};
 
     while (true)
     {
-        printf("%s~$: ", DB);
+        printf("%s~$: ", nanodb_database(db));
 
-        get_input(buffer, MAX_INPUT_SIZE);
+        // End of input behaves like a logout
+        if (!get_input(buffer, MAX_INPUT_SIZE))
+        {
+            printf("Logout.\n");
+            break;
+        }
 
         // exit
         if (strcmp(buffer, "exit") == 0 || strcmp(buffer, "quit") == 0)
         {
-            if (strcmp(DB, "nano") == 0)
+            if (strcmp(nanodb_database(db), DEFAULT_DB) == 0)
             {
 
                 printf("Logout.\n");
@@ -1362,9 +12477,7 @@ int main()
             }
             else
             {
-                strncpy(DB, DEFAULT_DB, sizeof(DB) - 1);
-                DB[sizeof(DB) - 1] = '\0';
-                printf("Switched to database '%s'\n", DB);
+                nanodb_execute(db, "use " DEFAULT_DB);
                 continue;
             }
         }
@@ -1384,8 +12497,12 @@ int main()
             continue;
         }
 
-        process_command(buffer);
+        nanodb_execute(db, buffer);
     }
 
+    // Write back dirty pages before leaving
+    nanodb_close(db);
+
     return 0;
 }
+#endif
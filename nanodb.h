@@ -0,0 +1,102 @@
+// nanoDB embedding API
+//
+// Link libnanodb.a (`make lib`) and include this header to run nanoDB
+// inside another program. Commands behave exactly as in the shell and
+// print their usual output on stdout; nanodb_scan reads rows without any
+// formatting by handing each record to a callback straight from the scan.
+//
+// The engine keeps its state in globals: one handle can be open at a time
+// and all calls must come from the same thread.
+//
+//   nanodb *db = nanodb_open("store");
+//   nanodb_execute(db, "insert into products set name:Laptop, price:999");
+//   nanodb_scan(db, "products", "price:999", print_row, NULL);
+//   nanodb_watch(db, "products", 1, print_change, NULL);
+//   nanodb_close(db);
+
+#ifndef NANODB_H
+#define NANODB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define NANODB_OK 0
+#define NANODB_ERROR -1
+
+typedef struct nanodb nanodb;
+
+// A record as stored, e.g. "id:1, name:John, age:30". `data` points into
+// the engine's buffers and is only valid during the callback.
+typedef struct
+{
+    uint32_t id;
+    const char *data; // NUL terminated
+    size_t length;
+} nanodb_record;
+
+// Return false to stop the scan early
+typedef bool (*nanodb_record_fn)(const nanodb_record *record, void *ctx);
+
+// Open the engine on database `db_name` (NULL for the default "nano"),
+// creating the db/ folder if needed. NULL if the database does not exist
+// or a handle is already open.
+nanodb *nanodb_open(const char *db_name);
+
+// Write all memtables and dirty pages to disk and release the handle
+void nanodb_close(nanodb *db);
+
+// Run one shell command, e.g. "create table users" or "use store".
+// NANODB_ERROR with nanodb_error() set when the command failed (an unknown
+// table, invalid syntax, ...); a query that matches nothing still succeeds.
+int nanodb_execute(nanodb *db, const char *command);
+
+// prepare <name> as <command> / execute <name> (<args>): `args` is the
+// comma separated argument list without parentheses, or NULL for none.
+// Both return NANODB_ERROR with nanodb_error() set on failure.
+int nanodb_prepare(nanodb *db, const char *name, const char *command);
+int nanodb_execute_prepared(nanodb *db, const char *name, const char *args);
+
+// Visit the records of `table` in the current database, all of them or
+// those matching `filter` ("field:value" or "field in (v1, v2, ...)", NULL
+// for none). Returns the number of records visited, or NANODB_ERROR with
+// nanodb_error() set, also when the scan fails partway. `visit` may run get, count, insert, upsert, update,
+// delete and execute commands, also on `table`; the scan keeps seeing the
+// records as they were when it started.
+long nanodb_scan(nanodb *db, const char *table, const char *filter, nanodb_record_fn visit, void *ctx);
+
+#define NANODB_INSERT 1
+#define NANODB_UPDATE 2
+#define NANODB_DELETE 3
+
+// One change from a table's change feed, in sequence order. `data` is the
+// new record (NULL for deletes) and is only valid during the callback.
+typedef struct
+{
+    uint64_t seq;
+    int op; // NANODB_INSERT, NANODB_UPDATE or NANODB_DELETE
+    uint32_t id;
+    const char *data;
+    size_t length;
+} nanodb_change;
+
+// Return false to stop watching
+typedef bool (*nanodb_change_fn)(const nanodb_change *change, void *ctx);
+
+// Turn on the change feed of `table` and call `visit` with its changes
+// from sequence `from_seq` on: first those already in the feed, then each
+// one as it is applied. To resume after a restart, pass the last seq seen
+// plus one. `visit` must not call back into nanoDB. Returns a handle for
+// nanodb_unwatch, or NANODB_ERROR.
+int nanodb_watch(nanodb *db, const char *table, uint64_t from_seq, nanodb_change_fn visit, void *ctx);
+
+// Stop a watch; nanodb_close stops all of them
+void nanodb_unwatch(nanodb *db, int watch);
+
+// The current database, as changed by "use <name>"
+const char *nanodb_database(nanodb *db);
+
+// Message for the last call that returned NANODB_ERROR
+const char *nanodb_error(nanodb *db);
+
+#endif
@@ -0,0 +1,613 @@
+// nanoDB trace replay and YCSB-style workload driver
+//
+// Builds the shell source into the same program (without its main) and
+// feeds commands to process_command from several client threads.
+//
+//   nanoreplay --trace <file> [--threads N] [--json]
+//       Replays a command script such as test_input.txt. A leading login
+//       (username and password lines) is skipped; lines are handed to the
+//       clients in file order. The trace is one session: data commands
+//       (get, count, insert, update, upsert, delete) overlap, while any
+//       other command (use, create, drop, ...) waits for the lines before
+//       it and holds back the lines after it. Every line runs in the
+//       session's current database, whichever client runs it.
+//   nanoreplay --workload a|b|c|e [--records N] [--operations N]
+//              [--threads N] [--distribution zipfian|uniform] [--json]
+//       Loads `records` rows into ycsb.usertable, then runs the mix:
+//         a  50% reads / 50% updates
+//         b  95% reads /  5% updates
+//         c  100% reads
+//         e  95% scans /  5% inserts (a scan is a filtered get that
+//            matches about 100 rows)
+//
+// The engine is single-threaded, so commands run one at a time under a
+// lock. Latencies include the time spent waiting for the lock, as a client
+// would see it, and commands that fail are counted apart. The report goes
+// to stdout; command output is discarded.
+
+#define NANODB_NO_MAIN
+#include "main.c"
+
+#include <math.h>
+#include <pthread.h>
+
+#ifdef _WIN32
+#define NULL_DEVICE "NUL"
+#else
+#define NULL_DEVICE "/dev/null"
+#endif
+
+#define REPLAY_MAX_THREADS 64
+#define REPLAY_MAX_COMMAND_TYPES 32
+#define REPLAY_BUCKETS 24 // bucket b counts latencies below 2^b microseconds
+#define YCSB_DB "ycsb"
+#define YCSB_TABLE "usertable"
+#define YCSB_SCAN_ROWS 100
+#define ZIPF_THETA 0.99
+
+typedef struct
+{
+    char name[32];
+    uint64_t count;
+    uint64_t failed; // commands that printed an error
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[REPLAY_BUCKETS];
+} CommandStats;
+
+typedef struct
+{
+    CommandStats types[REPLAY_MAX_COMMAND_TYPES];
+    int type_count;
+} StatsTable;
+
+// Zipfian generator over [0, n) (Gray et al., "Quickly generating
+// billion-record synthetic databases")
+typedef struct
+{
+    uint64_t n;
+    double theta, alpha, zetan, eta;
+} Zipfian;
+
+typedef struct
+{
+    char workload; // 0 for trace replay
+    uint64_t records;
+    uint64_t operations;
+    bool zipfian;
+    Zipfian zipf;
+    char **lines; // trace replay
+    size_t *line_waits; // lines that must be done before a line starts
+    bool *line_alone;   // not a data command: runs with no other line
+    bool *line_done;
+    size_t line_count;
+} Workload;
+
+typedef struct
+{
+    Workload *workload;
+    unsigned long state;
+    char db[50];
+    StatsTable stats;
+} Client;
+
+FILE *report;
+pthread_mutex_t engine_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t cursor_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t line_finished = PTHREAD_COND_INITIALIZER;
+uint64_t next_op = 0;       // next trace line or workload operation
+size_t lines_done = 0;      // trace lines 0..lines_done-1 are all done
+char trace_db[50] = DEFAULT_DB; // the trace session's current database
+uint64_t inserted_rows = 0; // rows in usertable, grows with workload e inserts
+
+unsigned long replay_rand(unsigned long *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+double replay_uniform(unsigned long *state)
+{
+    return (double)(replay_rand(state) >> 11) / (double)(1ul << 53);
+}
+
+void zipf_init(Zipfian *z, uint64_t n)
+{
+    z->n = n;
+    z->theta = ZIPF_THETA;
+    z->alpha = 1.0 / (1.0 - z->theta);
+    z->zetan = 0;
+    for (uint64_t i = 1; i <= n; i++)
+        z->zetan += 1.0 / pow((double)i, z->theta);
+    double zeta2 = 1.0 + 1.0 / pow(2.0, z->theta);
+    z->eta = (1.0 - pow(2.0 / (double)n, 1.0 - z->theta)) / (1.0 - zeta2 / z->zetan);
+}
+
+uint64_t zipf_next(const Zipfian *z, unsigned long *state)
+{
+    double u = replay_uniform(state);
+    double uz = u * z->zetan;
+    if (uz < 1.0)
+        return 0;
+    if (uz < 1.0 + pow(0.5, z->theta))
+        return 1;
+    uint64_t v = (uint64_t)((double)z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+    return v < z->n ? v : z->n - 1;
+}
+
+// Key of the next request: popular keys are scattered over the table
+// instead of all sitting at the start, as YCSB's scrambled zipfian does
+uint64_t workload_key(Client *c)
+{
+    Workload *w = c->workload;
+    if (!w->zipfian)
+        return replay_rand(&c->state) % w->records + 1;
+
+    uint64_t rank = zipf_next(&w->zipf, &c->state);
+    return (rank * 0x9E3779B97F4A7C15ull) % w->records + 1;
+}
+
+void stats_record(StatsTable *table, const char *type, uint64_t ns, bool failed)
+{
+    CommandStats *s = NULL;
+    for (int i = 0; i < table->type_count && !s; i++)
+    {
+        if (strcmp(table->types[i].name, type) == 0)
+            s = &table->types[i];
+    }
+    if (!s)
+    {
+        if (table->type_count == REPLAY_MAX_COMMAND_TYPES)
+            return;
+        s = &table->types[table->type_count++];
+        snprintf(s->name, sizeof(s->name), "%s", type);
+    }
+
+    int bucket = 0;
+    uint64_t us = ns / 1000;
+    while (bucket < REPLAY_BUCKETS - 1 && us >= (1ull << bucket))
+        bucket++;
+
+    s->count++;
+    s->failed += failed;
+    s->total_ns += ns;
+    if (ns > s->max_ns)
+        s->max_ns = ns;
+    s->buckets[bucket]++;
+}
+
+void stats_merge(StatsTable *into, const StatsTable *from)
+{
+    for (int i = 0; i < from->type_count; i++)
+    {
+        const CommandStats *src = &from->types[i];
+        CommandStats *dst = NULL;
+        for (int j = 0; j < into->type_count && !dst; j++)
+        {
+            if (strcmp(into->types[j].name, src->name) == 0)
+                dst = &into->types[j];
+        }
+        if (!dst)
+        {
+            if (into->type_count == REPLAY_MAX_COMMAND_TYPES)
+                continue;
+            dst = &into->types[into->type_count++];
+            memset(dst, 0, sizeof(*dst));
+            snprintf(dst->name, sizeof(dst->name), "%s", src->name);
+        }
+
+        dst->count += src->count;
+        dst->failed += src->failed;
+        dst->total_ns += src->total_ns;
+        if (src->max_ns > dst->max_ns)
+            dst->max_ns = src->max_ns;
+        for (int b = 0; b < REPLAY_BUCKETS; b++)
+            dst->buckets[b] += src->buckets[b];
+    }
+}
+
+// Upper bound (us) of the bucket holding the given fraction of the samples
+uint64_t stats_percentile(const CommandStats *s, double fraction)
+{
+    uint64_t target = (uint64_t)ceil((double)s->count * fraction);
+    uint64_t seen = 0;
+    for (int b = 0; b < REPLAY_BUCKETS; b++)
+    {
+        seen += s->buckets[b];
+        if (seen >= target && seen > 0)
+            return 1ull << b;
+    }
+    return 1ull << (REPLAY_BUCKETS - 1);
+}
+
+// Run one command the way the prompt would, in the client's database
+void client_execute(Client *c, const char *command, const char *type)
+{
+    uint64_t start = clock_ns();
+    pthread_mutex_lock(&engine_lock);
+
+    strcpy(DB, c->db);
+    bool failed = false;
+    if (strcmp(command, "exit") == 0 || strcmp(command, "quit") == 0)
+    {
+        strcpy(DB, DEFAULT_DB);
+    }
+    else
+    {
+        process_command(command);
+        failed = command_failed;
+    }
+    strcpy(c->db, DB);
+
+    pthread_mutex_unlock(&engine_lock);
+    stats_record(&c->stats, type, clock_ns() - start, failed);
+}
+
+// Block until the lines trace line `line` depends on are done
+void trace_line_wait(const Workload *w, size_t line)
+{
+    pthread_mutex_lock(&cursor_lock);
+    while (lines_done < w->line_waits[line])
+        pthread_cond_wait(&line_finished, &cursor_lock);
+    pthread_mutex_unlock(&cursor_lock);
+}
+
+void trace_line_done(Workload *w, size_t line)
+{
+    pthread_mutex_lock(&cursor_lock);
+    w->line_done[line] = true;
+    while (lines_done < w->line_count && w->line_done[lines_done])
+        lines_done++;
+    pthread_cond_broadcast(&line_finished);
+    pthread_mutex_unlock(&cursor_lock);
+}
+
+// Take the next operation number, false once the run is over
+bool next_operation(uint64_t limit, uint64_t *op)
+{
+    pthread_mutex_lock(&cursor_lock);
+    *op = next_op;
+    bool more = next_op < limit;
+    if (more)
+        next_op++;
+    pthread_mutex_unlock(&cursor_lock);
+    return more;
+}
+
+void ycsb_fields(Client *c, uint64_t key, char *out, size_t size)
+{
+    // field0 has one value per YCSB_SCAN_ROWS rows so workload e scans stay short
+    snprintf(out, size, "field0:g%llu, field1:%08lx%08lx, field2:%08lx, field3:%08lx",
+             (unsigned long long)(key / YCSB_SCAN_ROWS), replay_rand(&c->state) & 0xffffffff,
+             replay_rand(&c->state) & 0xffffffff, replay_rand(&c->state) & 0xffffffff,
+             replay_rand(&c->state) & 0xffffffff);
+}
+
+void *client_main(void *arg)
+{
+    Client *c = arg;
+    Workload *w = c->workload;
+    char command[MAX_INPUT_SIZE + 64], fields[200], type[64];
+    uint64_t op;
+
+    uint64_t limit = w->workload ? w->operations : w->line_count;
+    while (next_operation(limit, &op))
+    {
+        if (!w->workload)
+        {
+            command_type_name(w->lines[op], type, sizeof(type));
+            trace_line_wait(w, op);
+            // Only a line that runs alone changes trace_db, so it is stable here
+            strcpy(c->db, trace_db);
+            client_execute(c, w->lines[op], type);
+            if (w->line_alone[op])
+                strcpy(trace_db, c->db);
+            trace_line_done(w, op);
+            continue;
+        }
+
+        double roll = replay_uniform(&c->state);
+        uint64_t key = workload_key(c);
+        double reads = w->workload == 'a' ? 0.5 : w->workload == 'b' ? 0.95 : 1.0;
+
+        if (w->workload == 'e')
+        {
+            if (roll < 0.95)
+            {
+                snprintf(command, sizeof(command), "get %s field0:g%llu", YCSB_TABLE,
+                         (unsigned long long)(key / YCSB_SCAN_ROWS));
+                client_execute(c, command, "scan");
+            }
+            else
+            {
+                pthread_mutex_lock(&cursor_lock);
+                uint64_t new_key = ++inserted_rows;
+                pthread_mutex_unlock(&cursor_lock);
+                ycsb_fields(c, new_key, fields, sizeof(fields));
+                snprintf(command, sizeof(command), "insert into %s set %s", YCSB_TABLE, fields);
+                client_execute(c, command, "insert");
+            }
+        }
+        else if (roll < reads)
+        {
+            snprintf(command, sizeof(command), "get %s id:%llu", YCSB_TABLE, (unsigned long long)key);
+            client_execute(c, command, "read");
+        }
+        else
+        {
+            snprintf(command, sizeof(command), "update %s id:%llu field1:%08lx", YCSB_TABLE,
+                     (unsigned long long)key, replay_rand(&c->state) & 0xffffffff);
+            client_execute(c, command, "update");
+        }
+    }
+    return NULL;
+}
+
+// Read a trace file into memory, dropping blank lines and a leading login
+bool load_trace(const char *path, Workload *w)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return false;
+
+    char line[MAX_INPUT_SIZE];
+    size_t capacity = 0;
+    while (fgets(line, sizeof(line), file))
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0')
+            continue;
+
+        if (w->line_count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 256;
+            char **lines = realloc(w->lines, capacity * sizeof(char *));
+            if (!lines)
+            {
+                fclose(file);
+                return false;
+            }
+            w->lines = lines;
+        }
+        w->lines[w->line_count++] = strdup(line);
+    }
+    fclose(file);
+
+    if (w->line_count >= 2 && strcmp(w->lines[0], "admin") == 0)
+    {
+        free(w->lines[0]);
+        free(w->lines[1]);
+        memmove(w->lines, w->lines + 2, (w->line_count - 2) * sizeof(char *));
+        w->line_count -= 2;
+    }
+
+    // A command that is not a data command runs once every line before it
+    // is done; the lines after it wait for it
+    w->line_waits = malloc((w->line_count + 1) * sizeof(size_t));
+    w->line_alone = calloc(w->line_count + 1, sizeof(bool));
+    w->line_done = calloc(w->line_count + 1, sizeof(bool));
+    if (!w->line_waits || !w->line_alone || !w->line_done)
+        return false;
+    size_t waits = 0;
+    for (size_t i = 0; i < w->line_count; i++)
+    {
+        Statement stmt;
+        w->line_alone[i] = parse_statement(w->lines[i], &stmt) == STMT_OTHER;
+        if (w->line_alone[i])
+        {
+            w->line_waits[i] = i;
+            waits = i + 1;
+        }
+        else
+        {
+            w->line_waits[i] = waits;
+        }
+    }
+    return true;
+}
+
+// Single-threaded load phase of a YCSB workload
+void ycsb_load(Workload *w, StatsTable *stats)
+{
+    Client loader = {0};
+    loader.workload = w;
+    loader.state = 12345;
+    strcpy(loader.db, DEFAULT_DB);
+    char command[MAX_INPUT_SIZE + 64], fields[200];
+
+    client_execute(&loader, "create db " YCSB_DB, "create db");
+    client_execute(&loader, "use " YCSB_DB, "use");
+    client_execute(&loader, "create table " YCSB_TABLE, "create table");
+    for (uint64_t key = 1; key <= w->records; key++)
+    {
+        ycsb_fields(&loader, key, fields, sizeof(fields));
+        snprintf(command, sizeof(command), "insert into %s set %s", YCSB_TABLE, fields);
+        client_execute(&loader, command, "load insert");
+    }
+    inserted_rows = w->records;
+    *stats = loader.stats;
+}
+
+void print_replay_stats(const char *phase, const StatsTable *stats, double seconds, uint64_t total_ops, bool json)
+{
+    uint64_t failed = 0;
+    for (int i = 0; i < stats->type_count; i++)
+        failed += stats->types[i].failed;
+
+    if (json)
+    {
+        for (int i = 0; i < stats->type_count; i++)
+        {
+            const CommandStats *s = &stats->types[i];
+            fprintf(report, "{\"phase\":\"%s\",\"command\":\"%s\",\"count\":%llu,\"failed\":%llu,\"avg_us\":%.2f,\"p50_us\":%llu,\"p99_us\":%llu,\"max_us\":%.2f,\"histogram_us\":{",
+                    phase, s->name, (unsigned long long)s->count, (unsigned long long)s->failed, (double)s->total_ns / 1000.0 / (double)s->count,
+                    (unsigned long long)stats_percentile(s, 0.5), (unsigned long long)stats_percentile(s, 0.99),
+                    (double)s->max_ns / 1000.0);
+            bool first = true;
+            for (int b = 0; b < REPLAY_BUCKETS; b++)
+            {
+                if (s->buckets[b] == 0)
+                    continue;
+                fprintf(report, "%s\"%llu\":%llu", first ? "" : ",", 1ull << b, (unsigned long long)s->buckets[b]);
+                first = false;
+            }
+            fprintf(report, "}}\n");
+        }
+        fprintf(report, "{\"phase\":\"%s\",\"total_ops\":%llu,\"failed\":%llu,\"seconds\":%.3f,\"ops_per_sec\":%.1f}\n",
+                phase, (unsigned long long)total_ops, (unsigned long long)failed, seconds,
+                seconds > 0 ? (double)total_ops / seconds : 0.0);
+        return;
+    }
+
+    fprintf(report, "%s\n", phase);
+    fprintf(report, "%-20s %10s %8s %12s %10s %10s %10s %12s\n", "command", "count", "failed", "ops/sec", "avg_us",
+            "p50_us", "p99_us", "max_us");
+    for (int i = 0; i < stats->type_count; i++)
+    {
+        const CommandStats *s = &stats->types[i];
+        fprintf(report, "%-20s %10llu %8llu %12.1f %10.2f %10llu %10llu %12.2f\n", s->name,
+                (unsigned long long)s->count, (unsigned long long)s->failed, seconds > 0 ? (double)s->count / seconds : 0.0, (double)s->total_ns / 1000.0 / (double)s->count,
+                (unsigned long long)stats_percentile(s, 0.5), (unsigned long long)stats_percentile(s, 0.99),
+                (double)s->max_ns / 1000.0);
+
+        // Histogram: "<N" is the number of commands that took under N us
+        fprintf(report, "  histogram:");
+        for (int b = 0; b < REPLAY_BUCKETS; b++)
+        {
+            if (s->buckets[b])
+                fprintf(report, " <%llu:%llu", 1ull << b, (unsigned long long)s->buckets[b]);
+        }
+        fprintf(report, "\n");
+    }
+    fprintf(report, "Total: %llu command(s) in %.3f s (%.1f ops/sec), %llu failed\n", (unsigned long long)total_ops,
+            seconds, seconds > 0 ? (double)total_ops / seconds : 0.0, (unsigned long long)failed);
+}
+
+int main(int argc, char **argv)
+{
+    Workload w = {0};
+    w.records = 100000;
+    w.operations = 100000;
+    w.zipfian = true;
+    int threads = 1;
+    bool json = false;
+    const char *trace = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        if (strcmp(arg, "--json") == 0)
+        {
+            json = true;
+            continue;
+        }
+
+        const char *value = i + 1 < argc ? argv[++i] : NULL;
+        if (!value)
+        {
+            fprintf(stderr, "Missing value for %s\n", arg);
+            return 1;
+        }
+
+        if (strcmp(arg, "--trace") == 0)
+            trace = value;
+        else if (strcmp(arg, "--workload") == 0)
+            w.workload = value[0];
+        else if (strcmp(arg, "--records") == 0)
+            w.records = strtoull(value, NULL, 10);
+        else if (strcmp(arg, "--operations") == 0)
+            w.operations = strtoull(value, NULL, 10);
+        else if (strcmp(arg, "--threads") == 0)
+            threads = atoi(value);
+        else if (strcmp(arg, "--distribution") == 0)
+            w.zipfian = strcmp(value, "uniform") != 0;
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", arg);
+            return 1;
+        }
+    }
+
+    if ((trace == NULL) == (w.workload == 0) || (w.workload && !strchr("abce", w.workload)) || threads < 1 ||
+        threads > REPLAY_MAX_THREADS || w.records == 0)
+    {
+        fprintf(stderr, "Usage: nanoreplay --trace <file> | --workload a|b|c|e [--records N] [--operations N]\n"
+                        "                  [--threads N] [--distribution zipfian|uniform] [--json]\n");
+        return 1;
+    }
+
+    if (trace && !load_trace(trace, &w))
+    {
+        fprintf(stderr, "Failed to read trace '%s'.\n", trace);
+        return 1;
+    }
+
+    // Command output goes to the null device; the report keeps the real stdout
+    report = fdopen(dup(fileno(stdout)), "w");
+    if (!report || !freopen(NULL_DEVICE, "w", stdout))
+    {
+        fprintf(stderr, "Failed to redirect command output.\n");
+        return 1;
+    }
+    initialize();
+
+    if (w.workload)
+    {
+        StatsTable load = {0};
+        uint64_t start = clock_ns();
+        ycsb_load(&w, &load);
+        double seconds = (double)(clock_ns() - start) / 1e9;
+
+        print_replay_stats("load", &load, seconds, w.records + 3, json);
+        if (w.zipfian)
+            zipf_init(&w.zipf, w.records);
+    }
+
+    Client *clients = calloc((size_t)threads, sizeof(Client));
+    pthread_t *ids = calloc((size_t)threads, sizeof(pthread_t));
+    if (!clients || !ids)
+        return 1;
+
+    uint64_t start = clock_ns();
+    for (int i = 0; i < threads; i++)
+    {
+        clients[i].workload = &w;
+        clients[i].state = 88172645463325252ul + (unsigned long)i * 7919ul;
+        snprintf(clients[i].db, sizeof(clients[i].db), "%s", w.workload ? YCSB_DB : DEFAULT_DB);
+        pthread_create(&ids[i], NULL, client_main, &clients[i]);
+    }
+
+    StatsTable total = {0};
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(ids[i], NULL);
+        stats_merge(&total, &clients[i].stats);
+    }
+    double seconds = (double)(clock_ns() - start) / 1e9;
+
+    char phase[300];
+    if (w.workload)
+        snprintf(phase, sizeof(phase), "workload %c, %d thread(s), %s keys", w.workload, threads,
+                 w.zipfian ? "zipfian" : "uniform");
+    else
+        snprintf(phase, sizeof(phase), "trace %s, %d thread(s)", trace, threads);
+    print_replay_stats(phase, &total, seconds, next_op, json);
+
+    strcpy(DB, DEFAULT_DB);
+    if (w.workload)
+        process_command("delete db " YCSB_DB);
+    storage_shutdown();
+    fclose(report);
+
+    for (size_t i = 0; i < w.line_count; i++)
+        free(w.lines[i]);
+    free(w.lines);
+    free(w.line_waits);
+    free(w.line_alone);
+    free(w.line_done);
+    free(clients);
+    free(ids);
+    return 0;
+}